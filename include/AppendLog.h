@@ -0,0 +1,214 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "Crc32c.h"
+#include "MappedFile.h"
+
+using namespace std;
+
+// When the append-only log is forced to stable storage, as with Redis'
+// appendfsync.
+enum class FsyncPolicy {
+    Always,       // a write returns only once it is on disk
+    EverySecond,  // synced once a second; a crash loses about a second
+    No,           // written promptly, synced whenever the OS decides
+};
+
+enum class LogOp : uint8_t {
+    Set = 1,
+    Del = 2,
+    Expire = 3,
+    Clear = 4,
+};
+
+// Append-only log format, version 1. Integers are little-endian.
+//
+//   header  magic "FHKVAOF\0", u32 version, u32 flags (0)
+//   record  u32 CRC-32C of the rest of the record, u8 op, 3 bytes zero,
+//           u32 key size, u32 value size, i64 deadline (Unix ms, 0 = none),
+//           key bytes, value bytes
+//
+// SET carries the key's deadline and EXPIRE its new one, both absolute, so
+// replaying an old log drops whatever has expired since. Expiry itself is
+// never logged.
+struct LogRecord {
+    LogOp op;
+    string_view key;
+    string_view value;
+    int64_t deadline;
+};
+
+// Writer side of the log. Appends only copy the record into a buffer; a
+// flusher thread writes whatever has accumulated with one system call and
+// syncs according to the policy, so concurrent writers waiting under
+// FsyncPolicy::Always share each sync (group commit). The buffer is not
+// bounded: a disk slower than the write rate shows up as memory.
+//
+// The log can be rewritten while it is in use. The owner writes a compact
+// equivalent of its contents as of one instant to a new file; records
+// appended after that instant are kept aside and added when it is done,
+// and the new file then replaces the old one. Thread-safe.
+class AppendLog {
+public:
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t HEADER_BYTES = 16;
+    static constexpr size_t RECORD_HEADER = 24;
+
+    AppendLog() = default;
+    ~AppendLog();
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator=(const AppendLog&) = delete;
+
+    // Opens filename for appending, creating it if needed. validBytes is
+    // how much of an existing file replay accepted; a torn tail beyond it
+    // is cut off.
+    bool open(const string& filename, FsyncPolicy policy, uint64_t validBytes);
+    // Writes and syncs everything buffered, then closes the file.
+    void close();
+    bool isOpen() const { return open_.load(memory_order_acquire); }
+
+    // Buffers a record and returns its position in the log's history,
+    // which only grows, rewrites included. Records reach the file in the
+    // order they were appended.
+    uint64_t append(LogOp op, string_view key, string_view value, int64_t deadline);
+
+    // Under FsyncPolicy::Always, waits until the log is on disk up to
+    // position; otherwise returns at once. False once the log has failed.
+    bool waitDurable(uint64_t position);
+
+    // Rewriting, driven by one thread at a time. openRewrite() creates the
+    // new file. beginRewrite() marks the instant the compact contents
+    // describe and must be called while no record can be appended; every
+    // later record is also kept for the new file. writeRewrite() adds
+    // compact records, and finishRewrite() adds the kept ones and swaps the
+    // new file in, blocking appends only for the last of them. Any failure
+    // leaves the old log in use.
+    bool openRewrite();
+    void beginRewrite();
+    bool writeRewrite(const string& records);
+    bool finishRewrite();
+    void abortRewrite();
+
+    // Adds a record to out in the on-disk format.
+    static void encode(string& out, LogOp op, string_view key, string_view value, int64_t deadline);
+
+    void setPolicy(FsyncPolicy policy);
+    FsyncPolicy policy() const;
+    // Bytes in the log file, including those not yet written.
+    uint64_t size() const;
+    // Size of the file when it was opened or last rewritten.
+    uint64_t baseSize() const;
+    // False once a write or sync has failed; later records are dropped.
+    bool healthy() const { return !failed_.load(memory_order_relaxed); }
+
+    static optional<FsyncPolicy> parsePolicy(const string& name);
+    static const char* policyName(FsyncPolicy policy);
+
+private:
+#if defined(_WIN32)
+    using Handle = void*;
+#else
+    using Handle = int;
+#endif
+    static const Handle NO_FILE;
+
+    void flusherLoop();
+    static bool openFile(const string& filename, uint64_t validBytes, Handle& file);
+    // Writes data, then syncs if sync is set.
+    static bool writeFile(Handle file, const string& data, bool sync = false);
+    static bool syncFile(Handle file);
+    static void closeFile(Handle& file);
+
+    mutable mutex mutex_;
+    condition_variable wakeup_;   // flusher: data appended or closing
+    condition_variable durable_;  // writers: durableBytes_ advanced
+    string buffer_;               // appended, not yet handed to the flusher
+    uint64_t appendedBytes_ = 0;  // history position of the last record
+    uint64_t durableBytes_ = 0;
+    uint64_t fileBytes_ = 0;
+    uint64_t baseBytes_ = 0;
+    FsyncPolicy policy_ = FsyncPolicy::EverySecond;
+    bool flusherIdle_ = false;
+    bool closing_ = false;
+    bool rewriting_ = false;
+    string rewriteBuffer_;        // appended since beginRewrite()
+    atomic<bool> open_{false};
+    atomic<bool> failed_{false};
+    thread flusher_;
+    string filename_;
+
+    // Held while the live file is written, synced or replaced. Taken before
+    // mutex_ when both are needed.
+    mutex fileMutex_;
+    Handle file_ = NO_FILE;
+    uint64_t generation_ = 0;     // bumped when a rewrite replaces the file
+
+    // Owned by the rewriting thread.
+    Handle rewriteFile_ = NO_FILE;
+    uint64_t rewriteBytes_ = 0;
+};
+
+// Replays a log written by AppendLog straight from a read-only mapping.
+class AppendLogReader {
+public:
+    // Maps filename and checks its header. A file too short to hold a
+    // header counts as an empty log.
+    bool open(const string& filename);
+
+    // Calls f(const LogRecord&) for each intact record in order. A crash
+    // can leave a torn record at the end, which is skipped; a bad record
+    // anywhere else is corruption and returns false.
+    template <class F>
+    bool forEach(F&& f) {
+        const char* begin = file_.data();
+        const char* end = begin + file_.size();
+        const char* p = begin + (file_.size() < AppendLog::HEADER_BYTES ? file_.size() : AppendLog::HEADER_BYTES);
+        while (p != end) {
+            if (static_cast<size_t>(end - p) < AppendLog::RECORD_HEADER) {
+                break;  // torn header
+            }
+            uint32_t crc, keySize, valueSize;
+            LogRecord record;
+            memcpy(&crc, p, 4);
+            record.op = static_cast<LogOp>(static_cast<uint8_t>(p[4]));
+            memcpy(&keySize, p + 8, 4);
+            memcpy(&valueSize, p + 12, 4);
+            memcpy(&record.deadline, p + 16, 8);
+            uint64_t bytes = AppendLog::RECORD_HEADER + uint64_t(keySize) + valueSize;
+            if (static_cast<uint64_t>(end - p) < bytes) {
+                break;  // torn payload
+            }
+            if (Crc32c::compute(p + 4, static_cast<size_t>(bytes) - 4) != crc ||
+                record.op < LogOp::Set || record.op > LogOp::Clear) {
+                if (p + bytes == end) {
+                    break;  // the last record, partly written
+                }
+                validBytes_ = static_cast<uint64_t>(p - begin);
+                return false;
+            }
+            record.key = string_view(p + AppendLog::RECORD_HEADER, keySize);
+            record.value = string_view(p + AppendLog::RECORD_HEADER + keySize, valueSize);
+            f(record);
+            p += bytes;
+        }
+        validBytes_ = static_cast<uint64_t>(p - begin);
+        return true;
+    }
+
+    // Size of the intact prefix found by forEach(), header included; 0 if
+    // the file had no header.
+    uint64_t validBytes() const { return validBytes_ < AppendLog::HEADER_BYTES ? 0 : validBytes_; }
+    uint64_t fileBytes() const { return file_.size(); }
+
+private:
+    MappedFile file_;
+    uint64_t validBytes_ = 0;
+};
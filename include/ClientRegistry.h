@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct sockaddr;
+
+using namespace std;
+
+// The server's connected clients, as CLIENT LIST shows them, and the
+// limits on the replies a client may leave unread. Every network engine
+// registers its connections here and publishes their buffer sizes after
+// each read and send; CommandHandler reads them from whichever thread
+// runs the command, so sizes are atomics and the table has a mutex,
+// taken only to add, remove or list a client.
+//
+// Output limits: once a client's unsent replies pass the soft limit, its
+// connection is not read from until they are back under it, so a client
+// pipelining faster than it reads is slowed to the pace it reads at
+// rather than growing the server's memory. Past the hard limit the
+// connection is closed. A single reply is built whole before either is
+// checked, so KEYS on a large store can still go over by one reply, and
+// is then cut off at the hard limit. 0 turns a limit off.
+class ClientRegistry {
+public:
+    struct Client {
+        uint64_t id = 0;
+        int fd = -1;
+        string address;  // peer "ip:port"
+        chrono::steady_clock::time_point connected;
+        atomic<size_t> inputBytes{0};   // unparsed input held for it
+        atomic<size_t> outputBytes{0};  // replies not yet sent
+        atomic<int64_t> lastActiveMs{0};  // steady clock, of its last read
+        atomic<bool> paused{false};     // not read from, over the soft limit
+
+        // From the thread serving the connection.
+        void update(size_t input, size_t output) {
+            inputBytes.store(input, memory_order_relaxed);
+            outputBytes.store(output, memory_order_relaxed);
+        }
+        void touch(chrono::steady_clock::time_point now);
+    };
+
+    ClientRegistry() = default;
+    ClientRegistry(const ClientRegistry&) = delete;
+    ClientRegistry& operator=(const ClientRegistry&) = delete;
+
+    // The returned client stays valid until removed.
+    Client* add(uint64_t id, int fd, string address);
+    void remove(Client* client);
+    size_t count() const;
+    // One line per client, oldest first: "id=3 addr=127.0.0.1:50312 fd=9
+    // age=12 idle=0 qbuf=0 omem=0 paused=0", ages in seconds.
+    string list() const;
+
+    size_t softLimit() const { return softLimit_.load(memory_order_relaxed); }
+    size_t hardLimit() const { return hardLimit_.load(memory_order_relaxed); }
+    void setSoftLimit(size_t bytes) { softLimit_.store(bytes, memory_order_relaxed); }
+    void setHardLimit(size_t bytes) { hardLimit_.store(bytes, memory_order_relaxed); }
+    // Whether output is over a limit that is on.
+    bool overSoftLimit(size_t output) const { return softLimit() != 0 && output > softLimit(); }
+    bool overHardLimit(size_t output) const { return hardLimit() != 0 && output > hardLimit(); }
+    // Counts a connection closed for going over the hard limit.
+    void closedOverLimit() { closedOverLimit_.fetch_add(1, memory_order_relaxed); }
+    size_t closedOverLimitCount() const { return closedOverLimit_.load(memory_order_relaxed); }
+
+    // "ip:port" of a socket address, IPv4 or IPv6.
+    static string formatAddress(const sockaddr* address);
+
+    // Pausing is cheap and undone by the client catching up; closing is
+    // for a client that will not, so the hard limit is well above any
+    // reply but the largest values.
+    static constexpr size_t DEFAULT_SOFT_LIMIT = 16 * 1024 * 1024;
+    static constexpr size_t DEFAULT_HARD_LIMIT = size_t(1024) * 1024 * 1024;
+
+private:
+    mutable mutex mutex_;
+    unordered_map<uint64_t, unique_ptr<Client>> clients_;
+    atomic<size_t> softLimit_{DEFAULT_SOFT_LIMIT};
+    atomic<size_t> hardLimit_{DEFAULT_HARD_LIMIT};
+    atomic<size_t> closedOverLimit_{0};
+};
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <functional>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <vector>
+#include "ClientRegistry.h"
+#include "ExecutionLanes.h"
+#include "InputBuffer.h"
 #include "KeyValueStore.h"
 #include "Logger.h"
+#include "Resp.h"
 
 using namespace std;
 
@@ -11,35 +17,167 @@ using namespace std;
 // SET key value
 // GET key
 // DEL key
+// MGET key [key ...] / MSET key value [key value ...] / MDEL key [key ...]
 // EXPIRE key seconds
+// PEXPIRE key milliseconds
+// TTL key / PTTL key
+// SCAN cursor [MATCH pattern] [COUNT n]
+// PREFIX prefix [LIMIT n] / RANGE from to [LIMIT n]
 // STATS
-// Returns: "OK", value, "NOT_FOUND", "ERROR <msg>", or stats in JSON format
+// SAVE / BGSAVE filename [BINARY|TEXT]
+// BGREWRITEAOF
+// MEMORY STATS / MEMORY USAGE key
+// CONFIG GET|SET maxmemory|maxmemory-policy|appendfsync [value]
+// CONFIG GET|SET auto-aof-rewrite-percentage|auto-aof-rewrite-min-size [value]
+// CONFIG GET|SET ordered-index [yes|no]
+// CONFIG GET appendonly
+// CONFIG GET|SET client-output-soft-limit|client-output-hard-limit [bytes]
+// CLIENT LIST
+// PING [message]
+// Commands arrive as inline text lines or RESP multibulk requests (see
+// RespParser) and are answered in the same protocol. Inline replies are
+// "OK", a value, "(nil)", "ERROR: <msg>", or text; RESP replies are what a
+// Redis client expects of the same command.
+//
+// The keyspace may be split into partitions, each its own store served by
+// its own handler (EpollReactor's per-core mode): keyed commands then run
+// on the handler whose store owns their keys, see ownerOf, and the few
+// commands that read or change the whole keyspace (STATS, KEYS, CLEAR,
+// CONFIG SET, PREFIX, RANGE, MEMORY) reach every partition from whichever
+// handler runs them.
+//
+// Each command has a lane (see ExecutionLanes). Given the lanes, the
+// handler leaves a slow-lane command for its caller to run with runSlow,
+// off the thread that reads the connection; without them, or through
+// handleCommand, every command runs where it is read.
 class CommandHandler {
 public:
-    CommandHandler(KeyValueStore& store, Logger& logger) : store_(store), logger_(logger) {}
+    using Args = vector<string_view>;
+    // Offered each command by handlePipeline before it runs, with the
+    // bytes it arrived in. Returns where its reply is to be appended, or
+    // nullptr once it has taken the command to run elsewhere. args is
+    // empty for the reply to a protocol error, which cannot be taken.
+    using Route = function<string*(const Args& args, Protocol protocol, string_view request)>;
+    enum class Lane {
+        Fast,  // cost independent of the store's size
+        Slow,  // SAVE, LOAD, FLUSH, KEYS, CLEAR and CONFIG SET ordered-index
+    };
+    // A slow-lane command handlePipeline stopped at, for runSlow.
+    struct SlowCommand {
+        string request;  // the bytes it arrived in; empty if there is none
+        Protocol protocol = Protocol::Inline;
+    };
+
+    CommandHandler(KeyValueStore& store, Logger& logger) : store_(store), logger_(logger), partitions_{&store} {}
     
+    // Runs one inline command line and returns its reply.
     string handleCommand(const string& command);
+    // Runs every complete command at the front of input in order and
+    // appends each reply to output, newline-terminated if inline, so a
+    // connection can answer a pipelined read with one send. Consumed bytes
+    // are removed from input; a partial command is left for the next read,
+    // with how far parsing got, and not looked at again until it can be
+    // whole, and then only past that point.
+    // Returns false after QUIT, leaving anything behind it unread, or after
+    // a protocol error, which is answered and discards the rest.
+    bool handlePipeline(InputBuffer& input, string& output);
+    // As above, with each reply appended where route says, so a
+    // connection can have some of its commands run elsewhere and put their
+    // replies in place when they come back.
+    bool handlePipeline(InputBuffer& input, const Route& route);
+    // As the two above, but once lanes are set, a slow-lane command is not
+    // run: it is consumed into slow, which must be empty, and the rest of
+    // input is left for the caller to come back to once it has the reply
+    // from runSlow, so the connection's replies stay in command order. A
+    // slow command the lane has no room for is answered with an error.
+    bool handlePipeline(InputBuffer& input, string& output, SlowCommand& slow);
+    bool handlePipeline(InputBuffer& input, const Route& route, SlowCommand& slow);
+    // Runs slow, as taken by handlePipeline, on the slow lane, and passes
+    // its reply to done on the lane's thread.
+    void runSlow(SlowCommand slow, function<void(string& reply)> done);
+    // Runs one parsed command, as handlePipeline does, and appends its
+    // reply to output, newline-terminated if inline.
+    void runCommand(const Args& args, Protocol protocol, string& output);
+    // Runs the command args, whose first element is its name, found in a
+    // table built at compile time; its argument count is checked there, so
+    // handlers index args without checking. Allocates nothing before the
+    // handler runs.
+    void execute(const Args& args, ReplyWriter& reply);
+
+    // Makes this handler's store one of partitions (itself included), the
+    // stores the keyspace is split across. Commands whose keys belong to
+    // more than one partition are then refused, as are those that need the
+    // whole keyspace in one store (SCAN, SAVE, BGSAVE, LOAD, FLUSH,
+    // BGREWRITEAOF). Call before any command runs.
+    void setPartitions(vector<KeyValueStore*> partitions);
+    // The server's connected clients, for CLIENT LIST, STATS and the
+    // client-output limits of CONFIG, which are refused without it. Call
+    // before any command runs.
+    void setClients(ClientRegistry* clients) { clients_ = clients; }
+    // Where slow-lane commands run, and whose depths STATS reports;
+    // shared by every handler of a server. Call before any command runs.
+    void setLanes(ExecutionLanes* lanes) { lanes_ = lanes; }
+    // The lane of the command args; fast if it is not one.
+    static Lane laneOf(const Args& args);
+    // The partition of count that owns key. Only the part between the
+    // first '{' and the next '}' is hashed, if not empty, as in Redis
+    // Cluster, so keys that share a {tag} share a partition.
+    static size_t partitionOf(string_view key, size_t count);
+    // The partition of count that owns every key args names; false if it
+    // names none, names keys of more than one, or is not a valid command.
+    static bool ownerOf(const Args& args, size_t count, size_t& owner);
 
     // Public methods for testing
-    string handleSet(std::istringstream& iss);
-    string handleGet(std::istringstream& iss);
-    string handleDel(std::istringstream& iss);
-    string handleExists(std::istringstream& iss);
-    string handleExpire(std::istringstream& iss);
-    string handleTtl(std::istringstream& iss);
-    string handleKeys(std::istringstream& iss);
-    string handleClear(std::istringstream& iss);
-    string handleSave(std::istringstream& iss);
-    string handleLoad(std::istringstream& iss);
-    string handleDump(std::istringstream& iss);
-    string handleHelp(std::istringstream& iss);
-    string handleFlush(std::istringstream& iss);
-    string handleQuit(std::istringstream& iss);
+    void handleSet(const Args& args, ReplyWriter& reply);
+    void handleGet(const Args& args, ReplyWriter& reply);
+    void handleDel(const Args& args, ReplyWriter& reply);
+    void handleMget(const Args& args, ReplyWriter& reply);
+    void handleMset(const Args& args, ReplyWriter& reply);
+    void handleMdel(const Args& args, ReplyWriter& reply);
+    void handleExists(const Args& args, ReplyWriter& reply);
+    void handleExpire(const Args& args, ReplyWriter& reply);
+    void handleTtl(const Args& args, ReplyWriter& reply);
+    void handlePexpire(const Args& args, ReplyWriter& reply);
+    void handlePttl(const Args& args, ReplyWriter& reply);
+    void handleMemory(const Args& args, ReplyWriter& reply);
+    void handleConfig(const Args& args, ReplyWriter& reply);
+    void handleKeys(const Args& args, ReplyWriter& reply);
+    void handleScan(const Args& args, ReplyWriter& reply);
+    void handlePrefix(const Args& args, ReplyWriter& reply);
+    void handleRange(const Args& args, ReplyWriter& reply);
+    void handleClear(const Args& args, ReplyWriter& reply);
+    void handleClient(const Args& args, ReplyWriter& reply);
+    void handleSave(const Args& args, ReplyWriter& reply);
+    void handleBgsave(const Args& args, ReplyWriter& reply);
+    void handleBgrewriteaof(const Args& args, ReplyWriter& reply);
+    void handleLoad(const Args& args, ReplyWriter& reply);
+    void handleDump(const Args& args, ReplyWriter& reply);
+    void handleHelp(const Args& args, ReplyWriter& reply);
+    void handleFlush(const Args& args, ReplyWriter& reply);
+    void handlePing(const Args& args, ReplyWriter& reply);
+    void handleQuit(const Args& args, ReplyWriter& reply);
+    void handleStats(const Args& args, ReplyWriter& reply);
 
 private:
     KeyValueStore& store_;
     Logger& logger_;
+    vector<KeyValueStore*> partitions_;
+    ClientRegistry* clients_ = nullptr;
+    ExecutionLanes* lanes_ = nullptr;
+
+    // What every handlePipeline overload runs; slow is nullptr for those
+    // that run every command where it is read.
+    bool runPipeline(InputBuffer& input, const Route& route, SlowCommand* slow);
 
-    // Command handlers
-    string handleStats(std::istringstream& iss);
-}; 
\ No newline at end of file
+    // Optional BINARY/TEXT argument of SAVE and FLUSH at args[index];
+    // binary if absent.
+    static optional<SnapshotFormat> parseSnapshotFormat(const Args& args, size_t index);
+    // Optional LIMIT n of PREFIX and RANGE at args[index]; 0 if absent.
+    // False if malformed.
+    static bool parseLimit(const Args& args, size_t index, size_t& limit);
+    // Puts the keys PREFIX or RANGE gathered from every partition in order
+    // and keeps the first limit (0 for all).
+    void mergePartitions(vector<string>& keys, size_t limit) const;
+    // An array of keys; inline, one key per line or "(empty)".
+    static void writeKeys(const vector<string>& keys, ReplyWriter& reply);
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Epoch-based reclamation for lock-free readers.
+//
+// A reader pins the global epoch for the duration of a lookup with a Guard.
+// A writer that unlinks a record stamps it with currentEpoch() and keeps it
+// on a retire list; once the global epoch has advanced two steps past that
+// stamp no pinned reader can still reference the record and it may be freed.
+// The epoch only advances when every pinned thread has observed the current
+// value, so a stalled reader delays reclamation but never correctness.
+class EpochManager {
+public:
+    static constexpr size_t MAX_THREADS = 1024;
+
+    static EpochManager& getInstance();
+
+    // RAII pin of the calling thread. Guards nest; only the outermost one
+    // publishes and clears the thread's epoch.
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    uint64_t currentEpoch() const { return globalEpoch_.load(memory_order_acquire); }
+
+    // Advances the global epoch if every pinned thread has caught up with it
+    // and returns the epoch in effect afterwards.
+    uint64_t tryAdvance();
+
+    static bool isReclaimable(uint64_t retiredAt, uint64_t current) {
+        return retiredAt + 2 <= current;
+    }
+
+private:
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};   // 0 while the owning thread is not pinned
+        atomic<bool> inUse{false};
+    };
+
+    Slot slots_[MAX_THREADS];
+    atomic<size_t> highWater_{0};
+    atomic<uint64_t> globalEpoch_{1};
+
+    EpochManager() = default;
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    Slot* acquireSlot();
+    void enter();
+    void exit();
+
+    friend class Guard;
+    friend struct EpochThreadRecord;
+};
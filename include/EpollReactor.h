@@ -0,0 +1,231 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CommandHandler.h"
+#include "InputBuffer.h"
+#include "Logger.h"
+#include "Reactor.h"
+#include "SpscQueue.h"
+
+using namespace std;
+
+// Linux network engine for Server, built with KVSTORE_EPOLL. A few event
+// loop threads, each with its own epoll instance, share every connection
+// between them: sockets are non-blocking and registered edge-triggered
+// for both directions once, so an idle client costs its buffers and no
+// thread. Each loop accepts from the shared listening socket itself
+// (EPOLLEXCLUSIVE wakes one loop per connection), and a connection stays
+// on the loop that accepted it.
+//
+// A read runs every complete command it brings in through
+// CommandHandler::handlePipeline and writes the replies with as few sends
+// as the socket takes. It lands in a buffer of the loop's, parsed where it
+// lies, and only a command it leaves unfinished is moved to the
+// connection's own input, so a connection holds no input buffer between
+// requests; what it will not take waits in the connection's
+// output buffer for EPOLLOUT. Past the registry's soft output limit the
+// connection is not read from until EPOLLOUT has taken it back under, and
+// past the hard limit it is closed. Commands run on the loop thread, but
+// for those of the slow lane once the handler has one (see
+// ExecutionLanes): such a command goes to the lane's threads, and its
+// connection is not read from, nor its commands after it run, until the
+// lane posts the reply back to the loop and wakes it through its eventfd.
+// A KEYS or SAVE thus delays only the connection that sent it.
+//
+// In per-core mode nothing on the request path is shared: each loop is
+// pinned to a core and has its own SO_REUSEPORT listening socket, among
+// which the kernel spreads new connections, and its own partition of the
+// keyspace (CommandHandler::setPartitions). A keyed command that arrives
+// on a loop whose partition does not own its key is forwarded to the
+// owner's loop over a single-producer, single-consumer channel, run there
+// and its reply sent back the same way; replies to a connection's later
+// commands wait behind it, so each connection still sees its replies in
+// order. A loop sleeping in epoll_wait is woken for messages through its
+// eventfd, at most once per turn of the loop sending them.
+class EpollReactor : public Reactor {
+public:
+    // welcome is sent to a client that stays silent for welcomeDelay after
+    // connecting, or ahead of the replies to its first inline commands;
+    // never to a client that opens with a RESP request.
+    EpollReactor(CommandHandler& handler, Logger& logger, string welcome,
+                 chrono::milliseconds welcomeDelay, size_t loops = defaultLoops());
+    // Per-core mode: one loop for each of partitions, running the commands
+    // whose keys its partition owns.
+    EpollReactor(const vector<CommandHandler*>& partitions, Logger& logger, string welcome,
+                 chrono::milliseconds welcomeDelay);
+    ~EpollReactor() override;
+    EpollReactor(const EpollReactor&) = delete;
+    EpollReactor& operator=(const EpollReactor&) = delete;
+
+    // Listens on port, or any free port if 0, and starts the loops.
+    bool start(int port) override;
+    // Stops the loops and closes the listening socket and every connection.
+    void stop() override;
+
+    // The port listened on, once started.
+    int port() const override { return port_; }
+    size_t connectionCount() const override;
+    // Commands forwarded to the loop owning their keys, in per-core mode.
+    size_t forwardedCount() const;
+    // One loop per core.
+    static size_t defaultLoops();
+
+    // Bytes asked of recv at a time, and how many reads one connection may
+    // make before the loop serves the others.
+    static constexpr size_t READ_CHUNK = InputBuffer::READ_BYTES;
+    static constexpr size_t READS_PER_TURN = 16;
+    // Connections accepted per wake-up before the loop serves the others.
+    static constexpr size_t ACCEPTS_PER_TURN = 64;
+    // Messages a per-core loop's inbox holds, split between the channels
+    // from its peers, each taking at least MIN_CHANNEL_CAPACITY; more wait
+    // with their sender, which looks for room every OVERFLOW_RETRY_MS.
+    static constexpr size_t INBOX_CAPACITY = 4096;
+    static constexpr size_t MIN_CHANNEL_CAPACITY = 64;
+    static constexpr int OVERFLOW_RETRY_MS = 1;
+
+private:
+    struct Pending {
+        bool ready;  // false until a forwarded command's reply is back
+        string text;
+    };
+
+    struct Connection {
+        int fd;
+        uint64_t id;
+        InputBuffer input;     // a command still arriving, and what follows it
+        string output;
+        size_t sent = 0;       // bytes at the front of output already written
+        bool greeted = false;  // welcome sent, queued or not wanted
+        bool closing = false;  // QUIT or protocol error: close once drained
+        bool paused = false;   // over the soft output limit: not read from
+        bool waiting = false;  // for a slow-lane command's reply: not read from
+        ClientRegistry::Client* client = nullptr;
+        // Replies waiting for that of a command forwarded (in per-core
+        // mode) or sent to the slow lane ahead of them, in command order;
+        // firstPending numbers the front.
+        deque<Pending> pending;
+        uint64_t firstPending = 0;
+        // Per-core mode: a slow-lane command held until the commands
+        // forwarded ahead of it have run, as it may read or change their
+        // keys.
+        CommandHandler::SlowCommand held;
+    };
+
+    // A connection to come back to, which may have been closed and its fd
+    // reused since: id tells them apart.
+    struct Ref {
+        int fd;
+        uint64_t id;
+    };
+
+    // A forwarded command, or on its way back, its reply; also the reply
+    // to a slow-lane command.
+    struct Message {
+        Ref origin;  // the connection, on the loop that forwarded it
+        uint64_t sequence = 0;  // its place among the connection's pending replies
+        Protocol protocol = Protocol::Inline;
+        bool reply = false;
+        string text;
+    };
+    using Channel = SpscQueue<Message>;
+
+    struct Loop {
+        size_t index = 0;
+        CommandHandler* handler = nullptr;
+        int listenFd = -1;
+        int epollFd = -1;
+        int wakeFd = -1;  // eventfd written by stop(), and by peers in per-core mode
+        thread worker;
+        vector<unique_ptr<Connection>> byFd;
+        // Connections yet to be greeted, by deadline; the delay is fixed,
+        // so accept order is deadline order.
+        deque<pair<chrono::steady_clock::time_point, Ref>> greetings;
+        // Connections that used up READS_PER_TURN with input still unread;
+        // edge-triggered epoll will not report them again.
+        vector<Ref> unread;
+        // Where a connection with no partial command reads into.
+        InputBuffer reads;
+        atomic<size_t> connections{0};
+
+        // Per-core mode. inbox[i] carries messages from loop i, and
+        // outbox[i] is loop i's inbox from this one; none to itself.
+        vector<unique_ptr<Channel>> inbox;
+        vector<Channel*> outbox;
+        // Messages for a loop whose channel was full, sent before any
+        // newer ones.
+        vector<deque<Message>> overflow;
+        // Loops sent anything this turn, to be woken if asleep.
+        vector<bool> sentTo;
+        Message scratch;  // swapped through the channels, keeping its capacity
+        string replyScratch;
+        atomic<bool> sleeping{false};
+        atomic<size_t> forwarded{0};
+        // Replies from the slow lane, posted by its threads, which write
+        // wakeFd under the mutex so that closeAll() cannot close it under
+        // them.
+        mutex finishedMutex;
+        vector<Message> finished;
+        atomic<bool> hasFinished{false};
+    };
+
+    // A listening socket on port, shared by the loops or one of theirs.
+    int listenOn(int port);
+    void run(Loop& loop);
+    void acceptConnections(Loop& loop);
+    Connection* find(Loop& loop, Ref ref);
+    // Reads and runs commands; false once the connection should be closed.
+    bool readAndRun(Loop& loop, Connection& connection);
+    // Runs the commands in input, which holds the connection's unread
+    // bytes, up to QUIT or one for the slow lane.
+    void runCommands(Loop& loop, Connection& connection, InputBuffer& input);
+    // Gives a slow-lane command its place among the connection's pending
+    // replies, which then waits for it, and starts it once it is first.
+    void offload(Loop& loop, Connection& connection, CommandHandler::SlowCommand& slow);
+    void startSlow(Loop& loop, Connection& connection, CommandHandler::SlowCommand& slow);
+    // Puts the slow lane's replies in place and carries on with their
+    // connections.
+    void finishSlow(Loop& loop);
+    // Writes pending output; false on a socket error.
+    bool flush(Connection& connection);
+    // Pauses reading while unsent replies are over the soft limit, after
+    // trying to send them; false once they are over the hard limit.
+    bool limitOutput(Connection& connection);
+    void greetDue(Loop& loop, chrono::steady_clock::time_point now);
+    void disconnect(Loop& loop, Connection& connection);
+    // Whether a closing connection has nothing more to send.
+    static bool drained(const Connection& connection);
+    void closeAll();
+
+    // Per-core mode.
+    // Where the reply to a command of connection goes; nullptr once the
+    // command has been forwarded to the loop owning its keys.
+    static string* route(Loop& loop, Connection& connection, const CommandHandler::Args& args,
+                         Protocol protocol, string_view request);
+    static void post(Loop& loop, size_t to, Message& message);
+    // Runs forwarded commands, puts replies in place and sends what
+    // waited for room in a channel.
+    void deliver(Loop& loop);
+    void reply(Loop& loop, Message& message);
+    bool hasMail(const Loop& loop) const;
+    static bool hasOverflow(const Loop& loop);
+    void wakePeers(Loop& loop);
+    void pin(Loop& loop);
+
+    Logger& logger_;
+    string welcome_;
+    chrono::milliseconds welcomeDelay_;
+    bool perCore_;
+    vector<unique_ptr<Loop>> loops_;
+    vector<int> listeners_;
+    int port_ = 0;
+    atomic<bool> running_{false};
+    atomic<uint64_t> nextId_{1};
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "ThreadPool.h"
+
+using namespace std;
+
+// The two lanes commands run in. The fast lane is the thread that read a
+// command, an event loop or a Winsock worker, which runs GET, SET and
+// every other command whose cost does not grow with the store as soon as
+// it is parsed. The slow lane is a few threads of its own for those whose
+// cost does (SAVE, LOAD, FLUSH, KEYS, CLEAR, CONFIG SET ordered-index; see
+// CommandHandler::laneOf): the connection that sent one waits for its
+// reply, but the thread that read it goes on serving every other
+// connection, so a LOAD holds up no one else's GET, and the fast lane has
+// no queue to wait in behind it.
+//
+// At most as many slow commands run at once as the lane has threads; up
+// to MAX_QUEUED more wait for one, and past that a slow command is refused
+// rather than queued. Counters are atomics read by STATS from any thread;
+// the fast lane's are updated once per read, not per command.
+class ExecutionLanes {
+public:
+    explicit ExecutionLanes(size_t slowThreads = DEFAULT_SLOW_THREADS);
+    ExecutionLanes(const ExecutionLanes&) = delete;
+    ExecutionLanes& operator=(const ExecutionLanes&) = delete;
+
+    // A batch of commands run on the fast lane, around the batch.
+    void fastStarted() { fastRunning_.fetch_add(1, memory_order_relaxed); }
+    void fastFinished(size_t commands) {
+        fastRunning_.fetch_sub(1, memory_order_relaxed);
+        fastCompleted_.fetch_add(commands, memory_order_relaxed);
+    }
+    size_t fastRunning() const { return fastRunning_.load(memory_order_relaxed); }
+    uint64_t fastCompleted() const { return fastCompleted_.load(memory_order_relaxed); }
+
+    // Takes a place in the slow lane's queue for a command, which
+    // submitSlow then fills; false, counting the command as refused, if
+    // MAX_QUEUED are already waiting.
+    bool admitSlow();
+    void submitSlow(Task task);
+    size_t slowQueued() const { return slowQueued_.load(memory_order_relaxed); }
+    size_t slowRunning() const { return slowRunning_.load(memory_order_relaxed); }
+    uint64_t slowCompleted() const { return slowCompleted_.load(memory_order_relaxed); }
+    uint64_t slowRefused() const { return slowRefused_.load(memory_order_relaxed); }
+    size_t slowThreads() const { return slow_.size(); }
+
+    // Two, so a SAVE still leaves a thread for a KEYS.
+    static constexpr size_t DEFAULT_SLOW_THREADS = 2;
+    // Each connection has at most one slow command in the lane, so this
+    // is reached only by that many connections sending one at once.
+    static constexpr size_t MAX_QUEUED = 1024;
+
+private:
+    // Written by every fast-lane thread; kept off the slow lane's line.
+    alignas(64) atomic<size_t> fastRunning_{0};
+    atomic<uint64_t> fastCompleted_{0};
+    alignas(64) atomic<size_t> slowQueued_{0};
+    atomic<size_t> slowRunning_{0};
+    atomic<uint64_t> slowCompleted_{0};
+    atomic<uint64_t> slowRefused_{0};
+    // Last, so it is destroyed first and runs what is queued while the
+    // counters are still there.
+    ThreadPool slow_;
+};
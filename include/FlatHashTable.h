@@ -0,0 +1,528 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Define FLAT_HASH_TABLE_PORTABLE to force the scalar probing fallback.
+#if defined(FLAT_HASH_TABLE_PORTABLE)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define FLAT_HASH_TABLE_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLAT_HASH_TABLE_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// Open-addressing hash table of record pointers in the style of a Swiss
+// table. Slots are arranged in groups; each group stores one control byte
+// per slot (EMPTY, or the low 7 bits of the record's hash) followed by the
+// slot pointers themselves, so a probe touches one small region of memory.
+// The control bytes of a group are compared in one go with SIMD and only
+// slots whose byte matches are dereferenced and compared.
+//
+// Probing is linear over whole groups starting at the home group, which
+// keeps every record reachable without crossing a group that has an empty
+// slot. That lets erase shift a later record back into the hole instead of
+// leaving a tombstone, so the table never degrades under delete-heavy
+// workloads.
+//
+// Records are owned by the caller and must expose `uint64_t hash` and a
+// `key()` convertible to string_view. Writers must be serialized
+// externally. find() may run concurrently with a writer provided the
+// caller keeps replaced records and arrays alive until no reader can see
+// them (see EpochManager): writers publish with atomic stores, a growing
+// upsert() builds a new array and swaps it in, and erase() bumps a
+// sequence counter around its shifts so a reader that missed the key while
+// records were moving looks again.
+template <class Record>
+class FlatHashTable {
+public:
+    static constexpr uint8_t EMPTY = 0x80;
+
+#if defined(FLAT_HASH_TABLE_AVX2)
+    static constexpr size_t GROUP_WIDTH = 32;
+#elif defined(FLAT_HASH_TABLE_SSE2)
+    static constexpr size_t GROUP_WIDTH = 16;
+#else
+    static constexpr size_t GROUP_WIDTH = 8;
+#endif
+    static constexpr size_t MIN_GROUPS = 2;
+
+    struct alignas(GROUP_WIDTH < 16 ? 8 : GROUP_WIDTH) SlotGroup {
+        atomic<uint8_t> ctrl[GROUP_WIDTH];
+        atomic<Record*> slots[GROUP_WIDTH];
+    };
+
+    struct Array {
+        explicit Array(size_t numGroups) :
+            groupMask(numGroups - 1),
+            capacity(numGroups * GROUP_WIDTH),
+            groups(new SlotGroup[numGroups]) {
+            for (size_t g = 0; g < numGroups; ++g) {
+                for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                    groups[g].ctrl[i].store(EMPTY, memory_order_relaxed);
+                    groups[g].slots[i].store(nullptr, memory_order_relaxed);
+                }
+            }
+        }
+        ~Array() { delete[] groups; }
+        Array(const Array&) = delete;
+        Array& operator=(const Array&) = delete;
+
+        // Holds at most seven records for every eight slots.
+        size_t maxLoad() const { return capacity - capacity / 8; }
+        size_t bytes() const { return sizeof(Array) + (groupMask + 1) * sizeof(SlotGroup); }
+
+        size_t groupMask;
+        size_t capacity;
+        SlotGroup* groups;
+    };
+
+    FlatHashTable() : array_(new Array(MIN_GROUPS)), size_(0), seq_(0) {}
+    ~FlatHashTable() { delete array_.load(memory_order_relaxed); }
+    FlatHashTable(const FlatHashTable&) = delete;
+    FlatHashTable& operator=(const FlatHashTable&) = delete;
+
+    static size_t homeGroup(uint64_t hash, size_t groupMask) { return static_cast<size_t>(hash >> 7) & groupMask; }
+    static uint8_t fingerprint(uint64_t hash) { return static_cast<uint8_t>(hash & 0x7F); }
+
+    // Smallest group count that holds n records without growing.
+    static size_t groupsFor(size_t n) {
+        size_t groups = MIN_GROUPS;
+        while (groups * GROUP_WIDTH - groups * GROUP_WIDTH / 8 < n) {
+            groups <<= 1;
+        }
+        return groups;
+    }
+
+    size_t size() const { return size_; }
+    const Array* array() const { return array_.load(memory_order_acquire); }
+
+    // Safe to call without the writer lock.
+    Record* find(string_view key, uint64_t hash) const {
+        for (;;) {
+            uint64_t seq = seq_.load(memory_order_acquire);
+            if (seq & 1) {
+                this_thread::yield();
+                continue;
+            }
+            Record* found = findIn(array_.load(memory_order_acquire), key, hash);
+            // A hit is always a record that was live for this key; only a
+            // miss can be an artifact of a concurrent erase shifting records.
+            if (found != nullptr) {
+                return found;
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (seq_.load(memory_order_relaxed) == seq) {
+                return nullptr;
+            }
+        }
+    }
+
+    // Starts loading the home group of hash into cache, so that a batch of
+    // lookups can overlap their misses instead of paying them one by one.
+    // Same rules as find().
+    void prefetch(uint64_t hash) const {
+        const Array* a = array_.load(memory_order_acquire);
+        prefetch(&a->groups[homeGroup(hash, a->groupMask)]);
+    }
+
+    // Inserts record, or replaces the record with the same key, and returns
+    // the replaced record (nullptr if the key was new). When the table grows
+    // the previous array is handed to retireArray(Array*).
+    template <class RetireArray>
+    Record* upsert(Record* record, RetireArray&& retireArray) {
+        Array* a = array_.load(memory_order_relaxed);
+        size_t g, i;
+        if (locate(a, record->key(), record->hash, g, i)) {
+            Record* old = a->groups[g].slots[i].load(memory_order_relaxed);
+            a->groups[g].slots[i].store(record, memory_order_release);
+            return old;
+        }
+        if (size_ + 1 > a->maxLoad()) {
+            Array* bigger = new Array((a->groupMask + 1) * 2);
+            rehashInto(a, bigger);
+            array_.store(bigger, memory_order_release);
+            retireArray(a);
+            a = bigger;
+        }
+        insertNew(a, record);
+        size_++;
+        return nullptr;
+    }
+
+    // Removes and returns the record for key, or nullptr.
+    Record* erase(string_view key, uint64_t hash) {
+        Array* a = array_.load(memory_order_relaxed);
+        size_t g, i;
+        if (!locate(a, key, hash, g, i)) {
+            return nullptr;
+        }
+        Record* old = a->groups[g].slots[i].load(memory_order_relaxed);
+        eraseAt(a, g, i);
+        return old;
+    }
+
+    // Calls pred on every record and erases those for which it returns true;
+    // the predicate takes ownership of the records it accepts.
+    template <class Pred>
+    size_t eraseIf(Pred&& pred) {
+        Array* a = array_.load(memory_order_relaxed);
+        size_t erased = 0;
+        for (size_t g = 0; g <= a->groupMask; ++g) {
+            SlotGroup& group = a->groups[g];
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                // A record shifted back into the slot by the erase is
+                // examined again rather than skipped.
+                while (group.ctrl[i].load(memory_order_relaxed) != EMPTY &&
+                       pred(group.slots[i].load(memory_order_relaxed))) {
+                    eraseAt(a, g, i);
+                    erased++;
+                }
+            }
+        }
+        return erased;
+    }
+
+    template <class F>
+    void forEach(F&& f) const {
+        forEachIn(array_.load(memory_order_acquire), f);
+    }
+
+    template <class F>
+    static void forEachIn(const Array* a, F&& f) {
+        for (size_t g = 0; g <= a->groupMask; ++g) {
+            const SlotGroup& group = a->groups[g];
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                if (group.ctrl[i].load(memory_order_relaxed) != EMPTY) {
+                    Record* r = group.slots[i].load(memory_order_acquire);
+                    if (r != nullptr) {
+                        f(r);
+                    }
+                }
+            }
+        }
+    }
+
+    // Calls f on every record whose home group is the one cursor names and
+    // returns the cursor naming the next group, or 0 after the last. Those
+    // records lie between their home group and the first group after it
+    // with an empty slot. As in Redis' SCAN, cursors count through the
+    // group index with its bits reversed, so when the table grows or shrinks
+    // between calls the groups already visited map onto a prefix of the new
+    // order: a record present for a whole scan is seen at least once, and
+    // only then can it be seen twice. Call with writers excluded.
+    template <class F>
+    uint64_t scan(uint64_t cursor, F&& f) const {
+        const Array* a = array_.load(memory_order_acquire);
+        uint64_t mask = a->groupMask;
+        size_t home = static_cast<size_t>(cursor & mask);
+        size_t g = home;
+        for (size_t probed = 0; probed <= mask; ++probed) {
+            const SlotGroup& group = a->groups[g];
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                if (group.ctrl[i].load(memory_order_relaxed) != EMPTY) {
+                    Record* r = group.slots[i].load(memory_order_relaxed);
+                    if (homeGroup(r->hash, mask) == home) {
+                        f(r);
+                    }
+                }
+            }
+            if (Ctrl(group).matchEmpty()) {
+                break;
+            }
+            g = (g + 1) & mask;
+        }
+        cursor |= ~mask;
+        cursor = reverseBits(cursor);
+        cursor++;
+        return reverseBits(cursor);
+    }
+
+    // Calls f on up to count records, each found by walking forward from a
+    // slot chosen with rng(). An approximation of uniform sampling that
+    // needs no auxiliary index; records may be visited more than once.
+    template <class Rng, class F>
+    void sample(Rng&& rng, size_t count, F&& f) const {
+        const Array* a = array_.load(memory_order_acquire);
+        if (size_ == 0) {
+            return;
+        }
+        for (size_t n = 0; n < count; ++n) {
+            size_t slot = static_cast<size_t>(rng()) & (a->capacity - 1);
+            for (;;) {
+                const SlotGroup& group = a->groups[slot / GROUP_WIDTH];
+                size_t i = slot % GROUP_WIDTH;
+                if (group.ctrl[i].load(memory_order_relaxed) != EMPTY) {
+                    f(group.slots[i].load(memory_order_acquire));
+                    break;
+                }
+                slot = (slot + 1) & (a->capacity - 1);
+            }
+        }
+    }
+
+    // Installs an empty array with room for capacityHint records and returns
+    // the previous one, records included, for the caller to retire.
+    Array* detach(size_t capacityHint = 0) {
+        Array* old = array_.load(memory_order_relaxed);
+        array_.store(new Array(groupsFor(capacityHint)), memory_order_release);
+        size_ = 0;
+        return old;
+    }
+
+    // Takes over the contents of other, which must not be shared, and
+    // returns the array it replaced for the caller to retire.
+    Array* adopt(FlatHashTable& other) {
+        Array* old = array_.load(memory_order_relaxed);
+        array_.store(other.array_.load(memory_order_relaxed), memory_order_release);
+        size_ = other.size_;
+        other.array_.store(new Array(MIN_GROUPS), memory_order_relaxed);
+        other.size_ = 0;
+        return old;
+    }
+
+    // Pre-sizes an unshared table for n records.
+    void reserve(size_t n) {
+        Array* a = array_.load(memory_order_relaxed);
+        size_t groups = groupsFor(n);
+        if (groups <= a->groupMask + 1) {
+            return;
+        }
+        Array* bigger = new Array(groups);
+        rehashInto(a, bigger);
+        array_.store(bigger, memory_order_release);
+        delete a;
+    }
+
+private:
+    // Bit set of slot offsets within a group. SHIFT converts a bit index to
+    // an offset for the portable groups, which keep one bit per byte.
+    template <int SHIFT>
+    struct BitMask {
+        uint64_t bits;
+
+        explicit operator bool() const { return bits != 0; }
+        size_t lowest() const { return countTrailingZeros(bits) >> SHIFT; }
+        void clearLowest() { bits &= bits - 1; }
+    };
+
+    static void prefetch(const void* p) {
+#if defined(FLAT_HASH_TABLE_SSE2) || defined(FLAT_HASH_TABLE_AVX2)
+        _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(p);
+#else
+        (void)p;
+#endif
+    }
+
+    static uint64_t reverseBits(uint64_t x) {
+        x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+        x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+        x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+        return (x >> 32) | (x << 32);
+    }
+
+    static size_t countTrailingZeros(uint64_t x) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, x);
+        return index;
+#else
+        return static_cast<size_t>(__builtin_ctzll(x));
+#endif
+    }
+
+#if defined(FLAT_HASH_TABLE_AVX2)
+    struct Ctrl {
+        explicit Ctrl(const SlotGroup& g)
+            : bytes(_mm256_load_si256(reinterpret_cast<const __m256i*>(g.ctrl))) {}
+        BitMask<0> match(uint8_t h2) const {
+            return {static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_set1_epi8(static_cast<char>(h2)), bytes)))};
+        }
+        // EMPTY is the only control byte with the high bit set.
+        BitMask<0> matchEmpty() const {
+            return {static_cast<uint32_t>(_mm256_movemask_epi8(bytes))};
+        }
+        __m256i bytes;
+    };
+#elif defined(FLAT_HASH_TABLE_SSE2)
+    struct Ctrl {
+        explicit Ctrl(const SlotGroup& g)
+            : bytes(_mm_load_si128(reinterpret_cast<const __m128i*>(g.ctrl))) {}
+        BitMask<0> match(uint8_t h2) const {
+            return {static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(h2)), bytes)))};
+        }
+        // EMPTY is the only control byte with the high bit set.
+        BitMask<0> matchEmpty() const {
+            return {static_cast<uint32_t>(_mm_movemask_epi8(bytes))};
+        }
+        __m128i bytes;
+    };
+#else
+    // Eight control bytes compared at once inside a 64-bit word.
+    struct Ctrl {
+        static constexpr uint64_t LSBS = 0x0101010101010101ULL;
+        static constexpr uint64_t MSBS = 0x8080808080808080ULL;
+
+        explicit Ctrl(const SlotGroup& g) { memcpy(&bytes, g.ctrl, sizeof(bytes)); }
+        // May report a false positive next to a true match; callers compare
+        // the full key anyway.
+        BitMask<3> match(uint8_t h2) const {
+            uint64_t x = bytes ^ (LSBS * h2);
+            return {(x - LSBS) & ~x & MSBS};
+        }
+        BitMask<3> matchEmpty() const { return {bytes & MSBS}; }
+        uint64_t bytes;
+    };
+#endif
+
+    static Record* findIn(const Array* a, string_view key, uint64_t hash) {
+        uint8_t h2 = fingerprint(hash);
+        size_t g = homeGroup(hash, a->groupMask);
+        for (size_t probed = 0; probed <= a->groupMask; ++probed) {
+            const SlotGroup& group = a->groups[g];
+            // Pull in the slot pointers alongside the control bytes rather
+            // than waiting for the match to ask for them.
+            prefetch(&group.slots[GROUP_WIDTH / 2]);
+            Ctrl ctrl(group);
+            for (auto m = ctrl.match(h2); m; m.clearLowest()) {
+                Record* r = group.slots[m.lowest()].load(memory_order_acquire);
+                if (r != nullptr && r->hash == hash && r->key() == key) {
+                    return r;
+                }
+            }
+            if (ctrl.matchEmpty()) {
+                return nullptr;
+            }
+            g = (g + 1) & a->groupMask;
+        }
+        return nullptr;
+    }
+
+    static bool locate(const Array* a, string_view key, uint64_t hash, size_t& groupOut, size_t& slotOut) {
+        uint8_t h2 = fingerprint(hash);
+        size_t g = homeGroup(hash, a->groupMask);
+        for (size_t probed = 0; probed <= a->groupMask; ++probed) {
+            const SlotGroup& group = a->groups[g];
+            Ctrl ctrl(group);
+            for (auto m = ctrl.match(h2); m; m.clearLowest()) {
+                size_t i = m.lowest();
+                if (group.ctrl[i].load(memory_order_relaxed) != h2) {
+                    continue;
+                }
+                Record* r = group.slots[i].load(memory_order_relaxed);
+                if (r->hash == hash && r->key() == key) {
+                    groupOut = g;
+                    slotOut = i;
+                    return true;
+                }
+            }
+            if (ctrl.matchEmpty()) {
+                return false;
+            }
+            g = (g + 1) & a->groupMask;
+        }
+        return false;
+    }
+
+    // Places a record whose key is known to be absent in the first empty
+    // slot of its probe sequence. The slot is filled before the control
+    // byte so a reader that sees the fingerprint also sees the record.
+    static void insertNew(Array* a, Record* record) {
+        size_t g = homeGroup(record->hash, a->groupMask);
+        for (;;) {
+            SlotGroup& group = a->groups[g];
+            auto empty = Ctrl(group).matchEmpty();
+            if (empty) {
+                size_t i = empty.lowest();
+                group.slots[i].store(record, memory_order_release);
+                group.ctrl[i].store(fingerprint(record->hash), memory_order_release);
+                return;
+            }
+            g = (g + 1) & a->groupMask;
+        }
+    }
+
+    static void rehashInto(const Array* from, Array* to) {
+        forEachIn(from, [to](Record* r) { insertNew(to, r); });
+    }
+
+    // True if home lies in the cyclic group range (from, to].
+    static bool homeBetween(size_t home, size_t from, size_t to) {
+        return from <= to ? (from < home && home <= to) : (from < home || home <= to);
+    }
+
+    // Backward-shift deletion. Records only probe past a group while it is
+    // full, so a hole in a previously full group must be refilled from a
+    // later group by a record whose home is at or before the hole's group;
+    // the hole then moves to where that record was, and so on until the
+    // holed group had another empty slot to begin with.
+    void eraseAt(Array* a, size_t holeGroup, size_t holeSlot) {
+        uint64_t seq = seq_.load(memory_order_relaxed);
+        seq_.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        for (;;) {
+            SlotGroup& hole = a->groups[holeGroup];
+            if (Ctrl(hole).matchEmpty()) {
+                break;
+            }
+            bool moved = false;
+            for (size_t g = (holeGroup + 1) & a->groupMask; g != holeGroup && !moved; g = (g + 1) & a->groupMask) {
+                SlotGroup& group = a->groups[g];
+                Ctrl ctrl(group);
+                for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                    uint8_t c = group.ctrl[i].load(memory_order_relaxed);
+                    if (c == EMPTY) {
+                        continue;
+                    }
+                    Record* r = group.slots[i].load(memory_order_relaxed);
+                    if (homeBetween(homeGroup(r->hash, a->groupMask), holeGroup, g)) {
+                        continue;
+                    }
+                    hole.slots[holeSlot].store(r, memory_order_release);
+                    hole.ctrl[holeSlot].store(c, memory_order_release);
+                    holeGroup = g;
+                    holeSlot = i;
+                    moved = true;
+                    break;
+                }
+                if (!moved && ctrl.matchEmpty()) {
+                    // No record beyond a group with an empty slot ever
+                    // probed through the hole.
+                    break;
+                }
+            }
+            if (!moved) {
+                break;
+            }
+        }
+        SlotGroup& hole = a->groups[holeGroup];
+        hole.ctrl[holeSlot].store(EMPTY, memory_order_release);
+        hole.slots[holeSlot].store(nullptr, memory_order_release);
+        size_--;
+
+        seq_.store(seq + 2, memory_order_release);
+    }
+
+    atomic<Array*> array_;
+    size_t size_;
+    atomic<uint64_t> seq_;  // odd while erase is shifting records
+};
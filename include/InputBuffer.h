@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include "Resp.h"
+
+using namespace std;
+
+// A connection's unread input. Reads land at the back, straight from recv
+// into prepare()d room, and commands are consumed from the front by
+// moving a cursor, so a read that brings in a hundred commands moves no
+// bytes for them. What is left is moved to the front only when the back
+// runs out of room and it fills at most half the buffer; otherwise the
+// buffer doubles. Either way a byte is moved a bounded number of times
+// however it arrived, and storage is not zero-filled before recv writes it.
+//
+// The buffer also carries how far the parser got with the command at its
+// front (see RespParser::parse), so a command arriving over many reads is
+// not looked at again until it can be complete, and then only from where
+// the parser left off: a large value is accumulated without its bytes
+// being scanned once per read, and a request of many arguments without
+// them being parsed once per read.
+class InputBuffer {
+public:
+    InputBuffer() = default;
+    InputBuffer(InputBuffer&& other) noexcept { swap(other); }
+    InputBuffer& operator=(InputBuffer&& other) noexcept {
+        swap(other);
+        return *this;
+    }
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer& operator=(const InputBuffer&) = delete;
+
+    const char* data() const { return storage_.get() + head_; }
+    size_t size() const { return tail_ - head_; }
+    bool empty() const { return head_ == tail_; }
+    string_view view() const { return string_view(data(), size()); }
+    size_t capacity() const { return capacity_; }
+
+    // Room for at least count more bytes, to be written and then
+    // committed; any moving happens here, so pointers into the buffer are
+    // valid only until the next call.
+    char* prepare(size_t count);
+    void commit(size_t count) { tail_ += count; }
+    void append(const char* bytes, size_t count);
+    void append(string_view bytes) { append(bytes.data(), bytes.size()); }
+    // Drops count bytes from the front, which end a command, and the bytes
+    // needed by it. The progress is left alone: the parser resets it as a
+    // command completes, and what it holds then belongs to the command now
+    // at the front, from whose start its offsets count.
+    void consume(size_t count);
+    // Drops everything, progress included.
+    void clear();
+    // Takes what other holds, and its progress, into this buffer, which
+    // must be empty: the two trade storage, so nothing is copied.
+    void takeFrom(InputBuffer& other);
+    // Frees the storage if empty and larger than keep bytes, and the
+    // progress' spans with it.
+    void release(size_t keep);
+
+    // Parse progress of the command at the front: the bytes it needs at
+    // least before it can be complete, 0 when nothing is known, and where
+    // the parser left off in it.
+    size_t needed() const { return needed_; }
+    RespParser::Progress& progress() { return progress_; }
+    const RespParser::Progress& progress() const { return progress_; }
+    // Records needed, and makes room for the whole command and one more
+    // read after it: moving the start of a large value to the front costs
+    // least before the rest arrives, and one allocation of its size less
+    // than doubling up to it.
+    void expect(size_t needed);
+
+    // The first allocation; smaller reads still get this much.
+    static constexpr size_t MIN_CAPACITY = 1024;
+    // What a read asks prepare() for.
+    static constexpr size_t READ_BYTES = 16384;
+
+private:
+    void swap(InputBuffer& other) noexcept;
+    // Moves what is unread to the front, of new storage of capacity bytes
+    // unless that is the current capacity.
+    void moveTo(size_t capacity);
+
+    unique_ptr<char[]> storage_;
+    size_t capacity_ = 0;
+    size_t head_ = 0;  // first unread byte
+    size_t tail_ = 0;  // one past the last
+    size_t needed_ = 0;
+    RespParser::Progress progress_;
+};
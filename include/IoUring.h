@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <linux/io_uring.h>
+
+using namespace std;
+
+// One io_uring instance, spoken to through the raw system calls (the tree
+// takes no dependencies, so no liburing): a submission ring and a
+// completion ring shared with the kernel, used from the thread that set it
+// up. Built with KVSTORE_URING on Linux. UringReactor runs its connections
+// on one per event loop; AppendLog and SnapshotWriter write through the
+// calling thread's fileRing() once Server has chosen the io_uring engine.
+class IoUring {
+public:
+    IoUring() = default;
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Sets up a ring taking entries submissions at a time, and completions
+    // (at least entries) before the kernel has to hold them back. False,
+    // with errno set, if the kernel refuses.
+    bool init(unsigned entries, unsigned completions = 0);
+    bool ready() const { return fd_ >= 0; }
+
+    // Whether the kernel offers what UringReactor relies on: multishot
+    // accept and receive, provided buffer rings, zero-copy send and waits
+    // with a timeout, all there since Linux 6.0. If not, reason says what
+    // is missing.
+    static bool supported(string& reason);
+
+    // A cleared submission entry to fill in, queued with the next
+    // submit(). If the ring is full, what is queued is submitted first to
+    // make room; nullptr only if that fails.
+    io_uring_sqe* next();
+    // Hands what is queued to the kernel and waits for at least waitFor
+    // completions, or timeoutNs nanoseconds if that is not negative. False
+    // on an error other than the wait timing out or being interrupted.
+    bool submit(unsigned waitFor = 0, int64_t timeoutNs = -1);
+
+    // Calls f(const io_uring_cqe&) for each completion that has arrived,
+    // oldest first, and returns how many there were. f may queue
+    // submissions.
+    template <class F>
+    size_t drain(F&& f) {
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        size_t count = 0;
+        while (head != tail) {
+            io_uring_cqe cqe = cqes_[head & cqMask_];
+            // Released before f runs, so the kernel can reuse the slot.
+            __atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+            f(cqe);
+            count++;
+            if (head == tail) {
+                tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            }
+        }
+        return count;
+    }
+
+    // Provided buffers: count buffers (a power of two) of size bytes each,
+    // registered as buffer group group. A receive that selects the group
+    // takes one for each completion, which names it in its flags; the
+    // buffer is the kernel's again once recycle()d.
+    bool provideBuffers(uint16_t group, unsigned count, unsigned size);
+    const char* buffer(uint16_t id) const { return buffers_ + size_t(id) * bufferSize_; }
+    void recycle(uint16_t id);
+
+    // File writes. write() writes size bytes at the file position and, if
+    // sync, then forces them to disk, both in one submission; it returns
+    // once they are done. writeAt() only queues a write at offset, and
+    // finishWrites() waits for every write queued so far, false if any
+    // came up short.
+    bool write(int fd, const char* data, size_t size, bool sync = false);
+    bool sync(int fd);
+    bool writeAt(int fd, const char* data, size_t size, uint64_t offset);
+    bool finishWrites();
+
+    // The calling thread's ring for file writes, set up on first use, or
+    // nullptr unless useForFiles(true) was called and the kernel offers
+    // io_uring.
+    static IoUring* fileRing();
+    static void useForFiles(bool enabled);
+    static bool usedForFiles();
+
+    // Submission entries in a file ring.
+    static constexpr unsigned FILE_RING_ENTRIES = 16;
+
+private:
+    // Submits what is queued and waits for count completions of write()
+    // and sync(), false if any failed, and if queued for those of every
+    // writeAt() as well.
+    bool waitFiles(unsigned count, bool queued);
+
+    int fd_ = -1;
+    unsigned features_ = 0;
+
+    // Submission ring, shared with the kernel; sqeTail_ counts the entries
+    // handed out by next(), published at submit().
+    void* sqRing_ = nullptr;
+    size_t sqRingBytes_ = 0;
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqesBytes_ = 0;
+    unsigned sqeTail_ = 0;
+
+    // Completion ring; in the sq mapping when the kernel shares the two.
+    void* cqRing_ = nullptr;
+    size_t cqRingBytes_ = 0;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    // Provided buffers and the ring that hands them to the kernel, laid
+    // out as io_uring_buf_ring, whose flexible array member C++ places 8
+    // bytes too far; its slots are addressed directly instead.
+    io_uring_buf* bufferRing_ = nullptr;
+    size_t bufferRingBytes_ = 0;
+    char* buffers_ = nullptr;
+    size_t bufferBytes_ = 0;
+    unsigned bufferSize_ = 0;
+    uint16_t bufferMask_ = 0;
+    uint16_t bufferTail_ = 0;
+
+    // File writes queued by writeAt() and not yet waited for.
+    unsigned writesQueued_ = 0;
+    bool writeFailed_ = false;
+
+    static atomic<bool> forFiles_;
+};
@@ -1,14 +1,27 @@
 #pragma once
 
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <chrono>
 #include <mutex>
 #include <thread>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <sstream>
 #include <optional>
+#include <functional>
+#include <future>
+#include "AppendLog.h"
+#include "EpochManager.h"
+#include "FlatHashTable.h"
+#include "MemoryInfo.h"
+#include "OrderedIndex.h"
+#include "SlabAllocator.h"
+#include "Snapshot.h"
+#include "TimingWheel.h"
 #include "Logger.h"
 
 using namespace std;
@@ -18,42 +31,374 @@ struct StoreStats {
     size_t memoryUsage;
     size_t activeThreads;
     size_t totalKeys;
+    size_t shardCount;
+    size_t maxMemory;
+    size_t evictedKeys;
+    size_t rejectedWrites;
+    bool bgsaveInProgress;
+    size_t bgsaveKeysWritten;    // of bgsaveKeysTotal, while in progress
+    size_t bgsaveKeysTotal;
+    int64_t lastSaveTime;        // Unix seconds of the last successful SAVE or BGSAVE, 0 if none
+    bool bgsaveAttempted;        // whether the fields below describe a finished BGSAVE
+    bool lastBgsaveOk;
+    int64_t lastBgsaveMillis;
+    bool appendLogEnabled;
+    bool appendLogHealthy;
+    FsyncPolicy fsyncPolicy;
+    uint64_t appendLogBytes;
+    uint64_t appendLogBaseBytes;  // size after opening or the last rewrite
+    bool rewriteInProgress;
+    bool rewriteAttempted;       // whether the fields below describe a finished rewrite
+    bool lastRewriteOk;
+    int64_t lastRewriteMillis;
+};
+
+// Breakdown reported by MEMORY STATS. usedBytes is what maxMemory is
+// checked against: entries as reserved by the allocator plus hash tables.
+struct MemoryStats {
+    size_t usedBytes;
+    size_t entryBytes;
+    size_t tableBytes;
+    size_t indexBytes;           // ordered index nodes, 0 while it is off
+    size_t slabBytes;            // slab memory holding entries, free blocks included
+    size_t arenaBytes;           // memory reserved from the OS for slabs
+    size_t timerBytes;           // pending expiry timers, not in usedBytes
+    size_t pendingReclaimBytes;  // unlinked, waiting for readers to leave
+    size_t residentBytes;        // process RSS, 0 if unavailable
+    size_t totalKeys;
+};
+
+// On-disk layout used by save() and flush(). load() recognises either.
+enum class SnapshotFormat {
+    Text,    // "key value" lines; no TTLs, keys and values without spaces
+    Binary,  // checksummed blocks with TTLs, see Snapshot.h
+};
+
+// What set() does once memoryUsage would exceed maxMemory.
+enum class EvictionPolicy {
+    NoEviction,   // reject the write
+    AllKeysLru,   // evict the least recently used of a sample of keys
+    AllKeysLfu,   // evict the least frequently used of a sample of keys
+    VolatileTtl,  // evict the sampled key with a TTL that expires soonest
 };
 
 class KeyValueStore {
 public:
-    KeyValueStore();
+    // Number of independently locked shards used when none is given.
+    // Always rounded up to a power of two.
+    static constexpr size_t DEFAULT_SHARD_COUNT = 64;
+
+    // How often the cleaner advances the expiry wheels, and how many due
+    // keys it expires per shard on each pass before moving on.
+    static constexpr chrono::milliseconds EXPIRY_TICK{10};
+    static constexpr size_t EXPIRY_BATCH = 1024;
+
+    // hugePages asks for the entry arenas to be backed by huge pages where
+    // the OS allows it.
+    explicit KeyValueStore(size_t numShards = DEFAULT_SHARD_COUNT, bool hugePages = false);
     ~KeyValueStore();
 
     // Core operations
     bool set(const string& key, const string& value, int ttl = 0);
     string get(const string& key);
+    // Calls visit with key's value in place, without copying it, and
+    // returns whether key was found. visit runs inside the read's epoch
+    // guard and must not call back into the store.
+    bool read(string_view key, const function<void(string_view)>& visit);
     bool del(const string& key);
     bool exists(const string& key);
+    // Batch forms of get, set and del for many keys at once. Keys are
+    // grouped by shard so each shard is visited once, and their table
+    // groups are prefetched before any is probed. mget reads every key under
+    // one epoch guard and calls visit once per key in request order, with
+    // its value in place as read does, or nullopt for a missing key, so an
+    // empty value is told apart from a miss; visit must not call back into
+    // the store. mset takes each shard's lock once and clears
+    // any TTL as set does; it is refused as a whole if the batch would not
+    // fit in maxMemory. mdel returns how many keys it deleted. Neither write
+    // is atomic across shards.
+    void mget(const vector<string>& keys, const function<void(optional<string_view>)>& visit);
+    bool mset(const vector<pair<string, string>>& pairs);
+    size_t mdel(const vector<string>& keys);
     vector<string> keys();
+    // One step of a scan over the whole keyspace, as with Redis' SCAN.
+    // Starting at cursor (0 to begin), appends to out the live keys among
+    // about count records that match pattern (every key if it is empty) and
+    // returns the cursor to continue from, 0 once the scan is complete. A
+    // key present for the whole scan is returned at least once, whatever
+    // resizes happen between calls; keys added or removed meanwhile may or
+    // may not be. Holds one shard lock at a time, for at most count records.
+    uint64_t scan(uint64_t cursor, size_t count, vector<string>& out, string_view pattern = string_view());
+    // Glob-style match as in Redis' KEYS and SCAN: *, ?, [abc], [^a-z] and
+    // backslash escapes.
+    static bool matchPattern(string_view pattern, string_view text);
+    // Ordered lookups, answered from the ordered index in time proportional
+    // to the keys returned rather than to the keyspace. Append to out, in
+    // byte order, up to limit live keys (0 for no limit) that start with
+    // prefix, or that lie between from and to inclusive. Each shard is read
+    // under its own lock, so a key written during the call may or may not
+    // be returned. False if the index is off.
+    bool prefix(string_view prefix, size_t limit, vector<string>& out);
+    bool range(string_view from, string_view to, size_t limit, vector<string>& out);
+    // The ordered index is optional: it costs a B+tree entry per key and
+    // some time on every write. Turning it on builds it one shard at a
+    // time; from then on writes, deletes, expiry and eviction keep it
+    // current.
+    void setOrderedIndex(bool enabled);
+    bool orderedIndexEnabled() const { return orderedIndex_; }
     void clear();
-    bool save(const string& filename);
-    bool load(const string& filename);
-    bool flush(const string& filename);
+    bool save(const string& filename, SnapshotFormat format = SnapshotFormat::Binary);
+    // Replaces the store's contents with a snapshot. A binary snapshot is
+    // checksummed and decoded by up to threads workers, which then build
+    // the shards' tables in parallel; the text format is read on one.
+    bool load(const string& filename, size_t threads = 1);
+    bool flush(const string& filename, SnapshotFormat format = SnapshotFormat::Binary);
+    // Starts writing a point-in-time snapshot on a background thread and
+    // returns once that point is fixed; writes made afterwards are not in
+    // the file. Clients keep being served throughout. Returns false if a
+    // SAVE, BGSAVE or append-log rewrite is already running.
+    bool bgsave(const string& filename, SnapshotFormat format = SnapshotFormat::Binary);
+    bool snapshotInProgress() const { return snapshotInProgress_; }
     StoreStats getStats();
     bool expire(const string& key, int ttl_seconds);
     optional<chrono::seconds> ttl(const string& key);
+    bool pexpire(const string& key, int64_t ttl_milliseconds);
+    optional<chrono::milliseconds> pttl(const string& key);
+
+    size_t shardCount() const { return shards_.size(); }
+
+    // Replays the append-only log at filename into the store, if the file
+    // exists, then logs every later write to it. Meant for startup before
+    // clients connect: the log only describes writes made through it, so
+    // the store should be empty. Fails on a corrupt log, leaving whatever
+    // replayed before the bad record in place and logging off.
+    bool openAppendLog(const string& filename, FsyncPolicy policy = FsyncPolicy::EverySecond);
+    bool appendLogEnabled() const { return appendLog_.isOpen(); }
+    void setFsyncPolicy(FsyncPolicy policy) { appendLog_.setPolicy(policy); }
+    FsyncPolicy fsyncPolicy() const { return appendLog_.policy(); }
+    // Rewrites the append-only log on a background thread as one SET per
+    // live key, then swaps the result in for the old log. Writes made in
+    // the meantime are logged as usual and carried over. Returns false if
+    // logging is off or a SAVE, BGSAVE or rewrite is already running.
+    bool bgrewriteaof();
+    bool rewriteInProgress() const { return rewriteInProgress_; }
+
+    // The cleaner starts a rewrite once the log has grown by percentage
+    // since it was opened or last rewritten and is at least minBytes, as
+    // with Redis' auto-aof-rewrite-percentage and auto-aof-rewrite-min-size.
+    // A percentage of 0 turns this off.
+    static constexpr uint32_t DEFAULT_AUTO_REWRITE_PERCENTAGE = 100;
+    static constexpr uint64_t DEFAULT_AUTO_REWRITE_MIN_BYTES = 64ull * 1024 * 1024;
+    void setAutoRewritePercentage(uint32_t percentage) { autoRewritePercentage_ = percentage; }
+    uint32_t autoRewritePercentage() const { return autoRewritePercentage_; }
+    void setAutoRewriteMinBytes(uint64_t bytes) { autoRewriteMinBytes_ = bytes; }
+    uint64_t autoRewriteMinBytes() const { return autoRewriteMinBytes_; }
+
+    MemoryStats memoryStats();
+    // Bytes attributable to one key: its entry as reserved by the allocator
+    // plus its share of the shard's hash table.
+    optional<size_t> memoryUsageOf(const string& key);
+
+    // Memory limit in bytes, 0 for none. Enforced approximately: each write
+    // evicts sampled keys until it fits, and concurrent writers may
+    // overshoot by a few entries.
+    void setMaxMemory(size_t bytes) { maxMemory_ = bytes; }
+    size_t maxMemory() const { return maxMemory_; }
+    void setEvictionPolicy(EvictionPolicy policy) { policy_ = policy; }
+    EvictionPolicy evictionPolicy() const { return policy_; }
+
+    static optional<EvictionPolicy> parseEvictionPolicy(const string& name);
+    static const char* evictionPolicyName(EvictionPolicy policy);
+
+    // Keys examined per eviction, as with Redis' maxmemory-samples.
+    static constexpr size_t EVICTION_SAMPLES = 5;
 
 private:
-    struct Value {
-        string value;
-        chrono::system_clock::time_point expiry;
+    // A published entry is immutable apart from its expiry, which EXPIRE
+    // updates in place. Overwrites publish a new entry and retire the old
+    // one, so a reader holding a pointer always sees a consistent record.
+    // The key and value bytes follow the header in the same allocation,
+    // which comes from the shard's slab allocator unless it is too large
+    // for any size class.
+    struct Entry {
+        uint64_t hash;
+        atomic<int64_t> expiry;  // steady_clock milliseconds, 0 = never
+        uint32_t keySize;
+        uint32_t valueSize;
+        // Last access on the coarse access clock in the top 24 bits and a
+        // logarithmic access counter in the low 8. Readers update it with
+        // plain relaxed stores; a lost update only blurs the eviction order.
+        mutable atomic<uint32_t> access;
+        uint8_t sizeClass;  // SlabAllocator::NO_CLASS if heap-allocated
+
+        static Entry* create(SlabAllocator& slabs, uint64_t hash, string_view key, string_view value, int64_t expiry);
+        static void destroy(SlabAllocator& slabs, Entry* entry);
+
+        string_view key() const { return string_view(data(), keySize); }
+        string_view value() const { return string_view(data() + keySize, valueSize); }
+
+    private:
+        Entry(uint64_t h, int64_t exp, uint32_t k, uint32_t v, uint8_t c)
+            : hash(h), expiry(exp), keySize(k), valueSize(v), access(0), sizeClass(c) {}
+        const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+        char* data() { return reinterpret_cast<char*>(this + 1); }
     };
 
-    unordered_map<string, Value> store_;
-    mutex mutex_;
+    using Table = FlatHashTable<Entry>;
+    using Index = OrderedIndex<Entry>;
+
+    // A shard's new contents, built without any lock by load() before being
+    // swapped in.
+    struct LoadedShard {
+        Table table;
+        size_t entryBytes = 0;
+        vector<TimingWheel::Timer> timers;
+    };
+
+    // An entry as a snapshot saw it. The expiry is copied because EXPIRE
+    // changes it in place.
+    struct Frozen {
+        const Entry* entry;
+        int64_t expiry;
+    };
+
+    struct Shard;
+
+    struct Retired {
+        void* ptr;
+        void (*deleter)(Shard&, void*);
+        uint64_t epoch;
+        size_t bytes;
+    };
+
+    // Each shard owns a disjoint slice of the keyspace. Writers serialize on
+    // mutex_; readers take no lock and probe the table under an epoch guard.
+    // Aligned to a cache line so neighbouring shards do not false-share.
+    struct alignas(64) Shard {
+        explicit Shard(Arena& arena);
+        ~Shard();
+
+        mutex mutex_;
+        SlabAllocator slabs_;
+        Table table_;
+        vector<Retired> retired_;     // unlinked records awaiting reclamation
+        TimingWheel expiries_;        // a timer per TTL set on this shard
+        vector<TimingWheel::Timer> due_;  // fired timers not yet checked
+        size_t bytes_ = 0;            // entries and table array, as charged
+        // Set when a snapshot starts: the shard's contents must be copied
+        // into frozen_ before anything changes them.
+        bool snapshotPending_ = false;
+        vector<Frozen> frozen_;
+        // The shard's keys in order, maintained while indexed_ is set.
+        Index index_;
+        bool indexed_ = false;
+        size_t indexBytes_ = 0;       // of bytes_, charged for index_
+    };
+
+    Arena arena_;  // declared first: outlives the shards carving from it
+    vector<unique_ptr<Shard>> shards_;
+    size_t shardMask_;
     thread cleanerThread_;
-    bool running_;
-    size_t memoryUsage_;
-    size_t totalOperations_;
-    size_t activeThreads_;
+    thread snapshotThread_;
+    atomic<bool> running_;
+    atomic<size_t> memoryUsage_;
+    atomic<size_t> totalOperations_;
+    atomic<size_t> activeThreads_;
+    atomic<size_t> maxMemory_;
+    atomic<EvictionPolicy> policy_;
+    atomic<size_t> evictedKeys_;
+    atomic<size_t> rejectedWrites_;
+    atomic<size_t> evictionCursor_;  // shard to sample next
+    atomic<uint32_t> accessClock_;   // seconds, advanced by the cleaner
+    atomic<bool> snapshotInProgress_;   // one SAVE or BGSAVE at a time
+    atomic<bool> bgsaveInProgress_;
+    atomic<size_t> snapshotKeysWritten_;
+    atomic<size_t> snapshotKeysTotal_;
+    atomic<int64_t> lastSaveTime_;
+    atomic<bool> bgsaveAttempted_;
+    atomic<bool> lastBgsaveOk_;
+    atomic<int64_t> lastBgsaveMillis_;
+    atomic<bool> rewriteInProgress_;
+    atomic<bool> rewriteAttempted_;
+    atomic<bool> lastRewriteOk_;
+    atomic<int64_t> lastRewriteMillis_;
+    atomic<int64_t> rewriteRetryAt_;  // no automatic rewrite before, after a failure
+    atomic<uint32_t> autoRewritePercentage_;
+    atomic<uint64_t> autoRewriteMinBytes_;
+    atomic<bool> orderedIndex_;      // every shard indexed
+    mutex orderedIndexMutex_;        // serializes setOrderedIndex()
+    AppendLog appendLog_;
     Logger& logger_;
 
+    static uint64_t hashKey(string_view key);
+    Shard& shardFor(uint64_t hash);
+    // Indices into hashes grouped by shard, in request order within each
+    // shard; starts[s] .. starts[s + 1] are shard s's.
+    void groupByShard(const vector<uint64_t>& hashes, vector<size_t>& order, vector<size_t>& starts) const;
+    // Every shard's lock, taken in order, for operations that must look
+    // atomic across shards.
+    vector<unique_lock<mutex>> lockAll();
+
+    void put(string_view key, string_view value, int64_t expiry);
+    bool expireAt(string_view key, int64_t deadline);
+    void replay(const LogRecord& record, int64_t unixNow, int64_t steadyOffset);
+    // Appends a record if logging is on and returns its offset, else 0.
+    // Called with the key's shard locked, so log order matches the order
+    // writes to each key take effect.
+    uint64_t logWrite(LogOp op, string_view key, string_view value = string_view(), int64_t expiry = 0);
+    void awaitLog(uint64_t offset);
+
+    void retire(Shard& shard, void* ptr, void (*deleter)(Shard&, void*), size_t bytes);
+    void reclaim(Shard& shard);
+
+    void charge(Shard& shard, int64_t bytes);
+    void publish(Shard& shard, Entry* entry);
+    // Removes key from the table and the index and returns its entry, which
+    // the caller retires; nullptr if absent.
+    Entry* unlink(Shard& shard, string_view key, uint64_t hash);
+    // Refills the index from the table after its contents were replaced,
+    // or empties it if the shard is not indexed.
+    void rebuildIndex(Shard& shard);
+    void chargeIndex(Shard& shard);
+    bool orderedKeys(string_view from, const function<bool(string_view)>& inRange, size_t limit,
+                     vector<string>& out);
+    void retireEntry(Shard& shard, Entry* entry);
+    void retireGrownArray(Shard& shard, Table::Array* old);
+    void retireContents(Shard& shard, Table::Array* old, size_t entryBytes);
+    static size_t footprint(const Entry* entry);
+
+    static void deleteEntry(Shard& shard, void* ptr);
+    static void deleteTableArray(Shard& shard, void* ptr);
+    static void deleteTableArrayAndEntries(Shard& shard, void* ptr);
+
+    bool makeRoom(size_t bytes);
+    bool evictOne();
+    void touch(const Entry& entry) const;
+    static uint64_t evictionScore(const Entry& entry, EvictionPolicy policy, uint32_t clock);
+    static uint32_t accessClockNow();
+
     void cleanerLoop();
-    bool isExpired(const Value& value) const;
-}; 
\ No newline at end of file
+    void expireDue(Shard& shard, int64_t now);
+    bool isExpired(const Entry& entry) const;
+    bool isExpired(const Entry& entry, int64_t now) const;
+    static int64_t nowMillis();
+    static int64_t unixMillis();
+
+    bool claimSnapshot();
+    int64_t captureSnapshot(bool beginLogRewrite = false);
+    int64_t captureAndClear(uint64_t& logged);
+    void releaseSnapshot();
+    void freeze(Shard& shard);
+    static void collect(const Shard& shard, vector<Frozen>& out);
+    bool forEachFrozenShard(const function<bool(const vector<Frozen>&)>& write);
+    bool writeSnapshot(const string& filename, SnapshotFormat format, const function<int64_t()>& capture);
+    bool rewriteAppendLog();
+    bool autoRewriteDue();
+    static bool writeShard(const vector<Frozen>& frozen, ofstream& file, int64_t now);
+    static bool writeShard(const vector<Frozen>& frozen, SnapshotWriter& writer, int64_t now, int64_t unixOffset);
+    bool loadText(const string& filename);
+    bool loadBinary(const string& filename, size_t threads);
+    void addLoaded(size_t s, Entry* e, LoadedShard& out);
+    void installBatches(vector<vector<Entry*>>& batches);
+    void installShards(vector<LoadedShard>& loaded);
+};
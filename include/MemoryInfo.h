@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+using namespace std;
+
+// Queries against the system allocator and the OS used for memory
+// accounting, so reported usage reflects what was actually reserved
+// rather than the sizes that were asked for.
+class MemoryInfo {
+public:
+    // Bytes the allocator reserved for a block returned by operator new or
+    // malloc, including its size-class rounding.
+    static size_t usableSize(const void* ptr);
+
+    // Resident set size of the process, or 0 where it cannot be read.
+    static size_t residentBytes();
+};
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// B+tree of record pointers ordered by key, kept next to a hash table so
+// the keys between two bounds can be walked in order without looking at
+// the rest. Leaves hold up to LEAF_CAPACITY record pointers sorted by key;
+// inner nodes hold copies of separator keys, so a record can be replaced
+// or freed without touching them.
+//
+// Deletion is relaxed: a leaf is merged into a neighbour only once the two
+// fit in half a leaf and removed once empty, and inner nodes are never
+// rebalanced. The tree can therefore be sparser than a textbook B+tree
+// after heavy deletes, but a walk still visits at most one nearly empty
+// leaf per record it returns.
+//
+// Records are owned by the caller and must expose a key() convertible to
+// string_view. Not thread-safe: callers serialize every access.
+template <class Record>
+class OrderedIndex {
+public:
+    static constexpr size_t LEAF_CAPACITY = 64;
+    static constexpr size_t INNER_CAPACITY = 64;
+
+    OrderedIndex() : root_(new Leaf) { bytes_ = sizeof(Leaf); }
+    ~OrderedIndex() { destroy(root_); }
+    OrderedIndex(const OrderedIndex&) = delete;
+    OrderedIndex& operator=(const OrderedIndex&) = delete;
+
+    size_t size() const { return size_; }
+    // Memory held by the nodes, approximately for the separator keys.
+    size_t bytes() const { return bytes_; }
+
+    // Adds record, or replaces the one with the same key, which is returned.
+    Record* insert(Record* record) {
+        Split split;
+        Record* replaced = insertInto(root_, record, split);
+        if (split.right != nullptr) {
+            Inner* root = new Inner;
+            root->keys.push_back(move(split.key));
+            root->children.push_back(root_);
+            root->children.push_back(split.right);
+            bytes_ += innerBytes(root);
+            root_ = root;
+        }
+        if (replaced == nullptr) {
+            size_++;
+        }
+        return replaced;
+    }
+
+    // Removes the record with key and returns it, or nullptr if none.
+    Record* erase(string_view key) {
+        Record* removed = eraseFrom(root_, key);
+        while (!root_->leaf && static_cast<Inner*>(root_)->children.size() == 1) {
+            Inner* old = static_cast<Inner*>(root_);
+            root_ = old->children[0];
+            bytes_ -= innerBytes(old);
+            delete old;
+        }
+        if (removed != nullptr) {
+            size_--;
+        }
+        return removed;
+    }
+
+    void clear() {
+        destroy(root_);
+        root_ = new Leaf;
+        bytes_ = sizeof(Leaf);
+        size_ = 0;
+    }
+
+    // Calls f(Record*) for each record whose key is at least from, in key
+    // order, until f returns false.
+    template <class F>
+    void forEachFrom(string_view from, F&& f) const {
+        visit(root_, from, f);
+    }
+
+private:
+    struct Node {
+        explicit Node(bool l) : leaf(l) {}
+        bool leaf;
+    };
+
+    struct Leaf : Node {
+        Leaf() : Node(true) {}
+        uint32_t count = 0;
+        Record* records[LEAF_CAPACITY];
+    };
+
+    // children[i] holds keys below keys[i]; children[i + 1] those from it.
+    struct Inner : Node {
+        Inner() : Node(false) {}
+        vector<string> keys;
+        vector<Node*> children;
+    };
+
+    // Set when a node splits: the new right half and its lowest key.
+    struct Split {
+        Node* right = nullptr;
+        string key;
+    };
+
+    static size_t innerBytes(const Inner* inner) {
+        size_t bytes = sizeof(Inner) + inner->children.capacity() * sizeof(Node*) +
+                       inner->keys.capacity() * sizeof(string);
+        for (const string& key : inner->keys) {
+            bytes += key.capacity() > 15 ? key.capacity() : 0;
+        }
+        return bytes;
+    }
+
+    static size_t childFor(const Inner* inner, string_view key) {
+        return static_cast<size_t>(upper_bound(inner->keys.begin(), inner->keys.end(), key,
+            [](string_view k, const string& s) { return k < string_view(s); }) - inner->keys.begin());
+    }
+
+    static uint32_t lowerBound(const Leaf* leaf, string_view key) {
+        uint32_t lo = 0, hi = leaf->count;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (string_view(leaf->records[mid]->key()) < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    Record* insertInto(Node* node, Record* record, Split& split) {
+        string_view key = record->key();
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            uint32_t pos = lowerBound(leaf, key);
+            if (pos < leaf->count && string_view(leaf->records[pos]->key()) == key) {
+                Record* old = leaf->records[pos];
+                leaf->records[pos] = record;
+                return old;
+            }
+            if (leaf->count == LEAF_CAPACITY) {
+                Leaf* right = new Leaf;
+                bytes_ += sizeof(Leaf);
+                uint32_t half = LEAF_CAPACITY / 2;
+                right->count = LEAF_CAPACITY - half;
+                copy(leaf->records + half, leaf->records + LEAF_CAPACITY, right->records);
+                leaf->count = half;
+                if (pos > half) {
+                    leaf = right;
+                    pos -= half;
+                }
+                split.right = right;
+            }
+            copy_backward(leaf->records + pos, leaf->records + leaf->count, leaf->records + leaf->count + 1);
+            leaf->records[pos] = record;
+            leaf->count++;
+            if (split.right != nullptr) {
+                split.key = string(static_cast<Leaf*>(split.right)->records[0]->key());
+            }
+            return nullptr;
+        }
+
+        Inner* inner = static_cast<Inner*>(node);
+        size_t c = childFor(inner, key);
+        Split below;
+        Record* replaced = insertInto(inner->children[c], record, below);
+        if (below.right == nullptr) {
+            return replaced;
+        }
+        bytes_ -= innerBytes(inner);
+        inner->keys.insert(inner->keys.begin() + c, move(below.key));
+        inner->children.insert(inner->children.begin() + c + 1, below.right);
+        if (inner->children.size() > INNER_CAPACITY) {
+            // The middle separator moves up rather than being copied.
+            Inner* right = new Inner;
+            size_t half = inner->children.size() / 2;
+            split.key = move(inner->keys[half - 1]);
+            right->keys.assign(make_move_iterator(inner->keys.begin() + half), make_move_iterator(inner->keys.end()));
+            right->children.assign(inner->children.begin() + half, inner->children.end());
+            inner->keys.resize(half - 1);
+            inner->children.resize(half);
+            split.right = right;
+            bytes_ += innerBytes(right);
+        }
+        bytes_ += innerBytes(inner);
+        return replaced;
+    }
+
+    Record* eraseFrom(Node* node, string_view key) {
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            uint32_t pos = lowerBound(leaf, key);
+            if (pos == leaf->count || string_view(leaf->records[pos]->key()) != key) {
+                return nullptr;
+            }
+            Record* old = leaf->records[pos];
+            copy(leaf->records + pos + 1, leaf->records + leaf->count, leaf->records + pos);
+            leaf->count--;
+            return old;
+        }
+
+        Inner* inner = static_cast<Inner*>(node);
+        size_t c = childFor(inner, key);
+        Record* removed = eraseFrom(inner->children[c], key);
+        if (removed == nullptr) {
+            return nullptr;
+        }
+        Node* child = inner->children[c];
+        if (child->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(child);
+            if (leaf->count == 0) {
+                removeChild(inner, c);
+            } else if (c + 1 < inner->children.size() && merge(leaf, inner->children[c + 1])) {
+                removeChild(inner, c + 1);
+            } else if (c > 0 && merge(inner->children[c - 1], leaf)) {
+                removeChild(inner, c);
+            }
+        } else if (static_cast<Inner*>(child)->children.empty()) {
+            removeChild(inner, c);
+        }
+        return removed;
+    }
+
+    // Moves right's records into left if both are leaves that fit together
+    // in half a leaf.
+    static bool merge(Node* left, Node* right) {
+        if (!left->leaf || !right->leaf) {
+            return false;
+        }
+        Leaf* l = static_cast<Leaf*>(left);
+        Leaf* r = static_cast<Leaf*>(right);
+        if (l->count + r->count > LEAF_CAPACITY / 2) {
+            return false;
+        }
+        copy(r->records, r->records + r->count, l->records + l->count);
+        l->count += r->count;
+        r->count = 0;
+        return true;
+    }
+
+    // Deletes the empty child c along with the separator that bounds it.
+    void removeChild(Inner* inner, size_t c) {
+        bytes_ -= innerBytes(inner);
+        destroy(inner->children[c]);
+        inner->children.erase(inner->children.begin() + c);
+        if (!inner->keys.empty()) {
+            inner->keys.erase(inner->keys.begin() + (c > 0 ? c - 1 : 0));
+        }
+        bytes_ += innerBytes(inner);
+    }
+
+    template <class F>
+    static bool visit(const Node* node, string_view from, F& f) {
+        if (node->leaf) {
+            const Leaf* leaf = static_cast<const Leaf*>(node);
+            for (uint32_t i = lowerBound(leaf, from); i < leaf->count; ++i) {
+                if (!f(leaf->records[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        const Inner* inner = static_cast<const Inner*>(node);
+        for (size_t c = childFor(inner, from); c < inner->children.size(); ++c) {
+            if (!visit(inner->children[c], from, f)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void destroy(Node* node) {
+        if (node->leaf) {
+            bytes_ -= sizeof(Leaf);
+            delete static_cast<Leaf*>(node);
+            return;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        for (Node* child : inner->children) {
+            destroy(child);
+        }
+        bytes_ -= innerBytes(inner);
+        delete inner;
+    }
+
+    Node* root_;
+    size_t size_ = 0;
+    size_t bytes_ = 0;
+};
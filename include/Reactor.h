@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include "ClientRegistry.h"
+
+using namespace std;
+
+// A Linux network engine serving Server's clients: EpollReactor, or
+// UringReactor where the kernel has io_uring. Server picks one at run time
+// and drives it through this interface.
+class Reactor {
+public:
+    virtual ~Reactor() = default;
+
+    // Listens on port, or any free port if 0, and starts serving.
+    virtual bool start(int port) = 0;
+    // Stops serving and closes the listening socket and every connection.
+    virtual void stop() = 0;
+
+    // The port listened on, once started.
+    virtual int port() const = 0;
+    virtual size_t connectionCount() const = 0;
+
+    // Where connections are listed and output limits come from: the
+    // engine's own until given the server's, before start().
+    void setClients(ClientRegistry& clients) { clients_ = &clients; }
+    ClientRegistry& clients() { return *clients_; }
+
+protected:
+    ClientRegistry ownClients_;
+    ClientRegistry* clients_ = &ownClients_;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Which protocol a command arrived in; its reply goes back in the same one.
+enum class Protocol {
+    Inline,  // a line of whitespace-separated words, as typed into the client
+    Resp,    // RESP2 multibulk, as sent by Redis clients and redis-benchmark
+};
+
+// Splits a connection's input into commands. The protocol is picked per
+// command from its first byte, as Redis does: '*' starts a RESP multibulk
+// request ("*<n>\r\n" followed by n "$<len>\r\n<bytes>\r\n" bulk strings,
+// so arguments may hold any bytes), anything else an inline line ending in
+// "\n". Arguments are views into the caller's buffer and stay valid until
+// it changes.
+//
+// An Incomplete result says how much input the command needs at least, and
+// the caller (CommandHandler, keeping it in the connection's InputBuffer)
+// does not call again until that much is in: once a bulk length has been
+// read, its bytes are waited for without looking at them. Given a
+// Progress, the parser also keeps its place in the command there and goes
+// on from it on the next call, so each byte of a command arriving over
+// many reads is looked at once: an inline line is searched for its end
+// only in the bytes that are new, and a multibulk request's arguments are
+// not parsed again, however many of them there are.
+class RespParser {
+public:
+    enum class Status { Complete, Incomplete, Error };
+
+    // How far parsing got with a command still arriving. Offsets count
+    // from the command's first byte, so they hold wherever the buffer
+    // holding it moves the command to. Reset once the command is complete
+    // or found in error; the spans' capacity is kept for the next one.
+    struct Progress {
+        // Inline: how many bytes at the start hold no line end.
+        size_t scanned = 0;
+        // Multibulk: the argument count, or -1 before its line is in; the
+        // offset just past the last whole argument; and where each of those
+        // arguments is, as offset and length.
+        long long count = -1;
+        size_t parsed = 0;
+        vector<pair<size_t, size_t>> spans;
+
+        void reset() {
+            scanned = 0;
+            count = -1;
+            parsed = 0;
+            spans.clear();
+        }
+    };
+
+    // Limits, as Redis' defaults: longer requests are protocol errors.
+    static constexpr size_t MAX_INLINE = 64 * 1024;
+    static constexpr size_t MAX_ARGS = 1024 * 1024;
+    static constexpr size_t MAX_BULK = 512 * 1024 * 1024;
+
+    // Parses the command at the start of data. Complete fills args (empty
+    // for a blank line or an empty multibulk) and sets consumed to its
+    // length; Incomplete sets consumed to the bytes the command needs at
+    // least, more than size; Error sets error, after which the connection
+    // cannot be resynchronized. progress, if given, is where an earlier
+    // call on the same command left off, and is updated for the next.
+    static Status parse(const char* data, size_t size, vector<string_view>& args, size_t& consumed,
+                        Protocol& protocol, string& error, Progress* progress = nullptr);
+    // Appends the whitespace-separated words of an inline command line.
+    static void split(string_view line, vector<string_view>& args);
+    // The offset of the first byte in data[0, size) that is byte, or size
+    // if none is. The first 64 bytes are compared sixteen (SSE2) or
+    // thirty-two (AVX2) at a time here: most lines end within them, and
+    // for so few the call to memchr costs more than the search. Longer
+    // lines go on in memchr.
+    static size_t find(const char* data, size_t size, char byte);
+
+private:
+    static Status parseInline(const char* data, size_t size, vector<string_view>& args, size_t& consumed,
+                              string& error, Progress& progress);
+    static Status parseMultibulk(const char* data, size_t size, vector<string_view>& args, size_t& consumed,
+                                 string& error, Progress& progress);
+    // Reads the integer after data[pos] up to its "\r\n" and moves pos past
+    // the line.
+    static Status readLength(const char* data, size_t size, size_t& pos, long long& value, string& error);
+};
+
+// Appends replies to a connection's output buffer in the request's
+// protocol. Inline replies are the plain text the client prints; an array
+// is written one element per line. Handlers whose inline reply predates
+// RESP and says something different check resp() and write each form.
+class ReplyWriter {
+public:
+    ReplyWriter(string& out, Protocol protocol) : out_(out), protocol_(protocol) {}
+
+    bool resp() const { return protocol_ == Protocol::Resp; }
+
+    void status(string_view text);    // +text, or text
+    void error(string_view message);  // -ERR message, or "ERROR: message"
+    void integer(long long value);
+    void bulk(string_view value);
+    void nil();                       // a missing value, "(nil)" inline
+    // Announces count elements; each is then written with the calls above,
+    // or another array.
+    void array(size_t count);
+    // Several lines of text for a person to read: a bulk string in RESP.
+    void text(string_view text) { bulk(text); }
+
+private:
+    void endElement();
+
+    string& out_;
+    Protocol protocol_;
+    size_t inlineElements_ = 0;  // array elements still to be ended with "\n"
+};
@@ -1,36 +1,108 @@
 #pragma once
 
 #include <string>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <thread>
 #include <atomic>
+#include <memory>
+#include <vector>
 #include "KeyValueStore.h"
+#include "ClientRegistry.h"
 #include "CommandHandler.h"
 #include "Logger.h"
+
+// The network engine is chosen at build time: KVSTORE_EPOLL (the default
+// on Linux, see src/CMakeLists.txt) multiplexes every connection over a
+// few epoll event loops; otherwise Winsock hands each connection to a
+// ThreadPool worker for its lifetime, so at most as many clients as the
+// pool has threads are served at once. Builds with KVSTORE_URING as well
+// can run on io_uring instead, chosen at run time.
+#ifdef KVSTORE_EPOLL
+#include "EpollReactor.h"
+#ifdef KVSTORE_URING
+#include "UringReactor.h"
+#endif
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include "ThreadPool.h"
 
 #pragma comment(lib, "ws2_32.lib")
+#endif
 
 using namespace std;
 
+#ifdef KVSTORE_EPOLL
+// Linux network engines. Uring falls back to Epoll where io_uring is not
+// built in or the kernel lacks it.
+enum class IoEngine {
+    Epoll,
+    Uring,
+};
+#endif
+
 class Server {
 public:
+#ifdef KVSTORE_EPOLL
+    // With cores > 0 the server runs in per-core mode (see EpollReactor):
+    // that many event loops, each with its own partition of the keyspace,
+    // always on epoll. Otherwise engine serves the clients, and with
+    // io_uring, snapshot and append-log writes go through it too.
+    explicit Server(Logger& logger, size_t cores = 0, IoEngine engine = IoEngine::Epoll);
+#else
     explicit Server(Logger& logger);
+#endif
     ~Server();
 
+    // Replays and then appends to the log at filename; call before start().
+    // Not available in per-core mode, as with loadSnapshot.
+    bool openAppendLog(const string& filename, FsyncPolicy policy);
+    // Loads a snapshot using up to threads workers; call before start(), so
+    // no client connects to a partly loaded store.
+    bool loadSnapshot(const string& filename, size_t threads);
     bool start(int port);
     void stop();
 
 private:
-    SOCKET serverSocket_;
+    // How long a new connection may take to send its first command before
+    // it is greeted as an interactive client.
+    static constexpr long WELCOME_DELAY_MS = 100;
+#ifndef KVSTORE_EPOLL
+    // How long a send to a client that is not reading may block before
+    // the client is disconnected.
+    static constexpr long SEND_TIMEOUT_MS = 30000;
+#endif
+
+    // Sent to interactive clients on connecting.
+    static string welcomeMessage();
+
     KeyValueStore store_;
-    CommandHandler commandHandler_;
     Logger& logger_;
+    // Before the handlers and engines that refer to it.
+    ClientRegistry clients_;
+    CommandHandler commandHandler_;
+#ifdef KVSTORE_EPOLL
+    // Per-core mode: the partitions after the first, which is store_, and
+    // their handlers.
+    vector<unique_ptr<KeyValueStore>> partitions_;
+    vector<unique_ptr<CommandHandler>> partitionHandlers_;
+    unique_ptr<Reactor> reactor_;
+    // After the engine, so it is destroyed first: the slow commands it
+    // still has run and post their replies to an engine stopped but there.
+    ExecutionLanes lanes_;
+
+    // Whether the keyspace is split, so that store_ holds only part of it.
+    bool partitioned() const { return !partitions_.empty(); }
+#else
+    SOCKET serverSocket_;
     std::atomic<bool> running_;
     std::thread serverThread_;
+    // Before the pool, whose clients wait on it, so it outlives them.
+    ExecutionLanes lanes_;
     ThreadPool threadPool_;
+    std::atomic<uint64_t> nextClientId_{1};
 
     void handleClient(SOCKET clientSocket);
+    static bool sendAll(SOCKET socket, const string& data);
     void serverLoop(int port);
+#endif
 }; 
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Large chunks of memory obtained directly from the OS and carved into
+// fixed-size slabs. Chunks are only returned when the arena is destroyed.
+// With huge pages requested, chunks are 2 MB aligned and backed by huge
+// pages where the OS allows it (transparent huge pages on Linux, large
+// pages on Windows when the process holds SeLockMemoryPrivilege); otherwise
+// they silently fall back to normal pages. Thread-safe.
+class Arena {
+public:
+    static constexpr size_t CHUNK_BYTES = size_t(2) << 20;
+    static constexpr size_t SLAB_BYTES = size_t(16) << 10;
+
+    explicit Arena(bool hugePages = false);
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returns SLAB_BYTES of fresh memory.
+    void* allocateSlab();
+
+    size_t reservedBytes() const;
+    bool hugePages() const { return hugePages_; }
+
+private:
+    struct Chunk {
+        void* base;
+        size_t bytes;
+    };
+
+    void* mapChunk(size_t bytes);
+    static void unmapChunk(const Chunk& chunk);
+
+    mutable mutex mutex_;
+    bool hugePages_;
+    vector<Chunk> chunks_;
+    char* next_;   // next free slab in the newest chunk
+    char* end_;
+};
+
+// Size-classed allocator for small records. Each class hands out blocks of
+// one size from slabs taken from an Arena, and keeps freed blocks on an
+// intrusive free list for reuse by the same class. Requests larger than the
+// biggest class must go to the general-purpose heap instead. Freed memory
+// stays with its class; none goes back to the arena.
+// Thread-safe; meant to be owned per shard so the lock is uncontended.
+class SlabAllocator {
+public:
+    static constexpr uint8_t NO_CLASS = 0xFF;
+    static constexpr size_t MAX_BLOCK = 4096;
+
+    explicit SlabAllocator(Arena& arena);
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    // Smallest class holding bytes, or NO_CLASS if bytes > MAX_BLOCK.
+    static uint8_t classFor(size_t bytes);
+    static size_t classSize(uint8_t sizeClass);
+
+    void* allocate(uint8_t sizeClass);
+    void deallocate(void* ptr, uint8_t sizeClass);
+
+    // Memory taken from the arena, used or free.
+    size_t slabBytes() const;
+
+private:
+    static constexpr size_t NUM_CLASSES = 64;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct SizeClass {
+        FreeBlock* freeList = nullptr;
+        char* next = nullptr;  // unused tail of the current slab
+        char* end = nullptr;
+    };
+
+    Arena& arena_;
+    mutable mutex mutex_;
+    SizeClass classes_[NUM_CLASSES];
+    size_t slabs_;
+};
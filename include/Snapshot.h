@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Crc32c.h"
+#include "MappedFile.h"
+
+using namespace std;
+
+// Binary snapshot format, version 1. Integers are little-endian.
+//
+//   header  magic "FHKVSNAP", u32 version, u32 flags (0), u64 key count,
+//           u64 creation time (Unix ms)
+//   block   u32 record count, u32 payload bytes, u32 CRC-32C of the
+//           payload, u32 reserved (0), then the payload
+//   record  u32 key size, u32 value size, i64 expiry (Unix ms, 0 = none),
+//           key bytes, value bytes
+//   footer  a block header of zeros, then magic "FHKVEND\0"
+//
+// Every block is self-contained and checksummed on its own, so a loader
+// can verify and decode blocks independently. The key count in the header
+// lets the loader size its tables before decoding.
+struct SnapshotRecord {
+    string_view key;
+    string_view value;
+    int64_t expiresAtMs;
+};
+
+class IoUring;
+
+// Writes through the calling thread's IoUring::fileRing() when there is
+// one: a closed block is only queued, and the next one is encoded while
+// the disk takes it.
+class SnapshotWriter {
+public:
+    static constexpr uint32_t VERSION = 1;
+    // Payload size at which a block is closed.
+    static constexpr size_t BLOCK_BYTES = 256 * 1024;
+
+    explicit SnapshotWriter(const string& filename);
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    bool ok() const { return ring_ != nullptr ? !failed_ : static_cast<bool>(file_); }
+    void add(string_view key, string_view value, int64_t expiresAtMs);
+    // Writes the last block and the footer and fills in the key count.
+    bool finish();
+
+private:
+    void flushBlock();
+    // Writes data; the ring takes the string over until its write is done,
+    // leaving data with an earlier buffer to reuse.
+    void emit(string& data);
+
+    ofstream file_;
+    // The block being filled, behind room for its header.
+    string block_;
+    uint32_t blockRecords_;
+    uint64_t keyCount_;
+
+    // With a ring: the file, the buffer being written and where the next
+    // write goes.
+    IoUring* ring_ = nullptr;
+    int fd_ = -1;
+    string writing_;
+    uint64_t offset_ = 0;
+    bool failed_ = false;
+};
+
+class SnapshotReader {
+public:
+    // Maps the file and indexes its blocks. Fails on a missing file, a
+    // foreign or newer format, or a truncated one; block payloads are only
+    // checksummed when decoded.
+    bool open(const string& filename);
+
+    // True if the file starts with the snapshot magic.
+    static bool isSnapshot(const string& filename);
+
+    uint64_t keyCount() const { return keyCount_; }
+    size_t blockCount() const { return blocks_.size(); }
+
+    // Verifies block i and calls f(const SnapshotRecord&) for each of its
+    // records. Returns false on a checksum mismatch or malformed record.
+    template <class F>
+    bool decodeBlock(size_t i, F&& f) const {
+        const Block& block = blocks_[i];
+        if (Crc32c::compute(block.payload, block.bytes) != block.crc) {
+            return false;
+        }
+        const char* p = block.payload;
+        const char* end = p + block.bytes;
+        for (uint32_t r = 0; r < block.records; ++r) {
+            if (end - p < static_cast<ptrdiff_t>(RECORD_HEADER)) {
+                return false;
+            }
+            uint32_t keySize, valueSize;
+            SnapshotRecord record;
+            memcpy(&keySize, p, 4);
+            memcpy(&valueSize, p + 4, 4);
+            memcpy(&record.expiresAtMs, p + 8, 8);
+            p += RECORD_HEADER;
+            if (static_cast<uint64_t>(end - p) < uint64_t(keySize) + valueSize) {
+                return false;
+            }
+            record.key = string_view(p, keySize);
+            record.value = string_view(p + keySize, valueSize);
+            p += keySize + valueSize;
+            f(record);
+        }
+        return p == end;
+    }
+
+    template <class F>
+    bool forEachRecord(F&& f) const {
+        for (size_t i = 0; i < blocks_.size(); ++i) {
+            if (!decodeBlock(i, f)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static constexpr size_t RECORD_HEADER = 16;
+
+private:
+    struct Block {
+        const char* payload;
+        uint32_t records;
+        uint32_t bytes;
+        uint32_t crc;
+    };
+
+    MappedFile file_;
+    vector<Block> blocks_;
+    uint64_t keyCount_ = 0;
+};
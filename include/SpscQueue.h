@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Bounded single-producer, single-consumer queue: one thread pushes, one
+// other thread pops, with no lock and no allocation after construction.
+// Each side owns one index and keeps a copy of the other's, refreshed
+// only when the copy says the ring is full (producer) or empty
+// (consumer), so in steady state a push or pop touches no cache line the
+// other thread writes. Items are moved in and out of slots built once, so
+// a string's capacity stays in its slot from one use to the next.
+template <class T>
+class SpscQueue {
+public:
+    // Capacity is rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) {
+        size_t count = 2;
+        while (count < capacity) {
+            count <<= 1;
+        }
+        slots_.resize(count);
+        mask_ = count - 1;
+    }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer only. Moves item in and returns true, or returns false,
+    // leaving item alone, if the queue is full.
+    bool push(T& item) {
+        size_t tail = tail_.load(memory_order_relaxed);
+        if (tail - cachedHead_ > mask_) {
+            cachedHead_ = head_.load(memory_order_acquire);
+            if (tail - cachedHead_ > mask_) {
+                return false;
+            }
+        }
+        swap(slots_[tail & mask_], item);
+        tail_.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Moves the oldest item into item and returns true, or
+    // returns false if the queue is empty. item's old contents are left in
+    // the slot for a later push to reuse.
+    bool pop(T& item) {
+        size_t head = head_.load(memory_order_relaxed);
+        if (head == cachedTail_) {
+            cachedTail_ = tail_.load(memory_order_acquire);
+            if (head == cachedTail_) {
+                return false;
+            }
+        }
+        swap(slots_[head & mask_], item);
+        head_.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    // Either side; exact only when the other side is not running.
+    bool empty() const {
+        return head_.load(memory_order_acquire) == tail_.load(memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    vector<T> slots_;
+    size_t mask_;
+    // Consumer's line: where it pops next, and what it last saw of tail_.
+    alignas(64) atomic<size_t> head_{0};
+    size_t cachedTail_ = 0;
+    // Producer's line.
+    alignas(64) atomic<size_t> tail_{0};
+    size_t cachedHead_ = 0;
+};
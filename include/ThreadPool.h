@@ -1,74 +1,201 @@
 #pragma once
 
-#include <vector>
-#include <queue>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <functional>
 #include <atomic>
-#include <stdexcept>
-#include <iostream>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-class ThreadPool {
+using namespace std;
+
+// A move-only callable with no arguments, kept in place when it fits
+// INLINE_BYTES: a lambda capturing a few pointers or a unique_ptr is
+// queued and run without touching the heap, which std::function would for
+// anything past two pointers. Larger callables are moved to the heap.
+class Task {
 public:
-    explicit ThreadPool(size_t numThreads = 4) : stop_(false) {
-        for (size_t i = 0; i < numThreads; ++i) {
-            workers_.emplace_back([this] {
-                while (true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(queueMutex_);
-                        condition_.wait(lock, [this] {
-                            return stop_ || !tasks_.empty();
-                        });
-                        if (stop_ && tasks_.empty()) {
-                            return;
-                        }
-                        task = std::move(tasks_.front());
-                        tasks_.pop();
-                    }
-                    try {
-                        task();
-                    } catch (const std::exception& e) {
-                        std::cerr << "Exception in thread pool task: " << e.what() << std::endl;
-                    } catch (...) {
-                        std::cerr << "Unknown exception in thread pool task" << std::endl;
-                    }
-                }
-            });
+    // Sized so a Task and a queue slot's sequence fill one cache line.
+    static constexpr size_t INLINE_BYTES = 40;
+
+    Task() = default;
+    template <class F, class = enable_if_t<!is_same_v<decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Callable = decay_t<F>;
+        if constexpr (fitsInline<Callable>()) {
+            new (storage_) Callable(std::forward<F>(f));
+            ops_ = &inlineOps<Callable>;
+        } else {
+            new (storage_) Callable*(new Callable(std::forward<F>(f)));
+            ops_ = &heapOps<Callable>;
+        }
+    }
+    Task(Task&& other) noexcept { take(other); }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
         }
+        return *this;
     }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
 
-    ~ThreadPool() {
-        {
-            std::unique_lock<std::mutex> lock(queueMutex_);
-            stop_ = true;
+    explicit operator bool() const { return ops_ != nullptr; }
+    void operator()() { ops_->invoke(storage_); }
+    void reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
         }
-        condition_.notify_all();
-        for (std::thread& worker : workers_) {
-            if (worker.joinable()) {
-                worker.join();
-            }
+    }
+
+    template <class Callable>
+    static constexpr bool fitsInline() {
+        return sizeof(Callable) <= INLINE_BYTES && alignof(Callable) <= alignof(max_align_t) &&
+               is_nothrow_move_constructible_v<Callable>;
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        // Move-constructs into to and destroys from.
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template <class Callable>
+    static constexpr Ops inlineOps = {
+        [](void* storage) { (*static_cast<Callable*>(storage))(); },
+        [](void* from, void* to) {
+            new (to) Callable(std::move(*static_cast<Callable*>(from)));
+            static_cast<Callable*>(from)->~Callable();
+        },
+        [](void* storage) { static_cast<Callable*>(storage)->~Callable(); },
+    };
+    template <class Callable>
+    static constexpr Ops heapOps = {
+        [](void* storage) { (**static_cast<Callable**>(storage))(); },
+        [](void* from, void* to) { new (to) Callable*(*static_cast<Callable**>(from)); },
+        [](void* storage) { delete *static_cast<Callable**>(storage); },
+    };
+
+    void take(Task& other) noexcept {
+        if (other.ops_ != nullptr) {
+            other.ops_->relocate(other.storage_, storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
         }
     }
 
-    template<class F>
+    alignas(max_align_t) unsigned char storage_[INLINE_BYTES];
+    const Ops* ops_ = nullptr;
+};
+
+// A fixed pool of worker threads running submitted tasks, each once, in
+// no particular order. Each worker has a Chase-Lev deque of its own: a
+// task submitted from a worker goes on the bottom of that worker's deque,
+// where the worker takes it back, newest first, without contending with
+// anyone; an idle worker steals the oldest from the top of another's, the
+// only contended step, with one compare-and-swap. Tasks submitted from
+// other threads go through a bounded lock-free queue that every worker
+// takes from. Neither queue allocates once built: a task is moved into
+// its slot.
+//
+// An idle worker spins for a while, then parks on a condition variable;
+// a submit takes the park mutex only when some worker is parked. The
+// destructor runs every task already submitted, and any they submit,
+// before joining. Tasks may block, as the Winsock server's do for a
+// client's lifetime, but then hold their worker for that long.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t numThreads = 4);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Throws runtime_error once the pool is being destroyed. From outside
+    // the pool, waits for room if the shared queue is full; a worker whose
+    // deque and the shared queue are both full runs the task itself.
+    void submit(Task task);
+    template <class F>
     void submit(F&& f) {
-        {
-            std::unique_lock<std::mutex> lock(queueMutex_);
-            if (stop_) {
-                throw std::runtime_error("submit on stopped ThreadPool");
-            }
-            tasks_.emplace(std::forward<F>(f));
-        }
-        condition_.notify_one();
+        submit(Task(std::forward<F>(f)));
     }
 
+    size_t size() const { return workers_.size(); }
+
+    // Slots in a worker's deque, and in the queue for outside submitters.
+    static constexpr size_t DEQUE_CAPACITY = 1024;
+    static constexpr size_t INJECTION_CAPACITY = 4096;
+    // Rounds of looking for work, with a pause between, before parking.
+    static constexpr int SPIN_ROUNDS = 64;
+
 private:
-    std::vector<std::thread> workers_;
-    std::queue<std::function<void()>> tasks_;
-    std::mutex queueMutex_;
-    std::condition_variable condition_;
-    std::atomic<bool> stop_;
-}; 
\ No newline at end of file
+    // A slot's sequence says which position may use it next, so a slot
+    // is written only once whoever took its last task is done moving it.
+    struct alignas(64) Slot {
+        atomic<size_t> sequence{0};
+        Task task;
+    };
+
+    // Chase-Lev work-stealing deque with a fixed ring. Push and pop are
+    // the owner's; steal is anyone's. A push that finds its slot still in
+    // use fails rather than growing the ring, and the task goes elsewhere.
+    class WorkDeque {
+    public:
+        WorkDeque();
+        bool push(Task& task);
+        bool pop(Task& task);
+        bool steal(Task& task);
+        bool empty() const;
+
+    private:
+        unique_ptr<Slot[]> slots_;
+        alignas(64) atomic<size_t> top_{0};
+        alignas(64) atomic<size_t> bottom_{0};
+    };
+
+    // Bounded multi-producer, multi-consumer queue (Vyukov's): each side
+    // claims a position with one compare-and-swap on its index.
+    class InjectionQueue {
+    public:
+        InjectionQueue();
+        bool push(Task& task);
+        bool pop(Task& task);
+        bool empty() const;
+
+    private:
+        unique_ptr<Slot[]> slots_;
+        alignas(64) atomic<size_t> head_{0};
+        alignas(64) atomic<size_t> tail_{0};
+    };
+
+    struct Worker {
+        WorkDeque deque;
+        uint64_t random = 0;  // picks where stealing starts
+        thread handle;
+    };
+
+    void run(size_t index);
+    // Own deque, then the shared queue, then the other deques.
+    bool findTask(size_t index, Task& task);
+    bool hasWork() const;
+    void park();
+    void wakeOne();
+    static void execute(Task& task);
+
+    vector<unique_ptr<Worker>> workers_;
+    InjectionQueue injected_;
+    atomic<bool> stop_{false};
+    alignas(64) atomic<size_t> sleepers_{0};
+    mutex parkMutex_;
+    condition_variable parked_;
+    uint64_t wakeups_ = 0;  // under parkMutex_
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Hierarchical timing wheel for key expiry, in the style of the classic
+// Varghese/Lauck scheme. Level 0 has one slot per millisecond tick; each
+// higher level covers 64 times the span of the one below and its slots are
+// cascaded down as time reaches them, so advancing the clock only touches
+// timers that are due or about to be. Deadlines beyond the top level wait
+// in an overflow list that is re-examined whenever the top level turns.
+//
+// Timers carry a copy of the key rather than a pointer to the entry; the
+// owner validates each fired timer against the live entry, so stale timers
+// (key deleted, overwritten or given a new TTL) need no cancellation.
+// Not thread-safe; each shard guards its wheel with the shard lock.
+class TimingWheel {
+public:
+    struct Timer {
+        string key;
+        int64_t deadline;  // milliseconds on the owner's clock
+    };
+
+    explicit TimingWheel(int64_t now);
+
+    void schedule(string key, int64_t deadline);
+
+    // Moves every timer whose deadline is at or before now into due.
+    void advance(int64_t now, vector<Timer>& due);
+
+    // Drops every pending timer.
+    void clear();
+
+    size_t size() const { return size_; }
+
+    // Heap held by the wheel: slot vectors and out-of-line key copies.
+    size_t bytes() const;
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+
+    void place(Timer&& timer);
+    void cascade(int level);
+
+    vector<Timer> slots_[LEVELS][SLOTS];
+    vector<Timer> overflow_;
+    int64_t current_;  // next tick to process; earlier ticks are done
+    size_t size_;
+};
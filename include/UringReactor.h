@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CommandHandler.h"
+#include "InputBuffer.h"
+#include "IoUring.h"
+#include "Logger.h"
+#include "Reactor.h"
+
+using namespace std;
+
+// Linux io_uring network engine for Server, built with KVSTORE_URING and
+// chosen at run time (--io uring); Server falls back to EpollReactor when
+// IoUring::supported() says the kernel lacks what this needs. As in
+// EpollReactor's shared mode, a few event loop threads take connections
+// from one listening socket and keep them, but nothing waits for
+// readiness: each loop's ring holds a multishot accept on the listener and
+// a multishot receive on every connection, so one request keeps reporting
+// connections and data until cancelled, and all a turn of the loop has
+// queued goes to the kernel with the wait for the next completions, in one
+// system call.
+//
+// Received bytes land in buffers the loop registered with the kernel (a
+// provided buffer ring) and are copied into the loop's input buffer, or
+// the connection's if a command is still arriving, the buffer going back
+// to the kernel at once; commands then run through
+// CommandHandler::handlePipeline as with epoll. Each connection has one
+// send in flight at a time; replies that come meanwhile gather behind it
+// and go out together. A batch of ZEROCOPY_BYTES or more, in practice a
+// large GET value, is sent with zero-copy send: the kernel reads it in
+// place rather than copying it to the socket, and the buffer is left alone
+// until the kernel's notification says it is done with it.
+//
+// A connection whose unsent replies pass the registry's soft output limit
+// has its receive cancelled, and armed again once sends have taken it
+// back under; past the hard limit it is closed. So does a connection that
+// sends a slow-lane command (see ExecutionLanes), until the lane posts
+// its reply back and wakes the loop through its eventfd; the commands
+// behind it run then.
+class UringReactor : public Reactor {
+public:
+    // welcome and welcomeDelay as for EpollReactor.
+    UringReactor(CommandHandler& handler, Logger& logger, string welcome, chrono::milliseconds welcomeDelay,
+                 size_t loops = defaultLoops());
+    ~UringReactor() override;
+    UringReactor(const UringReactor&) = delete;
+    UringReactor& operator=(const UringReactor&) = delete;
+
+    // Fails if a loop cannot set up its ring as well as on socket errors.
+    bool start(int port) override;
+    void stop() override;
+
+    int port() const override { return port_; }
+    size_t connectionCount() const override;
+    // Sends made with zero-copy send.
+    size_t zeroCopySends() const;
+    static size_t defaultLoops();
+
+    // Submissions a loop's ring takes at once, and completions it holds.
+    static constexpr unsigned RING_ENTRIES = 1024;
+    static constexpr unsigned RING_COMPLETIONS = 8 * RING_ENTRIES;
+    // Provided buffers per loop, and the bytes each holds; a receive
+    // completes with at most one buffer's worth.
+    static constexpr unsigned BUFFER_COUNT = 256;
+    static constexpr unsigned BUFFER_BYTES = 16384;
+    // Sends of at least this many bytes are zero-copy; below it, setting
+    // up the page references costs more than the copy.
+    static constexpr size_t ZEROCOPY_BYTES = 16384;
+
+private:
+    struct Connection {
+        int fd;
+        uint64_t id;
+        InputBuffer input;      // a command still arriving, and what follows it
+        string output;          // replies not yet handed to the kernel
+        string sending;         // the batch being sent, the kernel's until done
+        size_t sent = 0;        // bytes at the front of sending already sent
+        bool sendPending = false;  // a send's result is still to come
+        unsigned requests = 0;  // requests on the connection not finished
+        unsigned sends = 0;     // of which sends, zero-copy ones finishing at their notification
+        bool receiving = false;
+        bool greeted = false;
+        bool closing = false;   // QUIT or protocol error: close once drained
+        bool shutDown = false;  // being closed, freed once requests is 0
+        bool queued = false;    // in the loop's flush list
+        bool paused = false;    // over the soft output limit: receive cancelled
+        bool waiting = false;   // for a slow-lane command's reply: receive cancelled
+        ClientRegistry::Client* client = nullptr;
+    };
+
+    struct Ref {
+        int fd;
+        uint64_t id;
+    };
+
+    struct Loop {
+        size_t index = 0;
+        IoUring ring;
+        int wakeFd = -1;  // eventfd written by stop() and the slow lane
+        uint64_t wakeCount = 0;
+        thread worker;
+        vector<unique_ptr<Connection>> byFd;
+        deque<pair<chrono::steady_clock::time_point, Ref>> greetings;
+        // Connections with new output, sent from once the turn's
+        // completions are all in.
+        vector<Ref> toFlush;
+        // Where received bytes are parsed for a connection with no partial
+        // command.
+        InputBuffer reads;
+        size_t requests = 0;  // requests in the ring not finished
+        atomic<size_t> connections{0};
+        atomic<size_t> zeroCopySends{0};
+        // Replies from the slow lane, posted by its threads, which write
+        // wakeFd under the mutex so that closeAll() cannot close it under
+        // them.
+        mutex finishedMutex;
+        vector<pair<Ref, string>> finished;
+        atomic<bool> hasFinished{false};
+    };
+
+    // What a request is, kept in the low bits of its user_data; the rest
+    // is its Connection, whose alignment leaves those bits clear.
+    enum Op : uint64_t {
+        Accept = 0,
+        Wake = 1,
+        Receive = 2,
+        Send = 3,
+        Cancel = 4,
+    };
+    static constexpr uint64_t OP_MASK = 7;
+
+    void run(Loop& loop, promise<bool>& started);
+    // A submission entry for a request of connection (nullptr for the
+    // loop's own), counted until its last completion; nullptr on failure.
+    io_uring_sqe* prepare(Loop& loop, Op op, Connection* connection);
+    bool armAccept(Loop& loop);
+    bool armWake(Loop& loop);
+    bool armReceive(Loop& loop, Connection& connection);
+    void complete(Loop& loop, const io_uring_cqe& cqe);
+    void accepted(Loop& loop, int fd, chrono::steady_clock::time_point deadline);
+    void received(Loop& loop, Connection& connection, const io_uring_cqe& cqe);
+    void sendCompleted(Loop& loop, Connection& connection, const io_uring_cqe& cqe);
+    // Runs the commands in input, which holds the connection's unread
+    // bytes, then applies the output limits.
+    void serve(Loop& loop, Connection& connection, InputBuffer& input);
+    // Once the client has taken enough of its replies, runs what arrived
+    // while paused and receives again.
+    void resume(Loop& loop, Connection& connection);
+    // Cancels the connection's receive if armed; false if it cannot.
+    bool stopReceiving(Loop& loop, Connection& connection);
+    // Hands a slow-lane command to the lane; the connection waits for it.
+    void offload(Loop& loop, Connection& connection, CommandHandler::SlowCommand& slow);
+    // Adds the slow lane's replies to their connections' output and
+    // carries on with them.
+    void finishSlow(Loop& loop);
+    // Starts the next send of a connection if none is in flight.
+    void flush(Loop& loop, Connection& connection);
+    void markForFlush(Loop& loop, Connection& connection);
+    void greetDue(Loop& loop, chrono::steady_clock::time_point now);
+    // Cancels a connection's requests and shuts its socket, which is
+    // closed once they have all finished.
+    void disconnect(Loop& loop, Connection& connection);
+    void releaseIfDone(Loop& loop, Connection& connection);
+    Connection* find(Loop& loop, Ref ref);
+    // Cancels everything on the ring and waits for it to finish.
+    void shutDownLoop(Loop& loop);
+    void closeAll();
+
+    CommandHandler& handler_;
+    Logger& logger_;
+    string welcome_;
+    chrono::milliseconds welcomeDelay_;
+    vector<unique_ptr<Loop>> loops_;
+    int listenFd_ = -1;
+    int port_ = 0;
+    atomic<bool> running_{false};
+    atomic<uint64_t> nextId_{1};
+};
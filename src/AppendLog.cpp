@@ -0,0 +1,439 @@
+#include "AppendLog.h"
+#include <cerrno>
+#include <chrono>
+#include <filesystem>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef KVSTORE_URING
+#include "IoUring.h"
+#endif
+
+using namespace std;
+
+namespace {
+    const char MAGIC[8] = {'F', 'H', 'K', 'V', 'A', 'O', 'F', '\0'};
+
+    // Unless writers are waiting for a sync, records are left to gather for
+    // up to WRITE_DELAY or WRITE_BYTES before the flusher writes them, so a
+    // steady stream of small writes costs one system call per batch rather
+    // than a thread wakeup per record.
+    const auto WRITE_DELAY = chrono::milliseconds(1);
+    const size_t WRITE_BYTES = 256 * 1024;
+
+    string fileHeader() {
+        string header(MAGIC, sizeof(MAGIC));
+        header.append(reinterpret_cast<const char*>(&AppendLog::VERSION), sizeof(AppendLog::VERSION));
+        header.append(4, '\0');
+        return header;
+    }
+}
+
+#if defined(_WIN32)
+const AppendLog::Handle AppendLog::NO_FILE = nullptr;
+#else
+const AppendLog::Handle AppendLog::NO_FILE = -1;
+#endif
+
+AppendLog::~AppendLog() {
+    close();
+}
+
+bool AppendLog::open(const string& filename, FsyncPolicy policy, uint64_t validBytes) {
+    close();
+    if (!openFile(filename, validBytes, file_)) {
+        return false;
+    }
+    if (validBytes < HEADER_BYTES) {
+        if (!writeFile(file_, fileHeader(), true)) {
+            closeFile(file_);
+            return false;
+        }
+        validBytes = HEADER_BYTES;
+    }
+    filename_ = filename;
+    appendedBytes_ = durableBytes_ = 0;
+    fileBytes_ = baseBytes_ = validBytes;
+    policy_ = policy;
+    closing_ = false;
+    failed_ = false;
+    open_ = true;
+    flusher_ = thread(&AppendLog::flusherLoop, this);
+    return true;
+}
+
+void AppendLog::close() {
+    if (!flusher_.joinable()) {
+        return;
+    }
+    open_ = false;
+    {
+        lock_guard<mutex> lock(mutex_);
+        closing_ = true;
+    }
+    wakeup_.notify_one();
+    flusher_.join();
+    closeFile(file_);
+}
+
+void AppendLog::encode(string& out, LogOp op, string_view key, string_view value, int64_t deadline) {
+    char header[RECORD_HEADER] = {};
+    uint32_t keySize = static_cast<uint32_t>(key.size());
+    uint32_t valueSize = static_cast<uint32_t>(value.size());
+    header[4] = static_cast<char>(op);
+    memcpy(header + 8, &keySize, 4);
+    memcpy(header + 12, &valueSize, 4);
+    memcpy(header + 16, &deadline, 8);
+    uint32_t crc = Crc32c::compute(header + 4, RECORD_HEADER - 4);
+    crc = Crc32c::extend(crc, key.data(), key.size());
+    crc = Crc32c::extend(crc, value.data(), value.size());
+    memcpy(header, &crc, 4);
+    out.append(header, RECORD_HEADER);
+    out.append(key.data(), key.size());
+    out.append(value.data(), value.size());
+}
+
+uint64_t AppendLog::append(LogOp op, string_view key, string_view value, int64_t deadline) {
+    size_t bytes = RECORD_HEADER + key.size() + value.size();
+    lock_guard<mutex> lock(mutex_);
+    size_t before = buffer_.size();
+    encode(buffer_, op, key, value, deadline);
+    if (rewriting_) {
+        rewriteBuffer_.append(buffer_, before, bytes);
+    }
+    appendedBytes_ += bytes;
+    fileBytes_ += bytes;
+    // A busy flusher picks the record up with its next batch.
+    if (flusherIdle_ && (before == 0 || buffer_.size() >= WRITE_BYTES || policy_ == FsyncPolicy::Always)) {
+        wakeup_.notify_one();
+    }
+    return appendedBytes_;
+}
+
+bool AppendLog::waitDurable(uint64_t position) {
+    unique_lock<mutex> lock(mutex_);
+    durable_.wait(lock, [this, position] {
+        return durableBytes_ >= position || policy_ != FsyncPolicy::Always || closing_ || failed_;
+    });
+    return !failed_;
+}
+
+void AppendLog::flusherLoop() {
+    string batch;
+    auto lastSync = chrono::steady_clock::now();
+    unique_lock<mutex> lock(mutex_);
+    for (;;) {
+        flusherIdle_ = true;
+        if (buffer_.empty() && !closing_) {
+            // Wake for new records, or in time for the once-a-second sync.
+            wakeup_.wait_for(lock, chrono::seconds(1));
+        }
+        if (policy_ != FsyncPolicy::Always && !closing_) {
+            wakeup_.wait_for(lock, WRITE_DELAY, [this] { return buffer_.size() >= WRITE_BYTES || closing_; });
+        }
+        flusherIdle_ = false;
+        bool closing = closing_;
+        batch.swap(buffer_);
+        uint64_t end = appendedBytes_;
+        uint64_t synced = durableBytes_;
+        uint64_t generation = generation_;
+        FsyncPolicy policy = policy_;
+        lock.unlock();
+
+        bool ok = true;
+        bool sync = false;
+        {
+            lock_guard<mutex> fileLock(fileMutex_);
+            // If a rewrite replaced the file meanwhile, the batch is already
+            // in the new one, synced.
+            if (generation == generation_) {
+                auto now = chrono::steady_clock::now();
+                sync = end > synced &&
+                       (policy == FsyncPolicy::Always || closing ||
+                        (policy == FsyncPolicy::EverySecond && now - lastSync >= chrono::seconds(1)));
+                // Everything appended so far goes out in one write, and the
+                // sync, if one is due, with it.
+                ok = !failed_ && writeFile(file_, batch, sync);
+                if (ok && sync) {
+                    lastSync = now;
+                }
+            }
+        }
+        batch.clear();
+
+        lock.lock();
+        if (!ok) {
+            failed_ = true;
+        } else if (sync && end > durableBytes_) {
+            durableBytes_ = end;
+        }
+        durable_.notify_all();
+        if (closing && buffer_.empty()) {
+            return;
+        }
+    }
+}
+
+bool AppendLog::openRewrite() {
+    rewriteBytes_ = 0;
+    if (!openFile(filename_ + ".rewrite", 0, rewriteFile_)) {
+        return false;
+    }
+    string header = fileHeader();
+    if (!writeFile(rewriteFile_, header)) {
+        abortRewrite();
+        return false;
+    }
+    rewriteBytes_ = header.size();
+    return true;
+}
+
+void AppendLog::beginRewrite() {
+    lock_guard<mutex> lock(mutex_);
+    rewriting_ = true;
+    rewriteBuffer_.clear();
+}
+
+bool AppendLog::writeRewrite(const string& records) {
+    if (!writeFile(rewriteFile_, records)) {
+        return false;
+    }
+    rewriteBytes_ += records.size();
+    return true;
+}
+
+bool AppendLog::finishRewrite() {
+    // Catch up on the kept records while appends go on, until few enough
+    // are left to add with appends held off. Syncing what has been written
+    // so far leaves only that last part to sync under the locks.
+    string kept;
+    for (bool synced = false;;) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (rewriteBuffer_.size() <= WRITE_BYTES) {
+                if (synced) {
+                    break;
+                }
+            } else {
+                kept.swap(rewriteBuffer_);
+            }
+        }
+        if (!writeRewrite(kept)) {
+            return false;
+        }
+        kept.clear();
+        if (!synced) {
+            if (!syncFile(rewriteFile_)) {
+                return false;
+            }
+            synced = true;
+        }
+    }
+
+    Handle old;
+    {
+        lock_guard<mutex> fileLock(fileMutex_);
+        lock_guard<mutex> lock(mutex_);
+        if (failed_ || !writeRewrite(rewriteBuffer_) || !syncFile(rewriteFile_)) {
+            return false;
+        }
+        error_code ec;
+        filesystem::rename(filename_ + ".rewrite", filename_, ec);
+        if (ec) {
+            return false;
+        }
+        old = file_;
+        file_ = rewriteFile_;
+        rewriteFile_ = NO_FILE;
+        generation_++;
+        // Whatever the flusher had yet to write is in the new file already.
+        buffer_.clear();
+        rewriting_ = false;
+        string().swap(rewriteBuffer_);
+        fileBytes_ = baseBytes_ = rewriteBytes_;
+        durableBytes_ = appendedBytes_;
+    }
+    durable_.notify_all();
+    // Closing the old file frees its blocks, which for a large log takes
+    // long enough that appends must not wait for it.
+    closeFile(old);
+    return true;
+}
+
+void AppendLog::abortRewrite() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        rewriting_ = false;
+        string().swap(rewriteBuffer_);
+    }
+    closeFile(rewriteFile_);
+    error_code ec;
+    filesystem::remove(filename_ + ".rewrite", ec);
+}
+
+void AppendLog::setPolicy(FsyncPolicy policy) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        policy_ = policy;
+    }
+    // Writers waiting on a sync that is no longer required go on.
+    durable_.notify_all();
+}
+
+FsyncPolicy AppendLog::policy() const {
+    lock_guard<mutex> lock(mutex_);
+    return policy_;
+}
+
+uint64_t AppendLog::size() const {
+    lock_guard<mutex> lock(mutex_);
+    return fileBytes_;
+}
+
+uint64_t AppendLog::baseSize() const {
+    lock_guard<mutex> lock(mutex_);
+    return baseBytes_;
+}
+
+optional<FsyncPolicy> AppendLog::parsePolicy(const string& name) {
+    for (FsyncPolicy policy : {FsyncPolicy::Always, FsyncPolicy::EverySecond, FsyncPolicy::No}) {
+        if (name == policyName(policy)) {
+            return policy;
+        }
+    }
+    return nullopt;
+}
+
+const char* AppendLog::policyName(FsyncPolicy policy) {
+    switch (policy) {
+        case FsyncPolicy::Always: return "always";
+        case FsyncPolicy::No: return "no";
+        case FsyncPolicy::EverySecond: break;
+    }
+    return "everysec";
+}
+
+#if defined(_WIN32)
+
+bool AppendLog::openFile(const string& filename, uint64_t validBytes, Handle& file) {
+    // FILE_SHARE_DELETE lets a finished rewrite be renamed over the log
+    // while it is still open.
+    HANDLE handle = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                                OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER offset;
+    offset.QuadPart = static_cast<LONGLONG>(validBytes);
+    if (!SetFilePointerEx(handle, offset, nullptr, FILE_BEGIN) || !SetEndOfFile(handle)) {
+        CloseHandle(handle);
+        return false;
+    }
+    file = handle;
+    return true;
+}
+
+bool AppendLog::writeFile(Handle file, const string& data, bool sync) {
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        DWORD chunk = left > (DWORD(1) << 30) ? (DWORD(1) << 30) : static_cast<DWORD>(left);
+        DWORD written = 0;
+        if (!WriteFile(file, p, chunk, &written, nullptr)) {
+            return false;
+        }
+        p += written;
+        left -= written;
+    }
+    return !sync || syncFile(file);
+}
+
+bool AppendLog::syncFile(Handle file) {
+    return FlushFileBuffers(file) != 0;
+}
+
+void AppendLog::closeFile(Handle& file) {
+    if (file != NO_FILE) {
+        CloseHandle(file);
+        file = NO_FILE;
+    }
+}
+
+#else
+
+bool AppendLog::openFile(const string& filename, uint64_t validBytes, Handle& file) {
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(validBytes)) != 0 || lseek(fd, 0, SEEK_END) < 0) {
+        ::close(fd);
+        return false;
+    }
+    file = fd;
+    return true;
+}
+
+bool AppendLog::writeFile(Handle file, const string& data, bool sync) {
+#ifdef KVSTORE_URING
+    // The write and the sync are submitted together, one system call.
+    if (IoUring* ring = IoUring::fileRing()) {
+        return ring->write(file, data.data(), data.size(), sync);
+    }
+#endif
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t written = ::write(file, p, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += written;
+        left -= static_cast<size_t>(written);
+    }
+    return !sync || syncFile(file);
+}
+
+bool AppendLog::syncFile(Handle file) {
+#ifdef KVSTORE_URING
+    if (IoUring* ring = IoUring::fileRing()) {
+        return ring->sync(file);
+    }
+#endif
+#if defined(__linux__)
+    // The file's size changes with every batch, so fdatasync still writes
+    // the inode, but skips timestamp-only updates.
+    return fdatasync(file) == 0;
+#else
+    return fsync(file) == 0;
+#endif
+}
+
+void AppendLog::closeFile(Handle& file) {
+    if (file != NO_FILE) {
+        ::close(file);
+        file = NO_FILE;
+    }
+}
+
+#endif
+
+bool AppendLogReader::open(const string& filename) {
+    validBytes_ = 0;
+    if (!file_.open(filename)) {
+        return false;
+    }
+    if (file_.size() < AppendLog::HEADER_BYTES) {
+        return true;
+    }
+    uint32_t version;
+    memcpy(&version, file_.data() + 8, 4);
+    return memcmp(file_.data(), MAGIC, sizeof(MAGIC)) == 0 && version == AppendLog::VERSION;
+}
@@ -0,0 +1,88 @@
+#include "ClientRegistry.h"
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+namespace {
+    int64_t steadyMs(chrono::steady_clock::time_point time) {
+        return chrono::duration_cast<chrono::milliseconds>(time.time_since_epoch()).count();
+    }
+}
+
+void ClientRegistry::Client::touch(chrono::steady_clock::time_point now) {
+    lastActiveMs.store(steadyMs(now), memory_order_relaxed);
+}
+
+ClientRegistry::Client* ClientRegistry::add(uint64_t id, int fd, string address) {
+    auto client = make_unique<Client>();
+    client->id = id;
+    client->fd = fd;
+    client->address = move(address);
+    client->connected = chrono::steady_clock::now();
+    client->touch(client->connected);
+    Client* added = client.get();
+    lock_guard<mutex> lock(mutex_);
+    clients_[id] = move(client);
+    return added;
+}
+
+void ClientRegistry::remove(Client* client) {
+    if (client == nullptr) {
+        return;
+    }
+    lock_guard<mutex> lock(mutex_);
+    clients_.erase(client->id);
+}
+
+size_t ClientRegistry::count() const {
+    lock_guard<mutex> lock(mutex_);
+    return clients_.size();
+}
+
+string ClientRegistry::list() const {
+    auto now = chrono::steady_clock::now();
+    vector<const Client*> clients;
+    ostringstream out;
+    lock_guard<mutex> lock(mutex_);
+    clients.reserve(clients_.size());
+    for (const auto& entry : clients_) {
+        clients.push_back(entry.second.get());
+    }
+    sort(clients.begin(), clients.end(), [](const Client* a, const Client* b) { return a->id < b->id; });
+    for (const Client* client : clients) {
+        auto age = chrono::duration_cast<chrono::seconds>(now - client->connected).count();
+        auto idle = (steadyMs(now) - client->lastActiveMs.load(memory_order_relaxed)) / 1000;
+        out << "id=" << client->id << " addr=" << client->address << " fd=" << client->fd << " age=" << age
+            << " idle=" << idle << " qbuf=" << client->inputBytes.load(memory_order_relaxed)
+            << " omem=" << client->outputBytes.load(memory_order_relaxed)
+            << " paused=" << (client->paused.load(memory_order_relaxed) ? 1 : 0) << "\n";
+    }
+    return out.str();
+}
+
+string ClientRegistry::formatAddress(const sockaddr* address) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    unsigned port = 0;
+    if (address->sa_family == AF_INET) {
+        auto* in = reinterpret_cast<const sockaddr_in*>(address);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        port = ntohs(in->sin_port);
+    } else if (address->sa_family == AF_INET6) {
+        auto* in6 = reinterpret_cast<const sockaddr_in6*>(address);
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        port = ntohs(in6->sin6_port);
+        return "[" + string(host) + "]:" + to_string(port);
+    }
+    return string(host) + ":" + to_string(port);
+}
@@ -2,180 +2,920 @@
 #include <sstream>
 #include <algorithm>
 #include <cctype>
+#include <charconv>
 #include <stdexcept>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 
 using namespace std;
 
+namespace {
+    bool equalsIgnoreCase(string_view a, string_view b) {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return toupper(static_cast<unsigned char>(x)) == toupper(static_cast<unsigned char>(y));
+        });
+    }
+
+    string lowercase(string_view text) {
+        string lower(text);
+        transform(lower.begin(), lower.end(), lower.begin(),
+                  [](unsigned char c) { return static_cast<char>(tolower(c)); });
+        return lower;
+    }
+
+    // The whole of text as a number, without a stream or a copy.
+    template <class T>
+    bool parseNumber(string_view text, T& value) {
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == errc() && result.ptr == text.data() + text.size();
+    }
+
+    // Compares arg, case-folded, with an upper-case command name.
+    int compareFolded(string_view arg, string_view name) {
+        size_t n = min(arg.size(), name.size());
+        for (size_t i = 0; i < n; ++i) {
+            char c = arg[i] >= 'a' && arg[i] <= 'z' ? static_cast<char>(arg[i] - ('a' - 'A')) : arg[i];
+            if (c != name[i]) {
+                return static_cast<unsigned char>(c) < static_cast<unsigned char>(name[i]) ? -1 : 1;
+            }
+        }
+        return arg.size() == name.size() ? 0 : (arg.size() < name.size() ? -1 : 1);
+    }
+
+    using Handler = void (CommandHandler::*)(const CommandHandler::Args&, ReplyWriter&);
+
+    const size_t ANY_ARGS = 0;
+
+    // Which arguments are keys, for running a command on the partition
+    // that owns them: args[first], then every step-th argument after it
+    // (step 0 for args[first] alone).
+    struct KeyArgs {
+        size_t first;
+        size_t step;
+    };
+    // Names no key, or reaches every partition itself.
+    constexpr KeyArgs NO_KEYS{0, 0};
+    constexpr KeyArgs FIRST_KEY{1, 0};
+    constexpr KeyArgs EVERY_ARG{1, 1};
+    constexpr KeyArgs KEY_VALUE_PAIRS{1, 2};
+    // Needs the whole keyspace in one store; refused once it is partitioned.
+    constexpr KeyArgs WHOLE_STORE{SIZE_MAX, 0};
+
+    // Takes time in proportion to the store, or to a file.
+    constexpr CommandHandler::Lane SLOW = CommandHandler::Lane::Slow;
+
+    // A command's handler and how many arguments it takes, its name
+    // included, checked before the handler runs; usage is the error for
+    // too few.
+    struct Command {
+        string_view name;
+        Handler handler;
+        size_t minArgs;
+        size_t maxArgs;
+        string_view usage;
+        KeyArgs keys;
+        CommandHandler::Lane lane = CommandHandler::Lane::Fast;
+    };
+
+    // Sorted by name, for a binary search that folds case as it compares
+    // rather than copying the name to upper-case it.
+    constexpr Command COMMANDS[] = {
+        {"BGREWRITEAOF", &CommandHandler::handleBgrewriteaof, 1, 1, "", WHOLE_STORE},
+        {"BGSAVE", &CommandHandler::handleBgsave, 2, 3, "BGSAVE requires a filename", WHOLE_STORE},
+        {"CLEAR", &CommandHandler::handleClear, 1, 1, "", NO_KEYS, SLOW},
+        {"CLIENT", &CommandHandler::handleClient, 2, 2, "CLIENT requires LIST", NO_KEYS},
+        {"CONFIG", &CommandHandler::handleConfig, 3, 4, "CONFIG requires GET or SET and a parameter", NO_KEYS},
+        {"DEL", &CommandHandler::handleDel, 2, 2, "DEL requires a key", FIRST_KEY},
+        {"EXISTS", &CommandHandler::handleExists, 2, 2, "EXISTS requires a key", FIRST_KEY},
+        {"EXPIRE", &CommandHandler::handleExpire, 3, 3, "EXPIRE requires key and TTL", FIRST_KEY},
+        {"FLUSH", &CommandHandler::handleFlush, 2, 3, "FLUSH requires a filename", WHOLE_STORE, SLOW},
+        {"GET", &CommandHandler::handleGet, 2, 2, "GET requires a key", FIRST_KEY},
+        {"HELP", &CommandHandler::handleHelp, 1, ANY_ARGS, "", NO_KEYS},
+        {"KEYS", &CommandHandler::handleKeys, 1, 1, "", NO_KEYS, SLOW},
+        {"LOAD", &CommandHandler::handleLoad, 2, 2, "LOAD requires a filename", WHOLE_STORE, SLOW},
+        {"MDEL", &CommandHandler::handleMdel, 2, ANY_ARGS, "MDEL requires at least one key", EVERY_ARG},
+        {"MEMORY", &CommandHandler::handleMemory, 2, 3, "MEMORY requires STATS or USAGE", NO_KEYS},
+        {"MGET", &CommandHandler::handleMget, 2, ANY_ARGS, "MGET requires at least one key", EVERY_ARG},
+        {"MSET", &CommandHandler::handleMset, 3, ANY_ARGS, "MSET requires key value pairs", KEY_VALUE_PAIRS},
+        {"PEXPIRE", &CommandHandler::handlePexpire, 3, 3, "PEXPIRE requires key and TTL in milliseconds", FIRST_KEY},
+        {"PING", &CommandHandler::handlePing, 1, 2, "", NO_KEYS},
+        {"PREFIX", &CommandHandler::handlePrefix, 2, ANY_ARGS, "PREFIX requires a prefix", NO_KEYS},
+        {"PTTL", &CommandHandler::handlePttl, 2, 2, "PTTL requires a key", FIRST_KEY},
+        {"QUIT", &CommandHandler::handleQuit, 1, ANY_ARGS, "", NO_KEYS},
+        {"RANGE", &CommandHandler::handleRange, 3, ANY_ARGS, "RANGE requires from and to", NO_KEYS},
+        {"SAVE", &CommandHandler::handleSave, 2, 3, "SAVE requires a filename", WHOLE_STORE, SLOW},
+        {"SCAN", &CommandHandler::handleScan, 2, ANY_ARGS, "SCAN requires a cursor", WHOLE_STORE},
+        {"SET", &CommandHandler::handleSet, 3, 4, "SET requires key and value", FIRST_KEY},
+        {"STATS", &CommandHandler::handleStats, 1, 1, "", NO_KEYS},
+        {"TTL", &CommandHandler::handleTtl, 2, 2, "TTL requires a key", FIRST_KEY},
+    };
+
+    constexpr bool sortedByName() {
+        for (size_t i = 1; i < size(COMMANDS); ++i) {
+            if (!(COMMANDS[i - 1].name < COMMANDS[i].name)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(sortedByName(), "COMMANDS must be sorted by name");
+
+    const Command* findCommand(string_view name) {
+        size_t lo = 0, hi = size(COMMANDS);
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int order = compareFolded(name, COMMANDS[mid].name);
+            if (order == 0) {
+                return &COMMANDS[mid];
+            }
+            if (order < 0) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        return nullptr;
+    }
+
+    // The partition of count owning every key of command in args; false if
+    // it names none or they are spread across partitions.
+    bool keysOwner(const Command& command, const CommandHandler::Args& args, size_t count, size_t& owner) {
+        if (command.keys.first == 0 || command.keys.first >= args.size()) {
+            return false;
+        }
+        owner = CommandHandler::partitionOf(args[command.keys.first], count);
+        if (command.keys.step != 0) {
+            for (size_t i = command.keys.first + command.keys.step; i < args.size(); i += command.keys.step) {
+                if (CommandHandler::partitionOf(args[i], count) != owner) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+void CommandHandler::setPartitions(vector<KeyValueStore*> partitions) {
+    partitions_ = move(partitions);
+}
+
+size_t CommandHandler::partitionOf(string_view key, size_t count) {
+    size_t open = key.find('{');
+    if (open != string_view::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != string_view::npos && close > open + 1) {
+            key = key.substr(open + 1, close - open - 1);
+        }
+    }
+    // Mixed differently from the store's own hash, whose high bits pick
+    // the shard, so each partition still spreads its keys over every
+    // shard.
+    uint64_t h = hash<string_view>{}(key);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return static_cast<size_t>(((h >> 32) * count) >> 32);
+}
+
+bool CommandHandler::ownerOf(const Args& args, size_t count, size_t& owner) {
+    const Command* command = args.empty() ? nullptr : findCommand(args[0]);
+    if (command == nullptr || args.size() < command->minArgs ||
+        (command->maxArgs != ANY_ARGS && args.size() > command->maxArgs)) {
+        return false;
+    }
+    return keysOwner(*command, args, count, owner);
+}
+
+CommandHandler::Lane CommandHandler::laneOf(const Args& args) {
+    const Command* command = args.empty() ? nullptr : findCommand(args[0]);
+    if (command == nullptr) {
+        return Lane::Fast;
+    }
+    // Of CONFIG SET's parameters, only ordered-index costs time with the
+    // store's size: it builds or drops the index over every key.
+    if (command->handler == &CommandHandler::handleConfig && args.size() > 2 && compareFolded(args[1], "SET") == 0 &&
+        compareFolded(args[2], "ORDERED-INDEX") == 0) {
+        return Lane::Slow;
+    }
+    return command->lane;
+}
+
 string CommandHandler::handleCommand(const string& command) {
-    istringstream iss(command);
-    string cmd;
-    iss >> cmd;
-    
-    // Convert command to uppercase
-    transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
-    
-    if (cmd.empty()) {
+    // Kept per thread so its capacity is reused from one command to the
+    // next.
+    thread_local Args args;
+    args.clear();
+    RespParser::split(command, args);
+    if (args.empty()) {
         return "ERROR: Empty command";
     }
-    
-    try {
-        if (cmd == "SET") {
-            return handleSet(iss);
-        } else if (cmd == "GET") {
-            return handleGet(iss);
-        } else if (cmd == "DEL") {
-            return handleDel(iss);
-        } else if (cmd == "EXISTS") {
-            return handleExists(iss);
-        } else if (cmd == "KEYS") {
-            return handleKeys(iss);
-        } else if (cmd == "STATS") {
-            return handleStats(iss);
-        } else if (cmd == "SAVE") {
-            return handleSave(iss);
-        } else if (cmd == "LOAD") {
-            return handleLoad(iss);
-        } else if (cmd == "CLEAR") {
-            return handleClear(iss);
-        } else if (cmd == "FLUSH") {
-            return handleFlush(iss);
-        } else if (cmd == "HELP") {
-            return handleHelp(iss);
-        } else if (cmd == "QUIT") {
-            return handleQuit(iss);
-        } else {
-            return "ERROR: Unknown command";
+
+    string response;
+    ReplyWriter reply(response, Protocol::Inline);
+    execute(args, reply);
+    return response;
+}
+
+void CommandHandler::execute(const Args& args, ReplyWriter& reply) {
+    const Command* command = findCommand(args[0]);
+    if (command == nullptr) {
+        reply.error("Unknown command");
+        return;
+    }
+    if (args.size() < command->minArgs) {
+        reply.error(command->usage);
+        return;
+    }
+    if (command->maxArgs != ANY_ARGS && args.size() > command->maxArgs) {
+        reply.error("Too many arguments for " + string(command->name));
+        return;
+    }
+    if (partitions_.size() > 1) {
+        size_t owner;
+        if (command->keys.first == WHOLE_STORE.first) {
+            reply.error(string(command->name) + " is not available with the keyspace partitioned");
+            return;
+        }
+        if (command->keys.first != 0 && !keysOwner(*command, args, partitions_.size(), owner)) {
+            reply.error("CROSSSLOT Keys in request don't hash to the same partition");
+            return;
         }
+    }
+
+    try {
+        (this->*command->handler)(args, reply);
     } catch (const exception& e) {
         logger_.error("Error handling command: " + string(e.what()));
-        return "ERROR: Internal server error";
+        reply.error("Internal server error");
     }
 }
 
-string CommandHandler::handleSet(istringstream& iss) {
-    string key, value;
-    if (!(iss >> key >> value)) {
-        return "ERROR: SET requires key and value";
+bool CommandHandler::handlePipeline(InputBuffer& input, string& output) {
+    return runPipeline(input, [&output](const Args&, Protocol, string_view) { return &output; }, nullptr);
+}
+
+bool CommandHandler::handlePipeline(InputBuffer& input, const Route& route) {
+    return runPipeline(input, route, nullptr);
+}
+
+bool CommandHandler::handlePipeline(InputBuffer& input, string& output, SlowCommand& slow) {
+    return runPipeline(input, [&output](const Args&, Protocol, string_view) { return &output; }, &slow);
+}
+
+bool CommandHandler::handlePipeline(InputBuffer& input, const Route& route, SlowCommand& slow) {
+    return runPipeline(input, route, &slow);
+}
+
+bool CommandHandler::runPipeline(InputBuffer& input, const Route& route, SlowCommand* slow) {
+    if (input.size() < input.needed()) {
+        // The command at the front is still arriving.
+        return true;
+    }
+    const char* data = input.data();
+    size_t size = input.size();
+    size_t start = 0;
+    size_t ran = 0;
+    bool open = true;
+    thread_local Args args;
+    if (lanes_ != nullptr) {
+        lanes_->fastStarted();
+    }
+    while (open && start < size) {
+        size_t consumed = 0;
+        Protocol protocol;
+        string error;
+        // Only the front command can have been looked at before; the
+        // progress is reset as each command completes, so it is the next
+        // one's from then on.
+        auto status =
+            RespParser::parse(data + start, size - start, args, consumed, protocol, error, &input.progress());
+        if (status == RespParser::Status::Incomplete) {
+            input.consume(start);
+            input.expect(consumed);
+            if (lanes_ != nullptr) {
+                lanes_->fastFinished(ran);
+            }
+            return true;
+        }
+        if (status == RespParser::Status::Error) {
+            // There is no telling where the next command starts: answer,
+            // drop the rest and have the connection closed.
+            logger_.error("Closing connection on " + error);
+            args.clear();
+            string& output = *route(args, protocol, string_view());
+            ReplyWriter(output, protocol).error(error);
+            if (protocol == Protocol::Inline) {
+                output += '\n';
+            }
+            start = size;
+            open = false;
+            break;
+        }
+        string_view request(data + start, consumed);
+        start += consumed;
+        if (args.empty()) {
+            continue;
+        }
+        // logger_.info("[REQUEST] " + string(args[0]));
+
+        if (slow != nullptr && lanes_ != nullptr && laneOf(args) == Lane::Slow) {
+            if (lanes_->admitSlow()) {
+                // The caller runs it, and the rest after its reply.
+                slow->request.assign(request.data(), request.size());
+                slow->protocol = protocol;
+                break;
+            }
+            // Slow commands are never routed elsewhere.
+            string& output = *route(args, protocol, request);
+            ReplyWriter(output, protocol).error("Too many slow commands queued, try again later");
+            if (protocol == Protocol::Inline) {
+                output += '\n';
+            }
+            continue;
+        }
+        string* output = route(args, protocol, request);
+        if (output != nullptr) {
+            runCommand(args, protocol, *output);
+            ran++;
+        }
+        if (equalsIgnoreCase(args[0], "QUIT")) {
+            open = false;
+        }
     }
-    
+    // A cursor moved once per read, not the bytes behind it per command.
+    input.consume(start);
+    if (lanes_ != nullptr) {
+        lanes_->fastFinished(ran);
+    }
+    return open;
+}
+
+void CommandHandler::runSlow(SlowCommand slow, function<void(string& reply)> done) {
+    lanes_->submitSlow([this, slow = move(slow), done = move(done)]() mutable {
+        // Taken whole and parsed once already, so it is complete.
+        thread_local Args args;
+        size_t consumed;
+        Protocol protocol;
+        string error;
+        RespParser::parse(slow.request.data(), slow.request.size(), args, consumed, protocol, error);
+        string reply;
+        runCommand(args, slow.protocol, reply);
+        done(reply);
+    });
+}
+
+void CommandHandler::runCommand(const Args& args, Protocol protocol, string& output) {
+    size_t replyStart = output.size();
+    ReplyWriter reply(output, protocol);
+    try {
+        execute(args, reply);
+    } catch (...) {
+        logger_.error("Unknown exception in handleCommand");
+        output.resize(replyStart);
+        reply.error("Internal server error");
+    }
+    // Add newline to an inline response if not present
+    if (protocol == Protocol::Inline && (output.size() == replyStart || output.back() != '\n')) {
+        output += '\n';
+    }
+}
+
+void CommandHandler::handleSet(const Args& args, ReplyWriter& reply) {
+    string key(args[1]);
+    string value(args[2]);
+
     int ttl = 0;
-    if (iss >> ttl) {
-        store_.set(key, value, ttl);
+    bool stored;
+    if (args.size() > 3 && parseNumber(args[3], ttl)) {
+        stored = store_.set(key, value, ttl);
     } else {
-        store_.set(key, value);
+        stored = store_.set(key, value);
+    }
+
+    if (!stored) {
+        reply.error("OOM command not allowed when used memory > maxmemory");
+        return;
     }
-    
-    return "OK";
+    reply.status("OK");
 }
 
-string CommandHandler::handleGet(istringstream& iss) {
-    string key;
-    if (!(iss >> key)) {
-        return "ERROR: GET requires a key";
+void CommandHandler::handleGet(const Args& args, ReplyWriter& reply) {
+    // The value is written to the reply straight from the table.
+    if (store_.read(args[1], [&reply](string_view value) { reply.bulk(value); })) {
+        return;
     }
+    if (reply.resp()) {
+        reply.nil();
+    } else {
+        reply.status("Key not found");
+    }
+}
 
-    string value = store_.get(key);
-    if (value.empty()) {
-        return "(nil)";
+void CommandHandler::handleDel(const Args& args, ReplyWriter& reply) {
+    bool deleted = store_.del(string(args[1]));
+    if (reply.resp()) {
+        reply.integer(deleted ? 1 : 0);
+    } else {
+        reply.status(deleted ? "OK" : "Key not found");
     }
-    return value;
 }
 
-string CommandHandler::handleDel(istringstream& iss) {
-    string key;
-    if (!(iss >> key)) {
-        return "ERROR: DEL requires a key";
+void CommandHandler::handleMget(const Args& args, ReplyWriter& reply) {
+    // One value per line in request order, "(nil)" for a missing key.
+    // Values are written to the reply straight from the table.
+    vector<string> keys(args.begin() + 1, args.end());
+    reply.array(keys.size());
+    store_.mget(keys, [&reply](optional<string_view> value) {
+        if (value) {
+            reply.bulk(*value);
+        } else {
+            reply.nil();
+        }
+    });
+}
+
+void CommandHandler::handleMset(const Args& args, ReplyWriter& reply) {
+    if (args.size() % 2 == 0) {
+        reply.error("MSET requires key value pairs");
+        return;
     }
-    
-    if (store_.del(key)) {
-        return "OK";
+    vector<pair<string, string>> pairs;
+    pairs.reserve(args.size() / 2);
+    for (size_t i = 1; i < args.size(); i += 2) {
+        pairs.emplace_back(string(args[i]), string(args[i + 1]));
     }
-    return "Key not found";
-}
 
-string CommandHandler::handleExists(istringstream& iss) {
-    string key;
-    if (!(iss >> key)) {
-        return "ERROR: EXISTS requires a key";
+    if (!store_.mset(pairs)) {
+        reply.error("OOM command not allowed when used memory > maxmemory");
+        return;
     }
-    
-    return store_.exists(key) ? "1" : "0";
+    reply.status("OK");
 }
 
-string CommandHandler::handleExpire(istringstream& iss) {
-    string key;
+void CommandHandler::handleMdel(const Args& args, ReplyWriter& reply) {
+    vector<string> keys(args.begin() + 1, args.end());
+    reply.integer(static_cast<long long>(store_.mdel(keys)));
+}
+
+void CommandHandler::handleExists(const Args& args, ReplyWriter& reply) {
+    reply.integer(store_.exists(string(args[1])) ? 1 : 0);
+}
+
+void CommandHandler::handleExpire(const Args& args, ReplyWriter& reply) {
     int ttl;
-    if (!(iss >> key >> ttl)) {
-        return "ERROR: EXPIRE requires key and TTL";
+    if (!parseNumber(args[2], ttl)) {
+        reply.error("EXPIRE requires key and TTL");
+        return;
     }
-    
-    if (store_.expire(key, ttl)) {
+    string key(args[1]);
+
+    bool set = store_.expire(key, ttl);
+    if (set) {
         logger_.info("EXPIRE " + key + " " + to_string(ttl));
-        return "OK";
     }
-    return "Key not found";
+    if (reply.resp()) {
+        reply.integer(set ? 1 : 0);
+    } else {
+        reply.status(set ? "OK" : "Key not found");
+    }
 }
 
-string CommandHandler::handleTtl(istringstream& iss) {
-    string key;
-    if (!(iss >> key)) {
-        return "ERROR: TTL requires a key";
-    }
-    
+void CommandHandler::handleTtl(const Args& args, ReplyWriter& reply) {
+    string key(args[1]);
+
     auto ttl = store_.ttl(key);
     if (ttl) {
         logger_.info("TTL " + key + " = " + to_string(ttl->count()) + " seconds");
-        return to_string(ttl->count());
+        reply.integer(ttl->count());
+    } else if (reply.resp()) {
+        // As Redis: -2 for a missing key, -1 for one without a TTL.
+        reply.integer(store_.exists(key) ? -1 : -2);
+    } else {
+        reply.status("Key not found or has no TTL");
     }
-    return "Key not found or has no TTL";
 }
 
-string CommandHandler::handleKeys(istringstream& iss) {
-    auto keys = store_.keys();
-    if (keys.empty()) {
-        return "(empty)";
+void CommandHandler::handlePexpire(const Args& args, ReplyWriter& reply) {
+    long long ttl;
+    if (!parseNumber(args[2], ttl)) {
+        reply.error("PEXPIRE requires key and TTL in milliseconds");
+        return;
     }
-    
-    stringstream ss;
+    string key(args[1]);
+
+    bool set = store_.pexpire(key, ttl);
+    if (set) {
+        logger_.info("PEXPIRE " + key + " " + to_string(ttl));
+    }
+    if (reply.resp()) {
+        reply.integer(set ? 1 : 0);
+    } else {
+        reply.status(set ? "OK" : "Key not found");
+    }
+}
+
+void CommandHandler::handlePttl(const Args& args, ReplyWriter& reply) {
+    string key(args[1]);
+
+    auto ttl = store_.pttl(key);
+    if (ttl) {
+        reply.integer(ttl->count());
+    } else if (reply.resp()) {
+        reply.integer(store_.exists(key) ? -1 : -2);
+    } else {
+        reply.status("Key not found or has no TTL");
+    }
+}
+
+void CommandHandler::handleMemory(const Args& args, ReplyWriter& reply) {
+    if (equalsIgnoreCase(args[1], "USAGE")) {
+        if (args.size() < 3) {
+            reply.error("MEMORY USAGE requires a key");
+            return;
+        }
+        KeyValueStore& owner = *partitions_[partitionOf(args[2], partitions_.size())];
+        auto bytes = owner.memoryUsageOf(string(args[2]));
+        if (bytes) {
+            reply.integer(static_cast<long long>(*bytes));
+        } else if (reply.resp()) {
+            reply.nil();
+        } else {
+            reply.status("Key not found");
+        }
+        return;
+    } else if (equalsIgnoreCase(args[1], "STATS")) {
+        MemoryStats stats = store_.memoryStats();
+        for (KeyValueStore* partition : partitions_) {
+            if (partition == &store_) {
+                continue;
+            }
+            // Resident memory is the process's, counted once.
+            MemoryStats part = partition->memoryStats();
+            stats.usedBytes += part.usedBytes;
+            stats.entryBytes += part.entryBytes;
+            stats.tableBytes += part.tableBytes;
+            stats.indexBytes += part.indexBytes;
+            stats.slabBytes += part.slabBytes;
+            stats.arenaBytes += part.arenaBytes;
+            stats.timerBytes += part.timerBytes;
+            stats.pendingReclaimBytes += part.pendingReclaimBytes;
+            stats.totalKeys += part.totalKeys;
+        }
+        stringstream ss;
+        ss << fixed << setprecision(2)
+           << "Used memory: " << stats.usedBytes << " bytes\n"
+           << "Entries: " << stats.entryBytes << " bytes\n"
+           << "Hash tables: " << stats.tableBytes << " bytes\n"
+           << "Ordered index: " << stats.indexBytes << " bytes\n"
+           << "Slabs: " << stats.slabBytes << " bytes\n"
+           << "Arena reserved: " << stats.arenaBytes << " bytes\n"
+           << "Expiry timers: " << stats.timerBytes << " bytes\n"
+           << "Pending reclaim: " << stats.pendingReclaimBytes << " bytes\n"
+           << "Resident memory: " << stats.residentBytes << " bytes\n"
+           << "Keys: " << stats.totalKeys << "\n"
+           << "Bytes per key: "
+           << (stats.totalKeys ? static_cast<double>(stats.usedBytes) / stats.totalKeys : 0.0) << "\n"
+           << "Fragmentation ratio: "
+           << (stats.usedBytes ? static_cast<double>(stats.residentBytes) / stats.usedBytes : 0.0);
+        reply.text(ss.str());
+        return;
+    }
+    reply.error("MEMORY requires STATS or USAGE");
+}
+
+void CommandHandler::handleConfig(const Args& args, ReplyWriter& reply) {
+    string parameter = lowercase(args[2]);
+
+    if (equalsIgnoreCase(args[1], "GET")) {
+        string value;
+        if (parameter == "maxmemory") {
+            size_t bytes = 0;
+            for (KeyValueStore* partition : partitions_) {
+                bytes += partition->maxMemory();
+            }
+            value = to_string(bytes);
+        } else if (parameter == "maxmemory-policy") {
+            value = KeyValueStore::evictionPolicyName(store_.evictionPolicy());
+        } else if (parameter == "appendonly") {
+            value = store_.appendLogEnabled() ? "yes" : "no";
+        } else if (parameter == "appendfsync") {
+            value = AppendLog::policyName(store_.fsyncPolicy());
+        } else if (parameter == "auto-aof-rewrite-percentage") {
+            value = to_string(store_.autoRewritePercentage());
+        } else if (parameter == "auto-aof-rewrite-min-size") {
+            value = to_string(store_.autoRewriteMinBytes());
+        } else if (parameter == "ordered-index") {
+            value = store_.orderedIndexEnabled() ? "yes" : "no";
+        } else if (parameter == "client-output-soft-limit" && clients_ != nullptr) {
+            value = to_string(clients_->softLimit());
+        } else if (parameter == "client-output-hard-limit" && clients_ != nullptr) {
+            value = to_string(clients_->hardLimit());
+        } else if (reply.resp()) {
+            // Redis answers a parameter it does not have with no pairs,
+            // which redis-benchmark relies on when asking for "save".
+            reply.array(0);
+            return;
+        } else {
+            reply.error("Unknown CONFIG parameter");
+            return;
+        }
+        // RESP replies with parameter-value pairs; inline, with the value.
+        if (reply.resp()) {
+            reply.array(2);
+            reply.bulk(parameter);
+        }
+        reply.bulk(value);
+        return;
+    } else if (equalsIgnoreCase(args[1], "SET")) {
+        if (args.size() < 4) {
+            reply.error("CONFIG SET requires a value");
+            return;
+        }
+        string value(args[3]);
+        if (parameter == "maxmemory") {
+            size_t bytes;
+            if (!parseNumber(value, bytes)) {
+                reply.error("maxmemory must be a number of bytes");
+                return;
+            }
+            // The limit is the server's, shared evenly between partitions.
+            size_t share = bytes / partitions_.size();
+            for (KeyValueStore* partition : partitions_) {
+                partition->setMaxMemory(bytes != 0 ? max<size_t>(share, 1) : 0);
+            }
+        } else if (parameter == "maxmemory-policy") {
+            value = lowercase(value);
+            auto policy = KeyValueStore::parseEvictionPolicy(value);
+            if (!policy) {
+                reply.error("Unknown maxmemory-policy");
+                return;
+            }
+            for (KeyValueStore* partition : partitions_) {
+                partition->setEvictionPolicy(*policy);
+            }
+        } else if (parameter == "appendfsync") {
+            value = lowercase(value);
+            auto policy = AppendLog::parsePolicy(value);
+            if (!policy) {
+                reply.error("appendfsync must be always, everysec or no");
+                return;
+            }
+            for (KeyValueStore* partition : partitions_) {
+                partition->setFsyncPolicy(*policy);
+            }
+        } else if (parameter == "auto-aof-rewrite-percentage") {
+            uint32_t percentage;
+            if (!parseNumber(value, percentage)) {
+                reply.error("auto-aof-rewrite-percentage must be a number");
+                return;
+            }
+            for (KeyValueStore* partition : partitions_) {
+                partition->setAutoRewritePercentage(percentage);
+            }
+        } else if (parameter == "auto-aof-rewrite-min-size") {
+            uint64_t bytes;
+            if (!parseNumber(value, bytes)) {
+                reply.error("auto-aof-rewrite-min-size must be a number of bytes");
+                return;
+            }
+            for (KeyValueStore* partition : partitions_) {
+                partition->setAutoRewriteMinBytes(bytes);
+            }
+        } else if (parameter == "ordered-index") {
+            value = lowercase(value);
+            if (value != "yes" && value != "no") {
+                reply.error("ordered-index must be yes or no");
+                return;
+            }
+            for (KeyValueStore* partition : partitions_) {
+                partition->setOrderedIndex(value == "yes");
+            }
+        } else if ((parameter == "client-output-soft-limit" || parameter == "client-output-hard-limit") &&
+                   clients_ != nullptr) {
+            size_t bytes;
+            if (!parseNumber(value, bytes)) {
+                reply.error(parameter + " must be a number of bytes");
+                return;
+            }
+            if (parameter == "client-output-soft-limit") {
+                clients_->setSoftLimit(bytes);
+            } else {
+                clients_->setHardLimit(bytes);
+            }
+        } else {
+            reply.error("Unknown CONFIG parameter");
+            return;
+        }
+        logger_.info("CONFIG SET " + parameter + " " + value);
+        reply.status("OK");
+        return;
+    }
+    reply.error("CONFIG requires GET or SET");
+}
+
+void CommandHandler::handleClient(const Args& args, ReplyWriter& reply) {
+    if (!equalsIgnoreCase(args[1], "LIST")) {
+        reply.error("CLIENT requires LIST");
+        return;
+    }
+    if (clients_ == nullptr) {
+        reply.error("CLIENT LIST is only available on a server");
+        return;
+    }
+    reply.text(clients_->list());
+}
+
+void CommandHandler::handleKeys(const Args&, ReplyWriter& reply) {
+    if (partitions_.size() == 1) {
+        writeKeys(store_.keys(), reply);
+        return;
+    }
+    vector<string> keys;
+    for (KeyValueStore* partition : partitions_) {
+        vector<string> part = partition->keys();
+        keys.insert(keys.end(), make_move_iterator(part.begin()), make_move_iterator(part.end()));
+    }
+    writeKeys(keys, reply);
+}
+
+void CommandHandler::handleScan(const Args& args, ReplyWriter& reply) {
+    uint64_t cursor;
+    if (!parseNumber(args[1], cursor)) {
+        reply.error("Invalid cursor");
+        return;
+    }
+    string_view pattern;
+    size_t count = 10;
+    for (size_t i = 2; i < args.size(); i += 2) {
+        if (equalsIgnoreCase(args[i], "MATCH")) {
+            if (i + 1 == args.size()) {
+                reply.error("MATCH requires a pattern");
+                return;
+            }
+            pattern = args[i + 1];
+        } else if (equalsIgnoreCase(args[i], "COUNT")) {
+            long long n;
+            if (i + 1 == args.size() || !parseNumber(args[i + 1], n) || n < 1) {
+                reply.error("COUNT must be a positive number");
+                return;
+            }
+            count = static_cast<size_t>(n);
+        } else {
+            reply.error("SCAN options are MATCH and COUNT");
+            return;
+        }
+    }
+
+    // The next cursor, then the keys: inline, one per line.
+    vector<string> keys;
+    uint64_t next = store_.scan(cursor, count, keys, pattern);
+    reply.array(2);
+    reply.bulk(to_string(next));
+    reply.array(keys.size());
     for (const auto& key : keys) {
-        ss << key << "\n";
+        reply.bulk(key);
     }
-    return ss.str();
 }
 
-string CommandHandler::handleClear(istringstream& iss) {
-    store_.clear();
-    return "OK";
+void CommandHandler::handlePrefix(const Args& args, ReplyWriter& reply) {
+    size_t limit;
+    if (!parseLimit(args, 2, limit)) {
+        reply.error("PREFIX takes only LIMIT <n>, with n positive");
+        return;
+    }
+    vector<string> keys;
+    for (KeyValueStore* partition : partitions_) {
+        if (!partition->prefix(args[1], limit, keys)) {
+            reply.error("Ordered index is off, see CONFIG SET ordered-index yes");
+            return;
+        }
+    }
+    mergePartitions(keys, limit);
+    writeKeys(keys, reply);
 }
 
-string CommandHandler::handleSave(istringstream& iss) {
-    string filename;
-    if (!(iss >> filename)) {
-        return "ERROR: SAVE requires a filename";
+void CommandHandler::handleRange(const Args& args, ReplyWriter& reply) {
+    size_t limit;
+    if (!parseLimit(args, 3, limit)) {
+        reply.error("RANGE takes only LIMIT <n>, with n positive");
+        return;
     }
-    
-    if (store_.save(filename)) {
-        return "OK";
+    vector<string> keys;
+    for (KeyValueStore* partition : partitions_) {
+        if (!partition->range(args[1], args[2], limit, keys)) {
+            reply.error("Ordered index is off, see CONFIG SET ordered-index yes");
+            return;
+        }
     }
-    return "ERROR: Failed to save to file";
+    mergePartitions(keys, limit);
+    writeKeys(keys, reply);
 }
 
-string CommandHandler::handleLoad(istringstream& iss) {
-    string filename;
-    if (!(iss >> filename)) {
-        return "ERROR: LOAD requires a filename";
+bool CommandHandler::parseLimit(const Args& args, size_t index, size_t& limit) {
+    limit = 0;
+    if (index == args.size()) {
+        return true;
     }
-    
-    if (store_.load(filename)) {
-        return "OK";
+    long long n;
+    if (!equalsIgnoreCase(args[index], "LIMIT") || index + 2 != args.size() ||
+        !parseNumber(args[index + 1], n) || n < 1) {
+        return false;
     }
-    return "ERROR: Failed to load from file";
+    limit = static_cast<size_t>(n);
+    return true;
 }
 
-string CommandHandler::handleDump(istringstream& iss) {
+void CommandHandler::mergePartitions(vector<string>& keys, size_t limit) const {
+    // Each partition appended its own keys in order, up to limit of them.
+    if (partitions_.size() > 1) {
+        sort(keys.begin(), keys.end());
+        if (limit != 0 && keys.size() > limit) {
+            keys.resize(limit);
+        }
+    }
+}
+
+void CommandHandler::writeKeys(const vector<string>& keys, ReplyWriter& reply) {
+    if (keys.empty() && !reply.resp()) {
+        reply.status("(empty)");
+        return;
+    }
+    reply.array(keys.size());
+    for (const auto& key : keys) {
+        reply.bulk(key);
+    }
+}
+
+void CommandHandler::handleClear(const Args&, ReplyWriter& reply) {
+    for (KeyValueStore* partition : partitions_) {
+        partition->clear();
+    }
+    reply.status("OK");
+}
+
+void CommandHandler::handleSave(const Args& args, ReplyWriter& reply) {
+    auto format = parseSnapshotFormat(args, 2);
+    if (!format) {
+        reply.error("Snapshot format must be BINARY or TEXT");
+        return;
+    }
+
+    if (store_.save(string(args[1]), *format)) {
+        reply.status("OK");
+    } else if (store_.snapshotInProgress()) {
+        reply.error("A save is already in progress");
+    } else {
+        reply.error("Failed to save to file");
+    }
+}
+
+void CommandHandler::handleBgsave(const Args& args, ReplyWriter& reply) {
+    auto format = parseSnapshotFormat(args, 2);
+    if (!format) {
+        reply.error("Snapshot format must be BINARY or TEXT");
+        return;
+    }
+
+    if (store_.bgsave(string(args[1]), *format)) {
+        reply.status("Background saving started");
+    } else {
+        reply.error("A save is already in progress");
+    }
+}
+
+void CommandHandler::handleBgrewriteaof(const Args&, ReplyWriter& reply) {
+    if (!store_.appendLogEnabled()) {
+        reply.error("The append-only log is off");
+    } else if (store_.bgrewriteaof()) {
+        reply.status("Background append only file rewriting started");
+    } else {
+        reply.error("A save or rewrite is already in progress");
+    }
+}
+
+optional<SnapshotFormat> CommandHandler::parseSnapshotFormat(const Args& args, size_t index) {
+    if (index >= args.size()) {
+        return SnapshotFormat::Binary;
+    }
+    if (equalsIgnoreCase(args[index], "BINARY")) {
+        return SnapshotFormat::Binary;
+    } else if (equalsIgnoreCase(args[index], "TEXT")) {
+        return SnapshotFormat::Text;
+    }
+    return nullopt;
+}
+
+void CommandHandler::handleLoad(const Args& args, ReplyWriter& reply) {
+    if (store_.load(string(args[1]))) {
+        reply.status("OK");
+    } else {
+        reply.error("Failed to load from file");
+    }
+}
+
+void CommandHandler::handleDump(const Args&, ReplyWriter& reply) {
     auto stats = store_.getStats();
     stringstream ss;
     ss << "Total operations: " << stats.totalOperations << "\n"
@@ -183,47 +923,150 @@ string CommandHandler::handleDump(istringstream& iss) {
        << "Total keys: " << stats.totalKeys << "\n"
        << "Memory usage: " << stats.memoryUsage << " bytes";
     logger_.info("DUMP command: statistics retrieved");
-    return ss.str();
+    reply.text(ss.str());
 }
 
-string CommandHandler::handleHelp(istringstream& iss) {
-    return "Commands:\n"
-           "  SET <key> <value> [ttl]  - Set key-value pair\n"
-           "  GET <key>               - Get value\n"
-           "  DEL <key>               - Delete key\n"
-           "  EXISTS <key>            - Check if key exists\n"
-           "  KEYS                    - List all keys\n"
-           "  STATS                   - Show statistics\n"
-           "  SAVE <filename>         - Save to file\n"
-           "  LOAD <filename>         - Load from file\n"
-           "  CLEAR                   - Clear all data\n"
-           "  FLUSH                   - Flush to disk\n"
-           "  HELP                    - Show this help\n"
-           "  QUIT                    - Disconnect";
+void CommandHandler::handleHelp(const Args&, ReplyWriter& reply) {
+    reply.text("Commands:\n"
+               "  SET <key> <value> [ttl]  - Set key-value pair\n"
+               "  GET <key>               - Get value\n"
+               "  DEL <key>               - Delete key\n"
+               "  MGET <key> [key ...]    - Get many values, one per line\n"
+               "  MSET <key> <value> [key value ...]\n"
+               "                          - Set many key-value pairs\n"
+               "  MDEL <key> [key ...]    - Delete many keys, reply is the count\n"
+               "  EXISTS <key>            - Check if key exists\n"
+               "  EXPIRE <key> <seconds>  - Set a TTL in seconds\n"
+               "  PEXPIRE <key> <ms>      - Set a TTL in milliseconds\n"
+               "  TTL <key>               - Remaining TTL in seconds\n"
+               "  PTTL <key>              - Remaining TTL in milliseconds\n"
+               "  KEYS                    - List all keys\n"
+               "  SCAN <cursor> [MATCH <pattern>] [COUNT <n>]\n"
+               "                          - Iterate keys a slice at a time\n"
+               "  PREFIX <prefix> [LIMIT <n>]\n"
+               "                          - Keys with a prefix, in order\n"
+               "  RANGE <from> <to> [LIMIT <n>]\n"
+               "                          - Keys from..to inclusive, in order\n"
+               "  STATS                   - Show statistics\n"
+               "  MEMORY STATS            - Memory breakdown and fragmentation\n"
+               "  MEMORY USAGE <key>      - Bytes used by one key\n"
+               "  CONFIG GET <param>      - Read maxmemory, maxmemory-policy,\n"
+               "                            appendonly, appendfsync,\n"
+               "                            auto-aof-rewrite-percentage,\n"
+               "                            auto-aof-rewrite-min-size or\n"
+               "                            ordered-index (PREFIX, RANGE),\n"
+               "                            client-output-soft-limit or\n"
+               "                            client-output-hard-limit (bytes)\n"
+               "  CONFIG SET <param> <v>  - Change any of those but appendonly\n"
+               "  CLIENT LIST             - Connected clients and their buffers\n"
+               "  SAVE <file> [format]    - Save as BINARY (default) or TEXT\n"
+               "  BGSAVE <file> [format]  - Save in the background, see STATS\n"
+               "  BGREWRITEAOF            - Compact the append-only log\n"
+               "  LOAD <filename>         - Load from file (either format)\n"
+               "  CLEAR                   - Clear all data\n"
+               "  FLUSH <file> [format]   - Save, then clear all data\n"
+               "  PING [message]          - PONG, or the message back\n"
+               "  HELP                    - Show this help\n"
+               "  QUIT                    - Disconnect");
 }
 
-string CommandHandler::handleFlush(istringstream& iss) {
-    string filename;
-    if (!(iss >> filename)) {
-        return "ERROR: FLUSH requires a filename";
+void CommandHandler::handleFlush(const Args& args, ReplyWriter& reply) {
+    auto format = parseSnapshotFormat(args, 2);
+    if (!format) {
+        reply.error("Snapshot format must be BINARY or TEXT");
+        return;
     }
-    
-    if (store_.flush(filename)) {
-        return "OK";
+
+    if (store_.flush(string(args[1]), *format)) {
+        reply.status("OK");
+    } else {
+        reply.error("Failed to flush to file");
     }
-    return "ERROR: Failed to flush to file";
 }
 
-string CommandHandler::handleQuit(istringstream& iss) {
-    return "BYE";
+void CommandHandler::handlePing(const Args& args, ReplyWriter& reply) {
+    if (args.size() > 1) {
+        reply.bulk(args[1]);
+    } else {
+        reply.status("PONG");
+    }
+}
+
+void CommandHandler::handleQuit(const Args&, ReplyWriter& reply) {
+    reply.status("BYE");
 }
 
-string CommandHandler::handleStats(istringstream& iss) {
+void CommandHandler::handleStats(const Args&, ReplyWriter& reply) {
     auto stats = store_.getStats();
+    for (KeyValueStore* partition : partitions_) {
+        if (partition == &store_) {
+            continue;
+        }
+        // Persistence is off while the keyspace is partitioned, so only
+        // the counters have anything to add.
+        auto part = partition->getStats();
+        stats.totalOperations += part.totalOperations;
+        stats.memoryUsage += part.memoryUsage;
+        stats.activeThreads += part.activeThreads;
+        stats.totalKeys += part.totalKeys;
+        stats.shardCount += part.shardCount;
+        stats.maxMemory += part.maxMemory;
+        stats.evictedKeys += part.evictedKeys;
+        stats.rejectedWrites += part.rejectedWrites;
+    }
     stringstream ss;
+    if (partitions_.size() > 1) {
+        ss << "Partitions: " << partitions_.size() << "\n";
+    }
     ss << "Total operations: " << stats.totalOperations << "\n"
        << "Active threads: " << stats.activeThreads << "\n"
        << "Total keys: " << stats.totalKeys << "\n"
-       << "Memory usage: " << stats.memoryUsage << " bytes";
-    return ss.str();
+       << "Shards: " << stats.shardCount << "\n"
+       << "Memory usage: " << stats.memoryUsage << " bytes\n"
+       << "Max memory: " << stats.maxMemory << " bytes\n"
+       << "Evicted keys: " << stats.evictedKeys << "\n"
+       << "Rejected writes: " << stats.rejectedWrites << "\n";
+    if (stats.bgsaveInProgress) {
+        size_t percent = stats.bgsaveKeysTotal == 0 ? 0 : stats.bgsaveKeysWritten * 100 / stats.bgsaveKeysTotal;
+        ss << "Background save: in progress, " << percent << "% (" << stats.bgsaveKeysWritten
+           << "/" << stats.bgsaveKeysTotal << " keys)\n";
+    } else {
+        ss << "Background save: idle\n";
+    }
+    ss << "Last save time: " << stats.lastSaveTime << "\n"
+       << "Last background save: ";
+    if (stats.bgsaveAttempted) {
+        ss << (stats.lastBgsaveOk ? "ok" : "failed") << " in " << stats.lastBgsaveMillis << " ms";
+    } else {
+        ss << "none";
+    }
+    ss << "\nAppend log: ";
+    if (stats.appendLogEnabled) {
+        ss << (stats.appendLogHealthy ? "on" : "write error") << ", fsync "
+           << AppendLog::policyName(stats.fsyncPolicy) << ", " << stats.appendLogBytes << " bytes ("
+           << stats.appendLogBaseBytes << " after the last rewrite)";
+    } else {
+        ss << "off";
+    }
+    ss << "\nLog rewrite: ";
+    if (stats.rewriteInProgress) {
+        ss << "in progress";
+    } else if (stats.rewriteAttempted) {
+        ss << "last " << (stats.lastRewriteOk ? "ok" : "failed") << " in " << stats.lastRewriteMillis << " ms";
+    } else {
+        ss << "none";
+    }
+    if (clients_ != nullptr) {
+        ss << "\nConnected clients: " << clients_->count()
+           << "\nClients closed over output limit: " << clients_->closedOverLimitCount();
+    }
+    if (lanes_ != nullptr) {
+        // The fast lane has no queue: a command runs as soon as it is read.
+        ss << "\nFast lane: " << lanes_->fastRunning() << " running, " << lanes_->fastCompleted()
+           << " completed"
+           << "\nSlow lane: " << lanes_->slowQueued() << " queued, " << lanes_->slowRunning() << " running (at most "
+           << lanes_->slowThreads() << "), " << lanes_->slowCompleted() << " completed, "
+           << lanes_->slowRefused() << " refused";
+    }
+    reply.text(ss.str());
 } 
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "Crc32c.h"
+#include <cstring>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+using namespace std;
+
+#if !defined(__SSE4_2__)
+namespace {
+    const uint32_t POLY = 0x82F63B78;  // reflected Castagnoli polynomial
+
+    struct Tables {
+        uint32_t t[8][256];
+
+        Tables() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    crc = (crc >> 1) ^ (POLY & (0u - (crc & 1)));
+                }
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (int k = 1; k < 8; ++k) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+
+    const Tables& tables() {
+        static const Tables instance;
+        return instance;
+    }
+}
+#endif
+
+uint32_t Crc32c::extend(uint32_t crc, const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(__SSE4_2__)
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+        p += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        size--;
+    }
+#else
+    const auto& t = tables().t;
+    // Eight bytes per step; the input is read little-endian.
+    while (size >= 8) {
+        uint32_t lo = crc ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+        uint32_t hi = uint32_t(p[4]) | uint32_t(p[5]) << 8 | uint32_t(p[6]) << 16 | uint32_t(p[7]) << 24;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+        size--;
+    }
+#endif
+    return ~crc;
+}
@@ -0,0 +1,83 @@
+#include "EpochManager.h"
+#include <stdexcept>
+
+using namespace std;
+
+// Per-thread pin state. The slot is claimed on first use and handed back
+// when the thread exits so short-lived threads do not exhaust the table.
+struct EpochThreadRecord {
+    EpochManager::Slot* slot = nullptr;
+    unsigned depth = 0;
+
+    ~EpochThreadRecord() {
+        if (slot != nullptr) {
+            slot->epoch.store(0, memory_order_release);
+            slot->inUse.store(false, memory_order_release);
+        }
+    }
+};
+
+static thread_local EpochThreadRecord threadRecord;
+
+EpochManager& EpochManager::getInstance() {
+    // Intentionally leaked: thread-local records of threads that outlive
+    // static destruction still point into the slot table.
+    static EpochManager* instance = new EpochManager();
+    return *instance;
+}
+
+EpochManager::Slot* EpochManager::acquireSlot() {
+    for (size_t i = 0; i < MAX_THREADS; ++i) {
+        bool expected = false;
+        if (!slots_[i].inUse.load(memory_order_relaxed) &&
+            slots_[i].inUse.compare_exchange_strong(expected, true, memory_order_acq_rel)) {
+            size_t high = highWater_.load(memory_order_relaxed);
+            while (high < i + 1 &&
+                   !highWater_.compare_exchange_weak(high, i + 1, memory_order_acq_rel)) {
+            }
+            return &slots_[i];
+        }
+    }
+    throw runtime_error("EpochManager: too many threads");
+}
+
+void EpochManager::enter() {
+    EpochThreadRecord& record = threadRecord;
+    if (record.depth++ > 0) {
+        return;
+    }
+    if (record.slot == nullptr) {
+        record.slot = acquireSlot();
+    }
+    // The store must be visible before any of the reader's loads, hence the
+    // sequentially consistent store rather than a release.
+    record.slot->epoch.store(globalEpoch_.load(memory_order_acquire), memory_order_seq_cst);
+}
+
+void EpochManager::exit() {
+    EpochThreadRecord& record = threadRecord;
+    if (--record.depth == 0) {
+        record.slot->epoch.store(0, memory_order_release);
+    }
+}
+
+uint64_t EpochManager::tryAdvance() {
+    uint64_t current = globalEpoch_.load(memory_order_seq_cst);
+    size_t high = highWater_.load(memory_order_acquire);
+    for (size_t i = 0; i < high; ++i) {
+        uint64_t pinned = slots_[i].epoch.load(memory_order_seq_cst);
+        if (pinned != 0 && pinned != current) {
+            return current;
+        }
+    }
+    globalEpoch_.compare_exchange_strong(current, current + 1, memory_order_acq_rel);
+    return globalEpoch_.load(memory_order_acquire);
+}
+
+EpochManager::Guard::Guard() {
+    EpochManager::getInstance().enter();
+}
+
+EpochManager::Guard::~Guard() {
+    EpochManager::getInstance().exit();
+}
@@ -0,0 +1,734 @@
+#include "EpollReactor.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0  // before Linux 4.5 every loop wakes; accept4 sorts it out
+#endif
+
+using namespace std;
+
+namespace {
+    const int EVENTS_PER_WAIT = 256;
+    // A buffer that grew past this for one large request or reply is
+    // released once empty, so idle connections stay small.
+    const size_t KEEP_CAPACITY = 64 * 1024;
+
+    string errorText() {
+        return strerror(errno);
+    }
+
+    void release(string& buffer) {
+        if (buffer.empty() && buffer.capacity() > KEEP_CAPACITY) {
+            string().swap(buffer);
+        }
+    }
+}
+
+EpollReactor::EpollReactor(CommandHandler& handler, Logger& logger, string welcome,
+                           chrono::milliseconds welcomeDelay, size_t loops)
+    : logger_(logger), welcome_(move(welcome)), welcomeDelay_(welcomeDelay), perCore_(false) {
+    for (size_t i = 0; i < max<size_t>(loops, 1); ++i) {
+        loops_.push_back(make_unique<Loop>());
+        loops_.back()->index = i;
+        loops_.back()->handler = &handler;
+    }
+}
+
+EpollReactor::EpollReactor(const vector<CommandHandler*>& partitions, Logger& logger, string welcome,
+                           chrono::milliseconds welcomeDelay)
+    : logger_(logger), welcome_(move(welcome)), welcomeDelay_(welcomeDelay), perCore_(true) {
+    size_t count = partitions.size();
+    size_t capacity = max(MIN_CHANNEL_CAPACITY, INBOX_CAPACITY / max<size_t>(count - 1, 1));
+    for (size_t i = 0; i < count; ++i) {
+        loops_.push_back(make_unique<Loop>());
+        Loop& loop = *loops_.back();
+        loop.index = i;
+        loop.handler = partitions[i];
+        loop.inbox.resize(count);
+        for (size_t from = 0; from < count; ++from) {
+            if (from != i) {
+                loop.inbox[from] = make_unique<Channel>(capacity);
+            }
+        }
+        loop.overflow.resize(count);
+        loop.sentTo.resize(count);
+    }
+    for (auto& loop : loops_) {
+        for (size_t to = 0; to < count; ++to) {
+            loop->outbox.push_back(loops_[to]->inbox[loop->index].get());
+        }
+    }
+}
+
+EpollReactor::~EpollReactor() {
+    stop();
+}
+
+size_t EpollReactor::defaultLoops() {
+    return max(1u, thread::hardware_concurrency());
+}
+
+size_t EpollReactor::connectionCount() const {
+    size_t count = 0;
+    for (const auto& loop : loops_) {
+        count += loop->connections.load(memory_order_relaxed);
+    }
+    return count;
+}
+
+size_t EpollReactor::forwardedCount() const {
+    size_t count = 0;
+    for (const auto& loop : loops_) {
+        count += loop->forwarded.load(memory_order_relaxed);
+    }
+    return count;
+}
+
+int EpollReactor::listenOn(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+        logger_.error("Error creating socket: " + errorText());
+        return -1;
+    }
+
+    // Allow address reuse, and in per-core mode a listening socket per loop
+    // on the one port.
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (perCore_ && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
+        logger_.error("setsockopt failed with error: " + errorText());
+        ::close(fd);
+        return -1;
+    }
+
+    sockaddr_in serverAddr{};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serverAddr.sin_port = htons(static_cast<uint16_t>(port));
+    socklen_t length = sizeof(serverAddr);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&serverAddr), &length) < 0) {
+        logger_.error("Bind failed with error: " + errorText());
+        ::close(fd);
+        return -1;
+    }
+    port_ = ntohs(serverAddr.sin_port);
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        logger_.error("Listen failed with error: " + errorText());
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool EpollReactor::start(int port) {
+    // The first socket settles the port when asked for any free one.
+    for (size_t i = 0; i < (perCore_ ? loops_.size() : 1); ++i) {
+        int fd = listenOn(i == 0 ? port : port_);
+        if (fd < 0) {
+            closeAll();
+            return false;
+        }
+        listeners_.push_back(fd);
+    }
+
+    for (auto& loop : loops_) {
+        loop->listenFd = listeners_[perCore_ ? loop->index : 0];
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // The listening socket stays level-triggered: a loop that leaves
+        // connections in the backlog is woken again for them.
+        epoll_event listenEvent{};
+        listenEvent.events = perCore_ ? EPOLLIN : static_cast<uint32_t>(EPOLLIN | EPOLLEXCLUSIVE);
+        listenEvent.data.fd = loop->listenFd;
+        epoll_event wakeEvent{};
+        wakeEvent.events = EPOLLIN;
+        wakeEvent.data.fd = loop->wakeFd;
+        if (loop->epollFd < 0 || loop->wakeFd < 0 ||
+            epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->listenFd, &listenEvent) < 0 ||
+            epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &wakeEvent) < 0) {
+            logger_.error("Event loop setup failed with error: " + errorText());
+            closeAll();
+            return false;
+        }
+    }
+
+    running_ = true;
+    for (auto& loop : loops_) {
+        loop->worker = thread(&EpollReactor::run, this, ref(*loop));
+        if (perCore_) {
+            pin(*loop);
+        }
+    }
+    logger_.info("Listening on port " + to_string(port_) + " with " + to_string(loops_.size()) +
+                 (perCore_ ? " per-core event loops" : " epoll event loops"));
+    return true;
+}
+
+void EpollReactor::pin(Loop& loop) {
+    // The index-th of the cores this process may run on, so a cpuset
+    // that leaves out core 0 is respected.
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    size_t target = loop.index % static_cast<size_t>(CPU_COUNT(&allowed));
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            if (pthread_setaffinity_np(loop.worker.native_handle(), sizeof(one), &one) != 0) {
+                logger_.error("Failed to pin event loop " + to_string(loop.index) + " to core " + to_string(cpu));
+            }
+            return;
+        }
+    }
+}
+
+void EpollReactor::stop() {
+    if (running_.exchange(false)) {
+        for (auto& loop : loops_) {
+            uint64_t one = 1;
+            if (write(loop->wakeFd, &one, sizeof(one)) < 0) {
+                logger_.error("Failed to wake event loop: " + errorText());
+            }
+        }
+        for (auto& loop : loops_) {
+            if (loop->worker.joinable()) {
+                loop->worker.join();
+            }
+        }
+        logger_.info("Event loops stopped");
+    }
+    closeAll();
+}
+
+void EpollReactor::closeAll() {
+    for (auto& loop : loops_) {
+        for (auto& connection : loop->byFd) {
+            if (connection != nullptr) {
+                ::close(connection->fd);
+                clients().remove(connection->client);
+                connection.reset();
+            }
+        }
+        loop->connections = 0;
+        loop->greetings.clear();
+        loop->unread.clear();
+        if (loop->epollFd >= 0) {
+            ::close(loop->epollFd);
+            loop->epollFd = -1;
+        }
+        {
+            // The slow lane may still be posting replies.
+            lock_guard<mutex> lock(loop->finishedMutex);
+            loop->finished.clear();
+            if (loop->wakeFd >= 0) {
+                ::close(loop->wakeFd);
+                loop->wakeFd = -1;
+            }
+        }
+        loop->listenFd = -1;
+    }
+    for (int fd : listeners_) {
+        ::close(fd);
+    }
+    listeners_.clear();
+}
+
+void EpollReactor::run(Loop& loop) {
+    epoll_event events[EVENTS_PER_WAIT];
+    vector<Ref> unread;
+    while (running_) {
+        int timeout = -1;
+        if (!loop.unread.empty()) {
+            timeout = 0;
+        } else if (!loop.greetings.empty()) {
+            auto wait = chrono::ceil<chrono::milliseconds>(loop.greetings.front().first - chrono::steady_clock::now());
+            timeout = static_cast<int>(max<chrono::milliseconds::rep>(0, wait.count()));
+        }
+        if (perCore_) {
+            // Announced before the inboxes are checked, and a sender checks
+            // it after pushing: either this sees the message or the sender
+            // sees the loop asleep and wakes it.
+            loop.sleeping.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (hasMail(loop)) {
+                timeout = 0;
+            } else if (hasOverflow(loop) && (timeout < 0 || timeout > OVERFLOW_RETRY_MS)) {
+                // Not a spin: the peer needs the core to make room.
+                timeout = OVERFLOW_RETRY_MS;
+            }
+        }
+        int ready = epoll_wait(loop.epollFd, events, EVENTS_PER_WAIT, timeout);
+        loop.sleeping.store(false, memory_order_relaxed);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger_.error("epoll_wait failed with error: " + errorText());
+            break;
+        }
+
+        // Connections cut short last turn go first.
+        unread.swap(loop.unread);
+        for (Ref ref : unread) {
+            Connection* connection = find(loop, ref);
+            if (connection != nullptr && !readAndRun(loop, *connection)) {
+                disconnect(loop, *connection);
+            }
+        }
+        unread.clear();
+
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == loop.wakeFd) {
+                // stop() was called, a peer sent messages or the slow lane
+                // replies
+                uint64_t count;
+                if (read(loop.wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    logger_.error("Failed to read event loop wake-up: " + errorText());
+                }
+                continue;
+            }
+            if (fd == loop.listenFd) {
+                acceptConnections(loop);
+                continue;
+            }
+            if (static_cast<size_t>(fd) >= loop.byFd.size() || loop.byFd[fd] == nullptr) {
+                continue;
+            }
+            Connection& connection = *loop.byFd[fd];
+            uint32_t flags = events[i].events;
+            bool open = (flags & EPOLLERR) == 0;
+            if (open && (flags & EPOLLOUT) != 0) {
+                open = flush(connection);
+            }
+            // A paused connection's unread input was reported before; it
+            // is read once the client has taken some of its replies.
+            bool resume = connection.paused && (flags & EPOLLOUT) != 0;
+            if (open && ((flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0 || resume)) {
+                open = readAndRun(loop, connection);
+            } else if (open && drained(connection)) {
+                open = false;
+            }
+            if (!open) {
+                disconnect(loop, connection);
+            }
+        }
+
+        greetDue(loop, chrono::steady_clock::now());
+        if (loop.hasFinished.load(memory_order_acquire)) {
+            finishSlow(loop);
+        }
+        if (perCore_) {
+            deliver(loop);
+            wakePeers(loop);
+        }
+    }
+}
+
+void EpollReactor::acceptConnections(Loop& loop) {
+    auto deadline = chrono::steady_clock::now() + welcomeDelay_;
+    for (size_t i = 0; i < ACCEPTS_PER_TURN; ++i) {
+        sockaddr_storage peer{};
+        socklen_t peerLength = sizeof(peer);
+        int fd = accept4(loop.listenFd, reinterpret_cast<sockaddr*>(&peer), &peerLength,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                logger_.error("Accept failed with error: " + errorText());
+            }
+            return;
+        }
+
+        // Replies are written whole, so there is nothing to gain from
+        // Nagle's algorithm holding back the tail of one.
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            logger_.error("Failed to watch client connection: " + errorText());
+            ::close(fd);
+            continue;
+        }
+
+        auto connection = make_unique<Connection>();
+        connection->fd = fd;
+        connection->id = nextId_.fetch_add(1, memory_order_relaxed);
+        connection->client =
+            clients().add(connection->id, fd, ClientRegistry::formatAddress(reinterpret_cast<sockaddr*>(&peer)));
+        loop.greetings.emplace_back(deadline, Ref{fd, connection->id});
+        if (static_cast<size_t>(fd) >= loop.byFd.size()) {
+            loop.byFd.resize(fd + 1);
+        }
+        loop.byFd[fd] = move(connection);
+        loop.connections++;
+        // logger_.info("New client connection accepted");
+    }
+}
+
+EpollReactor::Connection* EpollReactor::find(Loop& loop, Ref ref) {
+    if (static_cast<size_t>(ref.fd) >= loop.byFd.size()) {
+        return nullptr;
+    }
+    Connection* connection = loop.byFd[ref.fd].get();
+    return connection != nullptr && connection->id == ref.id ? connection : nullptr;
+}
+
+bool EpollReactor::readAndRun(Loop& loop, Connection& connection) {
+    // Edge-triggered: read until the socket is drained, or come back to it
+    // next turn, or no readiness will be reported for what is left.
+    bool peerOpen = true;
+    size_t reads = 0;
+    while (!connection.closing) {
+        if (!limitOutput(connection)) {
+            return false;
+        }
+        if (connection.paused || connection.waiting) {
+            break;
+        }
+        if (reads == READS_PER_TURN) {
+            loop.unread.push_back(Ref{connection.fd, connection.id});
+            break;
+        }
+        InputBuffer& input = connection.input.empty() ? loop.reads : connection.input;
+        ssize_t n = recv(connection.fd, input.prepare(READ_CHUNK), READ_CHUNK, 0);
+        if (n > 0) {
+            reads++;
+            input.commit(static_cast<size_t>(n));
+            if (!connection.greeted) {
+                connection.greeted = true;
+                if (input.data()[0] != '*') {
+                    connection.output += welcome_;
+                }
+            }
+            runCommands(loop, connection, input);
+            continue;
+        }
+        if (n == 0) {
+            // logger_.info("Client disconnected gracefully");
+            peerOpen = false;
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        break;
+    }
+    if (reads > 0) {
+        connection.client->touch(chrono::steady_clock::now());
+    }
+    connection.input.release(KEEP_CAPACITY);
+    if (!flush(connection) || !peerOpen) {
+        return false;
+    }
+    // After QUIT or a protocol error, close once the last reply is out.
+    return !drained(connection);
+}
+
+void EpollReactor::runCommands(Loop& loop, Connection& connection, InputBuffer& input) {
+    CommandHandler::SlowCommand slow;
+    bool open;
+    if (perCore_ && loops_.size() > 1) {
+        // Two references, small enough for function to hold without
+        // allocating.
+        open = loop.handler->handlePipeline(
+            input,
+            [&loop, &connection](const CommandHandler::Args& args, Protocol protocol, string_view request) {
+                return route(loop, connection, args, protocol, request);
+            },
+            slow);
+    } else {
+        open = loop.handler->handlePipeline(input, connection.output, slow);
+    }
+    if (&input == &loop.reads) {
+        // What the read left, a command unfinished or those behind a slow
+        // one, stays with its connection, which trades buffers with the loop.
+        connection.input.takeFrom(loop.reads);
+    }
+    if (!open) {
+        connection.closing = true;
+    }
+    if (!slow.request.empty()) {
+        offload(loop, connection, slow);
+    }
+}
+
+void EpollReactor::offload(Loop& loop, Connection& connection, CommandHandler::SlowCommand& slow) {
+    connection.pending.push_back(Pending{false, string()});
+    connection.waiting = true;
+    if (connection.pending.size() > 1) {
+        connection.held = move(slow);  // started by reply()
+        return;
+    }
+    startSlow(loop, connection, slow);
+}
+
+void EpollReactor::startSlow(Loop& loop, Connection& connection, CommandHandler::SlowCommand& slow) {
+    Ref origin{connection.fd, connection.id};
+    uint64_t sequence = connection.firstPending + connection.pending.size() - 1;
+    loop.handler->runSlow(move(slow), [this, &loop, origin, sequence](string& text) {
+        Message message;
+        message.origin = origin;
+        message.sequence = sequence;
+        message.reply = true;
+        message.text.swap(text);
+        lock_guard<mutex> lock(loop.finishedMutex);
+        loop.finished.push_back(move(message));
+        loop.hasFinished.store(true, memory_order_release);
+        uint64_t one = 1;
+        if (loop.wakeFd >= 0 && write(loop.wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            logger_.error("Failed to wake event loop: " + errorText());
+        }
+    });
+}
+
+void EpollReactor::finishSlow(Loop& loop) {
+    vector<Message> finished;
+    {
+        lock_guard<mutex> lock(loop.finishedMutex);
+        finished.swap(loop.finished);
+        loop.hasFinished.store(false, memory_order_relaxed);
+    }
+    for (Message& message : finished) {
+        Connection* connection = find(loop, message.origin);
+        if (connection == nullptr) {
+            continue;  // closed while its command was on the slow lane
+        }
+        connection->waiting = false;
+        reply(loop, message);
+        // Unless that closed it: the commands that arrived behind the slow
+        // one, then what the socket has had since.
+        connection = find(loop, message.origin);
+        if (connection == nullptr) {
+            continue;
+        }
+        if (!connection->input.empty() && !connection->closing) {
+            runCommands(loop, *connection, connection->input);
+        }
+        if (!readAndRun(loop, *connection)) {
+            disconnect(loop, *connection);
+        }
+    }
+}
+
+bool EpollReactor::drained(const Connection& connection) {
+    return connection.closing && connection.output.empty() && connection.pending.empty();
+}
+
+bool EpollReactor::flush(Connection& connection) {
+    while (connection.sent < connection.output.size()) {
+        ssize_t n = send(connection.fd, connection.output.data() + connection.sent,
+                         connection.output.size() - connection.sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            connection.sent += static_cast<size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The rest goes on EPOLLOUT.
+            connection.client->update(connection.input.size(), connection.output.size() - connection.sent);
+            return true;
+        } else {
+            return false;
+        }
+    }
+    connection.output.clear();
+    connection.sent = 0;
+    release(connection.output);
+    connection.client->update(connection.input.size(), 0);
+    return true;
+}
+
+bool EpollReactor::limitOutput(Connection& connection) {
+    ClientRegistry& registry = clients();
+    size_t unsent = connection.output.size() - connection.sent;
+    if (registry.overSoftLimit(unsent)) {
+        if (!flush(connection)) {
+            return false;
+        }
+        unsent = connection.output.size() - connection.sent;
+    }
+    if (registry.overHardLimit(unsent)) {
+        logger_.warning("Closing client " + to_string(connection.id) + ": " + to_string(unsent) +
+                        " bytes of replies unsent, over the hard limit");
+        registry.closedOverLimit();
+        return false;
+    }
+    bool paused = registry.overSoftLimit(unsent);
+    if (paused != connection.paused) {
+        connection.paused = paused;
+        connection.client->paused.store(paused, memory_order_relaxed);
+    }
+    return true;
+}
+
+void EpollReactor::greetDue(Loop& loop, chrono::steady_clock::time_point now) {
+    while (!loop.greetings.empty() && loop.greetings.front().first <= now) {
+        Connection* connection = find(loop, loop.greetings.front().second);
+        loop.greetings.pop_front();
+        if (connection == nullptr || connection->greeted) {
+            continue;
+        }
+        connection->greeted = true;
+        connection->output += welcome_;
+        if (!flush(*connection)) {
+            disconnect(loop, *connection);
+        }
+    }
+}
+
+void EpollReactor::disconnect(Loop& loop, Connection& connection) {
+    int fd = connection.fd;
+    ::close(fd);
+    clients().remove(connection.client);
+    loop.byFd[fd].reset();
+    loop.connections--;
+}
+
+string* EpollReactor::route(Loop& loop, Connection& connection, const CommandHandler::Args& args,
+                            Protocol protocol, string_view request) {
+    size_t owner;
+    if (!args.empty() && CommandHandler::ownerOf(args, loop.outbox.size(), owner) && owner != loop.index) {
+        Message& message = loop.scratch;
+        message.origin = Ref{connection.fd, connection.id};
+        message.sequence = connection.firstPending + connection.pending.size();
+        message.protocol = protocol;
+        message.reply = false;
+        message.text.assign(request.data(), request.size());
+        connection.pending.push_back(Pending{false, string()});
+        post(loop, owner, message);
+        loop.forwarded.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+    // Run here: straight to the output, unless behind a forwarded command.
+    if (connection.pending.empty()) {
+        return &connection.output;
+    }
+    if (!connection.pending.back().ready) {
+        connection.pending.push_back(Pending{true, string()});
+    }
+    return &connection.pending.back().text;
+}
+
+void EpollReactor::post(Loop& loop, size_t to, Message& message) {
+    // Behind anything already waiting, or the channel would reorder them.
+    if (!loop.overflow[to].empty() || !loop.outbox[to]->push(message)) {
+        loop.overflow[to].push_back(move(message));
+    }
+    loop.sentTo[to] = true;
+}
+
+bool EpollReactor::hasMail(const Loop& loop) const {
+    for (size_t from = 0; from < loops_.size(); ++from) {
+        if (from != loop.index && !loop.inbox[from]->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EpollReactor::hasOverflow(const Loop& loop) {
+    for (const auto& waiting : loop.overflow) {
+        if (!waiting.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EpollReactor::deliver(Loop& loop) {
+    thread_local CommandHandler::Args args;
+    for (size_t peer = 0; peer < loops_.size(); ++peer) {
+        if (peer == loop.index) {
+            continue;
+        }
+        // At most a channel's worth per turn, so a busy peer cannot keep
+        // this loop from its own connections.
+        Message& message = loop.scratch;
+        size_t capacity = loop.inbox[peer]->capacity();
+        for (size_t i = 0; i < capacity && loop.inbox[peer]->pop(message); ++i) {
+            if (message.reply) {
+                reply(loop, message);
+                continue;
+            }
+            // Forwarded whole and parsed once already, so it is complete.
+            size_t consumed;
+            Protocol protocol;
+            string error;
+            RespParser::parse(message.text.data(), message.text.size(), args, consumed, protocol, error);
+            loop.replyScratch.clear();
+            loop.handler->runCommand(args, message.protocol, loop.replyScratch);
+            message.text.swap(loop.replyScratch);
+            message.reply = true;
+            post(loop, peer, message);
+        }
+        while (!loop.overflow[peer].empty() && loop.outbox[peer]->push(loop.overflow[peer].front())) {
+            loop.overflow[peer].pop_front();
+            loop.sentTo[peer] = true;
+        }
+    }
+}
+
+void EpollReactor::reply(Loop& loop, Message& message) {
+    Connection* connection = find(loop, message.origin);
+    if (connection == nullptr) {
+        return;  // closed while its command was away
+    }
+    Pending& pending = connection->pending[message.sequence - connection->firstPending];
+    pending.ready = true;
+    pending.text.swap(message.text);
+    while (!connection->pending.empty() && connection->pending.front().ready) {
+        connection->output += connection->pending.front().text;
+        connection->pending.pop_front();
+        connection->firstPending++;
+    }
+    // Nothing is run behind a slow command, so its reply is the last.
+    if (!connection->held.request.empty() && connection->pending.size() == 1) {
+        startSlow(loop, *connection, connection->held);
+        connection->held = CommandHandler::SlowCommand();
+    }
+    if (!flush(*connection) || drained(*connection)) {
+        disconnect(loop, *connection);
+    }
+}
+
+void EpollReactor::wakePeers(Loop& loop) {
+    // Pairs with the fence in run(): the messages are in before the
+    // peer's sleeping flag is read.
+    atomic_thread_fence(memory_order_seq_cst);
+    for (size_t to = 0; to < loops_.size(); ++to) {
+        if (!loop.sentTo[to]) {
+            continue;
+        }
+        loop.sentTo[to] = false;
+        if (loops_[to]->sleeping.load(memory_order_relaxed)) {
+            uint64_t one = 1;
+            if (write(loops_[to]->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                logger_.error("Failed to wake event loop: " + errorText());
+            }
+        }
+    }
+}
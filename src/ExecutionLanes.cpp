@@ -0,0 +1,31 @@
+#include "ExecutionLanes.h"
+#include <algorithm>
+
+using namespace std;
+
+ExecutionLanes::ExecutionLanes(size_t slowThreads) : slow_(max<size_t>(slowThreads, 1)) {}
+
+bool ExecutionLanes::admitSlow() {
+    if (slowQueued_.fetch_add(1, memory_order_relaxed) >= MAX_QUEUED) {
+        slowQueued_.fetch_sub(1, memory_order_relaxed);
+        slowRefused_.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ExecutionLanes::submitSlow(Task task) {
+    slow_.submit([this, task = move(task)]() mutable {
+        slowQueued_.fetch_sub(1, memory_order_relaxed);
+        slowRunning_.fetch_add(1, memory_order_relaxed);
+        // Counted out even if the task throws, which the pool reports.
+        struct Finish {
+            ExecutionLanes& lanes;
+            ~Finish() {
+                lanes.slowRunning_.fetch_sub(1, memory_order_relaxed);
+                lanes.slowCompleted_.fetch_add(1, memory_order_relaxed);
+            }
+        } finish{*this};
+        task();
+    });
+}
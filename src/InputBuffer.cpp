@@ -0,0 +1,96 @@
+#include "InputBuffer.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+using namespace std;
+
+char* InputBuffer::prepare(size_t count) {
+    if (capacity_ - tail_ >= count) {
+        return storage_.get() + tail_;
+    }
+    size_t used = size();
+    if (used + count <= capacity_ && used <= capacity_ / 2) {
+        // Compacting moves at most half the buffer, and only after the
+        // other half has been read and consumed since the last time.
+        moveTo(capacity_);
+    } else {
+        moveTo(max({capacity_ * 2, used + count, MIN_CAPACITY}));
+    }
+    return storage_.get() + tail_;
+}
+
+void InputBuffer::moveTo(size_t capacity) {
+    size_t used = size();
+    if (capacity == capacity_) {
+        memmove(storage_.get(), storage_.get() + head_, used);
+    } else {
+        unique_ptr<char[]> moved(new char[capacity]);
+        if (used > 0) {
+            memcpy(moved.get(), storage_.get() + head_, used);
+        }
+        storage_ = move(moved);
+        capacity_ = capacity;
+    }
+    head_ = 0;
+    tail_ = used;
+}
+
+void InputBuffer::append(const char* bytes, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    memcpy(prepare(count), bytes, count);
+    commit(count);
+}
+
+void InputBuffer::consume(size_t count) {
+    head_ += count;
+    if (head_ == tail_) {
+        // Nothing left to move: the next read starts at the front.
+        head_ = 0;
+        tail_ = 0;
+    }
+    if (count > 0) {
+        needed_ = 0;
+    }
+}
+
+void InputBuffer::expect(size_t needed) {
+    needed_ = needed;
+    size_t wanted = needed + READ_BYTES;
+    if (capacity_ - head_ < wanted) {
+        moveTo(wanted <= capacity_ ? capacity_ : max(wanted, MIN_CAPACITY));
+    }
+}
+
+void InputBuffer::clear() {
+    head_ = 0;
+    tail_ = 0;
+    needed_ = 0;
+    progress_.reset();
+}
+
+void InputBuffer::takeFrom(InputBuffer& other) {
+    swap(other);
+    other.clear();
+}
+
+void InputBuffer::release(size_t keep) {
+    if (empty() && capacity_ > keep) {
+        storage_.reset();
+        capacity_ = 0;
+        head_ = 0;
+        tail_ = 0;
+        progress_ = RespParser::Progress();
+    }
+}
+
+void InputBuffer::swap(InputBuffer& other) noexcept {
+    storage_.swap(other.storage_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(head_, other.head_);
+    std::swap(tail_, other.tail_);
+    std::swap(needed_, other.needed_);
+    std::swap(progress_, other.progress_);
+}
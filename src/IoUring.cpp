@@ -0,0 +1,343 @@
+#include "IoUring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+atomic<bool> IoUring::forFiles_{false};
+
+namespace {
+    // A single read or write moves at most this much, so its byte count
+    // fits the completion's result.
+    const size_t MAX_CHUNK = size_t(1) << 30;
+    // Marks the user_data of writes queued by writeAt(), which is
+    // otherwise the byte count the completion should report.
+    const uint64_t QUEUED = uint64_t(1) << 63;
+
+    int setup(unsigned entries, io_uring_params& params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    }
+
+    int enter(int fd, unsigned submit, unsigned waitFor, unsigned flags, const void* arg, size_t argBytes) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, waitFor, flags, arg, argBytes));
+    }
+
+    int registerWith(int fd, unsigned opcode, const void* arg, unsigned count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+    }
+
+    void* map(int fd, size_t bytes, uint64_t offset) {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, static_cast<off_t>(offset));
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    template <class T>
+    T* at(void* base, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+}
+
+IoUring::~IoUring() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    // The kernel holds its own references to the mappings and the buffer
+    // ring's pages, so they can go in any order.
+    if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingBytes_);
+    }
+    if (sqRing_ != nullptr) {
+        munmap(sqRing_, sqRingBytes_);
+    }
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqesBytes_);
+    }
+    if (bufferRing_ != nullptr) {
+        munmap(bufferRing_, bufferRingBytes_);
+    }
+    if (buffers_ != nullptr) {
+        munmap(buffers_, bufferBytes_);
+    }
+}
+
+bool IoUring::init(unsigned entries, unsigned completions) {
+    // Each ring has a single user, so the kernel can skip the locking
+    // that sharing needs and run completion work only when it is asked
+    // for completions; older kernels take fewer hints, or none.
+    const unsigned hints[] = {
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+        0,
+    };
+    io_uring_params params{};
+    for (unsigned flags : hints) {
+        params = io_uring_params{};
+        params.flags = flags;
+        if (completions > entries) {
+            params.flags |= IORING_SETUP_CQSIZE;
+            params.cq_entries = completions;
+        }
+        fd_ = setup(entries, params);
+        if (fd_ >= 0 || errno != EINVAL) {
+            break;
+        }
+    }
+    if (fd_ < 0) {
+        return false;
+    }
+    features_ = params.features;
+
+    sqRingBytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingBytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (features_ & IORING_FEAT_SINGLE_MMAP) {
+        sqRingBytes_ = cqRingBytes_ = max(sqRingBytes_, cqRingBytes_);
+    }
+    sqRing_ = map(fd_, sqRingBytes_, IORING_OFF_SQ_RING);
+    cqRing_ = (features_ & IORING_FEAT_SINGLE_MMAP) ? sqRing_ : map(fd_, cqRingBytes_, IORING_OFF_CQ_RING);
+    sqesBytes_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(map(fd_, sqesBytes_, IORING_OFF_SQES));
+    if (sqRing_ == nullptr || cqRing_ == nullptr || sqes_ == nullptr) {
+        int error = errno;
+        ::close(fd_);
+        fd_ = -1;
+        errno = error;
+        return false;
+    }
+
+    sqHead_ = at<unsigned>(sqRing_, params.sq_off.head);
+    sqTail_ = at<unsigned>(sqRing_, params.sq_off.tail);
+    sqMask_ = *at<unsigned>(sqRing_, params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+    sqeTail_ = *sqTail_;
+    // Entries are used in ring order, so the indirection array is set
+    // once to the identity.
+    unsigned* array = at<unsigned>(sqRing_, params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; ++i) {
+        array[i] = i;
+    }
+    cqHead_ = at<unsigned>(cqRing_, params.cq_off.head);
+    cqTail_ = at<unsigned>(cqRing_, params.cq_off.tail);
+    cqMask_ = *at<unsigned>(cqRing_, params.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cqRing_, params.cq_off.cqes);
+    return true;
+}
+
+bool IoUring::supported(string& reason) {
+    IoUring ring;
+    if (!ring.init(8)) {
+        reason = errno == ENOSYS ? "io_uring is not available" : string("io_uring_setup failed: ") + strerror(errno);
+        return false;
+    }
+    if ((ring.features_ & IORING_FEAT_EXT_ARG) == 0) {
+        reason = "waits with a timeout are not supported";
+        return false;
+    }
+    const size_t opcodes = 256;
+    vector<char> storage(sizeof(io_uring_probe) + opcodes * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+    if (registerWith(ring.fd_, IORING_REGISTER_PROBE, probe, opcodes) < 0) {
+        reason = string("io_uring probe failed: ") + strerror(errno);
+        return false;
+    }
+    // SEND_ZC came last, with multishot receive.
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SEND_ZC, IORING_OP_ASYNC_CANCEL,
+                   IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC}) {
+        if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) {
+            reason = "io_uring opcode " + to_string(op) + " is not supported";
+            return false;
+        }
+    }
+    if (!ring.provideBuffers(0, 2, 4096)) {
+        reason = string("provided buffer rings are not supported: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+io_uring_sqe* IoUring::next() {
+    if (sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_ && !submit()) {
+        return nullptr;
+    }
+    io_uring_sqe* sqe = &sqes_[sqeTail_ & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sqeTail_++;
+    return sqe;
+}
+
+bool IoUring::submit(unsigned waitFor, int64_t timeoutNs) {
+    __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+    unsigned queued = sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+    __kernel_timespec timeout{};
+    io_uring_getevents_arg arg{};
+    if (waitFor > 0 && timeoutNs >= 0) {
+        timeout.tv_sec = timeoutNs / 1000000000;
+        timeout.tv_nsec = timeoutNs % 1000000000;
+        arg.ts = reinterpret_cast<uint64_t>(&timeout);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (queued == 0 && waitFor == 0) {
+        return true;
+    }
+    int result = enter(fd_, queued, waitFor, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                       (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    return result >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY;
+}
+
+bool IoUring::provideBuffers(uint16_t group, unsigned count, unsigned size) {
+    bufferRingBytes_ = count * sizeof(io_uring_buf);
+    bufferBytes_ = size_t(count) * size;
+    void* ring = mmap(nullptr, bufferRingBytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* buffers = mmap(nullptr, bufferBytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bufferRing_ = ring == MAP_FAILED ? nullptr : static_cast<io_uring_buf*>(ring);
+    buffers_ = buffers == MAP_FAILED ? nullptr : static_cast<char*>(buffers);
+    if (bufferRing_ == nullptr || buffers_ == nullptr) {
+        return false;
+    }
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufferRing_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (registerWith(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+    bufferSize_ = size;
+    bufferMask_ = static_cast<uint16_t>(count - 1);
+    bufferTail_ = 0;
+    for (unsigned id = 0; id < count; ++id) {
+        recycle(static_cast<uint16_t>(id));
+    }
+    return true;
+}
+
+void IoUring::recycle(uint16_t id) {
+    io_uring_buf& slot = bufferRing_[bufferTail_ & bufferMask_];
+    slot.addr = reinterpret_cast<uint64_t>(buffer(id));
+    slot.len = bufferSize_;
+    slot.bid = id;
+    // The tail is the first slot's reserved field (io_uring_buf_ring),
+    // published once the slot is written.
+    __atomic_store_n(&bufferRing_[0].resv, ++bufferTail_, __ATOMIC_RELEASE);
+}
+
+bool IoUring::write(int fd, const char* data, size_t size, bool sync) {
+    // Linked, so each runs only once the one before it has completed in
+    // full; a short write fails the rest of the chain.
+    unsigned queued = 0;
+    while (size > 0) {
+        size_t chunk = min(size, MAX_CHUNK);
+        io_uring_sqe* sqe = next();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(chunk);
+        sqe->off = static_cast<uint64_t>(-1);  // at the file position, moving it on
+        sqe->user_data = chunk;
+        data += chunk;
+        size -= chunk;
+        if (size > 0 || sync) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        queued++;
+    }
+    if (sync) {
+        io_uring_sqe* sqe = next();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = 0;
+        queued++;
+    }
+    return waitFiles(queued, false);
+}
+
+bool IoUring::sync(int fd) {
+    return write(fd, nullptr, 0, true);
+}
+
+bool IoUring::writeAt(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        size_t chunk = min(size, MAX_CHUNK);
+        io_uring_sqe* sqe = next();
+        if (sqe == nullptr) {
+            writeFailed_ = true;
+            return false;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(chunk);
+        sqe->off = offset;
+        sqe->user_data = chunk | QUEUED;
+        writesQueued_++;
+        data += chunk;
+        size -= chunk;
+        offset += chunk;
+    }
+    // Started now, so the disk works while the caller goes on.
+    return submit();
+}
+
+bool IoUring::finishWrites() {
+    bool ok = waitFiles(0, true) && !writeFailed_;
+    writeFailed_ = false;
+    return ok;
+}
+
+bool IoUring::waitFiles(unsigned count, bool queued) {
+    bool ok = true;
+    while (count > 0 || (queued && writesQueued_ > 0)) {
+        if (!submit(count + (queued ? writesQueued_ : 0))) {
+            return false;
+        }
+        drain([&](const io_uring_cqe& cqe) {
+            // A write should report the bytes it was given; a sync, 0.
+            bool done = cqe.res >= 0 && static_cast<uint64_t>(cqe.res) == (cqe.user_data & ~QUEUED);
+            if (cqe.user_data & QUEUED) {
+                writesQueued_--;
+                writeFailed_ = writeFailed_ || !done;
+            } else {
+                count--;
+                ok = ok && done;
+            }
+        });
+    }
+    return ok;
+}
+
+IoUring* IoUring::fileRing() {
+    if (!usedForFiles()) {
+        return nullptr;
+    }
+    // Set up once per thread; a thread on which it failed does without.
+    thread_local unique_ptr<IoUring> ring;
+    thread_local bool tried = false;
+    if (!tried) {
+        tried = true;
+        auto candidate = make_unique<IoUring>();
+        if (candidate->init(FILE_RING_ENTRIES)) {
+            ring = move(candidate);
+        }
+    }
+    return ring.get();
+}
+
+void IoUring::useForFiles(bool enabled) {
+    forFiles_.store(enabled, memory_order_relaxed);
+}
+
+bool IoUring::usedForFiles() {
+    return forFiles_.load(memory_order_relaxed);
+}
@@ -5,226 +5,1631 @@
 #include <algorithm>
 #include <chrono>
 #include <thread>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <new>
+#include "ThreadPool.h"
 
 using namespace std;
 
-KeyValueStore::KeyValueStore() : 
-    running_(true), 
-    memoryUsage_(0), 
-    totalOperations_(0), 
+namespace {
+    // How long the cleaner waits before starting another automatic log
+    // rewrite after one failed.
+    const int64_t REWRITE_RETRY_MILLIS = 10000;
+
+    // Rewritten records are gathered into writes of about this size.
+    const size_t REWRITE_WRITE_BYTES = 1024 * 1024;
+
+    // Keys read from one shard's ordered index per lock hold: limit-bound
+    // queries read about twice their share, at least the minimum.
+    const size_t ORDERED_BATCH_MIN = 16;
+    const size_t ORDERED_BATCH_MAX = 1024;
+
+    // Retired records accumulated by a shard before it tries to free them.
+    const size_t RECLAIM_BATCH = 64;
+
+    // Access counter parameters, as in Redis' LFU: new keys start at
+    // LFU_INIT so they are not evicted before they had a chance to be read,
+    // the counter grows logarithmically and loses one per idle minute.
+    const uint32_t LFU_INIT = 5;
+    const uint32_t LFU_LOG_FACTOR = 10;
+    const uint32_t LFU_DECAY_SECONDS = 60;
+    const uint32_t ACCESS_CLOCK_MASK = 0xFFFFFF;
+
+    uint64_t nextRandom() {
+        static thread_local uint64_t state =
+            hash<thread::id>{}(this_thread::get_id()) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    uint32_t idleSeconds(uint32_t access, uint32_t clock) {
+        return (clock - (access >> 8)) & ACCESS_CLOCK_MASK;
+    }
+
+    uint32_t decayedCounter(uint32_t access, uint32_t clock) {
+        uint32_t counter = access & 0xFF;
+        uint32_t periods = idleSeconds(access, clock) / LFU_DECAY_SECONDS;
+        return periods >= counter ? 0 : counter - periods;
+    }
+
+    // Matches the bracket class starting at pattern[pos] against c and sets
+    // end past its closing bracket; an unterminated class runs to the end
+    // of the pattern.
+    bool matchClass(string_view pattern, size_t pos, char c, size_t& end) {
+        size_t i = pos + 1;
+        bool negate = i < pattern.size() && pattern[i] == '^';
+        if (negate) {
+            i++;
+        }
+        bool matched = false;
+        while (i < pattern.size() && pattern[i] != ']') {
+            if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+                matched |= pattern[i + 1] == c;
+                i += 2;
+            } else if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                char lo = min(pattern[i], pattern[i + 2]);
+                char hi = max(pattern[i], pattern[i + 2]);
+                matched |= lo <= c && c <= hi;
+                i += 3;
+            } else {
+                matched |= pattern[i] == c;
+                i++;
+            }
+        }
+        end = i < pattern.size() ? i + 1 : i;
+        return matched != negate;
+    }
+
+    // Runs task(0) .. task(count - 1) on a pool of up to threads workers, or
+    // inline for a single thread, and returns once all have finished. False
+    // if any of them threw.
+    bool parallelFor(size_t threads, size_t count, const function<void(size_t)>& task) {
+        atomic<bool> ok(true);
+        auto run = [&task, &ok](size_t i) {
+            try {
+                task(i);
+            } catch (...) {
+                ok = false;
+            }
+        };
+        if (threads <= 1 || count <= 1) {
+            for (size_t i = 0; i < count; ++i) {
+                run(i);
+            }
+            return ok;
+        }
+        {
+            ThreadPool pool(min(threads, count));
+            for (size_t i = 0; i < count; ++i) {
+                pool.submit([&run, i] { run(i); });
+            }
+            // The pool's destructor lets the workers drain the queue.
+        }
+        return ok;
+    }
+}
+
+KeyValueStore::Entry* KeyValueStore::Entry::create(SlabAllocator& slabs, uint64_t hash, string_view key,
+                                                   string_view value, int64_t expiry) {
+    size_t bytes = sizeof(Entry) + key.size() + value.size();
+    uint8_t sizeClass = SlabAllocator::classFor(bytes);
+    void* memory = sizeClass != SlabAllocator::NO_CLASS ? slabs.allocate(sizeClass) : ::operator new(bytes);
+    Entry* entry = new (memory) Entry(hash, expiry, static_cast<uint32_t>(key.size()),
+                                      static_cast<uint32_t>(value.size()), sizeClass);
+    memcpy(entry->data(), key.data(), key.size());
+    memcpy(entry->data() + key.size(), value.data(), value.size());
+    return entry;
+}
+
+void KeyValueStore::Entry::destroy(SlabAllocator& slabs, Entry* entry) {
+    uint8_t sizeClass = entry->sizeClass;
+    entry->~Entry();
+    if (sizeClass != SlabAllocator::NO_CLASS) {
+        slabs.deallocate(entry, sizeClass);
+    } else {
+        ::operator delete(entry);
+    }
+}
+
+KeyValueStore::Shard::Shard(Arena& arena) : slabs_(arena), expiries_(nowMillis()) {}
+
+KeyValueStore::Shard::~Shard() {
+    // No reader can be inside a store that is being destroyed.
+    for (auto& r : retired_) {
+        r.deleter(*this, r.ptr);
+    }
+    table_.forEach([this](Entry* e) { Entry::destroy(slabs_, e); });
+}
+
+KeyValueStore::KeyValueStore(size_t numShards, bool hugePages) :
+    arena_(hugePages),
+    shardMask_(0),
+    running_(true),
+    memoryUsage_(0),
+    totalOperations_(0),
     activeThreads_(0),
+    maxMemory_(0),
+    policy_(EvictionPolicy::NoEviction),
+    evictedKeys_(0),
+    rejectedWrites_(0),
+    evictionCursor_(0),
+    accessClock_(accessClockNow()),
+    snapshotInProgress_(false),
+    bgsaveInProgress_(false),
+    snapshotKeysWritten_(0),
+    snapshotKeysTotal_(0),
+    lastSaveTime_(0),
+    bgsaveAttempted_(false),
+    lastBgsaveOk_(false),
+    lastBgsaveMillis_(0),
+    rewriteInProgress_(false),
+    rewriteAttempted_(false),
+    lastRewriteOk_(false),
+    lastRewriteMillis_(0),
+    rewriteRetryAt_(0),
+    autoRewritePercentage_(DEFAULT_AUTO_REWRITE_PERCENTAGE),
+    autoRewriteMinBytes_(DEFAULT_AUTO_REWRITE_MIN_BYTES),
+    orderedIndex_(false),
     logger_(Logger::getInstance()) {
+    size_t count = 1;
+    while (count < numShards) {
+        count <<= 1;
+    }
+    shards_.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        shards_.push_back(make_unique<Shard>(arena_));
+    }
+    shardMask_ = count - 1;
+    for (auto& shard : shards_) {
+        charge(*shard, shard->table_.array()->bytes());
+    }
     cleanerThread_ = thread(&KeyValueStore::cleanerLoop, this);
 }
 
 KeyValueStore::~KeyValueStore() {
     running_ = false;
+    // The cleaner goes first, as it can start a log rewrite. A background
+    // save or rewrite in progress gives up at its next shard.
     if (cleanerThread_.joinable()) {
         cleanerThread_.join();
     }
+    if (snapshotThread_.joinable()) {
+        snapshotThread_.join();
+    }
+    appendLog_.close();
+}
+
+uint64_t KeyValueStore::hashKey(string_view key) {
+    uint64_t h = hash<string_view>{}(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+KeyValueStore::Shard& KeyValueStore::shardFor(uint64_t hash) {
+    // Table slots and fingerprints come from the low bits of the hash,
+    // shards from the high bits.
+    return *shards_[static_cast<size_t>(hash >> 32) & shardMask_];
+}
+
+vector<unique_lock<mutex>> KeyValueStore::lockAll() {
+    vector<unique_lock<mutex>> locks;
+    locks.reserve(shards_.size());
+    for (auto& shard : shards_) {
+        locks.emplace_back(shard->mutex_);
+    }
+    return locks;
+}
+
+void KeyValueStore::retire(Shard& shard, void* ptr, void (*deleter)(Shard&, void*), size_t bytes) {
+    shard.retired_.push_back({ptr, deleter, EpochManager::getInstance().currentEpoch(), bytes});
+    if (shard.retired_.size() >= RECLAIM_BATCH) {
+        reclaim(shard);
+    }
+}
+
+void KeyValueStore::reclaim(Shard& shard) {
+    uint64_t epoch = EpochManager::getInstance().tryAdvance();
+    // Records are retired in epoch order, so the reclaimable ones are a
+    // prefix. Stopping at the first young one keeps this cheap while a
+    // snapshot holds the epoch back and the list grows long.
+    auto keep = find_if(shard.retired_.begin(), shard.retired_.end(), [epoch](const Retired& r) {
+        return !EpochManager::isReclaimable(r.epoch, epoch);
+    });
+    for (auto it = shard.retired_.begin(); it != keep; ++it) {
+        it->deleter(shard, it->ptr);
+    }
+    shard.retired_.erase(shard.retired_.begin(), keep);
+}
+
+// Memory is charged to the keyspace while an entry or array is reachable
+// and uncharged when it is unlinked, not when the epoch scheme finally frees
+// it; retired blocks are reported separately as pending reclaim.
+void KeyValueStore::charge(Shard& shard, int64_t bytes) {
+    shard.bytes_ += bytes;
+    memoryUsage_ += static_cast<size_t>(bytes);
+}
+
+void KeyValueStore::publish(Shard& shard, Entry* entry) {
+    freeze(shard);
+    Entry* old = shard.table_.upsert(entry, [this, &shard](Table::Array* a) {
+        retireGrownArray(shard, a);
+    });
+    charge(shard, footprint(entry));
+    if (shard.indexed_) {
+        shard.index_.insert(entry);
+        chargeIndex(shard);
+    }
+    if (old != nullptr) {
+        retireEntry(shard, old);
+    }
+}
+
+KeyValueStore::Entry* KeyValueStore::unlink(Shard& shard, string_view key, uint64_t hash) {
+    Entry* old = shard.table_.erase(key, hash);
+    if (old != nullptr && shard.indexed_) {
+        shard.index_.erase(key);
+        chargeIndex(shard);
+    }
+    return old;
+}
+
+void KeyValueStore::retireEntry(Shard& shard, Entry* entry) {
+    size_t bytes = footprint(entry);
+    charge(shard, -static_cast<int64_t>(bytes));
+    retire(shard, entry, &KeyValueStore::deleteEntry, bytes);
+}
+
+void KeyValueStore::retireGrownArray(Shard& shard, Table::Array* old) {
+    charge(shard, static_cast<int64_t>(shard.table_.array()->bytes()) - static_cast<int64_t>(old->bytes()));
+    retire(shard, old, &KeyValueStore::deleteTableArray, old->bytes());
+}
+
+// For clear, flush and load: the shard's whole previous contents go at
+// once and entryBytes worth of new entries arrive with the current array.
+// The index is charged apart and rebuilt by the caller.
+void KeyValueStore::retireContents(Shard& shard, Table::Array* old, size_t entryBytes) {
+    size_t held = shard.bytes_ - shard.indexBytes_;
+    charge(shard, static_cast<int64_t>(entryBytes + shard.table_.array()->bytes()) - static_cast<int64_t>(held));
+    retire(shard, old, &KeyValueStore::deleteTableArrayAndEntries, held);
+}
+
+void KeyValueStore::rebuildIndex(Shard& shard) {
+    shard.index_.clear();
+    if (shard.indexed_) {
+        shard.table_.forEach([&shard](Entry* e) { shard.index_.insert(e); });
+    }
+    chargeIndex(shard);
+}
+
+void KeyValueStore::chargeIndex(Shard& shard) {
+    size_t bytes = shard.indexed_ ? shard.index_.bytes() : 0;
+    charge(shard, static_cast<int64_t>(bytes) - static_cast<int64_t>(shard.indexBytes_));
+    shard.indexBytes_ = bytes;
+}
+
+size_t KeyValueStore::footprint(const Entry* entry) {
+    if (entry->sizeClass != SlabAllocator::NO_CLASS) {
+        return SlabAllocator::classSize(entry->sizeClass);
+    }
+    return MemoryInfo::usableSize(entry);
+}
+
+void KeyValueStore::deleteEntry(Shard& shard, void* ptr) {
+    Entry::destroy(shard.slabs_, static_cast<Entry*>(ptr));
+}
+
+void KeyValueStore::deleteTableArray(Shard&, void* ptr) {
+    delete static_cast<Table::Array*>(ptr);
+}
+
+void KeyValueStore::deleteTableArrayAndEntries(Shard& shard, void* ptr) {
+    Table::Array* array = static_cast<Table::Array*>(ptr);
+    Table::forEachIn(array, [&shard](Entry* e) { Entry::destroy(shard.slabs_, e); });
+    delete array;
 }
 
 bool KeyValueStore::set(const string& key, const string& value, int ttl) {
-    lock_guard<mutex> lock(mutex_);
-    Value v;
-    v.value = value;
+    int64_t expiry = 0;
     if (ttl > 0) {
-        v.expiry = chrono::system_clock::now() + chrono::seconds(ttl);
+        expiry = nowMillis() + int64_t(ttl) * 1000;
     }
-    store_[key] = v;
+    if (!makeRoom(sizeof(Entry) + key.size() + value.size())) {
+        rejectedWrites_++;
+        // logger_.warning("SET operation: key=" + key + " rejected, maxmemory reached");
+        return false;
+    }
+    put(key, value, expiry);
     totalOperations_++;
-    memoryUsage_ += key.size() + value.size();
     // logger_.info("SET operation: key=" + key + ", value=" + value + (ttl > 0 ? ", ttl=" + to_string(ttl) : ""));
     return true;
 }
 
-string KeyValueStore::get(const string& key) {
-    lock_guard<mutex> lock(mutex_);
-    auto it = store_.find(key);
-    if (it != store_.end()) {
-        if (isExpired(it->second)) {
-            store_.erase(it);
-            // logger_.info("GET operation: key=" + key + " (expired)");
-            return "";
+void KeyValueStore::put(string_view key, string_view value, int64_t expiry) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    // Built outside the lock; publication below is a single pointer store.
+    Entry* entry = Entry::create(shard.slabs_, h, key, value, expiry);
+    entry->access.store(accessClock_.load(memory_order_relaxed) << 8 | LFU_INIT, memory_order_relaxed);
+    uint64_t logged;
+    {
+        lock_guard<mutex> lock(shard.mutex_);
+        publish(shard, entry);
+        if (expiry != 0) {
+            shard.expiries_.schedule(string(key), expiry);
         }
-        // logger_.info("GET operation: key=" + key + ", value=" + it->second.value);
-        return it->second.value;
+        logged = logWrite(LogOp::Set, key, value, expiry);
     }
-    // logger_.info("GET operation: key=" + key + " (not found)");
-    return "";
+    awaitLog(logged);
 }
 
-bool KeyValueStore::del(const string& key) {
-    lock_guard<mutex> lock(mutex_);
-    auto it = store_.find(key);
-    if (it != store_.end()) {
-        memoryUsage_ -= key.size() + it->second.value.size();
-        store_.erase(it);
-        totalOperations_++;
-        // logger_.info("DEL operation: key=" + key + " (deleted)");
-        return true;
+string KeyValueStore::get(const string& key) {
+    string value;
+    read(key, [&value](string_view v) { value.assign(v); });
+    return value;
+}
+
+bool KeyValueStore::read(string_view key, const function<void(string_view)>& visit) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    EpochManager::Guard guard;
+    const Entry* e = shard.table_.find(key, h);
+    // Expired entries are left in place for the cleaner to unlink.
+    if (e == nullptr || isExpired(*e)) {
+        // logger_.info("GET operation: key=" + string(key) + " (not found)");
+        return false;
     }
-    // logger_.info("DEL operation: key=" + key + " (not found)");
-    return false;
+    touch(*e);
+    // logger_.info("GET operation: key=" + string(key) + ", value=" + string(e->value()));
+    visit(e->value());
+    return true;
 }
 
-bool KeyValueStore::exists(const string& key) {
-    lock_guard<mutex> lock(mutex_);
-    auto it = store_.find(key);
-    if (it != store_.end()) {
-        if (isExpired(it->second)) {
-            store_.erase(it);
-            // logger_.info("EXISTS operation: key=" + key + " (expired)");
+bool KeyValueStore::del(const string& key) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    uint64_t logged;
+    {
+        lock_guard<mutex> lock(shard.mutex_);
+        freeze(shard);
+        Entry* old = unlink(shard, key, h);
+        if (old == nullptr) {
+            // logger_.info("DEL operation: key=" + key + " (not found)");
             return false;
         }
-        // logger_.info("EXISTS operation: key=" + key + " (exists)");
-        return true;
+        retireEntry(shard, old);
+        logged = logWrite(LogOp::Del, key);
     }
-    // logger_.info("EXISTS operation: key=" + key + " (not found)");
-    return false;
+    awaitLog(logged);
+    totalOperations_++;
+    // logger_.info("DEL operation: key=" + key + " (deleted)");
+    return true;
+}
+
+void KeyValueStore::mget(const vector<string>& keys, const function<void(optional<string_view>)>& visit) {
+    vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        hashes[i] = hashKey(keys[i]);
+    }
+    vector<size_t> order, starts;
+    groupByShard(hashes, order, starts);
+    // Found shard by shard, then visited in request order; the guard
+    // keeps every entry found alive until the last visit.
+    vector<const Entry*> found(keys.size(), nullptr);
+    EpochManager::Guard guard;
+    int64_t now = nowMillis();
+    for (size_t s = 0; s + 1 < starts.size(); ++s) {
+        Table& table = shards_[s]->table_;
+        for (size_t j = starts[s]; j < starts[s + 1]; ++j) {
+            table.prefetch(hashes[order[j]]);
+        }
+        for (size_t j = starts[s]; j < starts[s + 1]; ++j) {
+            size_t i = order[j];
+            const Entry* e = table.find(keys[i], hashes[i]);
+            if (e != nullptr && !isExpired(*e, now)) {
+                touch(*e);
+                found[i] = e;
+            }
+        }
+    }
+    for (const Entry* e : found) {
+        visit(e != nullptr ? optional<string_view>(e->value()) : nullopt);
+    }
+    // logger_.info("MGET operation: " + to_string(keys.size()) + " keys");
+}
+
+bool KeyValueStore::mset(const vector<pair<string, string>>& pairs) {
+    size_t bytes = 0;
+    vector<uint64_t> hashes(pairs.size());
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        bytes += sizeof(Entry) + pairs[i].first.size() + pairs[i].second.size();
+        hashes[i] = hashKey(pairs[i].first);
+    }
+    if (!makeRoom(bytes)) {
+        rejectedWrites_ += pairs.size();
+        // logger_.warning("MSET operation: rejected, maxmemory reached");
+        return false;
+    }
+    vector<size_t> order, starts;
+    groupByShard(hashes, order, starts);
+    uint32_t access = accessClock_.load(memory_order_relaxed) << 8 | LFU_INIT;
+    uint64_t logged = 0;
+    vector<Entry*> entries;
+    for (size_t s = 0; s + 1 < starts.size(); ++s) {
+        if (starts[s] == starts[s + 1]) {
+            continue;
+        }
+        Shard& shard = *shards_[s];
+        // As with put(), entries are built before the lock is taken.
+        entries.clear();
+        for (size_t j = starts[s]; j < starts[s + 1]; ++j) {
+            size_t i = order[j];
+            Entry* entry = Entry::create(shard.slabs_, hashes[i], pairs[i].first, pairs[i].second, 0);
+            entry->access.store(access, memory_order_relaxed);
+            entries.push_back(entry);
+        }
+        lock_guard<mutex> lock(shard.mutex_);
+        for (Entry* entry : entries) {
+            shard.table_.prefetch(entry->hash);
+        }
+        for (Entry* entry : entries) {
+            publish(shard, entry);
+            logged = logWrite(LogOp::Set, entry->key(), entry->value(), 0);
+        }
+    }
+    awaitLog(logged);
+    totalOperations_ += pairs.size();
+    // logger_.info("MSET operation: " + to_string(pairs.size()) + " keys");
+    return true;
+}
+
+size_t KeyValueStore::mdel(const vector<string>& keys) {
+    vector<uint64_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        hashes[i] = hashKey(keys[i]);
+    }
+    vector<size_t> order, starts;
+    groupByShard(hashes, order, starts);
+    size_t deleted = 0;
+    uint64_t logged = 0;
+    for (size_t s = 0; s + 1 < starts.size(); ++s) {
+        if (starts[s] == starts[s + 1]) {
+            continue;
+        }
+        Shard& shard = *shards_[s];
+        lock_guard<mutex> lock(shard.mutex_);
+        for (size_t j = starts[s]; j < starts[s + 1]; ++j) {
+            shard.table_.prefetch(hashes[order[j]]);
+        }
+        freeze(shard);
+        for (size_t j = starts[s]; j < starts[s + 1]; ++j) {
+            size_t i = order[j];
+            Entry* old = unlink(shard, keys[i], hashes[i]);
+            if (old != nullptr) {
+                retireEntry(shard, old);
+                logged = logWrite(LogOp::Del, keys[i]);
+                deleted++;
+            }
+        }
+    }
+    awaitLog(logged);
+    totalOperations_ += deleted;
+    // logger_.info("MDEL operation: " + to_string(deleted) + " of " + to_string(keys.size()) + " keys deleted");
+    return deleted;
+}
+
+void KeyValueStore::groupByShard(const vector<uint64_t>& hashes, vector<size_t>& order,
+                                 vector<size_t>& starts) const {
+    // A counting sort: stable, and linear in the batch.
+    starts.assign(shards_.size() + 1, 0);
+    for (uint64_t h : hashes) {
+        starts[(static_cast<size_t>(h >> 32) & shardMask_) + 1]++;
+    }
+    for (size_t s = 1; s < starts.size(); ++s) {
+        starts[s] += starts[s - 1];
+    }
+    vector<size_t> next(starts.begin(), starts.end() - 1);
+    order.resize(hashes.size());
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        order[next[static_cast<size_t>(hashes[i] >> 32) & shardMask_]++] = i;
+    }
+}
+
+bool KeyValueStore::exists(const string& key) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    EpochManager::Guard guard;
+    const Entry* e = shard.table_.find(key, h);
+    // logger_.info("EXISTS operation: key=" + key);
+    if (e == nullptr || isExpired(*e)) {
+        return false;
+    }
+    touch(*e);
+    return true;
 }
 
 bool KeyValueStore::expire(const string& key, int ttl_seconds) {
-    lock_guard<mutex> lock(mutex_);
-    auto it = store_.find(key);
-    if (it != store_.end()) {
-        it->second.expiry = chrono::system_clock::now() + chrono::seconds(ttl_seconds);
-        // logger_.info("EXPIRE operation: key=" + key + ", ttl=" + to_string(ttl_seconds));
-        return true;
+    return pexpire(key, int64_t(ttl_seconds) * 1000);
+}
+
+bool KeyValueStore::pexpire(const string& key, int64_t ttl_milliseconds) {
+    // A deadline past what int64_t holds is as good as never.
+    int64_t now = nowMillis();
+    if (ttl_milliseconds > numeric_limits<int64_t>::max() - now) {
+        return expireAt(key, numeric_limits<int64_t>::max());
     }
-    // logger_.info("EXPIRE operation: key=" + key + " (not found)");
-    return false;
+    return expireAt(key, now + ttl_milliseconds);
+}
+
+bool KeyValueStore::expireAt(string_view key, int64_t deadline) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    uint64_t logged;
+    {
+        lock_guard<mutex> lock(shard.mutex_);
+        freeze(shard);
+        Entry* e = shard.table_.find(key, h);
+        int64_t now = nowMillis();
+        if (e == nullptr || isExpired(*e, now)) {
+            // logger_.info("EXPIRE operation: key=" + string(key) + " (not found)");
+            return false;
+        }
+        if (deadline <= now) {
+            // Already past its deadline: no point waiting for the wheel.
+            unlink(shard, key, h);
+            retireEntry(shard, e);
+            logged = logWrite(LogOp::Del, key);
+        } else {
+            // Any timer from an earlier TTL is left to fire and be ignored.
+            e->expiry.store(deadline, memory_order_release);
+            shard.expiries_.schedule(string(key), deadline);
+            logged = logWrite(LogOp::Expire, key, string_view(), deadline);
+        }
+    }
+    awaitLog(logged);
+    // logger_.info("EXPIRE operation: key=" + string(key) + ", deadline=" + to_string(deadline));
+    return true;
 }
 
 optional<chrono::seconds> KeyValueStore::ttl(const string& key) {
-    lock_guard<mutex> lock(mutex_);
-    auto it = store_.find(key);
-    if (it != store_.end()) {
-        if (isExpired(it->second)) {
-            // logger_.info("TTL operation: key=" + key + " (expired)");
-            return nullopt;
-        }
-        auto now = chrono::system_clock::now();
-        auto ttl = chrono::duration_cast<chrono::seconds>(it->second.expiry - now);
-        // logger_.info("TTL operation: key=" + key + ", ttl=" + to_string(ttl.count()));
-        return ttl;
-    }
-    // logger_.info("TTL operation: key=" + key + " (not found)");
-    return nullopt;
+    auto remaining = pttl(key);
+    if (!remaining) {
+        return nullopt;
+    }
+    // Round to the nearest second so a fresh "EXPIRE k 10" reports 10.
+    return chrono::duration_cast<chrono::seconds>(*remaining + chrono::milliseconds(500));
+}
+
+optional<chrono::milliseconds> KeyValueStore::pttl(const string& key) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    EpochManager::Guard guard;
+    const Entry* e = shard.table_.find(key, h);
+    if (e == nullptr) {
+        // logger_.info("TTL operation: key=" + key + " (not found)");
+        return nullopt;
+    }
+    int64_t expiry = e->expiry.load(memory_order_acquire);
+    int64_t now = nowMillis();
+    if (expiry == 0 || now >= expiry) {
+        // logger_.info("TTL operation: key=" + key + " (expired or no TTL)");
+        return nullopt;
+    }
+    // logger_.info("TTL operation: key=" + key);
+    return chrono::milliseconds(expiry - now);
 }
 
 vector<string> KeyValueStore::keys() {
-    lock_guard<mutex> lock(mutex_);
     vector<string> result;
-    for (const auto& pair : store_) {
-        if (!isExpired(pair.second)) {
-            result.push_back(pair.first);
-        }
+    int64_t now = nowMillis();
+    for (auto& shard : shards_) {
+        lock_guard<mutex> lock(shard->mutex_);
+        shard->table_.forEach([&result, now, this](const Entry* e) {
+            if (!isExpired(*e, now)) {
+                result.push_back(string(e->key()));
+            }
+        });
     }
     // logger_.info("KEYS operation: returned " + to_string(result.size()) + " keys");
     return result;
 }
 
+uint64_t KeyValueStore::scan(uint64_t cursor, size_t count, vector<string>& out, string_view pattern) {
+    // The low bits of the cursor pick the shard, the rest is the shard
+    // table's own cursor.
+    size_t shardBits = 0;
+    while ((size_t(1) << shardBits) <= shardMask_) {
+        shardBits++;
+    }
+    size_t s = static_cast<size_t>(cursor) & shardMask_;
+    uint64_t tableCursor = cursor >> shardBits;
+    count = max<size_t>(count, 1);
+    size_t visited = 0;
+    // Sparse tables are walked a bounded number of groups per call too.
+    size_t groups = 0;
+    int64_t now = nowMillis();
+    while (visited < count && groups < count * 10) {
+        {
+            Shard& shard = *shards_[s];
+            lock_guard<mutex> lock(shard.mutex_);
+            do {
+                tableCursor = shard.table_.scan(tableCursor, [&](const Entry* e) {
+                    visited++;
+                    if (!isExpired(*e, now) && (pattern.empty() || matchPattern(pattern, e->key()))) {
+                        out.emplace_back(e->key());
+                    }
+                });
+                groups++;
+            } while (tableCursor != 0 && visited < count && groups < count * 10);
+        }
+        if (tableCursor != 0) {
+            break;
+        }
+        if (++s == shards_.size()) {
+            // logger_.info("SCAN operation: complete");
+            return 0;
+        }
+    }
+    return tableCursor << shardBits | s;
+}
+
+bool KeyValueStore::matchPattern(string_view pattern, string_view text) {
+    // Greedy matching that backtracks to the last star on a mismatch.
+    size_t p = 0, t = 0;
+    size_t starP = string_view::npos, starT = 0;
+    while (t < text.size()) {
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '*') {
+                starP = p++;
+                starT = t;
+                continue;
+            }
+            if (c == '?') {
+                p++;
+                t++;
+                continue;
+            }
+            if (c == '[') {
+                size_t end;
+                if (matchClass(pattern, p, text[t], end)) {
+                    p = end;
+                    t++;
+                    continue;
+                }
+            } else {
+                size_t next = p + 1;
+                if (c == '\\' && next < pattern.size()) {
+                    c = pattern[next++];
+                }
+                if (c == text[t]) {
+                    p = next;
+                    t++;
+                    continue;
+                }
+            }
+        }
+        if (starP == string_view::npos) {
+            return false;
+        }
+        p = starP + 1;
+        t = ++starT;
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+bool KeyValueStore::prefix(string_view prefix, size_t limit, vector<string>& out) {
+    return orderedKeys(prefix, [prefix](string_view key) {
+        return key.substr(0, prefix.size()) == prefix;
+    }, limit, out);
+}
+
+bool KeyValueStore::range(string_view from, string_view to, size_t limit, vector<string>& out) {
+    return orderedKeys(from, [to](string_view key) { return key <= to; }, limit, out);
+}
+
+// Every shard's index holds its own slice of the keyspace in order, so the
+// answer is a merge of the shards' runs from the lower bound on. Each run
+// is read a batch at a time under the shard's lock and resumed after its
+// last key when the merge has used it up; batches are sized so most shards
+// are read once, which keeps a LIMIT query close to limit keys copied.
+bool KeyValueStore::orderedKeys(string_view from, const function<bool(string_view)>& inRange, size_t limit,
+                                vector<string>& out) {
+    if (!orderedIndex_) {
+        return false;
+    }
+    if (limit == 0) {
+        limit = SIZE_MAX;
+    }
+    size_t batch = limit == SIZE_MAX ? ORDERED_BATCH_MAX
+                                     : min(limit, max(ORDERED_BATCH_MIN, limit / shards_.size() * 2));
+    struct Run {
+        vector<string> keys;
+        size_t next = 0;
+        bool done = false;
+    };
+    vector<Run> runs(shards_.size());
+    int64_t now = nowMillis();
+    // Reads the next batch of shard s, from the lower bound or after the
+    // key the previous batch ended with. False if the shard is not indexed.
+    auto fill = [&](size_t s, string_view start, bool after) {
+        Run& run = runs[s];
+        run.keys.clear();
+        run.next = 0;
+        Shard& shard = *shards_[s];
+        lock_guard<mutex> lock(shard.mutex_);
+        if (!shard.indexed_) {
+            return false;
+        }
+        run.done = true;
+        shard.index_.forEachFrom(start, [&](const Entry* e) {
+            string_view key = e->key();
+            if (after && key == start) {
+                return true;
+            }
+            if (!inRange(key)) {
+                return false;
+            }
+            if (isExpired(*e, now)) {
+                return true;
+            }
+            if (run.keys.size() == batch) {
+                run.done = false;
+                return false;
+            }
+            run.keys.emplace_back(key);
+            return true;
+        });
+        return true;
+    };
+
+    auto greater = [&runs](size_t a, size_t b) { return runs[a].keys[runs[a].next] > runs[b].keys[runs[b].next]; };
+    vector<size_t> heap;
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        if (!fill(s, from, false)) {
+            return false;
+        }
+        if (!runs[s].keys.empty()) {
+            heap.push_back(s);
+        }
+    }
+    make_heap(heap.begin(), heap.end(), greater);
+    size_t returned = 0;
+    while (returned < limit && !heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), greater);
+        size_t s = heap.back();
+        Run& run = runs[s];
+        out.push_back(run.keys[run.next++]);
+        returned++;
+        if (run.next == run.keys.size()) {
+            if (!run.done) {
+                string last = move(run.keys.back());
+                if (!fill(s, last, true)) {
+                    return false;
+                }
+            }
+            if (run.next == run.keys.size()) {
+                heap.pop_back();
+                continue;
+            }
+        }
+        push_heap(heap.begin(), heap.end(), greater);
+    }
+    // logger_.info("ORDERED operation: returned " + to_string(returned) + " keys");
+    return true;
+}
+
+void KeyValueStore::setOrderedIndex(bool enabled) {
+    lock_guard<mutex> toggle(orderedIndexMutex_);
+    if (!enabled) {
+        orderedIndex_ = false;
+    }
+    // A shard at a time, so writers to the others carry on meanwhile.
+    for (auto& shard : shards_) {
+        lock_guard<mutex> lock(shard->mutex_);
+        if (shard->indexed_ != enabled) {
+            shard->indexed_ = enabled;
+            rebuildIndex(*shard);
+        }
+    }
+    orderedIndex_ = enabled;
+    // logger_.info(string("Ordered index ") + (enabled ? "on" : "off"));
+}
+
 void KeyValueStore::clear() {
-    lock_guard<mutex> lock(mutex_);
-    store_.clear();
-    memoryUsage_ = 0;
+    uint64_t logged;
+    {
+        // All shards at once, so the log's CLEAR cannot land between a
+        // write and the shard it went to being emptied.
+        auto locks = lockAll();
+        for (auto& shard : shards_) {
+            freeze(*shard);
+            retireContents(*shard, shard->table_.detach(), 0);
+            rebuildIndex(*shard);
+            shard->expiries_.clear();
+            shard->due_.clear();
+        }
+        logged = logWrite(LogOp::Clear, string_view());
+    }
+    awaitLog(logged);
     totalOperations_++;
     // logger_.info("CLEAR operation: all keys removed");
 }
 
-bool KeyValueStore::save(const string& filename) {
-    lock_guard<mutex> lock(mutex_);
-    ofstream file(filename);
-    if (!file) {
-        // logger_.error("SAVE operation: failed to open file " + filename);
-        return false;
+// Snapshots are copy-on-write at shard granularity. Starting one marks
+// every shard at a single instant; the first writer to touch a marked shard,
+// or the snapshot itself if it gets there first, copies the shard's entry
+// pointers before anything changes. The snapshot thread pins an epoch
+// before marking, so the entries those pointers name are not freed until it
+// is done with them, whatever happens to them in the table meanwhile.
+bool KeyValueStore::claimSnapshot() {
+    bool expected = false;
+    return snapshotInProgress_.compare_exchange_strong(expected, true);
+}
+
+// Marks every shard with all of them locked at once, so the snapshot is a
+// single point in time across shards. Returns that time. With
+// beginLogRewrite, that point is also where the rewritten log ends and the
+// records kept for it begin: no write can be logged while the locks are
+// held.
+int64_t KeyValueStore::captureSnapshot(bool beginLogRewrite) {
+    auto locks = lockAll();
+    size_t total = 0;
+    for (auto& shard : shards_) {
+        shard->snapshotPending_ = true;
+        total += shard->table_.size();
+    }
+    if (beginLogRewrite) {
+        appendLog_.beginRewrite();
+    }
+    snapshotKeysWritten_ = 0;
+    snapshotKeysTotal_ = total;
+    return nowMillis();
+}
+
+// For FLUSH: takes every shard's contents for the file and empties it in
+// one step, so no write can fall between the two. Sets logged to the
+// offset of the CLEAR record, for the caller to await once unlocked.
+int64_t KeyValueStore::captureAndClear(uint64_t& logged) {
+    auto locks = lockAll();
+    size_t total = 0;
+    for (auto& shard : shards_) {
+        // A background save is never running here; the snapshot is claimed.
+        collect(*shard, shard->frozen_);
+        total += shard->frozen_.size();
+        retireContents(*shard, shard->table_.detach(), 0);
+        rebuildIndex(*shard);
+        shard->expiries_.clear();
+        shard->due_.clear();
+    }
+    logged = logWrite(LogOp::Clear, string_view());
+    snapshotKeysWritten_ = 0;
+    snapshotKeysTotal_ = total;
+    return nowMillis();
+}
+
+void KeyValueStore::releaseSnapshot() {
+    // Shards left unwritten by a failed snapshot must not keep copying.
+    for (auto& shard : shards_) {
+        lock_guard<mutex> lock(shard->mutex_);
+        shard->snapshotPending_ = false;
+        vector<Frozen>().swap(shard->frozen_);
+    }
+    snapshotInProgress_ = false;
+}
+
+// Called with the shard locked before any change to its table or to an
+// entry's expiry.
+void KeyValueStore::freeze(Shard& shard) {
+    if (shard.snapshotPending_) {
+        collect(shard, shard.frozen_);
+        shard.snapshotPending_ = false;
+    }
+}
+
+void KeyValueStore::collect(const Shard& shard, vector<Frozen>& out) {
+    out.reserve(out.size() + shard.table_.size());
+    shard.table_.forEach([&out](const Entry* e) {
+        out.push_back({e, e->expiry.load(memory_order_acquire)});
+    });
+}
+
+bool KeyValueStore::writeShard(const vector<Frozen>& frozen, ofstream& file, int64_t now) {
+    for (const Frozen& f : frozen) {
+        if (f.expiry == 0 || now < f.expiry) {
+            file << f.entry->key() << " " << f.entry->value() << "\n";
+        }
     }
-    
-    for (const auto& pair : store_) {
-        if (!isExpired(pair.second)) {
-            file << pair.first << " " << pair.second.value << "\n";
+    return static_cast<bool>(file);
+}
+
+bool KeyValueStore::writeShard(const vector<Frozen>& frozen, SnapshotWriter& writer, int64_t now, int64_t unixOffset) {
+    for (const Frozen& f : frozen) {
+        if (f.expiry == 0 || now < f.expiry) {
+            // Steady-clock deadlines mean nothing to another process, so
+            // the file carries wall-clock ones.
+            writer.add(f.entry->key(), f.entry->value(), f.expiry == 0 ? 0 : f.expiry + unixOffset);
         }
     }
-    
+    return writer.ok();
+}
+
+// Hands each shard's captured contents to write() in turn, taking them over
+// first if the shard has not changed since the capture. False if write()
+// fails or the store is shutting down.
+bool KeyValueStore::forEachFrozenShard(const function<bool(const vector<Frozen>&)>& write) {
+    vector<Frozen> frozen;
+    for (auto& shard : shards_) {
+        if (!running_) {
+            return false;
+        }
+        {
+            lock_guard<mutex> lock(shard->mutex_);
+            freeze(*shard);
+            frozen.swap(shard->frozen_);
+        }
+        if (!write(frozen)) {
+            return false;
+        }
+        snapshotKeysWritten_ += frozen.size();
+        frozen.clear();
+    }
+    return true;
+}
+
+// Writes every shard to a temporary file that replaces filename only once
+// complete. Once the file is open, capture() fixes what is written by
+// filling the shards' frozen_ lists or marking them for freeze(), and
+// returns the time at which keys count as expired. No lock is held while
+// writing.
+bool KeyValueStore::writeSnapshot(const string& filename, SnapshotFormat format,
+                                  const function<int64_t()>& capture) {
+    string partial = filename + ".tmp";
+    bool written = false;
+    {
+        unique_ptr<SnapshotWriter> writer;
+        ofstream text;
+        if (format == SnapshotFormat::Binary) {
+            writer = make_unique<SnapshotWriter>(partial);
+        } else {
+            text.open(partial);
+        }
+        if (writer ? !writer->ok() : !text) {
+            // logger_.error("SAVE operation: failed to open file " + filename);
+            return false;
+        }
+        int64_t unixOffset = unixMillis() - nowMillis();
+
+        // Pinned before the capture, so nothing captured is freed before it
+        // has been written.
+        EpochManager::Guard guard;
+        int64_t now = capture();
+        written = forEachFrozenShard([&](const vector<Frozen>& frozen) {
+            return writer ? writeShard(frozen, *writer, now, unixOffset) : writeShard(frozen, text, now);
+        });
+        if (written) {
+            written = writer ? writer->finish() : static_cast<bool>(text.flush());
+        }
+    }
+    error_code ec;
+    if (written) {
+        filesystem::rename(partial, filename, ec);
+    }
+    if (!written || ec) {
+        filesystem::remove(partial, ec);
+        return false;
+    }
+    return true;
+}
+
+bool KeyValueStore::save(const string& filename, SnapshotFormat format) {
+    if (!claimSnapshot()) {
+        // logger_.warning("SAVE operation: a snapshot is already in progress");
+        return false;
+    }
+    bool saved = writeSnapshot(filename, format, [this] { return captureSnapshot(); });
+    releaseSnapshot();
+    if (saved) {
+        lastSaveTime_ = unixMillis() / 1000;
+    }
     // logger_.info("SAVE operation: saved to " + filename);
+    return saved;
+}
+
+bool KeyValueStore::bgsave(const string& filename, SnapshotFormat format) {
+    if (!claimSnapshot()) {
+        // logger_.warning("BGSAVE operation: a snapshot is already in progress");
+        return false;
+    }
+    if (snapshotThread_.joinable()) {
+        snapshotThread_.join();  // the previous save, already finished
+    }
+    bgsaveInProgress_ = true;
+    promise<void> captured;
+    future<void> capturedFuture = captured.get_future();
+    snapshotThread_ = thread([this, filename, format, captured = move(captured)]() mutable {
+        auto start = chrono::steady_clock::now();
+        bool signalled = false;
+        bool saved = writeSnapshot(filename, format, [this, &captured, &signalled] {
+            int64_t now = captureSnapshot();
+            captured.set_value();
+            signalled = true;
+            return now;
+        });
+        if (!signalled) {
+            captured.set_value();  // the file could not be created
+        }
+        releaseSnapshot();
+        if (saved) {
+            lastSaveTime_ = unixMillis() / 1000;
+        }
+        lastBgsaveMillis_ = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        lastBgsaveOk_ = saved;
+        bgsaveAttempted_ = true;
+        bgsaveInProgress_ = false;
+        // logger_.info("BGSAVE operation: " + string(saved ? "saved to " : "failed to save to ") + filename);
+    });
+    capturedFuture.wait();
     return true;
 }
 
-bool KeyValueStore::load(const string& filename) {
-    lock_guard<mutex> lock(mutex_);
+bool KeyValueStore::load(const string& filename, size_t threads) {
+    if (SnapshotReader::isSnapshot(filename)) {
+        return loadBinary(filename, threads);
+    }
+    return loadText(filename);
+}
+
+bool KeyValueStore::loadText(const string& filename) {
     ifstream file(filename);
     if (!file) {
         // logger_.error("LOAD operation: failed to open file " + filename);
         return false;
     }
-    
-    store_.clear();
-    memoryUsage_ = 0;
+
+    // Parse the whole file into per-shard entry lists without holding any
+    // lock; installBatches then publishes each shard under its lock alone.
+    vector<vector<Entry*>> batches(shards_.size());
     string key, value;
     while (file >> key >> value) {
-        Value v;
-        v.value = value;
-        store_[key] = v;
-        memoryUsage_ += key.size() + value.size();
+        uint64_t h = hashKey(key);
+        size_t s = static_cast<size_t>(h >> 32) & shardMask_;
+        batches[s].push_back(Entry::create(shards_[s]->slabs_, h, key, value, 0));
     }
-    
+    installBatches(batches);
+
     // logger_.info("LOAD operation: loaded from " + filename);
     return true;
 }
 
-bool KeyValueStore::flush(const string& filename) {
-    lock_guard<mutex> lock(mutex_);
-    ofstream file(filename);
-    if (!file) {
-        // logger_.error("FLUSH operation: failed to open file " + filename);
+bool KeyValueStore::loadBinary(const string& filename, size_t threads) {
+    SnapshotReader reader;
+    if (!reader.open(filename)) {
+        // logger_.error("LOAD operation: " + filename + " is missing, truncated or of an unknown version");
+        return false;
+    }
+
+    // Blocks are checksummed and decoded independently, so the file is cut
+    // into segments of consecutive blocks, each sorted by shard on its own.
+    // Nothing is allocated for the store until every block has checked out.
+    struct Pending {
+        SnapshotRecord record;
+        uint64_t hash;
+    };
+    size_t segments = min(reader.blockCount(), max<size_t>(threads, 1) * 4);
+    vector<vector<vector<Pending>>> parts(segments, vector<vector<Pending>>(shards_.size()));
+    size_t perShard = reader.keyCount() / max<size_t>(segments, 1) / shards_.size();
+    int64_t unixNow = unixMillis();
+    atomic<bool> intact(true);
+    bool ran = parallelFor(threads, segments, [&](size_t segment) {
+        auto& byShard = parts[segment];
+        for (auto& pending : byShard) {
+            pending.reserve(perShard + perShard / 8 + 16);
+        }
+        size_t first = reader.blockCount() * segment / segments;
+        size_t last = reader.blockCount() * (segment + 1) / segments;
+        for (size_t b = first; b < last && intact; ++b) {
+            bool ok = reader.decodeBlock(b, [&](const SnapshotRecord& record) {
+                if (record.expiresAtMs == 0 || record.expiresAtMs > unixNow) {
+                    uint64_t h = hashKey(record.key);
+                    byShard[static_cast<size_t>(h >> 32) & shardMask_].push_back({record, h});
+                }
+            });
+            if (!ok) {
+                intact = false;
+            }
+        }
+    });
+    if (!ran || !intact) {
+        // A corrupt block leaves the store as it was.
+        // logger_.error("LOAD operation: checksum mismatch in " + filename);
         return false;
     }
-    
-    for (const auto& pair : store_) {
-        if (!isExpired(pair.second)) {
-            file << pair.first << " " << pair.second.value << "\n";
+
+    // Each shard's table is then built by one worker, from its own slabs,
+    // taking the segments in file order so later records win.
+    int64_t steadyOffset = nowMillis() - unixNow;
+    vector<LoadedShard> loaded(shards_.size());
+    ran = parallelFor(threads, shards_.size(), [&](size_t s) {
+        size_t count = 0;
+        for (auto& byShard : parts) {
+            count += byShard[s].size();
         }
+        loaded[s].table.reserve(count);
+        for (auto& byShard : parts) {
+            for (const Pending& p : byShard[s]) {
+                int64_t expiry = p.record.expiresAtMs == 0 ? 0 : p.record.expiresAtMs + steadyOffset;
+                addLoaded(s, Entry::create(shards_[s]->slabs_, p.hash, p.record.key, p.record.value, expiry), loaded[s]);
+            }
+            vector<Pending>().swap(byShard[s]);
+        }
+    });
+    if (!ran) {
+        for (size_t s = 0; s < loaded.size(); ++s) {
+            loaded[s].table.forEach([this, s](Entry* e) { Entry::destroy(shards_[s]->slabs_, e); });
+        }
+        // logger_.error("LOAD operation: out of memory loading " + filename);
+        return false;
+    }
+    installShards(loaded);
+
+    // logger_.info("LOAD operation: loaded from " + filename);
+    return true;
+}
+
+// Adds a loaded entry to the table being built for shard s. Later records
+// override earlier ones, as with the old map assignment.
+void KeyValueStore::addLoaded(size_t s, Entry* e, LoadedShard& out) {
+    e->access.store(accessClock_.load(memory_order_relaxed) << 8 | LFU_INIT, memory_order_relaxed);
+    Entry* replaced = out.table.upsert(e, [](Table::Array* a) { delete a; });
+    out.entryBytes += footprint(e);
+    if (replaced != nullptr) {
+        out.entryBytes -= footprint(replaced);
+        Entry::destroy(shards_[s]->slabs_, replaced);
+    }
+    int64_t expiry = e->expiry.load(memory_order_relaxed);
+    if (expiry != 0) {
+        out.timers.push_back({string(e->key()), expiry});
+    }
+}
+
+void KeyValueStore::installBatches(vector<vector<Entry*>>& batches) {
+    vector<LoadedShard> loaded(shards_.size());
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        loaded[s].table.reserve(batches[s].size());
+        for (Entry* e : batches[s]) {
+            addLoaded(s, e, loaded[s]);
+        }
+        vector<Entry*>().swap(batches[s]);
+    }
+    installShards(loaded);
+}
+
+// Swaps every shard's privately built table in at once, replacing the
+// store's contents and expiry timers.
+void KeyValueStore::installShards(vector<LoadedShard>& loaded) {
+    uint64_t logged;
+    {
+        auto locks = lockAll();
+        // The log gets the loaded contents as if they had been written.
+        logged = logWrite(LogOp::Clear, string_view());
+        for (size_t s = 0; s < shards_.size(); ++s) {
+            Shard& shard = *shards_[s];
+            freeze(shard);
+            retireContents(shard, shard.table_.adopt(loaded[s].table), loaded[s].entryBytes);
+            rebuildIndex(shard);
+            shard.expiries_.clear();
+            shard.due_.clear();
+            for (auto& timer : loaded[s].timers) {
+                shard.expiries_.schedule(move(timer.key), timer.deadline);
+            }
+            if (appendLog_.isOpen()) {
+                shard.table_.forEach([this, &logged](const Entry* e) {
+                    logged = logWrite(LogOp::Set, e->key(), e->value(), e->expiry.load(memory_order_relaxed));
+                });
+            }
+        }
+    }
+    awaitLog(logged);
+}
+
+bool KeyValueStore::flush(const string& filename, SnapshotFormat format) {
+    if (!claimSnapshot()) {
+        // logger_.warning("FLUSH operation: a snapshot is already in progress");
+        return false;
+    }
+    // The store is emptied only once the file could be created; the
+    // contents are written from the captured lists afterwards.
+    uint64_t logged = 0;
+    bool flushed = writeSnapshot(filename, format, [this, &logged] { return captureAndClear(logged); });
+    releaseSnapshot();
+    awaitLog(logged);
+    if (flushed) {
+        lastSaveTime_ = unixMillis() / 1000;
     }
-    
-    store_.clear();
-    memoryUsage_ = 0;
     // logger_.info("FLUSH operation: flushed to " + filename);
+    return flushed;
+}
+
+bool KeyValueStore::openAppendLog(const string& filename, FsyncPolicy policy) {
+    uint64_t validBytes = 0;
+    error_code ec;
+    if (filesystem::exists(filename, ec)) {
+        AppendLogReader reader;
+        if (!reader.open(filename)) {
+            // logger_.error("Append log " + filename + " is not a log of a known version");
+            return false;
+        }
+        int64_t unixNow = unixMillis();
+        int64_t steadyOffset = nowMillis() - unixNow;
+        if (!reader.forEach([&](const LogRecord& record) { replay(record, unixNow, steadyOffset); })) {
+            // logger_.error("Append log " + filename + " is corrupt at offset " + to_string(reader.validBytes()));
+            return false;
+        }
+        validBytes = reader.validBytes();
+        // The reader's mapping must be gone before the file can be truncated.
+    }
+    return appendLog_.open(filename, policy, validBytes);
+}
+
+void KeyValueStore::replay(const LogRecord& record, int64_t unixNow, int64_t steadyOffset) {
+    switch (record.op) {
+        case LogOp::Set:
+            if (record.deadline != 0 && record.deadline <= unixNow) {
+                // Expired while the log sat on disk; it replaces any older value.
+                del(string(record.key));
+            } else {
+                put(record.key, record.value, record.deadline == 0 ? 0 : record.deadline + steadyOffset);
+            }
+            break;
+        case LogOp::Del:
+            del(string(record.key));
+            break;
+        case LogOp::Expire:
+            expireAt(record.key, record.deadline + steadyOffset);
+            break;
+        case LogOp::Clear:
+            clear();
+            break;
+    }
+}
+
+uint64_t KeyValueStore::logWrite(LogOp op, string_view key, string_view value, int64_t expiry) {
+    if (!appendLog_.isOpen()) {
+        return 0;
+    }
+    // Steady-clock deadlines mean nothing after a restart, so the log
+    // carries wall-clock ones.
+    int64_t deadline = expiry == 0 ? 0 : expiry + unixMillis() - nowMillis();
+    return appendLog_.append(op, key, value, deadline);
+}
+
+// Under FsyncPolicy::Always, waits for the sync covering offset; called
+// after the shard lock is released so writers share syncs.
+void KeyValueStore::awaitLog(uint64_t offset) {
+    if (offset != 0) {
+        appendLog_.waitDurable(offset);
+    }
+}
+
+bool KeyValueStore::bgrewriteaof() {
+    if (!appendLog_.isOpen() || !claimSnapshot()) {
+        // logger_.warning("BGREWRITEAOF operation: logging is off or a snapshot is in progress");
+        return false;
+    }
+    if (snapshotThread_.joinable()) {
+        snapshotThread_.join();  // the previous save or rewrite, already finished
+    }
+    rewriteInProgress_ = true;
+    snapshotThread_ = thread([this] {
+        auto start = chrono::steady_clock::now();
+        bool rewritten = rewriteAppendLog();
+        releaseSnapshot();
+        if (!rewritten) {
+            rewriteRetryAt_ = nowMillis() + REWRITE_RETRY_MILLIS;
+        }
+        lastRewriteMillis_ = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        lastRewriteOk_ = rewritten;
+        rewriteAttempted_ = true;
+        rewriteInProgress_ = false;
+        // logger_.info("BGREWRITEAOF operation: " + string(rewritten ? "done" : "failed"));
+    });
     return true;
 }
 
+// Writes a SET for every key live at the capture point to a new log file,
+// then lets the log add the records appended since and swap the file in.
+// Shards are captured as for a snapshot, so writers only ever wait for a
+// shard's table to be copied, never for the file.
+bool KeyValueStore::rewriteAppendLog() {
+    if (!appendLog_.openRewrite()) {
+        return false;
+    }
+    int64_t unixOffset = unixMillis() - nowMillis();
+    EpochManager::Guard guard;
+    int64_t now = captureSnapshot(true);
+    string records;
+    records.reserve(REWRITE_WRITE_BYTES + 4096);
+    bool written = forEachFrozenShard([&](const vector<Frozen>& frozen) {
+        for (const Frozen& f : frozen) {
+            if (f.expiry != 0 && now >= f.expiry) {
+                continue;
+            }
+            AppendLog::encode(records, LogOp::Set, f.entry->key(), f.entry->value(),
+                              f.expiry == 0 ? 0 : f.expiry + unixOffset);
+            if (records.size() >= REWRITE_WRITE_BYTES) {
+                if (!appendLog_.writeRewrite(records)) {
+                    return false;
+                }
+                records.clear();
+            }
+        }
+        return true;
+    });
+    if (!written || !appendLog_.writeRewrite(records) || !appendLog_.finishRewrite()) {
+        appendLog_.abortRewrite();
+        return false;
+    }
+    return true;
+}
+
+// Whether the log has grown enough since its last rewrite for the cleaner
+// to start another.
+bool KeyValueStore::autoRewriteDue() {
+    uint32_t percentage = autoRewritePercentage_;
+    if (percentage == 0 || !appendLog_.isOpen() || rewriteInProgress_ || nowMillis() < rewriteRetryAt_) {
+        return false;
+    }
+    uint64_t size = appendLog_.size();
+    uint64_t base = appendLog_.baseSize();
+    return size >= autoRewriteMinBytes_ && size >= base + base * percentage / 100;
+}
+
 StoreStats KeyValueStore::getStats() {
-    lock_guard<mutex> lock(mutex_);
     StoreStats stats;
     stats.totalOperations = totalOperations_;
     stats.memoryUsage = memoryUsage_;
     stats.activeThreads = activeThreads_;
-    stats.totalKeys = store_.size();
+    stats.totalKeys = 0;
+    for (auto& shard : shards_) {
+        lock_guard<mutex> lock(shard->mutex_);
+        stats.totalKeys += shard->table_.size();
+    }
+    stats.shardCount = shards_.size();
+    stats.maxMemory = maxMemory_;
+    stats.evictedKeys = evictedKeys_;
+    stats.rejectedWrites = rejectedWrites_;
+    stats.bgsaveInProgress = bgsaveInProgress_;
+    stats.bgsaveKeysWritten = snapshotKeysWritten_;
+    stats.bgsaveKeysTotal = snapshotKeysTotal_;
+    stats.lastSaveTime = lastSaveTime_;
+    stats.bgsaveAttempted = bgsaveAttempted_;
+    stats.lastBgsaveOk = lastBgsaveOk_;
+    stats.lastBgsaveMillis = lastBgsaveMillis_;
+    stats.appendLogEnabled = appendLog_.isOpen();
+    stats.appendLogHealthy = appendLog_.healthy();
+    stats.fsyncPolicy = appendLog_.policy();
+    stats.appendLogBytes = stats.appendLogEnabled ? appendLog_.size() : 0;
+    stats.appendLogBaseBytes = stats.appendLogEnabled ? appendLog_.baseSize() : 0;
+    stats.rewriteInProgress = rewriteInProgress_;
+    stats.rewriteAttempted = rewriteAttempted_;
+    stats.lastRewriteOk = lastRewriteOk_;
+    stats.lastRewriteMillis = lastRewriteMillis_;
     // logger_.info("STATS operation: retrieved statistics");
     return stats;
 }
 
 void KeyValueStore::cleanerLoop() {
     while (running_) {
-        {
-            lock_guard<mutex> lock(mutex_);
-            for (auto it = store_.begin(); it != store_.end();) {
-                if (isExpired(it->second)) {
-                    memoryUsage_ -= it->first.size() + it->second.value.size();
-                    it = store_.erase(it);
-                    // logger_.info("Cleaner: removed expired key");
-                } else {
-                    ++it;
-                }
+        // One shard at a time, and only the keys whose timers have fired, so
+        // a pass costs the same whether the store holds a thousand keys or
+        // twenty million.
+        for (auto& shard : shards_) {
+            if (!running_) {
+                break;
             }
+            accessClock_.store(accessClockNow(), memory_order_relaxed);
+            lock_guard<mutex> lock(shard->mutex_);
+            expireDue(*shard, nowMillis());
+            reclaim(*shard);
+        }
+        if (running_ && autoRewriteDue()) {
+            bgrewriteaof();
         }
-        this_thread::sleep_for(chrono::seconds(1));
+        this_thread::sleep_for(EXPIRY_TICK);
     }
 }
 
-bool KeyValueStore::isExpired(const Value& value) const {
-    if (value.expiry == chrono::system_clock::time_point()) {
-        return false;
+void KeyValueStore::expireDue(Shard& shard, int64_t now) {
+    shard.expiries_.advance(now, shard.due_);
+    if (!shard.due_.empty()) {
+        freeze(shard);
+    }
+    // A burst of simultaneous deadlines is worked off over several passes;
+    // readers already treat the leftover keys as gone.
+    size_t budget = EXPIRY_BATCH;
+    while (!shard.due_.empty() && budget-- > 0) {
+        TimingWheel::Timer& timer = shard.due_.back();
+        uint64_t h = hashKey(timer.key);
+        const Entry* e = shard.table_.find(timer.key, h);
+        // The timer may be stale: the key deleted, rewritten without a TTL,
+        // or given a later deadline with a timer of its own.
+        if (e != nullptr && isExpired(*e, now)) {
+            Entry* old = unlink(shard, timer.key, h);
+            retireEntry(shard, old);
+            // logger_.info("Cleaner: removed expired key");
+        }
+        shard.due_.pop_back();
     }
-    return chrono::system_clock::now() >= value.expiry;
+}
+
+MemoryStats KeyValueStore::memoryStats() {
+    MemoryStats stats = {};
+    for (auto& shard : shards_) {
+        lock_guard<mutex> lock(shard->mutex_);
+        size_t tableBytes = shard->table_.array()->bytes();
+        stats.tableBytes += tableBytes;
+        stats.indexBytes += shard->indexBytes_;
+        stats.entryBytes += shard->bytes_ - tableBytes - shard->indexBytes_;
+        stats.timerBytes += shard->expiries_.bytes();
+        for (const auto& r : shard->retired_) {
+            stats.pendingReclaimBytes += r.bytes;
+        }
+        stats.slabBytes += shard->slabs_.slabBytes();
+        stats.totalKeys += shard->table_.size();
+    }
+    stats.usedBytes = stats.entryBytes + stats.tableBytes + stats.indexBytes;
+    stats.arenaBytes = arena_.reservedBytes();
+    stats.residentBytes = MemoryInfo::residentBytes();
+    return stats;
+}
+
+optional<size_t> KeyValueStore::memoryUsageOf(const string& key) {
+    uint64_t h = hashKey(key);
+    Shard& shard = shardFor(h);
+    lock_guard<mutex> lock(shard.mutex_);
+    const Entry* e = shard.table_.find(key, h);
+    if (e == nullptr || isExpired(*e)) {
+        return nullopt;
+    }
+    // The table and index are shared by every key in the shard, so each
+    // carries an equal slice of them, empty slots included.
+    return footprint(e) + (shard.table_.array()->bytes() + shard.indexBytes_) / shard.table_.size();
+}
+
+optional<EvictionPolicy> KeyValueStore::parseEvictionPolicy(const string& name) {
+    for (EvictionPolicy policy : {EvictionPolicy::NoEviction, EvictionPolicy::AllKeysLru,
+                                  EvictionPolicy::AllKeysLfu, EvictionPolicy::VolatileTtl}) {
+        if (name == evictionPolicyName(policy)) {
+            return policy;
+        }
+    }
+    return nullopt;
+}
+
+const char* KeyValueStore::evictionPolicyName(EvictionPolicy policy) {
+    switch (policy) {
+        case EvictionPolicy::AllKeysLru: return "allkeys-lru";
+        case EvictionPolicy::AllKeysLfu: return "allkeys-lfu";
+        case EvictionPolicy::VolatileTtl: return "volatile-ttl";
+        case EvictionPolicy::NoEviction: break;
+    }
+    return "noeviction";
+}
+
+bool KeyValueStore::makeRoom(size_t bytes) {
+    size_t limit = maxMemory_.load(memory_order_relaxed);
+    if (limit == 0) {
+        return true;
+    }
+    while (memoryUsage_.load(memory_order_relaxed) + bytes > limit) {
+        if (policy_.load(memory_order_relaxed) == EvictionPolicy::NoEviction || !evictOne()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool KeyValueStore::evictOne() {
+    EvictionPolicy policy = policy_.load(memory_order_relaxed);
+    uint32_t clock = accessClock_.load(memory_order_relaxed);
+    // Shards are sampled in turn so concurrent writers spread their
+    // evictions instead of all draining the same shard.
+    for (size_t attempt = 0; attempt < shards_.size(); ++attempt) {
+        Shard& shard = *shards_[evictionCursor_.fetch_add(1, memory_order_relaxed) & shardMask_];
+        unique_lock<mutex> lock(shard.mutex_);
+        Entry* victim = nullptr;
+        uint64_t best = 0;
+        shard.table_.sample(nextRandom, EVICTION_SAMPLES, [&](Entry* e) {
+            uint64_t score = evictionScore(*e, policy, clock);
+            if (score > best) {
+                best = score;
+                victim = e;
+            }
+        });
+        if (victim == nullptr) {
+            continue;
+        }
+        freeze(shard);
+        uint64_t logged = logWrite(LogOp::Del, victim->key());
+        unlink(shard, victim->key(), victim->hash);
+        retireEntry(shard, victim);
+        evictedKeys_++;
+        // Durable before the write that made room for itself is.
+        lock.unlock();
+        awaitLog(logged);
+        return true;
+    }
+    return false;
+}
+
+uint64_t KeyValueStore::evictionScore(const Entry& entry, EvictionPolicy policy, uint32_t clock) {
+    uint32_t access = entry.access.load(memory_order_relaxed);
+    switch (policy) {
+        case EvictionPolicy::AllKeysLru:
+            return uint64_t(idleSeconds(access, clock)) + 1;
+        case EvictionPolicy::AllKeysLfu:
+            // Least frequently used first, the longest idle among equals.
+            return (uint64_t(255 - decayedCounter(access, clock)) << 24 | idleSeconds(access, clock)) + 1;
+        case EvictionPolicy::VolatileTtl: {
+            int64_t expiry = entry.expiry.load(memory_order_relaxed);
+            return expiry == 0 ? 0 : UINT64_MAX - static_cast<uint64_t>(expiry);
+        }
+        case EvictionPolicy::NoEviction:
+            break;
+    }
+    return 0;
+}
+
+void KeyValueStore::touch(const Entry& entry) const {
+    uint32_t access = entry.access.load(memory_order_relaxed);
+    uint32_t clock = accessClock_.load(memory_order_relaxed);
+    uint32_t counter = decayedCounter(access, clock);
+    if (counter < 255) {
+        uint32_t base = counter > LFU_INIT ? counter - LFU_INIT : 0;
+        // Increment with probability 1 / (base * LFU_LOG_FACTOR + 1).
+        if (nextRandom() % (base * LFU_LOG_FACTOR + 1) == 0) {
+            counter++;
+        }
+    }
+    uint32_t updated = (clock & ACCESS_CLOCK_MASK) << 8 | counter;
+    // Skip the store when nothing changed so hot keys read by many threads
+    // do not keep bouncing their cache line.
+    if (updated != access) {
+        entry.access.store(updated, memory_order_relaxed);
+    }
+}
+
+uint32_t KeyValueStore::accessClockNow() {
+    return static_cast<uint32_t>(nowMillis() / 1000) & ACCESS_CLOCK_MASK;
+}
+
+int64_t KeyValueStore::unixMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int64_t KeyValueStore::nowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool KeyValueStore::isExpired(const Entry& entry) const {
+    // Only entries with a TTL pay for reading the clock.
+    int64_t expiry = entry.expiry.load(memory_order_acquire);
+    return expiry != 0 && nowMillis() >= expiry;
+}
+
+bool KeyValueStore::isExpired(const Entry& entry, int64_t now) const {
+    int64_t expiry = entry.expiry.load(memory_order_acquire);
+    return expiry != 0 && now >= expiry;
 }
@@ -0,0 +1,45 @@
+#include "MemoryInfo.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#include <unistd.h>
+#include <fstream>
+#endif
+
+using namespace std;
+
+size_t MemoryInfo::usableSize(const void* ptr) {
+#if defined(_WIN32)
+    return _msize(const_cast<void*>(ptr));
+#elif defined(__APPLE__)
+    return malloc_size(ptr);
+#else
+    return malloc_usable_size(const_cast<void*>(ptr));
+#endif
+}
+
+size_t MemoryInfo::residentBytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.WorkingSetSize;
+    }
+    return 0;
+#elif defined(__APPLE__)
+    return 0;
+#else
+    // statm reports sizes in pages: total program size, then resident.
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident) {
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+    return 0;
+#endif
+}
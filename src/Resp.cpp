@@ -0,0 +1,311 @@
+#include "Resp.h"
+#include <charconv>
+#include <cstring>
+
+// Define RESP_PORTABLE to force the scalar line scanner.
+#if defined(RESP_PORTABLE)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define RESP_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RESP_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+    bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+
+    // A length line is a sign and at most 19 digits; anything longer
+    // without its "\r\n" is not one.
+    const size_t MAX_LENGTH_LINE = 32;
+    // Bytes find() searches itself before calling memchr.
+    const size_t SCAN_INLINE = 64;
+
+#if defined(RESP_SSE2) || defined(RESP_AVX2)
+    unsigned lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+    }
+#endif
+}
+
+RespParser::Status RespParser::parse(const char* data, size_t size, vector<string_view>& args, size_t& consumed,
+                                     Protocol& protocol, string& error, Progress* progress) {
+    args.clear();
+    // Unless more is known, an incomplete command needs another byte.
+    consumed = size + 1;
+    if (size == 0) {
+        return Status::Incomplete;
+    }
+    // A command parsed in one call still needs somewhere to keep its
+    // spans; kept per thread so their capacity is reused.
+    thread_local Progress scratch;
+    Progress& state = progress != nullptr ? *progress : scratch;
+    if (progress == nullptr) {
+        scratch.reset();
+    }
+    Status status;
+    if (data[0] == '*') {
+        protocol = Protocol::Resp;
+        status = parseMultibulk(data, size, args, consumed, error, state);
+    } else {
+        protocol = Protocol::Inline;
+        status = parseInline(data, size, args, consumed, error, state);
+    }
+    if (status != Status::Incomplete) {
+        state.reset();
+    }
+    return status;
+}
+
+RespParser::Status RespParser::parseInline(const char* data, size_t size, vector<string_view>& args,
+                                           size_t& consumed, string& error, Progress& progress) {
+    size_t from = min(progress.scanned, size);
+    size_t end = from + find(data + from, size - from, '\n');
+    if (end == size) {
+        if (size > MAX_INLINE) {
+            error = "Protocol error: too big inline request";
+            return Status::Error;
+        }
+        progress.scanned = size;
+        return Status::Incomplete;
+    }
+    // Trimmed in place: the line's view stops short of its "\r\n".
+    size_t length = end;
+    if (length > 0 && data[length - 1] == '\r') {
+        length--;
+    }
+    split(string_view(data, length), args);
+    consumed = end + 1;
+    return Status::Complete;
+}
+
+void RespParser::split(string_view line, vector<string_view>& args) {
+    const char* end = line.data() + line.size();
+    for (const char* p = line.data(); p != end;) {
+        while (p != end && isSpace(*p)) {
+            p++;
+        }
+        const char* word = p;
+        while (p != end && !isSpace(*p)) {
+            p++;
+        }
+        if (p != word) {
+            args.emplace_back(word, static_cast<size_t>(p - word));
+        }
+    }
+}
+
+size_t RespParser::find(const char* data, size_t size, char byte) {
+    // Most lines end within the first few vectors; past SCAN_INLINE bytes
+    // the line is long and the library's wider loop wins.
+    size_t limit = min(size, SCAN_INLINE);
+    size_t i = 0;
+#if defined(RESP_AVX2)
+    __m256i wanted = _mm256_set1_epi8(byte);
+    for (; i + 32 <= limit; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wanted)));
+        if (mask != 0) {
+            return i + lowestBit(mask);
+        }
+    }
+#endif
+#if defined(RESP_SSE2) || defined(RESP_AVX2)
+    __m128i wanted16 = _mm_set1_epi8(byte);
+    for (; i + 16 <= limit; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wanted16)));
+        if (mask != 0) {
+            return i + lowestBit(mask);
+        }
+    }
+#endif
+    if (size > limit) {
+        auto found = static_cast<const char*>(memchr(data + i, byte, size - i));
+        return found ? static_cast<size_t>(found - data) : size;
+    }
+    // The tail, shorter than a vector, or everything without one.
+    for (; i < size; ++i) {
+        if (data[i] == byte) {
+            return i;
+        }
+    }
+    return size;
+}
+
+RespParser::Status RespParser::parseMultibulk(const char* data, size_t size, vector<string_view>& args,
+                                              size_t& consumed, string& error, Progress& progress) {
+    Status status;
+    if (progress.count < 0) {
+        size_t pos = 0;
+        long long count;
+        status = readLength(data, size, pos, count, error);
+        if (status != Status::Complete) {
+            return status;
+        }
+        if (count > static_cast<long long>(MAX_ARGS)) {
+            error = "Protocol error: invalid multibulk length";
+            return Status::Error;
+        }
+        // "*0" and "*-1" are empty requests, skipped like blank lines.
+        progress.count = max(count, 0LL);
+        progress.parsed = pos;
+    }
+    // From the first argument not yet whole: one whose header or value was
+    // cut short is read again, but none before it.
+    size_t pos = progress.parsed;
+    auto& spans = progress.spans;
+    while (spans.size() < static_cast<size_t>(progress.count)) {
+        if (pos == size) {
+            return Status::Incomplete;
+        }
+        if (data[pos] != '$') {
+            error = string("Protocol error: expected '$', got '") + data[pos] + "'";
+            return Status::Error;
+        }
+        long long length;
+        status = readLength(data, size, pos, length, error);
+        if (status != Status::Complete) {
+            return status;
+        }
+        if (length < 0 || length > static_cast<long long>(MAX_BULK)) {
+            error = "Protocol error: invalid bulk length";
+            return Status::Error;
+        }
+        size_t bytes = static_cast<size_t>(length);
+        if (size - pos < bytes + 2) {
+            // Nothing to look at until the whole value is in.
+            consumed = pos + bytes + 2;
+            return Status::Incomplete;
+        }
+        if (data[pos + bytes] != '\r' || data[pos + bytes + 1] != '\n') {
+            error = "Protocol error: bulk string not terminated by CRLF";
+            return Status::Error;
+        }
+        spans.emplace_back(pos, bytes);
+        pos += bytes + 2;
+        progress.parsed = pos;
+    }
+    args.reserve(spans.size());
+    for (const auto& span : spans) {
+        args.emplace_back(data + span.first, span.second);
+    }
+    consumed = pos;
+    return Status::Complete;
+}
+
+RespParser::Status RespParser::readLength(const char* data, size_t size, size_t& pos, long long& value,
+                                          string& error) {
+    size_t start = pos + 1;
+    size_t limit = min(size, start + MAX_LENGTH_LINE);
+    size_t lineEnd = start + find(data + start, limit - start, '\r');
+    if (lineEnd == limit) {
+        if (limit - start == MAX_LENGTH_LINE) {
+            error = "Protocol error: length line too long";
+            return Status::Error;
+        }
+        return Status::Incomplete;
+    }
+    if (lineEnd + 1 == size) {
+        return Status::Incomplete;
+    }
+    const char* cr = data + lineEnd;
+    auto result = from_chars(data + start, cr, value);
+    if (data[lineEnd + 1] != '\n' || result.ec != errc() || result.ptr != cr) {
+        error = "Protocol error: invalid length";
+        return Status::Error;
+    }
+    pos = lineEnd + 2;
+    return Status::Complete;
+}
+
+void ReplyWriter::status(string_view text) {
+    if (resp()) {
+        out_ += '+';
+        out_ += text;
+        out_ += "\r\n";
+    } else {
+        out_ += text;
+    }
+    endElement();
+}
+
+void ReplyWriter::error(string_view message) {
+    out_ += resp() ? "-ERR " : "ERROR: ";
+    out_ += message;
+    if (resp()) {
+        out_ += "\r\n";
+    }
+    endElement();
+}
+
+void ReplyWriter::integer(long long value) {
+    char digits[24];
+    auto result = to_chars(digits, digits + sizeof(digits), value);
+    if (resp()) {
+        out_ += ':';
+    }
+    out_.append(digits, result.ptr);
+    if (resp()) {
+        out_ += "\r\n";
+    }
+    endElement();
+}
+
+void ReplyWriter::bulk(string_view value) {
+    if (resp()) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value.size());
+        out_ += '$';
+        out_.append(digits, result.ptr);
+        out_ += "\r\n";
+        out_ += value;
+        out_ += "\r\n";
+    } else {
+        out_ += value;
+    }
+    endElement();
+}
+
+void ReplyWriter::nil() {
+    out_ += resp() ? "$-1\r\n" : "(nil)";
+    endElement();
+}
+
+void ReplyWriter::array(size_t count) {
+    if (resp()) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), count);
+        out_ += '*';
+        out_.append(digits, result.ptr);
+        out_ += "\r\n";
+        return;
+    }
+    // Inline, a nested array's elements take the place of the element it
+    // is: SCAN's cursor and keys come out as one line each.
+    if (inlineElements_ > 0) {
+        inlineElements_--;
+    }
+    inlineElements_ += count;
+}
+
+void ReplyWriter::endElement() {
+    if (!resp() && inlineElements_ > 0) {
+        inlineElements_--;
+        out_ += '\n';
+    }
+}
@@ -1,15 +1,61 @@
 #include "../include/Server.h"
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <chrono>
+#include <climits>
+#include <future>
 #include <iostream>
 #include <sstream>
 #include <thread>
 
 using namespace std;
 
-#pragma comment(lib, "ws2_32.lib")
+#ifdef KVSTORE_EPOLL
+Server::Server(Logger& logger, size_t cores, IoEngine engine) : logger_(logger), commandHandler_(store_, logger) {
+    commandHandler_.setClients(&clients_);
+    commandHandler_.setLanes(&lanes_);
+    auto welcomeDelay = chrono::milliseconds(WELCOME_DELAY_MS);
+    if (cores == 0) {
+        if (engine == IoEngine::Uring) {
+#ifdef KVSTORE_URING
+            string reason;
+            if (IoUring::supported(reason)) {
+                IoUring::useForFiles(true);
+                reactor_ = make_unique<UringReactor>(commandHandler_, logger, welcomeMessage(), welcomeDelay);
+                reactor_->setClients(clients_);
+                return;
+            }
+            logger_.warning("io_uring unavailable (" + reason + "); falling back to epoll");
+#else
+            logger_.warning("Built without io_uring (KVSTORE_URING); falling back to epoll");
+#endif
+        }
+        reactor_ = make_unique<EpollReactor>(commandHandler_, logger, welcomeMessage(), welcomeDelay);
+        reactor_->setClients(clients_);
+        return;
+    }
+    vector<KeyValueStore*> stores{&store_};
+    vector<CommandHandler*> handlers{&commandHandler_};
+    for (size_t i = 1; i < cores; ++i) {
+        partitions_.push_back(make_unique<KeyValueStore>());
+        partitionHandlers_.push_back(make_unique<CommandHandler>(*partitions_.back(), logger));
+        partitionHandlers_.back()->setClients(&clients_);
+        partitionHandlers_.back()->setLanes(&lanes_);
+        stores.push_back(partitions_.back().get());
+        handlers.push_back(partitionHandlers_.back().get());
+    }
+    for (CommandHandler* handler : handlers) {
+        handler->setPartitions(stores);
+    }
+    reactor_ = make_unique<EpollReactor>(handlers, logger, welcomeMessage(), welcomeDelay);
+    reactor_->setClients(clients_);
+}
 
-Server::Server(Logger& logger) : logger_(logger), commandHandler_(store_, logger_) {
+Server::~Server() {
+    stop();
+}
+#else
+Server::Server(Logger& logger) : logger_(logger), commandHandler_(store_, logger) {
+    commandHandler_.setClients(&clients_);
+    commandHandler_.setLanes(&lanes_);
     serverSocket_ = INVALID_SOCKET;
     running_ = false;
 }
@@ -18,7 +64,72 @@ Server::~Server() {
     stop();
     WSACleanup();
 }
+#endif
+
+string Server::welcomeMessage() {
+    return "Welcome to Key-Value Store Server!\n"
+           "Commands:\n"
+           "  SET <key> <value> [ttl]  - Set key-value pair\n"
+           "  GET <key>               - Get value\n"
+           "  DEL <key>               - Delete key\n"
+           "  EXISTS <key>            - Check if key exists\n"
+           "  KEYS                    - List all keys\n"
+           "  STATS                   - Show statistics\n"
+           "  SAVE <filename>         - Save to file\n"
+           "  LOAD <filename>         - Load from file\n"
+           "  CLEAR                   - Clear all data\n"
+           "  FLUSH                   - Flush to disk\n"
+           "  HELP                    - Show this help\n"
+           "  QUIT                    - Disconnect\n\n";
+}
+
+bool Server::openAppendLog(const string& filename, FsyncPolicy policy) {
+#ifdef KVSTORE_EPOLL
+    if (partitioned()) {
+        logger_.error("An append log cannot be used with the keyspace partitioned across cores");
+        return false;
+    }
+#endif
+    auto start = chrono::steady_clock::now();
+    if (!store_.openAppendLog(filename, policy)) {
+        logger_.error("Failed to replay append log " + filename);
+        return false;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    logger_.info("Replayed append log " + filename + " (" + to_string(store_.getStats().totalKeys) +
+                 " keys) in " + to_string(elapsed.count()) + " ms; appendfsync " + AppendLog::policyName(policy));
+    return true;
+}
+
+bool Server::loadSnapshot(const string& filename, size_t threads) {
+#ifdef KVSTORE_EPOLL
+    if (partitioned()) {
+        logger_.error("A snapshot cannot be loaded with the keyspace partitioned across cores");
+        return false;
+    }
+#endif
+    auto start = chrono::steady_clock::now();
+    if (!store_.load(filename, threads)) {
+        logger_.error("Failed to load snapshot " + filename);
+        return false;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    logger_.info("Loaded snapshot " + filename + " (" + to_string(store_.getStats().totalKeys) + " keys) in " +
+                 to_string(elapsed.count()) + " ms on " + to_string(threads) + " threads");
+    return true;
+}
 
+#ifdef KVSTORE_EPOLL
+bool Server::start(int port) {
+    return reactor_->start(port);
+}
+
+void Server::stop() {
+    logger_.info("Server stop requested");
+    reactor_->stop();
+    logger_.info("Server stopped successfully");
+}
+#else
 bool Server::start(int port) {
     try {
         WSADATA wsaData;
@@ -118,38 +229,75 @@ void Server::serverLoop(int port) {
     logger_.info("Server loop stopped");
 }
 
+// send() may take less than it was given; loops until all of data is out.
+bool Server::sendAll(SOCKET socket, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        size_t left = data.size() - sent;
+        int chunk = left > INT_MAX ? INT_MAX : static_cast<int>(left);
+        int n = send(socket, data.data() + sent, chunk, 0);
+        if (n == SOCKET_ERROR) {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
 void Server::handleClient(SOCKET clientSocket) {
+    sockaddr_storage peer{};
+    socklen_t peerLength = sizeof(peer);
+    // A peer already gone is still served until its first failed read.
+    string address = "?";
+    if (getpeername(clientSocket, reinterpret_cast<sockaddr*>(&peer), &peerLength) == 0) {
+        address = ClientRegistry::formatAddress(reinterpret_cast<sockaddr*>(&peer));
+    }
+    ClientRegistry::Client* client =
+        clients_.add(nextClientId_.fetch_add(1), static_cast<int>(clientSocket), move(address));
+    // A client that stops reading would otherwise hold this pool worker in
+    // send() for as long as it stays connected.
+    DWORD sendTimeout = SEND_TIMEOUT_MS;
+    setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&sendTimeout),
+               sizeof(sendTimeout));
     try {
         logger_.info("Handling client connection");
         
-        // Send welcome message and menu
-        string welcome = "Welcome to Key-Value Store Server!\n"
-                        "Commands:\n"
-                        "  SET <key> <value> [ttl]  - Set key-value pair\n"
-                        "  GET <key>               - Get value\n"
-                        "  DEL <key>               - Delete key\n"
-                        "  EXISTS <key>            - Check if key exists\n"
-                        "  KEYS                    - List all keys\n"
-                        "  STATS                   - Show statistics\n"
-                        "  SAVE <filename>         - Save to file\n"
-                        "  LOAD <filename>         - Load from file\n"
-                        "  CLEAR                   - Clear all data\n"
-                        "  FLUSH                   - Flush to disk\n"
-                        "  HELP                    - Show this help\n"
-                        "  QUIT                    - Disconnect\n\n";
+        string welcome = welcomeMessage();
         
-        if (send(clientSocket, welcome.c_str(), welcome.length(), 0) == SOCKET_ERROR) {
-            logger_.error("Failed to send welcome message: " + to_string(WSAGetLastError()));
-            closesocket(clientSocket);
-            return;
+        // A Redis client speaks first and would take the welcome for a
+        // reply, so it is held back until the client has had a moment to:
+        // sent at once if nothing arrives, or with the first replies if
+        // those are inline, and never to a RESP client.
+        bool greeted = false;
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(clientSocket, &readable);
+        timeval wait{0, WELCOME_DELAY_MS * 1000};
+        if (select(static_cast<int>(clientSocket) + 1, &readable, nullptr, nullptr, &wait) == 0) {
+            if (!sendAll(clientSocket, welcome)) {
+                logger_.error("Failed to send welcome message: " + to_string(WSAGetLastError()));
+                clients_.remove(client);
+                closesocket(clientSocket);
+                return;
+            }
+            greeted = true;
         }
 
-        char buffer[1024];
+        // Every complete command a read brings in is run before anything is
+        // sent, and their responses go out together: a client pipelining a
+        // hundred commands in one packet costs one recv and one send here,
+        // not a send per command. recv writes straight into the input
+        // buffer, and commands are parsed from it in place. Sends block, so
+        // a client that stops reading is not read from either, which is
+        // what the soft output limit asks for, until the send times out;
+        // only the hard limit on one read's replies is checked here.
+        const int readChunk = static_cast<int>(InputBuffer::READ_BYTES);
         int bytesReceived;
-        string commandBuffer;
+        InputBuffer commandBuffer;
+        string responseBuffer;
 
         while (running_) {
-            bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+            bytesReceived = recv(clientSocket, commandBuffer.prepare(readChunk), readChunk, 0);
             if (bytesReceived <= 0) {
                 if (bytesReceived == 0) {
                     logger_.info("Client disconnected gracefully");
@@ -159,51 +307,46 @@ void Server::handleClient(SOCKET clientSocket) {
                 break;
             }
 
-            buffer[bytesReceived] = '\0';
-            commandBuffer += buffer;
-
-            // Process complete commands (those ending with newline)
-            size_t pos;
-            while ((pos = commandBuffer.find('\n')) != string::npos) {
-                string command = commandBuffer.substr(0, pos);
-                commandBuffer = commandBuffer.substr(pos + 1);
-
-                // Trim whitespace
-                command.erase(0, command.find_first_not_of(" \t\r\n"));
-                command.erase(command.find_last_not_of(" \t\r\n") + 1);
-
-                if (!command.empty()) {
-                    logger_.info("[REQUEST] " + command);
-                    
-                    string response;
-                    try {
-                        response = commandHandler_.handleCommand(command);
-                    } catch (const exception& e) {
-                        logger_.error("Exception in handleCommand: " + string(e.what()));
-                        response = "ERROR: Internal server error\n";
-                    } catch (...) {
-                        logger_.error("Unknown exception in handleCommand");
-                        response = "ERROR: Internal server error\n";
-                    }
-                    
-                    // Add newline to response if not present
-                    if (!response.empty() && response.back() != '\n') {
-                        response += '\n';
-                    }
-
-                    if (send(clientSocket, response.c_str(), response.length(), 0) == SOCKET_ERROR) {
-                        logger_.error("Send failed with error: " + to_string(WSAGetLastError()));
-                        closesocket(clientSocket);
-                        return;
-                    }
-
-                    // If command was QUIT, close the connection after sending BYE
-                    if (command == "QUIT") {
-                        logger_.info("Client requested disconnect");
-                        closesocket(clientSocket);
-                        return;
-                    }
+            commandBuffer.commit(static_cast<size_t>(bytesReceived));
+            client->touch(chrono::steady_clock::now());
+            if (!greeted) {
+                if (commandBuffer.data()[0] != '*') {
+                    responseBuffer = welcome;
                 }
+                greeted = true;
+            }
+            CommandHandler::SlowCommand slow;
+            bool open = commandHandler_.handlePipeline(commandBuffer, responseBuffer, slow);
+            // A slow-lane command waits its turn among the few the lane
+            // runs at once, then the commands behind it run.
+            while (open && !slow.request.empty()) {
+                promise<string> finished;
+                future<string> reply = finished.get_future();
+                commandHandler_.runSlow(move(slow), [&finished](string& text) { finished.set_value(move(text)); });
+                responseBuffer += reply.get();
+                slow = CommandHandler::SlowCommand();
+                open = commandHandler_.handlePipeline(commandBuffer, responseBuffer, slow);
+            }
+            client->update(commandBuffer.size(), responseBuffer.size());
+            if (clients_.overHardLimit(responseBuffer.size())) {
+                logger_.warning("Closing client " + to_string(client->id) + ": " +
+                                to_string(responseBuffer.size()) + " bytes of replies unsent, over the hard limit");
+                clients_.closedOverLimit();
+                break;
+            }
+            if (!responseBuffer.empty()) {
+                if (!sendAll(clientSocket, responseBuffer)) {
+                    logger_.error("Send failed with error: " + to_string(WSAGetLastError()));
+                    break;
+                }
+                responseBuffer.clear();
+                client->update(commandBuffer.size(), 0);
+            }
+
+            // If a command was QUIT, close the connection after sending BYE
+            if (!open) {
+                logger_.info("Client requested disconnect");
+                break;
             }
         }
     } catch (const exception& e) {
@@ -212,5 +355,7 @@ void Server::handleClient(SOCKET clientSocket) {
         logger_.error("Unknown exception in handleClient");
     }
     
+    clients_.remove(client);
     closesocket(clientSocket);
-} 
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,155 @@
+#include "SlabAllocator.h"
+#include <algorithm>
+#include <new>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace {
+    // Steps stay small where entries are common so rounding wastes little:
+    // 16 bytes up to 512, then 32, 128 and 256 bytes up to MAX_BLOCK.
+    const size_t CLASS_SIZES[] = {
+        16, 32, 48, 64, 80, 96, 112, 128,
+        144, 160, 176, 192, 208, 224, 240, 256,
+        272, 288, 304, 320, 336, 352, 368, 384,
+        400, 416, 432, 448, 464, 480, 496, 512,
+        544, 576, 608, 640, 672, 704, 736, 768,
+        800, 832, 864, 896, 928, 960, 992, 1024,
+        1152, 1280, 1408, 1536, 1664, 1792, 1920, 2048,
+        2304, 2560, 2816, 3072, 3328, 3584, 3840, 4096,
+    };
+}
+
+Arena::Arena(bool hugePages) : hugePages_(hugePages), next_(nullptr), end_(nullptr) {}
+
+Arena::~Arena() {
+    for (const auto& chunk : chunks_) {
+        unmapChunk(chunk);
+    }
+}
+
+void* Arena::allocateSlab() {
+    lock_guard<mutex> lock(mutex_);
+    if (next_ == end_) {
+        char* base = static_cast<char*>(mapChunk(CHUNK_BYTES));
+        next_ = base;
+        end_ = base + CHUNK_BYTES;
+    }
+    void* slab = next_;
+    next_ += SLAB_BYTES;
+    return slab;
+}
+
+size_t Arena::reservedBytes() const {
+    lock_guard<mutex> lock(mutex_);
+    return chunks_.size() * CHUNK_BYTES;
+}
+
+void* Arena::mapChunk(size_t bytes) {
+#if defined(_WIN32)
+    void* base = nullptr;
+    if (hugePages_ && GetLargePageMinimum() != 0 && bytes % GetLargePageMinimum() == 0) {
+        base = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    }
+    if (base == nullptr) {
+        base = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    if (base == nullptr) {
+        throw bad_alloc();
+    }
+    chunks_.push_back({base, bytes});
+    return base;
+#elif defined(__unix__) || defined(__APPLE__)
+    // Over-map by a chunk so the region can be trimmed to a huge page
+    // boundary; the kernel only backs aligned 2 MB ranges with huge pages.
+    size_t mapped = hugePages_ ? bytes + CHUNK_BYTES : bytes;
+    void* raw = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        throw bad_alloc();
+    }
+    char* base = static_cast<char*>(raw);
+    if (hugePages_) {
+        char* aligned = reinterpret_cast<char*>(
+            (reinterpret_cast<uintptr_t>(base) + CHUNK_BYTES - 1) & ~(uintptr_t(CHUNK_BYTES) - 1));
+        if (aligned != base) {
+            munmap(base, aligned - base);
+        }
+        size_t tail = (base + mapped) - (aligned + bytes);
+        if (tail != 0) {
+            munmap(aligned + bytes, tail);
+        }
+        base = aligned;
+#if defined(MADV_HUGEPAGE)
+        madvise(base, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    chunks_.push_back({base, bytes});
+    return base;
+#else
+    void* base = ::operator new(bytes);
+    chunks_.push_back({base, bytes});
+    return base;
+#endif
+}
+
+void Arena::unmapChunk(const Chunk& chunk) {
+#if defined(_WIN32)
+    VirtualFree(chunk.base, 0, MEM_RELEASE);
+#elif defined(__unix__) || defined(__APPLE__)
+    munmap(chunk.base, chunk.bytes);
+#else
+    ::operator delete(chunk.base);
+#endif
+}
+
+SlabAllocator::SlabAllocator(Arena& arena) : arena_(arena), slabs_(0) {}
+
+uint8_t SlabAllocator::classFor(size_t bytes) {
+    if (bytes > MAX_BLOCK) {
+        return NO_CLASS;
+    }
+    const size_t* found = lower_bound(begin(CLASS_SIZES), end(CLASS_SIZES), bytes);
+    return static_cast<uint8_t>(found - begin(CLASS_SIZES));
+}
+
+size_t SlabAllocator::classSize(uint8_t sizeClass) {
+    return CLASS_SIZES[sizeClass];
+}
+
+void* SlabAllocator::allocate(uint8_t sizeClass) {
+    lock_guard<mutex> lock(mutex_);
+    SizeClass& c = classes_[sizeClass];
+    if (c.freeList != nullptr) {
+        FreeBlock* block = c.freeList;
+        c.freeList = block->next;
+        return block;
+    }
+    size_t size = CLASS_SIZES[sizeClass];
+    if (static_cast<size_t>(c.end - c.next) < size) {
+        // The tail of the old slab that cannot fit a block is left unused.
+        c.next = static_cast<char*>(arena_.allocateSlab());
+        c.end = c.next + Arena::SLAB_BYTES;
+        slabs_++;
+    }
+    void* block = c.next;
+    c.next += size;
+    return block;
+}
+
+void SlabAllocator::deallocate(void* ptr, uint8_t sizeClass) {
+    lock_guard<mutex> lock(mutex_);
+    SizeClass& c = classes_[sizeClass];
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = c.freeList;
+    c.freeList = block;
+}
+
+size_t SlabAllocator::slabBytes() const {
+    lock_guard<mutex> lock(mutex_);
+    return slabs_ * Arena::SLAB_BYTES;
+}
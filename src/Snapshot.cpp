@@ -0,0 +1,170 @@
+#include "Snapshot.h"
+#include <chrono>
+#ifdef KVSTORE_URING
+#include <fcntl.h>
+#include <unistd.h>
+#include "IoUring.h"
+#endif
+
+using namespace std;
+
+namespace {
+    const char HEADER_MAGIC[8] = {'F', 'H', 'K', 'V', 'S', 'N', 'A', 'P'};
+    const char FOOTER_MAGIC[8] = {'F', 'H', 'K', 'V', 'E', 'N', 'D', '\0'};
+    const size_t HEADER_BYTES = 32;
+    const size_t BLOCK_HEADER_BYTES = 16;
+    const size_t KEY_COUNT_OFFSET = 16;
+
+    template <class T>
+    void append(string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <class T>
+    T read(const char* p) {
+        T value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+}
+
+SnapshotWriter::SnapshotWriter(const string& filename) : blockRecords_(0), keyCount_(0) {
+#ifdef KVSTORE_URING
+    ring_ = IoUring::fileRing();
+    if (ring_ != nullptr) {
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        failed_ = fd_ < 0;
+    }
+#endif
+    if (ring_ == nullptr) {
+        file_.open(filename, ios::binary | ios::trunc);
+    }
+    block_.reserve(BLOCK_HEADER_BYTES + BLOCK_BYTES + 4096);
+    block_.assign(BLOCK_HEADER_BYTES, '\0');
+    string header(HEADER_MAGIC, sizeof(HEADER_MAGIC));
+    append(header, VERSION);
+    append(header, uint32_t(0));
+    append(header, uint64_t(0));  // key count, filled in by finish()
+    append(header, static_cast<int64_t>(chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count()));
+    emit(header);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+#ifdef KVSTORE_URING
+    if (fd_ >= 0) {
+        // The ring may still be reading writing_.
+        ring_->finishWrites();
+        ::close(fd_);
+    }
+#endif
+}
+
+void SnapshotWriter::add(string_view key, string_view value, int64_t expiresAtMs) {
+    append(block_, static_cast<uint32_t>(key.size()));
+    append(block_, static_cast<uint32_t>(value.size()));
+    append(block_, expiresAtMs);
+    block_.append(key.data(), key.size());
+    block_.append(value.data(), value.size());
+    blockRecords_++;
+    keyCount_++;
+    if (block_.size() >= BLOCK_HEADER_BYTES + BLOCK_BYTES) {
+        flushBlock();
+    }
+}
+
+void SnapshotWriter::flushBlock() {
+    if (blockRecords_ == 0) {
+        return;
+    }
+    // The header goes in the room left for it, so a block is one write.
+    const char* payload = block_.data() + BLOCK_HEADER_BYTES;
+    auto payloadBytes = static_cast<uint32_t>(block_.size() - BLOCK_HEADER_BYTES);
+    uint32_t header[4] = {blockRecords_, payloadBytes, Crc32c::compute(payload, payloadBytes), 0};
+    memcpy(&block_[0], header, sizeof(header));
+    emit(block_);
+    block_.assign(BLOCK_HEADER_BYTES, '\0');
+    blockRecords_ = 0;
+}
+
+void SnapshotWriter::emit(string& data) {
+#ifdef KVSTORE_URING
+    if (ring_ != nullptr) {
+        if (failed_) {
+            return;
+        }
+        // The previous write has to be done with writing_ first.
+        failed_ = !ring_->finishWrites();
+        writing_.swap(data);
+        failed_ = failed_ || !ring_->writeAt(fd_, writing_.data(), writing_.size(), offset_);
+        offset_ += writing_.size();
+        return;
+    }
+#endif
+    file_.write(data.data(), data.size());
+}
+
+bool SnapshotWriter::finish() {
+    flushBlock();
+    string footer(BLOCK_HEADER_BYTES, '\0');
+    footer.append(FOOTER_MAGIC, sizeof(FOOTER_MAGIC));
+    emit(footer);
+#ifdef KVSTORE_URING
+    if (ring_ != nullptr) {
+        if (!failed_) {
+            failed_ = !ring_->finishWrites() ||
+                      !ring_->writeAt(fd_, reinterpret_cast<const char*>(&keyCount_), sizeof(keyCount_),
+                                      KEY_COUNT_OFFSET) ||
+                      !ring_->finishWrites();
+        }
+        return !failed_;
+    }
+#endif
+    file_.seekp(KEY_COUNT_OFFSET);
+    file_.write(reinterpret_cast<const char*>(&keyCount_), sizeof(keyCount_));
+    file_.flush();
+    return static_cast<bool>(file_);
+}
+
+bool SnapshotReader::isSnapshot(const string& filename) {
+    ifstream file(filename, ios::binary);
+    char magic[sizeof(HEADER_MAGIC)];
+    return file.read(magic, sizeof(magic)) && memcmp(magic, HEADER_MAGIC, sizeof(magic)) == 0;
+}
+
+bool SnapshotReader::open(const string& filename) {
+    blocks_.clear();
+    if (!file_.open(filename) || file_.size() < HEADER_BYTES) {
+        return false;
+    }
+    const char* p = file_.data();
+    const char* end = p + file_.size();
+    if (memcmp(p, HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0 || read<uint32_t>(p + 8) != SnapshotWriter::VERSION) {
+        return false;
+    }
+    keyCount_ = read<uint64_t>(p + KEY_COUNT_OFFSET);
+    p += HEADER_BYTES;
+
+    // Walk the block headers only; payloads are touched when decoded.
+    for (;;) {
+        if (static_cast<size_t>(end - p) < BLOCK_HEADER_BYTES) {
+            return false;
+        }
+        Block block;
+        block.records = read<uint32_t>(p);
+        block.bytes = read<uint32_t>(p + 4);
+        block.crc = read<uint32_t>(p + 8);
+        p += BLOCK_HEADER_BYTES;
+        if (block.records == 0) {
+            break;
+        }
+        if (static_cast<size_t>(end - p) < block.bytes) {
+            return false;
+        }
+        block.payload = p;
+        blocks_.push_back(block);
+        p += block.bytes;
+    }
+    return static_cast<size_t>(end - p) == sizeof(FOOTER_MAGIC) &&
+           memcmp(p, FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) == 0;
+}
@@ -0,0 +1,286 @@
+#include "ThreadPool.h"
+#include <iostream>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define THREADPOOL_PAUSE() _mm_pause()
+#else
+#define THREADPOOL_PAUSE() this_thread::yield()
+#endif
+
+using namespace std;
+
+namespace {
+    constexpr size_t DEQUE_MASK = ThreadPool::DEQUE_CAPACITY - 1;
+    constexpr size_t INJECTION_MASK = ThreadPool::INJECTION_CAPACITY - 1;
+    static_assert((ThreadPool::DEQUE_CAPACITY & DEQUE_MASK) == 0, "DEQUE_CAPACITY must be a power of two");
+    static_assert((ThreadPool::INJECTION_CAPACITY & INJECTION_MASK) == 0,
+                  "INJECTION_CAPACITY must be a power of two");
+
+    // The pool and worker the calling thread runs for, if any, so a task's
+    // own submits go on its worker's deque.
+    thread_local const void* currentPool = nullptr;
+    thread_local size_t currentWorker = 0;
+
+    // Positions only grow; their difference is signed while a pop has
+    // bottom one below top.
+    bool before(size_t a, size_t b) {
+        return static_cast<ptrdiff_t>(a - b) < 0;
+    }
+
+    uint64_t nextRandom(uint64_t& state) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+}
+
+ThreadPool::WorkDeque::WorkDeque() : slots_(new Slot[DEQUE_CAPACITY]) {
+    for (size_t i = 0; i < DEQUE_CAPACITY; ++i) {
+        slots_[i].sequence.store(i, memory_order_relaxed);
+    }
+}
+
+bool ThreadPool::WorkDeque::push(Task& task) {
+    size_t bottom = bottom_.load(memory_order_relaxed);
+    Slot& slot = slots_[bottom & DEQUE_MASK];
+    // Still holding the task from a lap ago, or a thief is moving it out.
+    if (slot.sequence.load(memory_order_acquire) != bottom) {
+        return false;
+    }
+    slot.task = move(task);
+    bottom_.store(bottom + 1, memory_order_release);
+    return true;
+}
+
+bool ThreadPool::WorkDeque::pop(Task& task) {
+    size_t bottom = bottom_.load(memory_order_relaxed);
+    if (!before(top_.load(memory_order_relaxed), bottom)) {
+        return false;
+    }
+    bottom--;
+    bottom_.store(bottom, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t top = top_.load(memory_order_relaxed);
+    if (before(top, bottom)) {
+        // More than one left: no thief can reach this one. Its slot is
+        // free for the next push, at the same position.
+        task = move(slots_[bottom & DEQUE_MASK].task);
+        return true;
+    }
+    bool won = top == bottom &&
+               top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+    bottom_.store(bottom + 1, memory_order_release);
+    if (!won) {
+        return false;
+    }
+    // The last one, taken from the top as a thief would.
+    Slot& slot = slots_[bottom & DEQUE_MASK];
+    task = move(slot.task);
+    slot.sequence.store(bottom + DEQUE_CAPACITY, memory_order_release);
+    return true;
+}
+
+bool ThreadPool::WorkDeque::steal(Task& task) {
+    size_t top = top_.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t bottom = bottom_.load(memory_order_acquire);
+    if (!before(top, bottom) ||
+        !top_.compare_exchange_strong(top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return false;
+    }
+    // The position is ours; the owner cannot write its slot again until
+    // the sequence says it may.
+    Slot& slot = slots_[top & DEQUE_MASK];
+    task = move(slot.task);
+    slot.sequence.store(top + DEQUE_CAPACITY, memory_order_release);
+    return true;
+}
+
+bool ThreadPool::WorkDeque::empty() const {
+    return !before(top_.load(memory_order_acquire), bottom_.load(memory_order_acquire));
+}
+
+ThreadPool::InjectionQueue::InjectionQueue() : slots_(new Slot[INJECTION_CAPACITY]) {
+    for (size_t i = 0; i < INJECTION_CAPACITY; ++i) {
+        slots_[i].sequence.store(i, memory_order_relaxed);
+    }
+}
+
+bool ThreadPool::InjectionQueue::push(Task& task) {
+    size_t tail = tail_.load(memory_order_relaxed);
+    while (true) {
+        Slot& slot = slots_[tail & INJECTION_MASK];
+        size_t sequence = slot.sequence.load(memory_order_acquire);
+        if (sequence == tail) {
+            if (tail_.compare_exchange_weak(tail, tail + 1, memory_order_relaxed)) {
+                slot.task = move(task);
+                slot.sequence.store(tail + 1, memory_order_release);
+                return true;
+            }
+        } else if (before(sequence, tail)) {
+            return false;  // full
+        } else {
+            tail = tail_.load(memory_order_relaxed);
+        }
+    }
+}
+
+bool ThreadPool::InjectionQueue::pop(Task& task) {
+    size_t head = head_.load(memory_order_relaxed);
+    while (true) {
+        Slot& slot = slots_[head & INJECTION_MASK];
+        size_t sequence = slot.sequence.load(memory_order_acquire);
+        if (sequence == head + 1) {
+            if (head_.compare_exchange_weak(head, head + 1, memory_order_relaxed)) {
+                task = move(slot.task);
+                slot.sequence.store(head + INJECTION_CAPACITY, memory_order_release);
+                return true;
+            }
+        } else if (before(sequence, head + 1)) {
+            return false;  // empty, or the push to it not finished
+        } else {
+            head = head_.load(memory_order_relaxed);
+        }
+    }
+}
+
+bool ThreadPool::InjectionQueue::empty() const {
+    return !before(head_.load(memory_order_acquire), tail_.load(memory_order_acquire));
+}
+
+ThreadPool::ThreadPool(size_t numThreads) {
+    // Every worker exists before any starts, as each steals from all.
+    for (size_t i = 0; i < max<size_t>(numThreads, 1); ++i) {
+        workers_.push_back(make_unique<Worker>());
+        workers_.back()->random = 0x9e3779b97f4a7c15ull * (i + 1);
+    }
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->handle = thread([this, i] { run(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(parkMutex_);
+        stop_.store(true, memory_order_release);
+        wakeups_++;
+    }
+    parked_.notify_all();
+    for (auto& worker : workers_) {
+        if (worker->handle.joinable()) {
+            worker->handle.join();
+        }
+    }
+}
+
+void ThreadPool::submit(Task task) {
+    if (currentPool == this) {
+        // From one of our tasks, which the pool runs before stopping.
+        if (!workers_[currentWorker]->deque.push(task) && !injected_.push(task)) {
+            execute(task);
+            return;
+        }
+    } else {
+        if (stop_.load(memory_order_acquire)) {
+            throw runtime_error("submit on stopped ThreadPool");
+        }
+        while (!injected_.push(task)) {
+            this_thread::yield();
+        }
+    }
+    // Pairs with the fence in park(): either the worker sees the task or
+    // this sees the worker parked.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleepers_.load(memory_order_relaxed) > 0) {
+        wakeOne();
+    }
+}
+
+void ThreadPool::run(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+    Task task;
+    while (true) {
+        // Read before looking, so a stop seen here comes after every
+        // outside submit: none is missed by leaving.
+        bool stopping = stop_.load(memory_order_acquire);
+        if (findTask(index, task)) {
+            execute(task);
+            continue;
+        }
+        if (stopping) {
+            return;
+        }
+        bool found = false;
+        for (int i = 0; i < SPIN_ROUNDS && !found; ++i) {
+            THREADPOOL_PAUSE();
+            found = findTask(index, task);
+        }
+        if (found) {
+            execute(task);
+            continue;
+        }
+        park();
+    }
+}
+
+bool ThreadPool::findTask(size_t index, Task& task) {
+    Worker& self = *workers_[index];
+    if (self.deque.pop(task) || injected_.pop(task)) {
+        return true;
+    }
+    size_t count = workers_.size();
+    size_t start = static_cast<size_t>(nextRandom(self.random) % count);
+    for (size_t i = 0; i < count; ++i) {
+        size_t victim = (start + i) % count;
+        if (victim != index && workers_[victim]->deque.steal(task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::hasWork() const {
+    if (!injected_.empty()) {
+        return true;
+    }
+    for (const auto& worker : workers_) {
+        if (!worker->deque.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::park() {
+    unique_lock<mutex> lock(parkMutex_);
+    sleepers_.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!hasWork() && !stop_.load(memory_order_relaxed)) {
+        uint64_t seen = wakeups_;
+        parked_.wait(lock, [this, seen] { return wakeups_ != seen || stop_.load(memory_order_relaxed); });
+    }
+    sleepers_.fetch_sub(1, memory_order_relaxed);
+}
+
+void ThreadPool::wakeOne() {
+    {
+        lock_guard<mutex> lock(parkMutex_);
+        wakeups_++;
+    }
+    parked_.notify_one();
+}
+
+void ThreadPool::execute(Task& task) {
+    try {
+        task();
+    } catch (const exception& e) {
+        cerr << "Exception in thread pool task: " << e.what() << endl;
+    } catch (...) {
+        cerr << "Unknown exception in thread pool task" << endl;
+    }
+    task.reset();
+}
@@ -0,0 +1,103 @@
+#include "TimingWheel.h"
+#include <utility>
+
+using namespace std;
+
+TimingWheel::TimingWheel(int64_t now) : current_(now), size_(0) {}
+
+void TimingWheel::schedule(string key, int64_t deadline) {
+    place(Timer{move(key), deadline});
+    size_++;
+}
+
+void TimingWheel::place(Timer&& timer) {
+    // Overdue timers fire on the next tick processed.
+    int64_t deadline = timer.deadline < current_ ? current_ : timer.deadline;
+    int64_t delta = deadline - current_;
+    for (int level = 0; level < LEVELS; ++level) {
+        if (delta < (int64_t(1) << (SLOT_BITS * (level + 1)))) {
+            size_t slot = static_cast<size_t>(deadline >> (SLOT_BITS * level)) & (SLOTS - 1);
+            slots_[level][slot].push_back(move(timer));
+            return;
+        }
+    }
+    overflow_.push_back(move(timer));
+}
+
+void TimingWheel::cascade(int level) {
+    size_t slot = static_cast<size_t>(current_ >> (SLOT_BITS * level)) & (SLOTS - 1);
+    // Higher levels turn first so their timers can land in this level's
+    // upcoming slots or below.
+    if (slot == 0) {
+        if (level + 1 < LEVELS) {
+            cascade(level + 1);
+        } else {
+            vector<Timer> far;
+            far.swap(overflow_);
+            for (auto& timer : far) {
+                place(move(timer));
+            }
+        }
+    }
+    vector<Timer> timers;
+    timers.swap(slots_[level][slot]);
+    for (auto& timer : timers) {
+        place(move(timer));
+    }
+}
+
+void TimingWheel::advance(int64_t now, vector<Timer>& due) {
+    if (size_ == 0) {
+        // Nothing to cascade; skip the idle ticks outright.
+        if (current_ <= now) {
+            current_ = now + 1;
+        }
+        return;
+    }
+    while (current_ <= now && size_ > 0) {
+        size_t slot = static_cast<size_t>(current_) & (SLOTS - 1);
+        if (slot == 0) {
+            cascade(1);
+        }
+        vector<Timer>& fired = slots_[0][slot];
+        size_ -= fired.size();
+        for (auto& timer : fired) {
+            due.push_back(move(timer));
+        }
+        fired.clear();
+        current_++;
+    }
+    if (current_ <= now) {
+        current_ = now + 1;
+    }
+}
+
+void TimingWheel::clear() {
+    for (auto& level : slots_) {
+        for (auto& slot : level) {
+            vector<Timer>().swap(slot);
+        }
+    }
+    vector<Timer>().swap(overflow_);
+    size_ = 0;
+}
+
+size_t TimingWheel::bytes() const {
+    size_t total = 0;
+    auto add = [&total](const vector<Timer>& timers) {
+        total += timers.capacity() * sizeof(Timer);
+        for (const auto& timer : timers) {
+            // Keys that fit the small-string buffer hold no heap memory.
+            if (timer.key.capacity() > string().capacity()) {
+                total += timer.key.capacity() + 1;
+            }
+        }
+    };
+    for (const auto& level : slots_) {
+        for (const auto& slot : level) {
+            add(slot);
+        }
+    }
+    add(overflow_);
+    return total;
+}
@@ -0,0 +1,659 @@
+#include "UringReactor.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+    const uint16_t BUFFER_GROUP = 0;
+    // A send moves at most this much, so its byte count fits the result.
+    const size_t MAX_SEND = size_t(1) << 30;
+    // How long stop() waits for a loop's cancelled requests to finish.
+    const auto SHUTDOWN_WAIT = chrono::seconds(1);
+    // As in EpollReactor: a buffer that grew past this for one large
+    // request or reply is released once empty.
+    const size_t KEEP_CAPACITY = 64 * 1024;
+
+    string errorText(int error = errno) {
+        return strerror(error);
+    }
+
+    void release(string& buffer) {
+        if (buffer.empty() && buffer.capacity() > KEEP_CAPACITY) {
+            string().swap(buffer);
+        }
+    }
+}
+
+UringReactor::UringReactor(CommandHandler& handler, Logger& logger, string welcome,
+                           chrono::milliseconds welcomeDelay, size_t loops)
+    : handler_(handler), logger_(logger), welcome_(move(welcome)), welcomeDelay_(welcomeDelay) {
+    for (size_t i = 0; i < max<size_t>(loops, 1); ++i) {
+        loops_.push_back(make_unique<Loop>());
+        loops_.back()->index = i;
+    }
+}
+
+UringReactor::~UringReactor() {
+    stop();
+}
+
+size_t UringReactor::defaultLoops() {
+    return max(1u, thread::hardware_concurrency());
+}
+
+size_t UringReactor::connectionCount() const {
+    size_t count = 0;
+    for (const auto& loop : loops_) {
+        count += loop->connections.load(memory_order_relaxed);
+    }
+    return count;
+}
+
+size_t UringReactor::zeroCopySends() const {
+    size_t count = 0;
+    for (const auto& loop : loops_) {
+        count += loop->zeroCopySends.load(memory_order_relaxed);
+    }
+    return count;
+}
+
+bool UringReactor::start(int port) {
+    listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (listenFd_ < 0) {
+        logger_.error("Error creating socket: " + errorText());
+        return false;
+    }
+    int opt = 1;
+    if (setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        logger_.error("setsockopt failed with error: " + errorText());
+        closeAll();
+        return false;
+    }
+    sockaddr_in serverAddr{};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serverAddr.sin_port = htons(static_cast<uint16_t>(port));
+    socklen_t length = sizeof(serverAddr);
+    if (bind(listenFd_, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) < 0 ||
+        getsockname(listenFd_, reinterpret_cast<sockaddr*>(&serverAddr), &length) < 0) {
+        logger_.error("Bind failed with error: " + errorText());
+        closeAll();
+        return false;
+    }
+    port_ = ntohs(serverAddr.sin_port);
+    if (listen(listenFd_, SOMAXCONN) < 0) {
+        logger_.error("Listen failed with error: " + errorText());
+        closeAll();
+        return false;
+    }
+
+    running_ = true;
+    bool started = true;
+    for (auto& loop : loops_) {
+        loop->wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (loop->wakeFd < 0) {
+            logger_.error("Event loop setup failed with error: " + errorText());
+            started = false;
+            break;
+        }
+        // Each loop sets up its own ring, so start() waits to hear it did.
+        promise<bool> ready;
+        future<bool> result = ready.get_future();
+        loop->worker = thread([this, &loop = *loop, &ready] { run(loop, ready); });
+        if (!result.get()) {
+            started = false;
+            break;
+        }
+    }
+    if (!started) {
+        stop();
+        return false;
+    }
+    logger_.info("Listening on port " + to_string(port_) + " with " + to_string(loops_.size()) +
+                 " io_uring event loops");
+    return true;
+}
+
+void UringReactor::stop() {
+    if (running_.exchange(false)) {
+        for (auto& loop : loops_) {
+            uint64_t one = 1;
+            if (loop->wakeFd >= 0 && write(loop->wakeFd, &one, sizeof(one)) < 0) {
+                logger_.error("Failed to wake event loop: " + errorText());
+            }
+        }
+        for (auto& loop : loops_) {
+            if (loop->worker.joinable()) {
+                loop->worker.join();
+            }
+        }
+        logger_.info("Event loops stopped");
+    }
+    closeAll();
+}
+
+void UringReactor::closeAll() {
+    for (auto& loop : loops_) {
+        // Left over only if a loop gave up waiting for its requests.
+        for (auto& connection : loop->byFd) {
+            if (connection != nullptr) {
+                ::close(connection->fd);
+                connection.reset();
+            }
+        }
+        loop->connections = 0;
+        loop->greetings.clear();
+        loop->toFlush.clear();
+        // The slow lane may still be posting replies.
+        lock_guard<mutex> lock(loop->finishedMutex);
+        loop->finished.clear();
+        if (loop->wakeFd >= 0) {
+            ::close(loop->wakeFd);
+            loop->wakeFd = -1;
+        }
+    }
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+        listenFd_ = -1;
+    }
+}
+
+void UringReactor::run(Loop& loop, promise<bool>& started) {
+    // Set up here: the ring is used only by the thread that creates it.
+    bool ready = loop.ring.init(RING_ENTRIES, RING_COMPLETIONS) &&
+                 loop.ring.provideBuffers(BUFFER_GROUP, BUFFER_COUNT, BUFFER_BYTES) && armAccept(loop) &&
+                 armWake(loop) && loop.ring.submit();
+    if (!ready) {
+        logger_.error("io_uring setup failed with error: " + errorText());
+    }
+    started.set_value(ready);
+    if (!ready) {
+        return;
+    }
+
+    vector<Ref> toFlush;
+    while (running_) {
+        int64_t timeoutNs = -1;
+        if (!loop.greetings.empty()) {
+            auto wait = chrono::duration_cast<chrono::nanoseconds>(loop.greetings.front().first - chrono::steady_clock::now());
+            timeoutNs = max<int64_t>(0, wait.count());
+        }
+        // What the last turn queued goes in with the wait.
+        if (!loop.ring.submit(1, timeoutNs)) {
+            logger_.error("io_uring_enter failed with error: " + errorText());
+            break;
+        }
+        loop.ring.drain([this, &loop](const io_uring_cqe& cqe) { complete(loop, cqe); });
+        greetDue(loop, chrono::steady_clock::now());
+        if (loop.hasFinished.load(memory_order_acquire)) {
+            finishSlow(loop);
+        }
+
+        // Every completion of the turn is in, so each connection's replies
+        // to all it sent go out in one send.
+        toFlush.swap(loop.toFlush);
+        for (Ref ref : toFlush) {
+            Connection* connection = find(loop, ref);
+            if (connection != nullptr) {
+                connection->queued = false;
+                flush(loop, *connection);
+                releaseIfDone(loop, *connection);
+            }
+        }
+        toFlush.clear();
+    }
+    shutDownLoop(loop);
+}
+
+io_uring_sqe* UringReactor::prepare(Loop& loop, Op op, Connection* connection) {
+    io_uring_sqe* sqe = loop.ring.next();
+    if (sqe == nullptr) {
+        logger_.error("io_uring submission failed with error: " + errorText());
+        return nullptr;
+    }
+    sqe->user_data = reinterpret_cast<uint64_t>(connection) | op;
+    loop.requests++;
+    if (connection != nullptr) {
+        connection->requests++;
+    }
+    return sqe;
+}
+
+bool UringReactor::armAccept(Loop& loop) {
+    io_uring_sqe* sqe = prepare(loop, Accept, nullptr);
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return true;
+}
+
+bool UringReactor::armWake(Loop& loop) {
+    io_uring_sqe* sqe = prepare(loop, Wake, nullptr);
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop.wakeFd;
+    sqe->addr = reinterpret_cast<uint64_t>(&loop.wakeCount);
+    sqe->len = sizeof(loop.wakeCount);
+    return true;
+}
+
+bool UringReactor::armReceive(Loop& loop, Connection& connection) {
+    io_uring_sqe* sqe = prepare(loop, Receive, &connection);
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    connection.receiving = true;
+    return true;
+}
+
+void UringReactor::complete(Loop& loop, const io_uring_cqe& cqe) {
+    Op op = static_cast<Op>(cqe.user_data & OP_MASK);
+    auto* connection = reinterpret_cast<Connection*>(cqe.user_data & ~OP_MASK);
+    // A multishot request, or a zero-copy send, says when more is to come.
+    bool last = (cqe.flags & IORING_CQE_F_MORE) == 0;
+    if (last) {
+        loop.requests--;
+    }
+    switch (op) {
+        case Accept:
+            if (cqe.res >= 0) {
+                accepted(loop, cqe.res, chrono::steady_clock::now() + welcomeDelay_);
+            } else if (cqe.res != -ECANCELED && cqe.res != -ECONNABORTED && cqe.res != -EINTR) {
+                logger_.error("Accept failed with error: " + errorText(-cqe.res));
+            }
+            // Multishot accept ends on an error; the next one takes over.
+            if (last && running_ && !armAccept(loop)) {
+                logger_.error("Failed to accept further connections");
+            }
+            return;
+        case Wake:
+            // The slow lane has replies, or stop() was called and the loop
+            // exits after this turn.
+            if (running_ && !armWake(loop)) {
+                logger_.error("Failed to watch the event loop's eventfd");
+            }
+            return;
+        case Cancel:
+            return;
+        case Receive:
+        case Send:
+            if (last) {
+                connection->requests--;
+            }
+            if (op == Receive) {
+                received(loop, *connection, cqe);
+            } else {
+                sendCompleted(loop, *connection, cqe);
+            }
+            releaseIfDone(loop, *connection);
+            return;
+    }
+}
+
+void UringReactor::accepted(Loop& loop, int fd, chrono::steady_clock::time_point deadline) {
+    if (!running_) {
+        ::close(fd);
+        return;
+    }
+    // Replies are written whole, so there is nothing to gain from Nagle's
+    // algorithm holding back the tail of one.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_storage peer{};
+    socklen_t peerLength = sizeof(peer);
+    getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &peerLength);
+
+    auto connection = make_unique<Connection>();
+    connection->fd = fd;
+    connection->id = nextId_.fetch_add(1, memory_order_relaxed);
+    connection->client =
+        clients().add(connection->id, fd, ClientRegistry::formatAddress(reinterpret_cast<sockaddr*>(&peer)));
+    loop.greetings.emplace_back(deadline, Ref{fd, connection->id});
+    if (static_cast<size_t>(fd) >= loop.byFd.size()) {
+        loop.byFd.resize(fd + 1);
+    }
+    Connection& added = *connection;
+    loop.byFd[fd] = move(connection);
+    loop.connections++;
+    // logger_.info("New client connection accepted");
+    if (!armReceive(loop, added)) {
+        disconnect(loop, added);
+        releaseIfDone(loop, added);
+    }
+}
+
+void UringReactor::received(Loop& loop, Connection& connection, const io_uring_cqe& cqe) {
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+        connection.receiving = false;
+    }
+    // As with epoll, bytes are parsed in a buffer of the loop's, and only
+    // a command they leave unfinished is kept by the connection.
+    InputBuffer& input = connection.input.empty() ? loop.reads : connection.input;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        // Copied out and handed straight back, so a slow client never
+        // holds one of the loop's buffers.
+        auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe.res > 0 && !connection.shutDown && !connection.closing) {
+            input.append(loop.ring.buffer(id), static_cast<size_t>(cqe.res));
+        }
+        loop.ring.recycle(id);
+    }
+    if (connection.shutDown) {
+        return;
+    }
+    // Only a pause cancels the receive of a connection still open.
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)) {
+        // logger_.info("Client disconnected gracefully");
+        disconnect(loop, connection);
+        return;
+    }
+    if (cqe.res > 0 && !connection.closing) {
+        connection.client->touch(chrono::steady_clock::now());
+        if (!connection.greeted) {
+            connection.greeted = true;
+            if (input.data()[0] != '*') {
+                connection.output += welcome_;
+            }
+        }
+        if (!connection.paused && !connection.waiting) {
+            serve(loop, connection, input);
+        } else if (&input == &loop.reads) {
+            // Received before the cancel took effect: run on resuming.
+            connection.input.takeFrom(loop.reads);
+        }
+        if (connection.shutDown) {
+            return;
+        }
+    }
+    // The receive stops when the buffers run out (ENOBUFS), by then
+    // recycled, and on some errors; after QUIT it is left stopped, while
+    // paused until resume(), and while waiting until finishSlow().
+    if (!connection.receiving && !connection.closing && !connection.paused && !connection.waiting &&
+        !armReceive(loop, connection)) {
+        disconnect(loop, connection);
+    }
+}
+
+void UringReactor::serve(Loop& loop, Connection& connection, InputBuffer& input) {
+    CommandHandler::SlowCommand slow;
+    if (!handler_.handlePipeline(input, connection.output, slow)) {
+        connection.closing = true;
+    }
+    if (&input == &loop.reads) {
+        connection.input.takeFrom(loop.reads);
+    }
+    connection.input.release(KEEP_CAPACITY);
+    markForFlush(loop, connection);
+    if (!slow.request.empty()) {
+        offload(loop, connection, slow);
+        if (connection.shutDown) {
+            return;
+        }
+    }
+
+    ClientRegistry& registry = clients();
+    size_t unsent = connection.output.size() + connection.sending.size() - connection.sent;
+    connection.client->update(connection.input.size(), unsent);
+    if (registry.overHardLimit(unsent)) {
+        logger_.warning("Closing client " + to_string(connection.id) + ": " + to_string(unsent) +
+                        " bytes of replies unsent, over the hard limit");
+        registry.closedOverLimit();
+        disconnect(loop, connection);
+        return;
+    }
+    if (!registry.overSoftLimit(unsent) || connection.paused) {
+        return;
+    }
+    connection.paused = true;
+    connection.client->paused.store(true, memory_order_relaxed);
+    if (!stopReceiving(loop, connection)) {
+        disconnect(loop, connection);
+    }
+}
+
+void UringReactor::resume(Loop& loop, Connection& connection) {
+    size_t unsent = connection.output.size() + connection.sending.size() - connection.sent;
+    if (!connection.paused || connection.shutDown || clients().overSoftLimit(unsent)) {
+        return;
+    }
+    connection.paused = false;
+    connection.client->paused.store(false, memory_order_relaxed);
+    if (!connection.input.empty() && !connection.closing && !connection.waiting) {
+        serve(loop, connection, connection.input);
+    }
+    // A receive whose cancel is still to complete is armed again when it
+    // does.
+    if (!connection.shutDown && !connection.paused && !connection.waiting && !connection.receiving &&
+        !connection.closing && !armReceive(loop, connection)) {
+        disconnect(loop, connection);
+    }
+}
+
+bool UringReactor::stopReceiving(Loop& loop, Connection& connection) {
+    if (!connection.receiving) {
+        return true;
+    }
+    io_uring_sqe* sqe = prepare(loop, Cancel, nullptr);
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<uint64_t>(&connection) | Receive;
+    return true;
+}
+
+void UringReactor::offload(Loop& loop, Connection& connection, CommandHandler::SlowCommand& slow) {
+    connection.waiting = true;
+    Ref origin{connection.fd, connection.id};
+    handler_.runSlow(move(slow), [this, &loop, origin](string& text) {
+        lock_guard<mutex> lock(loop.finishedMutex);
+        loop.finished.emplace_back(origin, move(text));
+        loop.hasFinished.store(true, memory_order_release);
+        uint64_t one = 1;
+        if (loop.wakeFd >= 0 && write(loop.wakeFd, &one, sizeof(one)) < 0) {
+            logger_.error("Failed to wake event loop: " + errorText());
+        }
+    });
+    if (!stopReceiving(loop, connection)) {
+        disconnect(loop, connection);
+    }
+}
+
+void UringReactor::finishSlow(Loop& loop) {
+    vector<pair<Ref, string>> finished;
+    {
+        lock_guard<mutex> lock(loop.finishedMutex);
+        finished.swap(loop.finished);
+        loop.hasFinished.store(false, memory_order_relaxed);
+    }
+    for (auto& [ref, text] : finished) {
+        Connection* connection = find(loop, ref);
+        if (connection == nullptr || connection->shutDown) {
+            continue;  // closed while its command was on the slow lane
+        }
+        connection->waiting = false;
+        connection->output += text;
+        if (connection->paused) {
+            // resume() carries on once sends have caught up.
+            markForFlush(loop, *connection);
+            continue;
+        }
+        // The commands that arrived behind the slow one, then receive.
+        serve(loop, *connection, connection->input);
+        if (!connection->shutDown && !connection->paused && !connection->waiting && !connection->receiving &&
+            !connection->closing && !armReceive(loop, *connection)) {
+            disconnect(loop, *connection);
+        }
+        releaseIfDone(loop, *connection);
+    }
+}
+
+void UringReactor::sendCompleted(Loop& loop, Connection& connection, const io_uring_cqe& cqe) {
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+        connection.sends--;
+    }
+    if ((cqe.flags & IORING_CQE_F_NOTIF) == 0) {
+        connection.sendPending = false;
+        if (cqe.res < 0) {
+            disconnect(loop, connection);
+            return;
+        }
+        connection.sent += static_cast<size_t>(cqe.res);
+    }
+    flush(loop, connection);
+    resume(loop, connection);
+}
+
+void UringReactor::flush(Loop& loop, Connection& connection) {
+    if (connection.sendPending || connection.shutDown) {
+        return;
+    }
+    if (connection.sent == connection.sending.size()) {
+        if (connection.sends > 0) {
+            return;  // the kernel may still be reading sending in place
+        }
+        connection.sending.clear();
+        connection.sent = 0;
+        if (connection.output.empty()) {
+            release(connection.sending);
+            connection.client->update(connection.input.size(), 0);
+            // After QUIT or a protocol error, close once the last reply is out.
+            if (connection.closing) {
+                disconnect(loop, connection);
+            }
+            return;
+        }
+        connection.sending.swap(connection.output);
+        release(connection.output);
+    }
+
+    size_t left = min(connection.sending.size() - connection.sent, MAX_SEND);
+    bool zeroCopy = left >= ZEROCOPY_BYTES;
+    io_uring_sqe* sqe = prepare(loop, Send, &connection);
+    if (sqe == nullptr) {
+        disconnect(loop, connection);
+        return;
+    }
+    sqe->opcode = zeroCopy ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+    sqe->fd = connection.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(connection.sending.data() + connection.sent);
+    sqe->len = static_cast<uint32_t>(left);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    connection.client->update(connection.input.size(), connection.output.size() + left);
+    connection.sendPending = true;
+    connection.sends++;
+    if (zeroCopy) {
+        loop.zeroCopySends.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void UringReactor::markForFlush(Loop& loop, Connection& connection) {
+    if (!connection.queued) {
+        connection.queued = true;
+        loop.toFlush.push_back(Ref{connection.fd, connection.id});
+    }
+}
+
+void UringReactor::greetDue(Loop& loop, chrono::steady_clock::time_point now) {
+    while (!loop.greetings.empty() && loop.greetings.front().first <= now) {
+        Connection* connection = find(loop, loop.greetings.front().second);
+        loop.greetings.pop_front();
+        if (connection == nullptr || connection->greeted || connection->shutDown) {
+            continue;
+        }
+        connection->greeted = true;
+        connection->output += welcome_;
+        markForFlush(loop, *connection);
+    }
+}
+
+void UringReactor::disconnect(Loop& loop, Connection& connection) {
+    if (connection.shutDown) {
+        return;
+    }
+    connection.shutDown = true;
+    // Ends the receive and a send waiting for room; a zero-copy send's
+    // notification still comes once the socket lets go of the data, which
+    // the shutdown hastens.
+    if (connection.requests > 0) {
+        io_uring_sqe* sqe = prepare(loop, Cancel, nullptr);
+        if (sqe != nullptr) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = connection.fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        }
+    }
+    shutdown(connection.fd, SHUT_RDWR);
+}
+
+void UringReactor::releaseIfDone(Loop& loop, Connection& connection) {
+    // Closed only now, so the descriptor cannot be reused while the ring
+    // still refers to it.
+    if (connection.shutDown && connection.requests == 0) {
+        int fd = connection.fd;
+        ::close(fd);
+        clients().remove(connection.client);
+        loop.byFd[fd].reset();
+        loop.connections--;
+    }
+}
+
+UringReactor::Connection* UringReactor::find(Loop& loop, Ref ref) {
+    if (static_cast<size_t>(ref.fd) >= loop.byFd.size()) {
+        return nullptr;
+    }
+    Connection* connection = loop.byFd[ref.fd].get();
+    return connection != nullptr && connection->id == ref.id ? connection : nullptr;
+}
+
+void UringReactor::shutDownLoop(Loop& loop) {
+    // Buffers the kernel may still write to or read from live in this
+    // loop, so everything it has in flight is cancelled and waited for
+    // before they go.
+    for (auto& connection : loop.byFd) {
+        if (connection != nullptr) {
+            disconnect(loop, *connection);
+        }
+    }
+    io_uring_sqe* sqe = prepare(loop, Cancel, nullptr);
+    if (sqe != nullptr) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    }
+    auto deadline = chrono::steady_clock::now() + SHUTDOWN_WAIT;
+    while (loop.requests > 0 && chrono::steady_clock::now() < deadline) {
+        if (!loop.ring.submit(1, 10 * 1000 * 1000)) {
+            break;
+        }
+        loop.ring.drain([this, &loop](const io_uring_cqe& cqe) { complete(loop, cqe); });
+    }
+    for (auto& connection : loop.byFd) {
+        if (connection != nullptr) {
+            releaseIfDone(loop, *connection);
+        }
+    }
+    if (loop.requests > 0) {
+        logger_.error("Event loop " + to_string(loop.index) + " stopped with " + to_string(loop.requests) +
+                      " io_uring requests unfinished");
+    }
+}
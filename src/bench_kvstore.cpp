@@ -0,0 +1,1768 @@
+#include "../include/KeyValueStore.h"
+#include "../include/CommandHandler.h"
+#include "../include/InputBuffer.h"
+#include "../include/MemoryInfo.h"
+#include "../include/ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef KVSTORE_EPOLL
+#include "../include/EpollReactor.h"
+#ifdef KVSTORE_URING
+#include "../include/UringReactor.h"
+#endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Throughput benchmarks for KeyValueStore. These are not registered with
+// ctest; run them on an otherwise idle machine.
+//
+// Usage: bench_kvstore [scenario ...]   (no arguments runs every scenario)
+
+// Heap accounting for the memory-per-key scenarios. Blocks are plain
+// malloc blocks so the store's own usable-size queries keep working; live
+// bytes are counted as the allocator's usable size, rounding included.
+static atomic<size_t> heapLiveBytes(0);
+static atomic<size_t> heapAllocations(0);
+// Every operator new call, never decremented, for allocations per command.
+static atomic<size_t> heapAllocationCalls(0);
+
+void* operator new(size_t size) {
+    void* block = malloc(size == 0 ? 1 : size);
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    // Written before usableSize sees it, which GCC otherwise takes for a
+    // read of uninitialized memory; the caller writes this line anyway.
+    *static_cast<unsigned char*>(block) = 0;
+    heapLiveBytes.fetch_add(MemoryInfo::usableSize(block), memory_order_relaxed);
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    heapAllocationCalls.fetch_add(1, memory_order_relaxed);
+    return block;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    heapLiveBytes.fetch_sub(MemoryInfo::usableSize(ptr), memory_order_relaxed);
+    heapAllocations.fetch_sub(1, memory_order_relaxed);
+    free(ptr);
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete[](void* ptr) noexcept { operator delete(ptr); }
+void operator delete(void* ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { operator delete(ptr); }
+
+namespace {
+
+string makeKey(size_t i) {
+    return "key:" + to_string(i);
+}
+
+// Runs body on numThreads threads for the given duration and returns the
+// total number of operations they report per second.
+double runTimed(int numThreads, chrono::milliseconds duration,
+                const function<size_t(int, const atomic<bool>&)>& body) {
+    atomic<bool> stop(false);
+    atomic<size_t> total(0);
+    vector<thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            total += body(t, stop);
+        });
+    }
+    auto start = chrono::steady_clock::now();
+    this_thread::sleep_for(duration);
+    stop = true;
+    for (auto& th : threads) {
+        th.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return total / elapsed.count();
+}
+
+vector<int> threadCounts() {
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    vector<int> counts;
+    for (int n = 1; n < maxThreads; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+// 95% GET / 5% SET over a preloaded keyspace. GET takes no lock, so
+// throughput should scale close to linearly with cores.
+void benchReadHeavy() {
+    const size_t numKeys = 1000000;
+    KeyValueStore store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), "value" + to_string(i));
+    }
+
+    double base = 0;
+    for (int numThreads : threadCounts()) {
+        double opsPerSec = runTimed(numThreads, chrono::milliseconds(1000),
+            [&store, numKeys](int t, const atomic<bool>& stop) {
+                mt19937_64 rng(t + 1);
+                vector<string> keys;
+                for (int i = 0; i < 4096; ++i) {
+                    keys.push_back(makeKey(rng() % numKeys));
+                }
+                size_t ops = 0;
+                while (!stop.load(memory_order_relaxed)) {
+                    const string& key = keys[ops & 4095];
+                    if (ops % 20 == 0) {
+                        store.set(key, "updated");
+                    } else {
+                        store.get(key);
+                    }
+                    ++ops;
+                }
+                return ops;
+            });
+        if (base == 0) {
+            base = opsPerSec;
+        }
+        cout << "read-heavy threads=" << numThreads
+             << " ops/s=" << static_cast<long long>(opsPerSec)
+             << " scaling=" << opsPerSec / base << endl;
+    }
+}
+
+// The pre-flat-table store layout: one std::unordered_map node per key
+// holding a std::string value and expiry, looked up under a mutex.
+class MapStore {
+public:
+    void set(const string& key, const string& value) {
+        lock_guard<mutex> lock(mutex_);
+        map_[key] = Value{value, {}};
+    }
+    string get(const string& key) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = map_.find(key);
+        return it == map_.end() ? string() : it->second.value;
+    }
+
+private:
+    struct Value {
+        string value;
+        chrono::system_clock::time_point expiry;
+    };
+    mutex mutex_;
+    unordered_map<string, Value> map_;
+};
+
+template <class Store>
+double nsPerGet(Store& store, size_t numKeys, size_t offset) {
+    const size_t lookups = 2000000;
+    mt19937_64 rng(42);
+    vector<string> keys;
+    keys.reserve(lookups);
+    for (size_t i = 0; i < lookups; ++i) {
+        keys.push_back(makeKey(offset + rng() % numKeys));
+    }
+    size_t bytes = 0;
+    auto start = chrono::steady_clock::now();
+    for (const auto& key : keys) {
+        bytes += store.get(key).size();
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    if (bytes == 42) {
+        cout << "";  // keep the loop from being optimised away
+    }
+    return elapsed.count() / lookups;
+}
+
+// Memory a store holds outside the counted heap: KeyValueStore entries
+// live in mmap'd slabs.
+size_t offHeapBytes(MapStore&) { return 0; }
+size_t offHeapBytes(KeyValueStore& store) { return store.memoryStats().slabBytes; }
+
+template <class Store>
+void benchTableWith(const char* name, size_t numKeys) {
+    size_t bytesBefore = heapLiveBytes, allocsBefore = heapAllocations;
+    Store store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), "value" + to_string(i));
+    }
+    // Give the store's cleaner a pass to free tables retired while growing.
+    this_thread::sleep_for(chrono::milliseconds(1500));
+    size_t bytes = heapLiveBytes - bytesBefore + offHeapBytes(store);
+    size_t allocs = heapAllocations - allocsBefore;
+    double hit = nsPerGet(store, numKeys, 0);
+    double miss = nsPerGet(store, numKeys, numKeys);
+    cout << "table keys=" << numKeys << " " << name
+         << " bytes/key=" << static_cast<double>(bytes) / numKeys
+         << " allocs/key=" << static_cast<double>(allocs) / numKeys
+         << " get_hit_ns=" << hit << " get_miss_ns=" << miss << endl;
+}
+
+// Memory per key and single-threaded GET latency of KeyValueStore ("flat")
+// against the unordered_map layout it replaced ("map"), with 10-16 byte keys
+// and values. Heap bytes are malloc usable sizes. Run each variant in a
+// fresh process for comparable numbers.
+void benchTable(const string& variant, size_t numKeys) {
+    if (variant == "flat") {
+        benchTableWith<KeyValueStore>("flat", numKeys);
+    } else {
+        benchTableWith<MapStore>("unordered_map", numKeys);
+    }
+}
+
+// Resident memory and heap allocation rate while loading keys shaped like
+// the production workload: 20-60 byte keys and 100-400 byte values.
+void benchAllocation(size_t numKeys, bool hugePages) {
+    mt19937_64 rng(11);
+    auto text = [&rng](size_t minLen, size_t maxLen) {
+        string s(minLen + rng() % (maxLen - minLen + 1), 'x');
+        for (auto& c : s) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+        return s;
+    };
+    vector<pair<string, string>> data;
+    data.reserve(numKeys);
+    for (size_t i = 0; i < numKeys; ++i) {
+        data.emplace_back(text(20, 60), text(100, 400));
+    }
+
+    size_t rssBefore = MemoryInfo::residentBytes();
+    size_t allocsBefore = heapAllocations;
+    auto start = chrono::steady_clock::now();
+    KeyValueStore store(KeyValueStore::DEFAULT_SHARD_COUNT, hugePages);
+    for (const auto& kv : data) {
+        store.set(kv.first, kv.second);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    size_t allocs = heapAllocations - allocsBefore;
+    size_t rss = MemoryInfo::residentBytes() - rssBefore;
+    MemoryStats memory = store.memoryStats();
+    cout << "alloc keys=" << numKeys << (hugePages ? " huge_pages" : "")
+         << " rss_mb_per_million=" << rss / 1048576.0 * 1000000 / numKeys
+         << " used_mb_per_million=" << memory.usedBytes / 1048576.0 * 1000000 / numKeys
+         << " heap_allocs_per_key=" << static_cast<double>(allocs) / numKeys
+         << " sets_per_sec=" << static_cast<long long>(numKeys / elapsed.count()) << endl;
+}
+
+// Save and load times for a snapshot of numKeys production-shaped entries
+// (20-60 byte keys, 100-400 byte values; 10M keys is a ~3 GB file) in both
+// formats. The file stays in the page cache, so this measures parsing and
+// insertion rather than the disk.
+void benchSnapshot(size_t numKeys) {
+    const string path = "bench_snapshot.tmp";
+    mt19937_64 rng(5);
+    double loadSeconds[2] = {0, 0};
+    for (SnapshotFormat format : {SnapshotFormat::Binary, SnapshotFormat::Text}) {
+        bool binary = format == SnapshotFormat::Binary;
+        size_t fileBytes = 0;
+        {
+            KeyValueStore store;
+            for (size_t i = 0; i < numKeys; ++i) {
+                string key = makeKey(i) + string(20 + rng() % 30, 'k');
+                store.set(key, string(100 + rng() % 301, 'v'));
+            }
+            auto start = chrono::steady_clock::now();
+            store.save(path, format);
+            chrono::duration<double> saved = chrono::steady_clock::now() - start;
+            ifstream file(path, ios::binary | ios::ate);
+            fileBytes = static_cast<size_t>(file.tellg());
+            cout << "snapshot keys=" << numKeys << " format=" << (binary ? "binary" : "text")
+                 << " file_mb=" << fileBytes / 1048576 << " save_s=" << saved.count() << endl;
+        }
+        KeyValueStore store;
+        auto start = chrono::steady_clock::now();
+        store.load(path);
+        chrono::duration<double> loaded = chrono::steady_clock::now() - start;
+        loadSeconds[binary ? 0 : 1] = loaded.count();
+        cout << "snapshot keys=" << numKeys << " format=" << (binary ? "binary" : "text")
+             << " load_s=" << loaded.count()
+             << " load_mb_per_s=" << fileBytes / 1048576.0 / loaded.count()
+             << " keys_loaded=" << store.getStats().totalKeys << endl;
+    }
+    cout << "snapshot keys=" << numKeys << " binary_speedup=" << loadSeconds[1] / loadSeconds[0] << endl;
+    remove(path.c_str());
+}
+
+// Startup time for one snapshot of numKeys production-shaped entries at 1,
+// 4 and 16 loader threads. Checksumming, hashing and entry construction are
+// spread over the workers, so time should fall with threads until it is
+// bound by the final swap or by memory bandwidth.
+void benchParallelLoad(size_t numKeys) {
+    const string path = "bench_load.tmp";
+    mt19937_64 rng(13);
+    {
+        KeyValueStore store;
+        for (size_t i = 0; i < numKeys; ++i) {
+            string key = makeKey(i) + string(20 + rng() % 30, 'k');
+            store.set(key, string(100 + rng() % 301, 'v'), i % 10 == 0 ? 3600 : 0);
+        }
+        store.save(path);
+    }
+    double single = 0;
+    for (size_t threads : {1, 4, 16}) {
+        KeyValueStore store;
+        auto start = chrono::steady_clock::now();
+        bool loaded = store.load(path, threads);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        if (threads == 1) {
+            single = elapsed.count();
+        }
+        cout << "load keys=" << numKeys << " threads=" << threads << " ok=" << loaded
+             << " load_s=" << elapsed.count() << " speedup=" << single / elapsed.count()
+             << " keys_loaded=" << store.getStats().totalKeys << endl;
+    }
+    remove(path.c_str());
+}
+
+// SET latency seen by another client while a full KEYS and then a full
+// SCAN (COUNT 1000) run over numKeys keys, and the largest single reply
+// each produces. KEYS holds each shard lock for the whole shard and
+// returns everything at once; SCAN holds a lock for one slice per call.
+void benchScan(size_t numKeys) {
+    KeyValueStore store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), "value");
+    }
+    struct Sample {
+        chrono::steady_clock::time_point at;
+        double micros;
+    };
+    vector<Sample> samples;
+    samples.reserve(20000000);
+    atomic<bool> stop(false);
+    thread writer([&] {
+        mt19937_64 rng(17);
+        while (!stop) {
+            string key = makeKey(rng() % numKeys);
+            auto start = chrono::steady_clock::now();
+            store.set(key, "rewritten");
+            auto end = chrono::steady_clock::now();
+            samples.push_back({start, chrono::duration<double, micro>(end - start).count()});
+        }
+    });
+
+    this_thread::sleep_for(chrono::milliseconds(200));
+    auto keysStart = chrono::steady_clock::now();
+    size_t all = store.keys().size();
+    auto keysEnd = chrono::steady_clock::now();
+
+    size_t returned = 0;
+    size_t largest = 0;
+    uint64_t cursor = 0;
+    do {
+        vector<string> batch;
+        cursor = store.scan(cursor, 1000, batch);
+        returned += batch.size();
+        largest = max(largest, batch.size());
+    } while (cursor != 0);
+    auto scanEnd = chrono::steady_clock::now();
+    stop = true;
+    writer.join();
+
+    auto report = [&](const char* command, chrono::steady_clock::time_point from, chrono::steady_clock::time_point to,
+                      size_t keys, size_t largestReply) {
+        vector<double> micros;
+        for (const auto& sample : samples) {
+            if (sample.at >= from && sample.at < to) {
+                micros.push_back(sample.micros);
+            }
+        }
+        sort(micros.begin(), micros.end());
+        cout << "scan keys=" << numKeys << " command=" << command
+             << " seconds=" << chrono::duration<double>(to - from).count()
+             << " keys_returned=" << keys << " largest_reply_keys=" << largestReply;
+        if (!micros.empty()) {
+            cout << " set_p99_us=" << micros[micros.size() * 99 / 100] << " set_max_us=" << micros.back();
+        }
+        cout << endl;
+    };
+    report("keys", keysStart, keysEnd, all, all);
+    report("scan", keysEnd, scanEnd, returned, largest);
+}
+
+// SET latency seen by another client while the store is idle, during a
+// SAVE and during a BGSAVE of numKeys ~150-byte values. Neither holds a
+// shard lock while writing the file, so both should leave the tail close
+// to idle; the difference is that SAVE keeps its own caller waiting.
+// Pipelined clients: depth commands per write, each write arriving as one
+// read. The loop is the one in Server::handleClient, with the socket calls
+// counted instead of made, and is compared with the old one send per
+// command.
+void benchPipeline(size_t numCommands) {
+    KeyValueStore store;
+    CommandHandler handler(store, Logger::getInstance());
+    for (size_t i = 0; i < 100000; ++i) {
+        store.set(makeKey(i), "value");
+    }
+    mt19937_64 rng(31);
+    vector<string> commands;
+    for (size_t i = 0; i < numCommands; ++i) {
+        string key = makeKey(rng() % 100000);
+        commands.push_back(rng() % 10 == 0 ? "SET " + key + " value\n" : "GET " + key + "\n");
+    }
+    for (size_t depth : {1, 10, 100}) {
+        vector<string> writes;
+        for (size_t i = 0; i < commands.size(); i += depth) {
+            string write;
+            for (size_t j = i; j < min(commands.size(), i + depth); ++j) {
+                write += commands[j];
+            }
+            writes.push_back(move(write));
+        }
+        for (bool coalesced : {false, true}) {
+            size_t recvs = 0, sends = 0, bytes = 0;
+            InputBuffer buffer;
+            string input, output;
+            auto start = chrono::steady_clock::now();
+            for (const auto& write : writes) {
+                recvs++;
+                if (coalesced) {
+                    buffer.append(write);
+                    handler.handlePipeline(buffer, output);
+                    sends++;
+                    bytes += output.size();
+                    output.clear();
+                } else {
+                    input += write;
+                    size_t pos;
+                    while ((pos = input.find('\n')) != string::npos) {
+                        string response = handler.handleCommand(input.substr(0, pos)) + "\n";
+                        input.erase(0, pos + 1);
+                        sends++;
+                        bytes += response.size();
+                    }
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "pipeline commands=" << numCommands << " depth=" << depth
+                 << " mode=" << (coalesced ? "coalesced" : "send-per-command")
+                 << " syscalls_per_command=" << static_cast<double>(recvs + sends) / numCommands
+                 << " commands_per_sec=" << static_cast<size_t>(numCommands / seconds)
+                 << " reply_bytes=" << bytes << endl;
+        }
+    }
+}
+
+// The pipeline bench's mix sent as redis-benchmark sends it, RESP
+// multibulk, against the inline text protocol, fed in 16 KB reads as the
+// server receives it. Values are 3 bytes, redis-benchmark's default, and
+// then 32 KB, which arrive across reads and are waited for once their
+// header is in.
+void benchResp(size_t numCommands) {
+    KeyValueStore store;
+    CommandHandler handler(store, Logger::getInstance());
+    const size_t readSize = 16384;
+    for (size_t valueSize : {size_t(3), size_t(32768)}) {
+        store.clear();
+        string value(valueSize, 'v');
+        bool large = valueSize > 1024;
+        size_t keys = large ? 1000 : 100000;
+        size_t commandsForSize = large ? numCommands / 100 : numCommands;
+        for (size_t i = 0; i < keys; ++i) {
+            store.set(makeKey(i), value);
+        }
+        for (Protocol protocol : {Protocol::Inline, Protocol::Resp}) {
+            mt19937_64 rng(37);
+            string stream;
+            for (size_t i = 0; i < commandsForSize; ++i) {
+                string key = makeKey(rng() % keys);
+                bool set = rng() % 10 == 0;
+                if (protocol == Protocol::Inline) {
+                    stream += set ? "SET " + key + " " + value + "\n" : "GET " + key + "\n";
+                } else if (set) {
+                    stream += "*3\r\n$3\r\nSET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n$" +
+                              to_string(value.size()) + "\r\n" + value + "\r\n";
+                } else {
+                    stream += "*2\r\n$3\r\nGET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n";
+                }
+            }
+            size_t replyBytes = 0;
+            InputBuffer input;
+            string output;
+            auto start = chrono::steady_clock::now();
+            for (size_t at = 0; at < stream.size(); at += readSize) {
+                input.append(string_view(stream).substr(at, readSize));
+                handler.handlePipeline(input, output);
+                replyBytes += output.size();
+                output.clear();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "resp commands=" << commandsForSize << " value_bytes=" << valueSize
+                 << " protocol=" << (protocol == Protocol::Resp ? "resp" : "inline")
+                 << " commands_per_sec=" << static_cast<size_t>(commandsForSize / seconds)
+                 << " request_bytes=" << stream.size() << " reply_bytes=" << replyBytes << endl;
+        }
+    }
+}
+
+// Command framing alone. First the line scanner against memchr over lines
+// of 8 to 1024 bytes, in ns per line. Then a connection's input kept the
+// way it was before InputBuffer, a string parsed again from its start
+// after each read and erased up to the unfinished command, against
+// handlePipeline on an InputBuffer, fed in 16 KB reads: pipelined RESP GETs,
+// SETs of values from 1 KB to 1 MB that arrive across reads, and one MDEL
+// of 1,000 to 100,000 keys, whose arguments the string way parses again
+// on every read and the buffer only once.
+void benchFraming(size_t numCommands) {
+    for (size_t length : {size_t(8), size_t(32), size_t(128), size_t(1024)}) {
+        size_t lines = max<size_t>(1000, numCommands * 32 / length);
+        string text;
+        text.reserve(lines * length);
+        for (size_t i = 0; i < lines; ++i) {
+            text.append(length - 1, 'a');
+            text += '\n';
+        }
+        for (bool simd : {false, true}) {
+            auto start = chrono::steady_clock::now();
+            size_t found = 0;
+            for (size_t at = 0; at < text.size(); ++found) {
+                size_t rest = text.size() - at;
+                if (simd) {
+                    at += RespParser::find(text.data() + at, rest, '\n') + 1;
+                } else {
+                    auto end = static_cast<const char*>(memchr(text.data() + at, '\n', rest));
+                    at = end ? static_cast<size_t>(end - text.data()) + 1 : text.size();
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "framing scan line_bytes=" << length << " scanner=" << (simd ? "simd" : "memchr")
+                 << " lines=" << found << " ns_per_line=" << seconds * 1e9 / found << endl;
+        }
+    }
+
+    KeyValueStore store;
+    CommandHandler handler(store, Logger::getInstance());
+    const size_t readSize = 16384;
+    for (size_t valueSize : {size_t(0), size_t(1024), size_t(65536), size_t(1 << 20)}) {
+        string value(valueSize, 'v');
+        size_t commands = valueSize == 0 ? numCommands : max<size_t>(16, numCommands * 32 / valueSize);
+        string stream;
+        for (size_t i = 0; i < commands; ++i) {
+            string key = makeKey(i % 1000);
+            stream += valueSize == 0 ? "*2\r\n$3\r\nGET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n"
+                                     : "*3\r\n$3\r\nSET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n$" +
+                                           to_string(value.size()) + "\r\n" + value + "\r\n";
+        }
+        for (bool buffered : {false, true}) {
+            // The same store for both, so neither frees values the other
+            // set.
+            store.clear();
+            for (size_t i = 0; i < 1000; ++i) {
+                store.set(makeKey(i), "value");
+            }
+            string input, output;
+            InputBuffer buffer;
+            vector<string_view> args;
+            auto start = chrono::steady_clock::now();
+            for (size_t at = 0; at < stream.size(); at += readSize) {
+                string_view read = string_view(stream).substr(at, readSize);
+                if (buffered) {
+                    buffer.append(read);
+                    handler.handlePipeline(buffer, output);
+                } else {
+                    input.append(read);
+                    size_t done = 0, consumed;
+                    Protocol protocol;
+                    string error;
+                    while (RespParser::parse(input.data() + done, input.size() - done, args, consumed, protocol,
+                                             error) == RespParser::Status::Complete) {
+                        handler.runCommand(args, protocol, output);
+                        done += consumed;
+                    }
+                    input.erase(0, done);
+                }
+                output.clear();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "framing input=" << (buffered ? "input-buffer" : "string") << " command="
+                 << (valueSize == 0 ? "get" : "set") << " value_bytes=" << valueSize << " commands=" << commands
+                 << " ns_per_command=" << seconds * 1e9 / commands
+                 << " mb_per_sec=" << stream.size() / seconds / 1e6 << endl;
+        }
+    }
+
+    for (size_t keys : {size_t(1000), size_t(10000), size_t(100000)}) {
+        string stream = "*" + to_string(keys + 1) + "\r\n$4\r\nMDEL\r\n";
+        for (size_t i = 0; i < keys; ++i) {
+            string key = makeKey(i);
+            stream += "$" + to_string(key.size()) + "\r\n" + key + "\r\n";
+        }
+        for (bool buffered : {false, true}) {
+            string input, output;
+            InputBuffer buffer;
+            vector<string_view> args;
+            auto start = chrono::steady_clock::now();
+            for (size_t at = 0; at < stream.size(); at += readSize) {
+                string_view read = string_view(stream).substr(at, readSize);
+                if (buffered) {
+                    buffer.append(read);
+                    handler.handlePipeline(buffer, output);
+                } else {
+                    input.append(read);
+                    size_t consumed;
+                    Protocol protocol;
+                    string error;
+                    if (RespParser::parse(input.data(), input.size(), args, consumed, protocol, error) ==
+                        RespParser::Status::Complete) {
+                        handler.runCommand(args, protocol, output);
+                        input.erase(0, consumed);
+                    }
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "framing input=" << (buffered ? "input-buffer" : "string") << " command=mdel args=" << keys
+                 << " reads=" << (stream.size() + readSize - 1) / readSize << " ms=" << seconds * 1e3 << endl;
+        }
+    }
+}
+
+// Heap allocations and time per command through the handler, commands
+// and buffers prepared up front so only dispatch, the store and the reply
+// are measured: GET hits and misses one per handleCommand call, and GET
+// hits pipelined 16 deep through handlePipeline in each protocol. The
+// count includes the store's background threads, so it may be a hair
+// above zero.
+void benchDispatch(size_t numCommands) {
+    KeyValueStore store;
+    CommandHandler handler(store, Logger::getInstance());
+    const size_t keys = 1000;
+    for (size_t i = 0; i < keys; ++i) {
+        store.set(makeKey(i), "value");
+    }
+    vector<string> hits, misses, inlineChunks, respChunks;
+    for (size_t i = 0; i < keys; ++i) {
+        string key = makeKey(i);
+        hits.push_back("GET " + key);
+        misses.push_back("get missing:" + to_string(i));
+    }
+    for (size_t i = 0; i < keys; i += 16) {
+        string inlineChunk, respChunk;
+        for (size_t j = i; j < min(keys, i + 16); ++j) {
+            string key = makeKey(j);
+            inlineChunk += "GET " + key + "\r\n";
+            respChunk += "*2\r\n$3\r\nGET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n";
+        }
+        inlineChunks.push_back(move(inlineChunk));
+        respChunks.push_back(move(respChunk));
+    }
+
+    auto report = [&](const char* name, size_t commands, const function<void()>& run) {
+        run();  // warm-up: thread-local and reply buffers reach their size
+        size_t allocations = heapAllocationCalls.load();
+        auto start = chrono::steady_clock::now();
+        run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        allocations = heapAllocationCalls.load() - allocations;
+        cout << "dispatch case=" << name << " commands=" << commands
+             << " allocations_per_command=" << static_cast<double>(allocations) / commands
+             << " ns_per_command=" << seconds * 1e9 / commands << endl;
+    };
+    size_t rounds = max<size_t>(1, numCommands / keys);
+    for (auto [name, lines] : {make_pair("handleCommand-get-hit", &hits), make_pair("handleCommand-get-miss", &misses)}) {
+        report(name, rounds * keys, [&, lines = lines] {
+            for (size_t r = 0; r < rounds; ++r) {
+                for (const auto& line : *lines) {
+                    string response = handler.handleCommand(line);
+                }
+            }
+        });
+    }
+    InputBuffer input;
+    string output;
+    output.reserve(4096);
+    for (auto [name, chunks] : {make_pair("pipeline-inline-get", &inlineChunks), make_pair("pipeline-resp-get", &respChunks)}) {
+        report(name, rounds * keys, [&, chunks = chunks] {
+            for (size_t r = 0; r < rounds; ++r) {
+                for (const auto& chunk : *chunks) {
+                    input.clear();
+                    input.append(chunk);
+                    handler.handlePipeline(input, output);
+                    output.clear();
+                }
+            }
+        });
+    }
+}
+
+// Batches of batchSize random keys as one MGET/MSET/MDEL against the same
+// keys as single-key calls, in keys per second.
+void benchBatch(size_t numKeys, size_t batchSize) {
+    KeyValueStore store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), "value");
+    }
+    auto makeBatch = [numKeys, batchSize](mt19937_64& rng) {
+        vector<string> keys;
+        for (size_t i = 0; i < batchSize; ++i) {
+            keys.push_back(makeKey(rng() % numKeys));
+        }
+        return keys;
+    };
+    using Op = function<void(const vector<string>&)>;
+    vector<pair<string, Op>> ops = {
+        {"get", [&store](const vector<string>& keys) {
+            for (const auto& key : keys) {
+                store.get(key);
+            }
+        }},
+        {"mget", [&store](const vector<string>& keys) { store.mget(keys, [](optional<string_view>) {}); }},
+        {"set", [&store](const vector<string>& keys) {
+            for (const auto& key : keys) {
+                store.set(key, "value");
+            }
+        }},
+        {"mset", [&store](const vector<string>& keys) {
+            vector<pair<string, string>> pairs;
+            for (const auto& key : keys) {
+                pairs.emplace_back(key, "value");
+            }
+            store.mset(pairs);
+        }},
+    };
+    // Untimed, so the first variant measured does not pay for warming up.
+    mt19937_64 warmRng(0);
+    for (int i = 0; i < 20000; ++i) {
+        ops[0].second(makeBatch(warmRng));
+    }
+    for (int threads : threadCounts()) {
+        for (const auto& op : ops) {
+            double batches = runTimed(threads, chrono::milliseconds(1000), [&](int t, const atomic<bool>& stop) {
+                mt19937_64 rng(t + 1);
+                // Batches are drawn in advance so only the calls are timed.
+                vector<vector<string>> prepared;
+                for (int i = 0; i < 64; ++i) {
+                    prepared.push_back(makeBatch(rng));
+                }
+                size_t done = 0;
+                while (!stop) {
+                    op.second(prepared[done++ % prepared.size()]);
+                }
+                return done;
+            });
+            cout << "batch keys=" << numKeys << " batch=" << batchSize << " threads=" << threads
+                 << " op=" << op.first << " keys_per_sec=" << static_cast<size_t>(batches * batchSize) << endl;
+        }
+    }
+
+    // Deletes only count once per key, so they are timed over emptying the
+    // whole store in random order.
+    for (const char* op : {"del", "mdel"}) {
+        vector<string> keys;
+        for (size_t i = 0; i < numKeys; ++i) {
+            keys.push_back(makeKey(i));
+        }
+        for (const auto& key : keys) {
+            store.set(key, "value");
+        }
+        shuffle(keys.begin(), keys.end(), mt19937_64(29));
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < numKeys; i += batchSize) {
+            vector<string> batch(keys.begin() + i, keys.begin() + min(numKeys, i + batchSize));
+            if (op[0] == 'm') {
+                store.mdel(batch);
+            } else {
+                for (const auto& key : batch) {
+                    store.del(key);
+                }
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "batch keys=" << numKeys << " batch=" << batchSize << " threads=1 op=" << op
+             << " keys_per_sec=" << static_cast<size_t>(numKeys / seconds) << endl;
+    }
+}
+
+// PREFIX with a LIMIT answered from the ordered index against the same
+// query done by filtering KEYS, plus what the index costs SET and memory.
+void benchPrefix(size_t numKeys) {
+    auto timeSets = [numKeys](KeyValueStore& store) {
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < numKeys; ++i) {
+            store.set(makeKey(i), "value");
+        }
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    KeyValueStore plain;
+    double plainSeconds = timeSets(plain);
+    KeyValueStore store;
+    store.setOrderedIndex(true);
+    double indexedSeconds = timeSets(store);
+    MemoryStats memory = store.memoryStats();
+    cout << "prefix keys=" << numKeys << " set_seconds_plain=" << plainSeconds
+         << " set_seconds_indexed=" << indexedSeconds
+         << " index_bytes_per_key=" << static_cast<double>(memory.indexBytes) / numKeys << endl;
+
+    const int queries = 1000;
+    mt19937_64 rng(23);
+    for (size_t limit : {10, 100, 1000}) {
+        size_t returned = 0;
+        auto start = chrono::steady_clock::now();
+        for (int q = 0; q < queries; ++q) {
+            vector<string> keys;
+            // About 1100 matches each: key:NNN and its extensions.
+            store.prefix(makeKey(rng() % 1000), limit, keys);
+            returned += keys.size();
+        }
+        double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / queries;
+        cout << "prefix keys=" << numKeys << " command=prefix limit=" << limit << " us_per_query=" << micros
+             << " keys_per_query=" << static_cast<double>(returned) / queries << endl;
+    }
+    auto start = chrono::steady_clock::now();
+    string wanted = makeKey(rng() % 1000);
+    vector<string> all = store.keys();
+    size_t matched = count_if(all.begin(), all.end(), [&wanted](const string& key) {
+        return key.compare(0, wanted.size(), wanted) == 0;
+    });
+    double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    cout << "prefix keys=" << numKeys << " command=keys-filter us_per_query=" << micros
+         << " keys_per_query=" << matched << endl;
+}
+
+void benchBackgroundSave(size_t numKeys) {
+    const string path = "bench_bgsave.tmp";
+    KeyValueStore store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), string(150, 'v'));
+    }
+    struct Sample {
+        chrono::steady_clock::time_point at;
+        double micros;
+    };
+    vector<Sample> samples;
+    samples.reserve(20000000);
+    atomic<bool> stop(false);
+    thread writer([&] {
+        mt19937_64 rng(9);
+        while (!stop) {
+            string key = makeKey(rng() % numKeys);
+            auto start = chrono::steady_clock::now();
+            store.set(key, string(150, 'w'));
+            auto end = chrono::steady_clock::now();
+            samples.push_back({start, chrono::duration<double, micro>(end - start).count()});
+        }
+    });
+
+    using Window = pair<chrono::steady_clock::time_point, chrono::steady_clock::time_point>;
+    Window idle, save, bgsave;
+    idle.first = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::seconds(2));
+    idle.second = save.first = chrono::steady_clock::now();
+    store.save(path);
+    save.second = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::milliseconds(500));
+    bgsave.first = chrono::steady_clock::now();
+    store.bgsave(path);
+    chrono::duration<double, micro> started = chrono::steady_clock::now() - bgsave.first;
+    while (store.getStats().bgsaveInProgress) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    bgsave.second = chrono::steady_clock::now();
+    stop = true;
+    writer.join();
+
+    auto report = [&](const char* phase, const Window& window) {
+        vector<double> micros;
+        for (const auto& sample : samples) {
+            if (sample.at >= window.first && sample.at < window.second) {
+                micros.push_back(sample.micros);
+            }
+        }
+        if (micros.empty()) {
+            return;
+        }
+        sort(micros.begin(), micros.end());
+        cout << "bgsave keys=" << numKeys << " phase=" << phase
+             << " seconds=" << chrono::duration<double>(window.second - window.first).count()
+             << " sets=" << micros.size()
+             << " set_p50_us=" << micros[micros.size() / 2]
+             << " set_p99_us=" << micros[micros.size() * 99 / 100]
+             << " set_max_us=" << micros.back() << endl;
+    };
+    report("idle", idle);
+    report("save", save);
+    report("bgsave", bgsave);
+    cout << "bgsave keys=" << numKeys << " bgsave_call_us=" << started.count() << endl;
+    remove(path.c_str());
+}
+
+// SET throughput with the append-only log off and under each fsync policy,
+// over a preloaded keyspace of numKeys 100-byte values, then the time to
+// replay the resulting log. Under "always" concurrent writers share syncs,
+// so its throughput should grow with the thread count.
+void benchAppendLog(size_t numKeys) {
+    const string path = "bench_appendonly.tmp";
+    const string value(100, 'v');
+    // Writers under "always" mostly sleep in the sync, so they are worth
+    // running beyond the core count.
+    for (int threads : {1, 4, 16}) {
+        double baseline = 0;
+        for (int mode = -1; mode < 3; ++mode) {
+            remove(path.c_str());
+            KeyValueStore store;
+            if (mode >= 0) {
+                FsyncPolicy policy = static_cast<FsyncPolicy>(mode);
+                store.openAppendLog(path, policy);
+            }
+            for (size_t i = 0; i < numKeys; ++i) {
+                store.set(makeKey(i), value);
+            }
+            double ops = runTimed(threads, chrono::seconds(2), [&](int t, const atomic<bool>& stop) {
+                mt19937_64 rng(t + 1);
+                size_t done = 0;
+                while (!stop) {
+                    store.set(makeKey(rng() % numKeys), value);
+                    done++;
+                }
+                return done;
+            });
+            if (mode < 0) {
+                baseline = ops;
+            }
+            cout << "appendlog keys=" << numKeys << " threads=" << threads
+                 << " fsync=" << (mode < 0 ? "off" : AppendLog::policyName(static_cast<FsyncPolicy>(mode)))
+                 << " set_ops_per_sec=" << ops << " vs_off=" << ops / baseline << endl;
+        }
+    }
+
+    // Replay of the last log written: the preload plus the timed writes.
+    ifstream file(path, ios::binary | ios::ate);
+    double logMb = static_cast<double>(file.tellg()) / 1048576;
+    KeyValueStore store;
+    auto start = chrono::steady_clock::now();
+    store.openAppendLog(path, FsyncPolicy::No);
+    chrono::duration<double> replayed = chrono::steady_clock::now() - start;
+    cout << "appendlog replay log_mb=" << logMb << " replay_s=" << replayed.count()
+         << " replay_mb_per_s=" << logMb / replayed.count()
+         << " keys=" << store.getStats().totalKeys << endl;
+    remove(path.c_str());
+}
+
+// SET latency seen by a client while the append-only log is idle and while
+// it is being rewritten, after numKeys 100-byte values have each been
+// overwritten three times. The rewrite only copies shard tables under the
+// shard locks, so the tail should stay close to idle; the log should come
+// out at about a quarter of its size.
+void benchLogRewrite(size_t numKeys) {
+    const string path = "bench_rewrite.tmp";
+    const string value(100, 'v');
+    remove(path.c_str());
+    KeyValueStore store;
+    store.setAutoRewritePercentage(0);
+    store.openAppendLog(path, FsyncPolicy::EverySecond);
+    for (int round = 0; round < 4; ++round) {
+        for (size_t i = 0; i < numKeys; ++i) {
+            store.set(makeKey(i), value);
+        }
+    }
+    uint64_t before = store.getStats().appendLogBytes;
+
+    struct Sample {
+        chrono::steady_clock::time_point at;
+        double micros;
+    };
+    vector<Sample> samples;
+    samples.reserve(20000000);
+    atomic<bool> stop(false);
+    thread writer([&] {
+        mt19937_64 rng(11);
+        while (!stop) {
+            string key = makeKey(rng() % numKeys);
+            auto start = chrono::steady_clock::now();
+            store.set(key, value);
+            auto end = chrono::steady_clock::now();
+            samples.push_back({start, chrono::duration<double, micro>(end - start).count()});
+        }
+    });
+    this_thread::sleep_for(chrono::seconds(2));
+    auto rewriteStart = chrono::steady_clock::now();
+    store.bgrewriteaof();
+    while (store.rewriteInProgress()) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    auto rewriteEnd = chrono::steady_clock::now();
+    stop = true;
+    writer.join();
+
+    for (bool rewriting : {false, true}) {
+        vector<double> micros;
+        for (const auto& sample : samples) {
+            if ((sample.at >= rewriteStart && sample.at < rewriteEnd) == rewriting) {
+                micros.push_back(sample.micros);
+            }
+        }
+        if (micros.empty()) {
+            continue;
+        }
+        sort(micros.begin(), micros.end());
+        cout << "aofrewrite keys=" << numKeys << " phase=" << (rewriting ? "rewrite" : "idle")
+             << " sets=" << micros.size()
+             << " set_p50_us=" << micros[micros.size() / 2]
+             << " set_p99_us=" << micros[micros.size() * 99 / 100]
+             << " set_max_us=" << micros.back() << endl;
+    }
+    StoreStats stats = store.getStats();
+    cout << "aofrewrite keys=" << numKeys << " ok=" << stats.lastRewriteOk
+         << " rewrite_ms=" << stats.lastRewriteMillis
+         << " log_mb_before=" << before / 1048576.0
+         << " log_mb_after=" << stats.appendLogBaseBytes / 1048576.0 << endl;
+    remove(path.c_str());
+}
+
+// Worst-case SET latency over a large keyspace where a small fraction of
+// keys carry a TTL. Expiry work should scale with the keys that are due,
+// not with the size of the store, so the tail stays flat as keys grow.
+void benchExpiry(size_t numKeys) {
+    KeyValueStore store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), "value", i % 100 == 0 ? 1 : 0);
+    }
+    vector<double> micros;
+    mt19937_64 rng(7);
+    auto end = chrono::steady_clock::now() + chrono::seconds(3);
+    while (chrono::steady_clock::now() < end) {
+        string key = makeKey(rng() % numKeys);
+        auto start = chrono::steady_clock::now();
+        store.set(key, "rewritten");
+        chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+        micros.push_back(elapsed.count());
+    }
+    sort(micros.begin(), micros.end());
+    cout << "expiry keys=" << numKeys << " remaining=" << store.getStats().totalKeys
+         << " set_p50_us=" << micros[micros.size() / 2]
+         << " set_p999_us=" << micros[micros.size() * 999 / 1000]
+         << " set_max_us=" << micros.back() << endl;
+}
+
+// ThreadPool as it was before work stealing: one queue of std::function
+// behind one mutex and condition variable, kept as the baseline.
+class MutexPool {
+public:
+    explicit MutexPool(size_t numThreads) {
+        for (size_t i = 0; i < numThreads; ++i) {
+            workers_.emplace_back([this] {
+                while (true) {
+                    function<void()> task;
+                    {
+                        unique_lock<mutex> lock(mutex_);
+                        condition_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                        if (stop_ && tasks_.empty()) {
+                            return;
+                        }
+                        task = move(tasks_.front());
+                        tasks_.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+    ~MutexPool() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stop_ = true;
+        }
+        condition_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+    template <class F>
+    void submit(F&& f) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            tasks_.emplace(forward<F>(f));
+        }
+        condition_.notify_one();
+    }
+
+private:
+    vector<thread> workers_;
+    queue<function<void()>> tasks_;
+    mutex mutex_;
+    condition_variable condition_;
+    bool stop_ = false;
+};
+
+// Submit-to-finish throughput of numTasks small tasks, each capturing 32
+// bytes (past std::function's inline room), and heap allocations per
+// task: from one outside thread, from four, and as a fork-join tree whose
+// tasks submit their two halves from inside the pool.
+template <class Pool>
+void benchPoolWith(const char* name, size_t numTasks) {
+    size_t workers = max(2u, thread::hardware_concurrency());
+    auto report = [&](const char* mode, const function<void(Pool&, atomic<size_t>&)>& run) {
+        atomic<size_t> done{0};
+        size_t allocations;
+        double seconds;
+        {
+            Pool pool(workers);
+            allocations = heapAllocationCalls.load();
+            auto start = chrono::steady_clock::now();
+            run(pool, done);
+            while (done.load(memory_order_acquire) < numTasks) {
+                this_thread::yield();
+            }
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            allocations = heapAllocationCalls.load() - allocations;
+        }
+        cout << "threadpool pool=" << name << " mode=" << mode << " workers=" << workers << " tasks=" << numTasks
+             << " tasks_per_sec=" << static_cast<size_t>(numTasks / seconds)
+             << " allocations_per_task=" << static_cast<double>(allocations) / numTasks << endl;
+    };
+
+    for (size_t submitters : {1, 4}) {
+        string mode = "external-" + to_string(submitters);
+        report(mode.c_str(), [&](Pool& pool, atomic<size_t>& done) {
+            vector<thread> threads;
+            for (size_t t = 0; t < submitters; ++t) {
+                threads.emplace_back([&, t] {
+                    for (size_t i = t; i < numTasks; i += submitters) {
+                        size_t payload[3] = {t, i, 1};
+                        pool.submit([&done, payload] { done.fetch_add(payload[2], memory_order_relaxed); });
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        });
+    }
+
+    report("fork-join", [&](Pool& pool, atomic<size_t>& done) {
+        // Leaves are the tasks counted; each splits its range in two.
+        struct Split {
+            Pool* pool;
+            atomic<size_t>* done;
+            size_t begin, end;
+            void operator()() const {
+                if (end - begin == 1) {
+                    done->fetch_add(1, memory_order_relaxed);
+                    return;
+                }
+                size_t middle = begin + (end - begin) / 2;
+                pool->submit(Split{pool, done, begin, middle});
+                pool->submit(Split{pool, done, middle, end});
+            }
+        };
+        pool.submit(Split{&pool, &done, 0, numTasks});
+    });
+}
+
+void benchThreadPool(size_t numTasks) {
+    benchPoolWith<MutexPool>("mutex", numTasks);
+    benchPoolWith<ThreadPool>("work-stealing", numTasks);
+}
+
+#ifdef KVSTORE_EPOLL
+// Client end of the connections scenario. Every connection opens with a
+// RESP PING, so the server never greets it, and then waits; the first
+// active of them each keep one GET outstanding for two seconds while the
+// rest stay idle.
+class ConnectionClients {
+public:
+    ConnectionClients(int port, size_t count) : port_(port), count_(count), epollFd_(epoll_create1(0)) {}
+    ~ConnectionClients() {
+        for (const auto& connection : connections_) {
+            close(connection.fd);
+        }
+        close(epollFd_);
+    }
+
+    // Opens every connection and waits for each PONG.
+    void open() {
+        const string ping = "*1\r\n$4\r\nPING\r\n";
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < count_; ++i) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<uint16_t>(port_));
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                perror("connect");
+                exit(1);
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = connections_.size();
+            epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+            connections_.push_back(Connection{fd, 0, start});
+            send(fd, ping.data(), ping.size(), MSG_NOSIGNAL);
+            connections_.back().expected = 7;  // +PONG\r\n
+        }
+        double connectSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        drain();
+        double servedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "connections open=" << count_ << " connect_seconds=" << connectSeconds
+             << " all_answered_seconds=" << servedSeconds << endl;
+    }
+
+    // Closed-loop GETs on the first active connections for duration.
+    void run(size_t active, chrono::milliseconds duration) {
+        vector<double> micros;
+        auto start = chrono::steady_clock::now();
+        auto deadline = start + duration;
+        for (size_t i = 0; i < active; ++i) {
+            request(connections_[i]);
+        }
+        size_t completed = 0;
+        epoll_event events[1024];
+        while (chrono::steady_clock::now() < deadline) {
+            int ready = epoll_wait(epollFd_, events, 1024, 100);
+            auto now = chrono::steady_clock::now();
+            for (int i = 0; i < ready; ++i) {
+                Connection& connection = connections_[events[i].data.u64];
+                if (receive(connection)) {
+                    micros.push_back(chrono::duration<double, micro>(now - connection.sent).count());
+                    completed++;
+                    if (now < deadline) {
+                        request(connection);
+                    }
+                }
+            }
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        drain();
+        sort(micros.begin(), micros.end());
+        cout << "connections open=" << count_ << " active=" << active
+             << " gets_per_sec=" << static_cast<size_t>(completed / seconds)
+             << " p50_us=" << (micros.empty() ? 0 : micros[micros.size() / 2])
+             << " p99_us=" << (micros.empty() ? 0 : micros[micros.size() * 99 / 100]) << endl;
+    }
+
+private:
+    struct Connection {
+        int fd;
+        size_t expected;  // reply bytes still to come
+        chrono::steady_clock::time_point sent;
+    };
+
+    void request(Connection& connection) {
+        static const string get = "*2\r\n$3\r\nGET\r\n$3\r\nkey\r\n";
+        connection.sent = chrono::steady_clock::now();
+        connection.expected = 11;  // $5\r\nvalue\r\n
+        send(connection.fd, get.data(), get.size(), MSG_NOSIGNAL);
+    }
+
+    // Reads what has arrived; true once the whole reply is in.
+    bool receive(Connection& connection) {
+        char buffer[64];
+        while (connection.expected > 0) {
+            ssize_t n = recv(connection.fd, buffer, min(sizeof(buffer), connection.expected), 0);
+            if (n <= 0) {
+                return false;
+            }
+            connection.expected -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Waits for every outstanding reply.
+    void drain() {
+        size_t outstanding = 0;
+        for (const auto& connection : connections_) {
+            outstanding += connection.expected > 0 ? 1 : 0;
+        }
+        epoll_event events[1024];
+        while (outstanding > 0) {
+            int ready = epoll_wait(epollFd_, events, 1024, 1000);
+            if (ready <= 0) {
+                cerr << "connections: " << outstanding << " replies never came" << endl;
+                exit(1);
+            }
+            for (int i = 0; i < ready; ++i) {
+                if (receive(connections_[events[i].data.u64])) {
+                    outstanding--;
+                }
+            }
+        }
+    }
+
+    int port_;
+    size_t count_;
+    int epollFd_;
+    vector<Connection> connections_;
+};
+
+// numConnections clients held open against the epoll engine at once,
+// from a child process so the two ends do not share one descriptor limit:
+// how long they take to connect and be answered, what an idle connection
+// costs the server, and GET throughput and latency with 100 of them
+// active beside the idle rest, and then all of them.
+void benchConnections(size_t numConnections) {
+    int toChild[2], toParent[2];
+    if (pipe(toChild) != 0 || pipe(toParent) != 0) {
+        perror("pipe");
+        return;
+    }
+    cout.flush();
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return;
+    }
+    if (child == 0) {
+        int port;
+        char go;
+        if (read(toChild[0], &port, sizeof(port)) != sizeof(port)) {
+            _exit(1);
+        }
+        {
+            ConnectionClients clients(port, numConnections);
+            clients.open();
+            cout.flush();
+            if (write(toParent[1], "i", 1) != 1 || read(toChild[0], &go, 1) != 1) {
+                _exit(1);
+            }
+            clients.run(100, chrono::milliseconds(2000));
+            clients.run(numConnections, chrono::milliseconds(2000));
+            cout.flush();
+        }
+        _exit(0);
+    }
+
+    KeyValueStore store;
+    CommandHandler handler(store, Logger::getInstance());
+    store.set("key", "value");
+    size_t heapBefore = heapLiveBytes.load();
+    EpollReactor reactor(handler, Logger::getInstance(), "welcome\n", chrono::milliseconds(100));
+    if (!reactor.start(0)) {
+        cerr << "connections: the engine did not start" << endl;
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        return;
+    }
+    int port = reactor.port();
+    char idle;
+    if (write(toChild[1], &port, sizeof(port)) == sizeof(port) && read(toParent[0], &idle, 1) == 1) {
+        size_t connections = reactor.connectionCount();
+        cout << "connections open=" << connections << " loops=" << EpollReactor::defaultLoops()
+             << " server_heap_bytes_per_idle_connection="
+             << (heapLiveBytes.load() - heapBefore) / max<size_t>(connections, 1) << endl;
+        cout.flush();
+        if (write(toChild[1], "g", 1) != 1) {
+            kill(child, SIGKILL);
+        }
+    }
+    waitpid(child, nullptr, 0);
+    reactor.stop();
+    for (int fd : {toChild[0], toChild[1], toParent[0], toParent[1]}) {
+        close(fd);
+    }
+}
+// Closed-loop RESP load from a forked process: connections spread over
+// threads, each connection sending depth commands (90% GET, 10% SET of
+// valueBytes-byte values over numKeys keys, which should hold values of
+// that size) and waiting for all of their replies before the next batch.
+// Returns the commands answered per second.
+double forkedLoad(int port, size_t connections, size_t threads, size_t depth, size_t numKeys,
+                  chrono::milliseconds duration, size_t valueBytes = 16) {
+    int results[2];
+    if (pipe(results) != 0) {
+        perror("pipe");
+        return 0;
+    }
+    cout.flush();
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (child == 0) {
+        atomic<size_t> completed(0);
+        auto deadline = chrono::steady_clock::now() + duration;
+        vector<thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                int epollFd = epoll_create1(0);
+                vector<int> fds;
+                vector<size_t> expected;  // reply bytes still to come, per connection
+                mt19937_64 rng(t);
+                uniform_int_distribution<size_t> keys(0, numKeys - 1);
+                string batch;
+                string value = "$" + to_string(valueBytes) + "\r\n" + string(valueBytes, 'v') + "\r\n";
+                auto sendBatch = [&](size_t c) {
+                    batch.clear();
+                    for (size_t i = 0; i < depth; ++i) {
+                        string key = makeKey(keys(rng));
+                        if (rng() % 10 == 0) {
+                            batch += "*3\r\n$3\r\nSET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n" + value;
+                            expected[c] += 5;  // +OK\r\n
+                        } else {
+                            batch += "*2\r\n$3\r\nGET\r\n$" + to_string(key.size()) + "\r\n" + key + "\r\n";
+                            expected[c] += value.size();  // the reply is the bulk string SET sends
+                        }
+                    }
+                    // Blocking for what the socket will not take at once,
+                    // as a large batch may not fit.
+                    size_t sent = 0;
+                    while (sent < batch.size()) {
+                        ssize_t n = send(fds[c], batch.data() + sent, batch.size() - sent, MSG_NOSIGNAL);
+                        if (n > 0) {
+                            sent += static_cast<size_t>(n);
+                        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                            break;
+                        }
+                    }
+                };
+                for (size_t c = t; c < connections; c += threads) {
+                    int fd = socket(AF_INET, SOCK_STREAM, 0);
+                    sockaddr_in address{};
+                    address.sin_family = AF_INET;
+                    address.sin_port = htons(static_cast<uint16_t>(port));
+                    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                        perror("connect");
+                        _exit(1);
+                    }
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    epoll_event event{};
+                    event.events = EPOLLIN;
+                    event.data.u64 = fds.size();
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+                    fds.push_back(fd);
+                    expected.push_back(0);
+                    sendBatch(fds.size() - 1);
+                }
+                size_t done = 0;
+                char buffer[65536];
+                epoll_event events[256];
+                while (chrono::steady_clock::now() < deadline) {
+                    int ready = epoll_wait(epollFd, events, 256, 100);
+                    for (int i = 0; i < ready; ++i) {
+                        size_t c = events[i].data.u64;
+                        ssize_t n;
+                        while (expected[c] > 0 && (n = recv(fds[c], buffer, sizeof(buffer), 0)) > 0) {
+                            expected[c] -= min(expected[c], static_cast<size_t>(n));
+                        }
+                        if (expected[c] == 0) {
+                            done += depth;
+                            sendBatch(c);
+                        }
+                    }
+                }
+                completed += done;
+                for (int fd : fds) {
+                    close(fd);
+                }
+                close(epollFd);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double opsPerSec = completed.load() / chrono::duration<double>(duration).count();
+        _exit(write(results[1], &opsPerSec, sizeof(opsPerSec)) == sizeof(opsPerSec) ? 0 : 1);
+    }
+    double opsPerSec = 0;
+    if (read(results[0], &opsPerSec, sizeof(opsPerSec)) != sizeof(opsPerSec)) {
+        opsPerSec = 0;
+    }
+    waitpid(child, nullptr, 0);
+    close(results[0]);
+    close(results[1]);
+    return opsPerSec;
+}
+
+// Per-core mode against the shared store at 1 to N cores: the same
+// pipelined GET/SET load through n epoll loops sharing one store, and
+// through n loops each owning a partition, forwarding the commands whose
+// keys another owns. The client runs on the same host, with half as many
+// threads as there are cores.
+void benchPerCore(size_t numKeys) {
+    Logger& logger = Logger::getInstance();
+    size_t clientThreads = max(1u, thread::hardware_concurrency() / 2);
+    const size_t connections = 64, depth = 16;
+    const auto duration = chrono::milliseconds(2000);
+    string value(16, 'v');
+    for (int cores : threadCounts()) {
+        double shared;
+        {
+            KeyValueStore store;
+            CommandHandler handler(store, logger);
+            for (size_t i = 0; i < numKeys; ++i) {
+                store.set(makeKey(i), value);
+            }
+            EpollReactor reactor(handler, logger, "", chrono::milliseconds(100), cores);
+            if (!reactor.start(0)) {
+                return;
+            }
+            shared = forkedLoad(reactor.port(), connections, clientThreads, depth, numKeys, duration);
+            reactor.stop();
+        }
+
+        vector<unique_ptr<KeyValueStore>> stores;
+        vector<unique_ptr<CommandHandler>> handlers;
+        vector<KeyValueStore*> partitions;
+        vector<CommandHandler*> loops;
+        for (int i = 0; i < cores; ++i) {
+            stores.push_back(make_unique<KeyValueStore>());
+            handlers.push_back(make_unique<CommandHandler>(*stores.back(), logger));
+            partitions.push_back(stores.back().get());
+            loops.push_back(handlers.back().get());
+        }
+        for (auto& handler : handlers) {
+            handler->setPartitions(partitions);
+        }
+        for (size_t i = 0; i < numKeys; ++i) {
+            string key = makeKey(i);
+            partitions[CommandHandler::partitionOf(key, partitions.size())]->set(key, value);
+        }
+        EpollReactor reactor(loops, logger, "", chrono::milliseconds(100));
+        if (!reactor.start(0)) {
+            return;
+        }
+        double perCore = forkedLoad(reactor.port(), connections, clientThreads, depth, numKeys, duration);
+        size_t forwarded = reactor.forwardedCount();
+        reactor.stop();
+        cout << "percore cores=" << cores << " shared_ops_per_sec=" << static_cast<size_t>(shared)
+             << " percore_ops_per_sec=" << static_cast<size_t>(perCore) << " forwarded_pct="
+             << (perCore > 0 ? forwarded * 100.0 / (perCore * duration.count() / 1000.0) : 0) << endl;
+    }
+}
+
+// GET latency on one epoll loop while another connection sends KEYS over
+// numKeys keys back to back: first with KEYS run on the loop that reads
+// it, so every GET behind it waits, then on the slow lane.
+void benchLanes(size_t numKeys) {
+    Logger& logger = Logger::getInstance();
+    KeyValueStore store;
+    string value(16, 'v');
+    size_t keysReply = 0;  // inline: each key and a newline
+    for (size_t i = 0; i < numKeys; ++i) {
+        string key = makeKey(i);
+        store.set(key, value);
+        keysReply += key.size() + 1;
+    }
+    store.set("key", "value");
+    keysReply += 4;
+    for (bool slowLane : {false, true}) {
+        CommandHandler handler(store, logger);
+        EpollReactor reactor(handler, logger, "", chrono::milliseconds(100));
+        // After the reactor, so it is gone before the loop its replies go to.
+        ExecutionLanes lanes;
+        if (slowLane) {
+            handler.setLanes(&lanes);
+        }
+        if (!reactor.start(0)) {
+            return;
+        }
+        cout << "lanes slow_lane=" << (slowLane ? "on" : "off") << endl;
+        atomic<bool> stop(false);
+        size_t keysCommands = 0;
+        thread slow([&] {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<uint16_t>(reactor.port()));
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                perror("connect");
+                exit(1);
+            }
+            vector<char> buffer(65536);
+            while (!stop.load()) {
+                send(fd, "KEYS\n", 5, MSG_NOSIGNAL);
+                size_t expected = keysReply;
+                while (expected > 0) {
+                    ssize_t n = recv(fd, buffer.data(), min(buffer.size(), expected), 0);
+                    if (n <= 0) {
+                        close(fd);
+                        return;
+                    }
+                    expected -= static_cast<size_t>(n);
+                }
+                keysCommands++;
+            }
+            close(fd);
+        });
+        {
+            ConnectionClients clients(reactor.port(), 16);
+            clients.open();
+            clients.run(16, chrono::milliseconds(2000));
+        }
+        stop = true;
+        slow.join();
+        reactor.stop();
+        cout << "lanes slow_lane=" << (slowLane ? "on" : "off") << " keys_commands=" << keysCommands << endl;
+    }
+}
+
+#ifdef KVSTORE_URING
+// The io_uring engine against epoll: the pipelined GET/SET load of
+// percore at growing value sizes, through as many loops as cores, then
+// the same snapshot and append-log writes with and without the file
+// rings. Large values are where zero-copy send and the batched
+// submissions should show; up to 512 MB of values are preloaded.
+void benchUring(size_t numKeys) {
+    string reason;
+    if (!IoUring::supported(reason)) {
+        cout << "uring skipped: " << reason << endl;
+        return;
+    }
+    Logger& logger = Logger::getInstance();
+    size_t clientThreads = max(1u, thread::hardware_concurrency() / 2);
+    const size_t connections = 64, depth = 16;
+    const auto duration = chrono::milliseconds(2000);
+    for (size_t valueBytes : {16, 1024, 16384, 131072, 524288}) {
+        size_t keys = min(numKeys, (size_t(512) << 20) / valueBytes);
+        KeyValueStore store;
+        CommandHandler handler(store, logger);
+        string value(valueBytes, 'v');
+        for (size_t i = 0; i < keys; ++i) {
+            store.set(makeKey(i), value);
+        }
+        double epoll, uring;
+        {
+            EpollReactor reactor(handler, logger, "", chrono::milliseconds(100));
+            if (!reactor.start(0)) {
+                return;
+            }
+            epoll = forkedLoad(reactor.port(), connections, clientThreads, depth, keys, duration, valueBytes);
+        }
+        size_t zeroCopy;
+        {
+            UringReactor reactor(handler, logger, "", chrono::milliseconds(100));
+            if (!reactor.start(0)) {
+                return;
+            }
+            uring = forkedLoad(reactor.port(), connections, clientThreads, depth, keys, duration, valueBytes);
+            zeroCopy = reactor.zeroCopySends();
+        }
+        cout << "uring value_bytes=" << valueBytes << " keys=" << keys
+             << " epoll_ops_per_sec=" << static_cast<size_t>(epoll)
+             << " uring_ops_per_sec=" << static_cast<size_t>(uring) << " vs_epoll=" << uring / epoll
+             << " uring_mb_per_sec=" << uring * valueBytes * 0.9 / 1048576 << " zerocopy_sends=" << zeroCopy
+             << endl;
+    }
+
+    const string snapshot = "bench_uring_snapshot.tmp";
+    const string log = "bench_uring_appendonly.tmp";
+    const string value(100, 'v');
+    KeyValueStore store;
+    for (size_t i = 0; i < numKeys; ++i) {
+        store.set(makeKey(i), value);
+    }
+    for (bool ring : {false, true}) {
+        IoUring::useForFiles(ring);
+        auto start = chrono::steady_clock::now();
+        store.save(snapshot);
+        chrono::duration<double> saved = chrono::steady_clock::now() - start;
+
+        remove(log.c_str());
+        KeyValueStore logged;
+        logged.openAppendLog(log, FsyncPolicy::Always);
+        double ops = runTimed(4, chrono::seconds(2), [&](int t, const atomic<bool>& stop) {
+            mt19937_64 rng(t + 1);
+            size_t done = 0;
+            while (!stop) {
+                logged.set(makeKey(rng() % numKeys), value);
+                done++;
+            }
+            return done;
+        });
+        cout << "uring files=" << (ring ? "io_uring" : "write") << " keys=" << numKeys
+             << " save_s=" << saved.count() << " appendlog_always_set_ops_per_sec=" << static_cast<size_t>(ops)
+             << endl;
+    }
+    IoUring::useForFiles(false);
+    remove(snapshot.c_str());
+    remove(log.c_str());
+}
+#endif
+#endif
+
+}
+
+int main(int argc, char** argv) {
+    map<string, function<void()>> scenarios = {
+        {"read-heavy", benchReadHeavy},
+        {"expiry-1m", [] { benchExpiry(1000000); }},
+        {"alloc-1m", [] { benchAllocation(1000000, false); }},
+        {"snapshot-1m", [] { benchSnapshot(1000000); }},
+        {"snapshot-10m", [] { benchSnapshot(10000000); }},
+        {"load-1m", [] { benchParallelLoad(1000000); }},
+        {"scan-1m", [] { benchScan(1000000); }},
+        {"scan-10m", [] { benchScan(10000000); }},
+        {"prefix-1m", [] { benchPrefix(1000000); }},
+        {"batch-1m", [] { benchBatch(1000000, 100); }},
+        {"pipeline-1m", [] { benchPipeline(1000000); }},
+        {"resp-1m", [] { benchResp(1000000); }},
+        {"framing-1m", [] { benchFraming(1000000); }},
+        {"dispatch-1m", [] { benchDispatch(1000000); }},
+        {"threadpool-1m", [] { benchThreadPool(1000000); }},
+#ifdef KVSTORE_EPOLL
+        {"connections-10k", [] { benchConnections(10000); }},
+        {"percore-1m", [] { benchPerCore(1000000); }},
+        {"lanes-1m", [] { benchLanes(1000000); }},
+#endif
+#ifdef KVSTORE_URING
+        {"uring-1m", [] { benchUring(1000000); }},
+#endif
+        {"prefix-10m", [] { benchPrefix(10000000); }},
+        {"load-10m", [] { benchParallelLoad(10000000); }},
+        {"bgsave-1m", [] { benchBackgroundSave(1000000); }},
+        {"appendlog-1m", [] { benchAppendLog(1000000); }},
+        {"aofrewrite-1m", [] { benchLogRewrite(1000000); }},
+        {"bgsave-10m", [] { benchBackgroundSave(10000000); }},
+        {"alloc-1m-hugepages", [] { benchAllocation(1000000, true); }},
+        {"expiry-10m", [] { benchExpiry(10000000); }},
+    };
+    for (const char* variant : {"flat", "map"}) {
+        for (size_t millions : {1, 10, 50}) {
+            scenarios["table-" + string(variant) + "-" + to_string(millions) + "m"] = [variant, millions] {
+                benchTable(variant, millions * 1000000);
+            };
+        }
+    }
+
+    vector<string> selected(argv + 1, argv + argc);
+    if (selected.empty()) {
+        for (const auto& s : scenarios) {
+            selected.push_back(s.first);
+        }
+    }
+    for (const auto& name : selected) {
+        auto it = scenarios.find(name);
+        if (it == scenarios.end()) {
+            cerr << "Unknown scenario: " << name << endl;
+            return 1;
+        }
+        it->second();
+    }
+    return 0;
+}
@@ -5,6 +5,9 @@
 #include <atomic>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 using namespace std;
 
@@ -17,8 +20,57 @@ void signalHandler(int signum) {
 
 int main(int argc, char** argv) {
     try {
-        if (argc != 2) {
-            cerr << "Usage: " << argv[0] << " <port>" << endl;
+        // Options come after the port; what remains is the append log and
+        // its policy.
+        string snapshot;
+        size_t cores = 0;
+        string engine = "epoll";
+        size_t loadThreads = max(1u, thread::hardware_concurrency());
+        vector<string> positional;
+        bool usageError = argc < 2;
+        for (int i = 2; i < argc && !usageError; ++i) {
+            string arg = argv[i];
+            if (arg == "--load" && i + 1 < argc) {
+                snapshot = argv[++i];
+            } else if (arg == "--load-threads" && i + 1 < argc) {
+                loadThreads = static_cast<size_t>(max(1, stoi(argv[++i])));
+            } else if (arg == "--cores" && i + 1 < argc) {
+                cores = static_cast<size_t>(max(1, stoi(argv[++i])));
+            } else if (arg == "--io" && i + 1 < argc) {
+                engine = argv[++i];
+                usageError = engine != "epoll" && engine != "uring";
+            } else if (arg.rfind("--", 0) == 0) {
+                usageError = true;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (usageError || positional.size() > 2) {
+            cerr << "Usage: " << argv[0]
+                 << " <port> [--cores n] [--io epoll|uring] [--load snapshot-file] [--load-threads n] [appendonly-file [always|everysec|no]]"
+                 << endl;
+            return 1;
+        }
+#ifndef KVSTORE_EPOLL
+        if (cores > 0 || engine != "epoll") {
+            cerr << "--cores and --io need the Linux engines (KVSTORE_EPOLL)." << endl;
+            return 1;
+        }
+#endif
+        if (cores > 0 && engine == "uring") {
+            // Forwarding between partitions is built on the epoll loops.
+            cerr << "--cores runs on epoll and cannot be combined with --io uring." << endl;
+            return 1;
+        }
+        if (cores > 1 && (!snapshot.empty() || !positional.empty())) {
+            // Snapshots and the log describe one store, not partitions.
+            cerr << "--cores cannot be combined with --load or an append log." << endl;
+            return 1;
+        }
+        if (!snapshot.empty() && !positional.empty()) {
+            // The log is replayed into an empty store and describes its whole
+            // contents, so a snapshot has nothing to add.
+            cerr << "--load cannot be combined with an append log." << endl;
             return 1;
         }
 
@@ -36,7 +88,29 @@ int main(int argc, char** argv) {
         logger.info("Port: " + to_string(port));
         
         // Initialize server
+#ifdef KVSTORE_EPOLL
+        Server server(logger, cores, engine == "uring" ? IoEngine::Uring : IoEngine::Epoll);
+#else
         Server server(logger);
+#endif
+
+        if (!positional.empty()) {
+            auto policy = AppendLog::parsePolicy(positional.size() == 2 ? positional[1] : "everysec");
+            if (!policy) {
+                cerr << "Invalid appendfsync policy. Must be always, everysec or no." << endl;
+                return 1;
+            }
+            if (!server.openAppendLog(positional[0], *policy)) {
+                cerr << "Failed to open append log " << positional[0] << endl;
+                return 1;
+            }
+        }
+
+        // Connections are only accepted once the dataset is in memory.
+        if (!snapshot.empty() && !server.loadSnapshot(snapshot, loadThreads)) {
+            cerr << "Failed to load snapshot " << snapshot << endl;
+            return 1;
+        }
 
         // Set up signal handlers
         signal(SIGINT, signalHandler);
@@ -1,12 +1,43 @@
 #include "../include/KeyValueStore.h"
 #include "../include/CommandHandler.h"
+#include "../include/InputBuffer.h"
 #include "../include/Logger.h"
+#include "../include/FlatHashTable.h"
+#include "../include/OrderedIndex.h"
+#include "../include/TimingWheel.h"
+#include "../include/SlabAllocator.h"
+#include "../include/SpscQueue.h"
+#include "../include/ThreadPool.h"
 #include <cassert>
 #include <thread>
 #include <vector>
+#include <random>
+#include <map>
+#include <set>
 #include <chrono>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <filesystem>
+#ifdef KVSTORE_EPOLL
+#include "../include/EpollReactor.h"
+#ifdef KVSTORE_URING
+#include "../include/UringReactor.h"
+#endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -66,6 +97,1812 @@ void testConcurrentAccess() {
     }
 }
 
+// Runs a fixed amount of mixed SET/GET work per thread and returns the
+// aggregate throughput in operations per second.
+double measureThroughput(KeyValueStore& store, int numThreads, int opsPerThread) {
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < numThreads; ++i) {
+        threads.emplace_back([&store, i, opsPerThread]() {
+            for (int j = 0; j < opsPerThread; ++j) {
+                string key = "scale" + to_string(i) + "_" + to_string(j % 1000);
+                if (j % 4 == 0) {
+                    store.set(key, "value" + to_string(j));
+                } else {
+                    store.get(key);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return (static_cast<double>(numThreads) * opsPerThread) / elapsed.count();
+}
+
+void testShardedScaling() {
+    const int opsPerThread = 200000;
+    unsigned int cores = max(1u, thread::hardware_concurrency());
+
+    // A single shard behaves like the old global mutex and serves as the baseline.
+    for (size_t shards : {size_t(1), KeyValueStore::DEFAULT_SHARD_COUNT}) {
+        KeyValueStore store(shards);
+        assert(store.shardCount() == shards);
+        double base = 0;
+        for (int numThreads : {1, 2, 4, 8}) {
+            double opsPerSec = measureThroughput(store, numThreads, opsPerThread);
+            if (numThreads == 1) {
+                base = opsPerSec;
+            }
+            cout << "  shards=" << shards << " threads=" << numThreads
+                 << " ops/s=" << static_cast<long long>(opsPerSec)
+                 << " speedup=" << opsPerSec / base << endl;
+        }
+        // Every fourth op is a SET, so each of the 8 thread ids writes 250 distinct keys.
+        assert(store.getStats().totalKeys == 8 * 250);
+    }
+    cout << "  (" << cores << " hardware threads available)" << endl;
+
+    // Keys spread over every shard and remain reachable through multi-key operations.
+    KeyValueStore store(8);
+    for (int i = 0; i < 1000; ++i) {
+        store.set("k" + to_string(i), "v" + to_string(i));
+    }
+    assert(store.keys().size() == 1000);
+    assert(store.getStats().totalKeys == 1000);
+    store.clear();
+    assert(store.keys().empty());
+}
+
+void testLockFreeReads() {
+    // Few shards so writers keep growing and overwriting the same tables
+    // while readers walk them without a lock.
+    KeyValueStore store(2);
+    const int numKeys = 5000;
+    atomic<bool> stop(false);
+
+    vector<thread> writers;
+    for (int w = 0; w < 2; ++w) {
+        writers.emplace_back([&store, &stop, w, numKeys]() {
+            for (int round = 0; !stop; ++round) {
+                for (int k = w; k < numKeys; k += 2) {
+                    string key = "rcu" + to_string(k);
+                    if (round % 3 == 2) {
+                        store.del(key);
+                    } else {
+                        store.set(key, key + ":" + to_string(round));
+                    }
+                }
+            }
+        });
+    }
+
+    vector<thread> readers;
+    for (int r = 0; r < 4; ++r) {
+        readers.emplace_back([&store, r, numKeys]() {
+            for (int i = 0; i < 200000; ++i) {
+                string key = "rcu" + to_string((i * 7 + r) % numKeys);
+                string value = store.get(key);
+                // Either absent or a complete value written for this key.
+                assert(value.empty() || value.compare(0, key.size() + 1, key + ":") == 0);
+                store.exists(key);
+            }
+        });
+    }
+    for (auto& t : readers) {
+        t.join();
+    }
+    stop = true;
+    for (auto& t : writers) {
+        t.join();
+    }
+
+    // Expired keys read as absent without being erased by the reader.
+    assert(store.set("short", "lived", 1));
+    this_thread::sleep_for(chrono::milliseconds(1100));
+    assert(store.get("short").empty());
+    assert(!store.exists("short"));
+    assert(!store.ttl("short"));
+}
+
+void testTimingWheel() {
+    TimingWheel wheel(1000);
+    // Deadlines on every level of the wheel, past its top level, and
+    // already overdue.
+    vector<int64_t> deadlines = {999, 1000, 1001, 1063, 1064, 1065, 5095, 5096, 300000, 20000000, 40000000};
+    for (int64_t d : deadlines) {
+        wheel.schedule("t" + to_string(d), d);
+    }
+    assert(wheel.size() == deadlines.size());
+
+    vector<TimingWheel::Timer> due;
+    size_t fired = 0;
+    for (int64_t now = 1000; now <= 40000000; now += 37) {
+        wheel.advance(now, due);
+        for (const auto& timer : due) {
+            // Fires no earlier than its deadline and within one step of it.
+            assert(timer.deadline <= now && timer.deadline > now - 37 - 1);
+            fired++;
+        }
+        due.clear();
+    }
+    wheel.advance(40000037, due);
+    fired += due.size();
+    assert(fired == deadlines.size());
+    assert(wheel.size() == 0);
+}
+
+void testMillisecondExpiry() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+
+    assert(store.set("soon", "gone"));
+    assert(store.set("later", "kept"));
+    assert(handler.handleCommand("PEXPIRE soon 100") == "OK");
+    assert(handler.handleCommand("EXPIRE later 60") == "OK");
+    assert(handler.handleCommand("PEXPIRE missing 100") == "Key not found");
+    assert(handler.handleCommand("PTTL later") != "Key not found or has no TTL");
+    assert(handler.handleCommand("TTL later") == "60");
+    auto remaining = store.pttl("soon");
+    assert(remaining && remaining->count() > 0 && remaining->count() <= 100);
+    // The largest TTL does not wrap into the past.
+    assert(store.set("forever", "kept"));
+    assert(handler.handleCommand("PEXPIRE forever 9223372036854775807") == "OK");
+    assert(store.exists("forever") && store.pttl("forever")->count() > (int64_t(1) << 62));
+    assert(store.del("forever"));
+
+    // The cleaner unlinks the key once its timer fires, without a scan.
+    this_thread::sleep_for(chrono::milliseconds(300));
+    assert(!store.exists("soon"));
+    assert(store.getStats().totalKeys == 1);
+    assert(handler.handleCommand("PTTL soon") == "Key not found or has no TTL");
+
+    // A rewrite without TTL outlives the timer set for the old value.
+    assert(store.set("reset", "v", 1));
+    assert(store.set("reset", "v2"));
+    this_thread::sleep_for(chrono::milliseconds(1100));
+    assert(store.get("reset") == "v2");
+    assert(!store.pttl("reset"));
+}
+
+void testEviction() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    const size_t limit = 256 * 1024;
+    assert(handler.handleCommand("CONFIG SET maxmemory 262144") == "OK");
+    assert(handler.handleCommand("CONFIG SET maxmemory-policy allkeys-lru") == "OK");
+    assert(handler.handleCommand("CONFIG GET maxmemory-policy") == "allkeys-lru");
+    assert(handler.handleCommand("CONFIG SET maxmemory-policy sometimes") == "ERROR: Unknown maxmemory-policy");
+
+    // Four writers push several times the limit through the store.
+    const string value(100, 'v');
+    vector<thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.emplace_back([&store, &value, t]() {
+            for (int i = 0; i < 5000; ++i) {
+                assert(store.set("evict" + to_string(t) + "_" + to_string(i), value));
+                store.get("evict" + to_string(t) + "_" + to_string(i / 2));
+            }
+        });
+    }
+    for (auto& t : writers) {
+        t.join();
+    }
+    StoreStats stats = store.getStats();
+    // Concurrent writers may each overshoot by an entry, and table growth
+    // is not reserved ahead of time.
+    assert(stats.memoryUsage <= limit + limit / 10);
+    assert(stats.evictedKeys > 0);
+    assert(stats.totalKeys + stats.evictedKeys == 4 * 5000);
+
+    // volatile-ttl only ever evicts keys that have a TTL.
+    store.clear();
+    store.setEvictionPolicy(EvictionPolicy::VolatileTtl);
+    for (int i = 0; i < 100; ++i) {
+        assert(store.set("pinned" + to_string(i), value));
+    }
+    for (int i = 0; i < 2000; ++i) {
+        assert(store.set("volatile" + to_string(i), value, 60));
+    }
+    for (int i = 0; i < 100; ++i) {
+        assert(store.exists("pinned" + to_string(i)));
+    }
+
+    // With nothing left to evict, or under noeviction, writes are refused.
+    store.setEvictionPolicy(EvictionPolicy::NoEviction);
+    assert(handler.handleCommand("SET another " + value).find("OOM") != string::npos);
+    assert(store.getStats().rejectedWrites == 1);
+}
+
+void testMemoryAccounting() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    MemoryStats empty = store.memoryStats();
+    assert(empty.entryBytes == 0 && empty.tableBytes > 0);
+    assert(empty.usedBytes == store.getStats().memoryUsage);
+
+    // Overwrites, deletes and expiry must all give back what they charged.
+    for (int i = 0; i < 1000; ++i) {
+        store.set("mem" + to_string(i), string(50, 'a'));
+        store.set("mem" + to_string(i), string(200, 'b'));
+    }
+    MemoryStats full = store.memoryStats();
+    assert(full.totalKeys == 1000);
+    assert(full.entryBytes >= 1000 * (200 + 4));
+    assert(full.usedBytes == store.getStats().memoryUsage);
+
+    auto usage = store.memoryUsageOf("mem7");
+    assert(usage && *usage >= 200 + 4);
+    assert(handler.handleCommand("MEMORY USAGE mem7") == to_string(*usage));
+    assert(handler.handleCommand("MEMORY USAGE nothing") == "Key not found");
+    assert(handler.handleCommand("MEMORY STATS").find("Fragmentation ratio: ") != string::npos);
+
+    for (int i = 0; i < 500; ++i) {
+        store.del("mem" + to_string(i));
+    }
+    for (int i = 500; i < 1000; ++i) {
+        store.pexpire("mem" + to_string(i), 1);
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+    MemoryStats drained = store.memoryStats();
+    assert(drained.totalKeys == 0 && drained.entryBytes == 0);
+    assert(drained.usedBytes == store.getStats().memoryUsage);
+
+    store.set("again", "x");
+    store.clear();
+    assert(store.memoryStats().entryBytes == 0);
+}
+
+void testSlabAllocator() {
+    assert(SlabAllocator::classSize(SlabAllocator::classFor(1)) == 16);
+    assert(SlabAllocator::classSize(SlabAllocator::classFor(200)) == 208);
+    assert(SlabAllocator::classSize(SlabAllocator::classFor(4096)) == 4096);
+    assert(SlabAllocator::classFor(4097) == SlabAllocator::NO_CLASS);
+
+    Arena arena;
+    SlabAllocator slabs(arena);
+    uint8_t sizeClass = SlabAllocator::classFor(300);
+    vector<char*> blocks;
+    for (int i = 0; i < 1000; ++i) {
+        char* block = static_cast<char*>(slabs.allocate(sizeClass));
+        memset(block, i & 0xFF, SlabAllocator::classSize(sizeClass));
+        blocks.push_back(block);
+    }
+    // Blocks never overlap, even across slab boundaries.
+    sort(blocks.begin(), blocks.end());
+    for (size_t i = 1; i < blocks.size(); ++i) {
+        assert(blocks[i] - blocks[i - 1] >= static_cast<ptrdiff_t>(SlabAllocator::classSize(sizeClass)));
+    }
+    size_t slabBytes = slabs.slabBytes();
+    for (char* block : blocks) {
+        slabs.deallocate(block, sizeClass);
+    }
+    // Freed blocks are reused before any new slab is taken.
+    for (int i = 0; i < 1000; ++i) {
+        slabs.allocate(sizeClass);
+    }
+    assert(slabs.slabBytes() == slabBytes);
+    assert(arena.reservedBytes() >= slabBytes);
+
+    // Entries too large for any class still round-trip through the store.
+    KeyValueStore store(4, true);
+    string big(10000, 'b');
+    assert(store.set("big", big));
+    assert(store.get("big") == big);
+    assert(store.set("small", "s"));
+    assert(store.del("big"));
+    assert(store.get("small") == "s");
+}
+
+void testBinarySnapshot() {
+    const string path = "test_snapshot.bin";
+    KeyValueStore store;
+    for (int i = 0; i < 5000; ++i) {
+        assert(store.set("snap" + to_string(i), "value " + to_string(i) + " with spaces"));
+    }
+    assert(store.set("ttl", "keeps its deadline", 100));
+    assert(store.set("gone", "expires before the save", 1));
+    assert(store.pexpire("gone", 1));
+    this_thread::sleep_for(chrono::milliseconds(20));
+    assert(store.save(path));
+
+    KeyValueStore loaded;
+    assert(loaded.set("stale", "replaced by the load"));
+    assert(loaded.load(path));
+    assert(loaded.getStats().totalKeys == 5001);
+    assert(loaded.get("snap4321") == "value 4321 with spaces");
+    assert(!loaded.exists("stale") && !loaded.exists("gone"));
+    auto ttl = loaded.ttl("ttl");
+    assert(ttl && ttl->count() >= 98 && ttl->count() <= 100);
+
+    // The text format is still readable and writable, for values without
+    // spaces.
+    KeyValueStore plain;
+    assert(plain.set("a", "1") && plain.set("b", "2"));
+    assert(plain.save("test_snapshot.txt", SnapshotFormat::Text));
+    KeyValueStore fromText;
+    assert(fromText.load("test_snapshot.txt"));
+    assert(fromText.getStats().totalKeys == 2 && fromText.get("b") == "2");
+
+    // A flipped payload byte fails the block checksum and leaves the store
+    // untouched; so does a truncated file.
+    string bytes;
+    {
+        ifstream in(path, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    string corrupt = bytes;
+    corrupt[bytes.size() / 2] ^= 0x01;
+    ofstream(path, ios::binary | ios::trunc).write(corrupt.data(), corrupt.size());
+    assert(!loaded.load(path));
+    assert(loaded.get("snap4321") == "value 4321 with spaces");
+    ofstream(path, ios::binary | ios::trunc).write(bytes.data(), bytes.size() - 10);
+    assert(!loaded.load(path));
+    assert(loaded.getStats().totalKeys == 5001);
+
+    remove(path.c_str());
+    remove("test_snapshot.txt");
+}
+
+void testBackgroundSave() {
+    const string path = "test_bgsave.bin";
+    KeyValueStore store;
+    for (int i = 0; i < 20000; ++i) {
+        assert(store.set("bg" + to_string(i), "before"));
+    }
+    assert(store.set("ttl", "v", 100));
+
+    // Everything written after bgsave() returns is missing from the file,
+    // however far the background writer has got.
+    assert(store.bgsave(path));
+    for (int i = 0; i < 20000; i += 2) {
+        assert(store.set("bg" + to_string(i), "after"));
+        assert(store.del("bg" + to_string(i + 1)));
+    }
+    assert(store.pexpire("ttl", 1));
+    assert(store.set("new", "after"));
+    store.clear();
+    while (store.getStats().bgsaveInProgress) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    StoreStats stats = store.getStats();
+    assert(stats.bgsaveAttempted && stats.lastBgsaveOk && stats.lastSaveTime > 0);
+    assert(stats.bgsaveKeysWritten == stats.bgsaveKeysTotal);
+
+    KeyValueStore loaded;
+    assert(loaded.load(path));
+    assert(loaded.getStats().totalKeys == 20001);
+    assert(loaded.get("bg0") == "before" && loaded.get("bg19999") == "before");
+    assert(!loaded.exists("new"));
+    auto ttl = loaded.ttl("ttl");
+    assert(ttl && ttl->count() >= 98);
+
+    // A save that cannot open its file is reported, not left running.
+    assert(store.bgsave("no_such_dir/test_bgsave.bin"));
+    while (store.getStats().bgsaveInProgress) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    assert(!store.getStats().lastBgsaveOk);
+    assert(store.save(path));
+
+    remove(path.c_str());
+}
+
+void testParallelLoad() {
+    const string path = "test_parallel_load.bin";
+    {
+        KeyValueStore store;
+        for (int i = 0; i < 50000; ++i) {
+            assert(store.set("load" + to_string(i), "value " + to_string(i), i % 7 == 0 ? 100 : 0));
+        }
+        assert(store.set("short", "lived", 1));
+        assert(store.pexpire("short", 50));
+        assert(store.save(path));
+    }
+    this_thread::sleep_for(chrono::milliseconds(60));
+
+    // Every thread count gives the same contents, TTLs included, minus the
+    // key that expired while the file sat on disk.
+    for (size_t threads : {1, 4, 16}) {
+        KeyValueStore store;
+        assert(store.set("stale", "replaced by the load"));
+        assert(store.load(path, threads));
+        assert(store.getStats().totalKeys == 50000);
+        assert(!store.exists("stale") && !store.exists("short"));
+        assert(store.get("load0") == "value 0" && store.get("load49999") == "value 49999");
+        auto ttl = store.ttl("load7");
+        assert(ttl && ttl->count() >= 98);
+        assert(!store.ttl("load1"));
+    }
+
+    // A damaged block fails the whole load before anything is replaced.
+    string bytes;
+    {
+        ifstream in(path, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    bytes[bytes.size() * 3 / 4] ^= 0x01;
+    ofstream(path, ios::binary | ios::trunc).write(bytes.data(), bytes.size());
+    KeyValueStore store;
+    assert(store.set("kept", "1"));
+    assert(!store.load(path, 8));
+    assert(store.getStats().totalKeys == 1 && store.get("kept") == "1");
+
+    remove(path.c_str());
+}
+
+void testThreadPool() {
+    // Small callables, move-only ones included, are kept in place; larger
+    // ones go to the heap, and either kind is destroyed exactly once.
+    auto owned = make_shared<int>(7);
+    {
+        int seen = 0;
+        auto pointer = make_unique<int>(42);
+        auto read = [&seen, p = move(pointer)] { seen = *p; };
+        static_assert(Task::fitsInline<decltype(read)>(), "a move-only lambda is kept in place");
+        Task small(move(read));
+        Task moved = move(small);
+        assert(!small && moved);
+        moved();
+        assert(seen == 42);
+
+        char padding[100] = {1};
+        Task large([&seen, padding, owned] { seen = padding[0] + *owned; });
+        assert(owned.use_count() == 2);
+        Task target = [] {};
+        target = move(large);
+        target();
+        assert(seen == 8 && owned.use_count() == 2);
+    }
+    assert(owned.use_count() == 1);
+
+    // Submitters from outside, more tasks than the shared queue holds:
+    // the destructor runs every one before joining.
+    atomic<size_t> count{0};
+    const size_t perThread = 3 * ThreadPool::INJECTION_CAPACITY;
+    {
+        ThreadPool pool(4);
+        vector<thread> submitters;
+        for (int t = 0; t < 4; ++t) {
+            submitters.emplace_back([&] {
+                for (size_t i = 0; i < perThread; ++i) {
+                    pool.submit([&count] { count.fetch_add(1, memory_order_relaxed); });
+                }
+            });
+        }
+        for (auto& submitter : submitters) {
+            submitter.join();
+        }
+    }
+    assert(count == 4 * perThread);
+
+    // Tasks spawning tasks on their own deques, past a deque's capacity,
+    // while idle workers steal: each runs exactly once.
+    const size_t leaves = 1 << 16;
+    vector<atomic<int>> runs(leaves);
+    {
+        // Declared first, to outlive the pool's draining.
+        function<void(size_t, size_t)> split;
+        ThreadPool pool(4);
+        split = [&](size_t begin, size_t end) {
+            if (end - begin == 1) {
+                runs[begin].fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            size_t middle = (begin + end) / 2;
+            pool.submit([&split, begin, middle] { split(begin, middle); });
+            pool.submit([&split, middle, end] { split(middle, end); });
+        };
+        pool.submit([&split, leaves] { split(0, leaves); });
+        pool.submit([&pool, &count] {
+            for (size_t i = 0; i < 4 * ThreadPool::DEQUE_CAPACITY; ++i) {
+                pool.submit([&count] { count.fetch_add(1, memory_order_relaxed); });
+            }
+        });
+    }
+    for (auto& run : runs) {
+        assert(run.load() == 1);
+    }
+    assert(count == 4 * perThread + 4 * ThreadPool::DEQUE_CAPACITY);
+
+    // A throwing task is reported and the worker goes on; parked workers
+    // wake for work submitted after they went idle.
+    {
+        ThreadPool pool(2);
+        pool.submit([] { throw runtime_error("expected by the test"); });
+        this_thread::sleep_for(chrono::milliseconds(50));
+        atomic<bool> ran{false};
+        pool.submit([&ran] { ran = true; });
+        for (int i = 0; i < 200 && !ran; ++i) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        assert(ran);
+    }
+}
+
+void testAppendLog() {
+    const string path = "test_appendonly.aof";
+    remove(path.c_str());
+    {
+        KeyValueStore store;
+        assert(store.openAppendLog(path, FsyncPolicy::Always));
+        assert(store.set("a", "1") && store.set("b", "2") && store.set("c", "3"));
+        assert(store.set("a", "overwritten"));
+        assert(store.del("b"));
+        assert(store.expire("c", 100));
+        assert(store.set("short", "lived", 1));
+        assert(store.pexpire("short", 1));
+        assert(store.set("cleared", "x"));
+        store.clear();
+        assert(store.set("a", "after clear") && store.set("c", "3", 100));
+        assert(store.set("d", "4"));
+        assert(store.pexpire("d", 0));
+        this_thread::sleep_for(chrono::milliseconds(5));
+        assert(store.getStats().appendLogEnabled);
+    }
+
+    // A crash can leave half a record at the end; replay drops it and the
+    // log is cut back before new records are appended.
+    ofstream(path, ios::binary | ios::app).write("\x01\x02\x03", 3);
+    {
+        KeyValueStore store;
+        assert(store.openAppendLog(path, FsyncPolicy::EverySecond));
+        assert(store.getStats().totalKeys == 2);
+        assert(store.get("a") == "after clear");
+        assert(!store.exists("b") && !store.exists("short") && !store.exists("cleared") && !store.exists("d"));
+        auto ttl = store.ttl("c");
+        assert(ttl && ttl->count() >= 98 && ttl->count() <= 100);
+        assert(store.set("e", "5"));
+    }
+    {
+        KeyValueStore store;
+        assert(store.openAppendLog(path, FsyncPolicy::No));
+        assert(store.getStats().totalKeys == 3 && store.get("e") == "5");
+    }
+
+    // Damage before the last record is corruption, not a torn write.
+    string bytes;
+    {
+        ifstream in(path, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    bytes[AppendLog::HEADER_BYTES + AppendLog::RECORD_HEADER] ^= 0x01;
+    ofstream(path, ios::binary | ios::trunc).write(bytes.data(), bytes.size());
+    KeyValueStore store;
+    assert(!store.openAppendLog(path));
+    assert(!store.appendLogEnabled());
+
+    remove(path.c_str());
+}
+
+void testAppendLogRewrite() {
+    const string path = "test_rewrite.aof";
+    remove(path.c_str());
+    map<string, string> expected;
+    {
+        KeyValueStore store;
+        store.setAutoRewritePercentage(0);
+        assert(store.openAppendLog(path, FsyncPolicy::EverySecond));
+        for (int round = 0; round < 20; ++round) {
+            for (int i = 0; i < 1000; ++i) {
+                assert(store.set("rw" + to_string(i), "round " + to_string(round)));
+            }
+        }
+        assert(store.set("ttl", "v", 100));
+        assert(store.set("gone", "x", 1));
+        assert(store.pexpire("gone", 1));
+        this_thread::sleep_for(chrono::milliseconds(5));
+        uint64_t before = store.getStats().appendLogBytes;
+
+        // Writers keep going while the rewrite runs; what they write ends up
+        // after the compacted records.
+        assert(store.bgrewriteaof());
+        assert(!store.bgrewriteaof() && !store.save("test_rewrite.bin"));
+        vector<thread> writers;
+        for (int t = 0; t < 4; ++t) {
+            writers.emplace_back([&store, t] {
+                for (int i = t; i < 1000; i += 4) {
+                    if (i % 10 == 0) {
+                        assert(store.del("rw" + to_string(i)));
+                    } else {
+                        assert(store.set("rw" + to_string(i), "during " + to_string(i)));
+                    }
+                }
+            });
+        }
+        for (auto& w : writers) {
+            w.join();
+        }
+        while (store.rewriteInProgress()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        StoreStats stats = store.getStats();
+        assert(stats.rewriteAttempted && stats.lastRewriteOk);
+        assert(stats.appendLogBytes < before / 5);
+
+        // Writes after the swap go to the new file.
+        assert(store.set("late", "after rewrite"));
+        for (const string& key : store.keys()) {
+            expected[key] = store.get(key);
+        }
+    }
+    assert(!filesystem::exists(path + ".rewrite"));
+    {
+        KeyValueStore store;
+        assert(store.openAppendLog(path));
+        assert(store.getStats().totalKeys == expected.size());
+        for (const auto& kv : expected) {
+            assert(store.get(kv.first) == kv.second);
+        }
+        assert(!store.exists("rw10") && !store.exists("gone"));
+        auto ttl = store.ttl("ttl");
+        assert(ttl && ttl->count() >= 98);
+
+        // Growth past the thresholds starts a rewrite without being asked.
+        uint64_t base = store.getStats().appendLogBaseBytes;
+        store.setAutoRewriteMinBytes(base);
+        store.setAutoRewritePercentage(50);
+        for (int i = 0; store.getStats().appendLogBytes < base * 3 / 2; ++i) {
+            assert(store.set("rw1", "grow " + to_string(i)));
+        }
+        while (!store.getStats().rewriteAttempted) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        while (store.rewriteInProgress()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        assert(store.getStats().lastRewriteOk);
+        assert(store.getStats().appendLogBaseBytes < base * 3 / 2);
+    }
+
+    // Without a log there is nothing to rewrite.
+    KeyValueStore plain;
+    assert(!plain.bgrewriteaof());
+
+    remove(path.c_str());
+}
+
+struct TestRecord {
+    uint64_t hash;
+    string name;
+
+    const string& key() const { return name; }
+};
+
+void testFlatHashTable() {
+    FlatHashTable<TestRecord> table;
+    auto noRetire = [](FlatHashTable<TestRecord>::Array* a) { delete a; };
+    const int n = 20000;
+    vector<unique_ptr<TestRecord>> records;
+    for (int i = 0; i < n; ++i) {
+        string key = "flat" + to_string(i);
+        // Only a few distinct hashes so long probe runs and wrap-around occur.
+        uint64_t h = hash<string>{}(key) & 0xFF0000000000037FULL;
+        records.push_back(make_unique<TestRecord>(TestRecord{h, key}));
+        assert(table.upsert(records.back().get(), noRetire) == nullptr);
+    }
+    assert(table.size() == n);
+
+    // Erase every third record, backward-shifting the rest of each run.
+    for (int i = 0; i < n; i += 3) {
+        assert(table.erase(records[i]->name, records[i]->hash) == records[i].get());
+    }
+    for (int i = 0; i < n; ++i) {
+        TestRecord* found = table.find(records[i]->name, records[i]->hash);
+        assert((i % 3 == 0) == (found == nullptr));
+    }
+
+    size_t erased = table.eraseIf([](TestRecord* r) { return r->name.back() == '7'; });
+    size_t visited = 0;
+    table.forEach([&visited](TestRecord* r) {
+        assert(r->name.back() != '7');
+        visited++;
+    });
+    assert(visited == table.size());
+    assert(visited + erased == n - (n + 2) / 3);
+    for (int i = 0; i < n; ++i) {
+        bool live = i % 3 != 0 && records[i]->name.back() != '7';
+        assert(live == (table.find(records[i]->name, records[i]->hash) != nullptr));
+    }
+}
+
+void testScan() {
+    assert(KeyValueStore::matchPattern("*", "anything"));
+    assert(KeyValueStore::matchPattern("user:*:name", "user:42:name"));
+    assert(!KeyValueStore::matchPattern("user:*:name", "user:42:email"));
+    assert(KeyValueStore::matchPattern("h?llo", "hello") && !KeyValueStore::matchPattern("h?llo", "hllo"));
+    assert(KeyValueStore::matchPattern("h[ae]llo", "hallo") && !KeyValueStore::matchPattern("h[ae]llo", "hillo"));
+    assert(KeyValueStore::matchPattern("h[^e]llo", "hallo") && !KeyValueStore::matchPattern("h[^e]llo", "hello"));
+    assert(KeyValueStore::matchPattern("key[0-9]", "key7") && !KeyValueStore::matchPattern("key[0-9]", "keyx"));
+    assert(KeyValueStore::matchPattern("a\\*b", "a*b") && !KeyValueStore::matchPattern("a\\*b", "axb"));
+    assert(KeyValueStore::matchPattern("*a*b*", "xxaxxbxx") && !KeyValueStore::matchPattern("*a*b*", "xxbxxaxx"));
+
+    KeyValueStore store;
+    for (int i = 0; i < 5000; ++i) {
+        assert(store.set("scan" + to_string(i), "v"));
+    }
+    assert(store.set("expiring", "v", 1));
+    assert(store.pexpire("expiring", 1));
+    this_thread::sleep_for(chrono::milliseconds(5));
+
+    // Keys present throughout are all returned even though the tables grow
+    // several times and other keys are deleted while the scan runs.
+    set<string> seen;
+    uint64_t cursor = 0;
+    int calls = 0;
+    int added = 0;
+    do {
+        vector<string> batch;
+        cursor = store.scan(cursor, 50, batch);
+        assert(batch.size() <= 50 + 64);
+        seen.insert(batch.begin(), batch.end());
+        for (int i = 0; i < 100; ++i, ++added) {
+            assert(store.set("added" + to_string(added), "v"));
+        }
+        if (calls < 100) {
+            store.del("added" + to_string(calls));
+        }
+        calls++;
+    } while (cursor != 0);
+    for (int i = 0; i < 5000; ++i) {
+        assert(seen.count("scan" + to_string(i)) == 1);
+    }
+    assert(seen.count("expiring") == 0);
+    assert(calls > 5000 / 100);
+
+    // MATCH filters keys after they are visited; COUNT bounds the work.
+    vector<string> matched;
+    cursor = 0;
+    do {
+        cursor = store.scan(cursor, 1000, matched, "scan1??");
+    } while (cursor != 0);
+    assert(matched.size() == 100);
+
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    store.clear();
+    assert(handler.handleCommand("SET only one") == "OK");
+    string reply = handler.handleCommand("SCAN 0 MATCH o* COUNT 1000");
+    assert(reply == "0\nonly\n");
+    assert(handler.handleCommand("SCAN 0 MATCH x* COUNT 1000") == "0\n");
+    assert(handler.handleCommand("SCAN").find("ERROR") == 0);
+    assert(handler.handleCommand("SCAN abc").find("ERROR") == 0);
+    assert(handler.handleCommand("SCAN 0 COUNT 0").find("ERROR") == 0);
+    assert(handler.handleCommand("SCAN 0 LIMIT 5").find("ERROR") == 0);
+}
+
+void testOrderedIndex() {
+    // The tree against std::set through splits, merges and root collapses.
+    struct Record {
+        string k;
+        string_view key() const { return k; }
+    };
+    vector<unique_ptr<Record>> records(20000);
+    OrderedIndex<Record> index;
+    set<string> expected;
+    uint64_t state = 12345;
+    for (int step = 0; step < 200000; ++step) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t i = static_cast<size_t>(state >> 33) % records.size();
+        // Insert-heavy first, delete-heavy later.
+        if ((state >> 20) % 100 < (step < 100000 ? 70u : 20u)) {
+            if (!records[i]) {
+                records[i] = make_unique<Record>(Record{"k" + to_string(i)});
+                assert(index.insert(records[i].get()) == nullptr);
+                expected.insert(records[i]->k);
+            }
+        } else if (records[i]) {
+            assert(index.erase(records[i]->k) == records[i].get());
+            expected.erase(records[i]->k);
+            records[i].reset();
+        }
+        assert(index.size() == expected.size());
+    }
+    vector<string> walked;
+    index.forEachFrom("", [&walked](Record* r) { walked.push_back(r->k); return true; });
+    assert(walked == vector<string>(expected.begin(), expected.end()));
+    walked.clear();
+    index.forEachFrom("k5", [&walked](Record* r) { walked.push_back(r->k); return walked.size() < 10; });
+    assert(walked == vector<string>(expected.lower_bound("k5"), next(expected.lower_bound("k5"), 10)));
+    Record replacement{"k5"};
+    if (records[5]) {
+        assert(index.insert(&replacement) == records[5].get());
+        assert(index.insert(records[5].get()) == &replacement);
+    }
+    assert(index.erase("missing") == nullptr);
+    size_t emptyBytes = OrderedIndex<Record>().bytes();
+    for (auto& r : records) {
+        if (r) {
+            index.erase(r->k);
+        }
+    }
+    assert(index.size() == 0 && index.bytes() == emptyBytes);
+
+    KeyValueStore store;
+    for (int i = 0; i < 3000; ++i) {
+        assert(store.set("user:" + to_string(i), "v"));
+    }
+    vector<string> keys;
+    assert(!store.prefix("user:1", 0, keys));
+    size_t before = store.memoryStats().usedBytes;
+    store.setOrderedIndex(true);
+    assert(store.memoryStats().indexBytes > 0);
+    assert(store.memoryStats().usedBytes == before + store.memoryStats().indexBytes);
+
+    // Built from the existing keys, then kept current by writes.
+    assert(store.set("user:10a", "v"));
+    assert(store.set("userz", "v"));
+    assert(store.del("user:100"));
+    set<string> live;
+    for (int i = 0; i < 3000; ++i) {
+        live.insert("user:" + to_string(i));
+    }
+    live.insert("user:10a");
+    live.insert("userz");
+    live.erase("user:100");
+    assert(store.prefix("user:10", 0, keys));
+    assert(keys == vector<string>(live.lower_bound("user:10"), live.lower_bound("user:11")));
+    assert(keys.size() == 1 + 10 + 99 + 1);
+    keys.clear();
+    assert(store.prefix("user:", 5, keys));
+    assert(keys == vector<string>({"user:0", "user:1", "user:10", "user:1000", "user:1001"}));
+    keys.clear();
+    assert(store.range("user:2998", "userz", 0, keys));
+    assert(keys == vector<string>(live.lower_bound("user:2998"), live.end()));
+    assert(keys.size() == 1 + 1 + 700 + 70 + 7 + 1);
+
+    // A LIMIT larger than one batch per shard still comes out in order.
+    keys.clear();
+    assert(store.prefix("user:", 2500, keys));
+    assert(keys.size() == 2500 && is_sorted(keys.begin(), keys.end()));
+    assert(adjacent_find(keys.begin(), keys.end()) == keys.end());
+
+    // Expired keys are skipped at once and unlinked by the cleaner.
+    assert(store.pexpire("user:1000", 1));
+    this_thread::sleep_for(chrono::milliseconds(50));
+    keys.clear();
+    assert(store.prefix("user:1000", 0, keys) && keys.empty());
+    assert(store.set("soon", "v"));
+    assert(store.pexpire("soon", 1));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    assert(store.memoryStats().totalKeys == 3000);
+
+    // Loading and clearing replace the index along with the tables.
+    string file = "ordered_index_test.snap";
+    assert(store.save(file));
+    store.clear();
+    keys.clear();
+    assert(store.prefix("", 0, keys) && keys.empty());
+    assert(store.load(file, 4));
+    assert(store.prefix("", 0, keys) && keys.size() == 3000);
+    remove(file.c_str());
+
+    store.setOrderedIndex(false);
+    assert(store.memoryStats().indexBytes == 0);
+    assert(!store.range("a", "z", 0, keys));
+
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    assert(handler.handleCommand("PREFIX user:1").find("ERROR") == 0);
+    assert(handler.handleCommand("CONFIG SET ordered-index yes") == "OK");
+    assert(handler.handleCommand("CONFIG GET ordered-index") == "yes");
+    assert(handler.handleCommand("PREFIX user:99 LIMIT 3") == "user:99\nuser:990\nuser:991\n");
+    assert(handler.handleCommand("RANGE user:998 user:999") == "user:998\nuser:999\n");
+    assert(handler.handleCommand("RANGE b a") == "(empty)");
+    assert(handler.handleCommand("PREFIX").find("ERROR") == 0);
+    assert(handler.handleCommand("PREFIX a LIMIT 0").find("ERROR") == 0);
+    assert(handler.handleCommand("RANGE a").find("ERROR") == 0);
+    assert(handler.handleCommand("RANGE a b COUNT 2").find("ERROR") == 0);
+}
+
+void testBatchCommands() {
+    KeyValueStore store;
+    store.setOrderedIndex(true);
+    vector<pair<string, string>> pairs;
+    vector<string> keys;
+    for (int i = 0; i < 500; ++i) {
+        pairs.emplace_back("batch" + to_string(i), "v" + to_string(i));
+        keys.push_back("batch" + to_string(i));
+    }
+    // A repeated key takes the later value, as with two SETs in a row.
+    pairs.emplace_back("batch7", "again");
+    assert(store.set("batch3", "old", 100));
+    assert(store.mset(pairs));
+    assert(store.get("batch7") == "again");
+    assert(!store.ttl("batch3"));
+    assert(store.getStats().totalKeys == 500);
+
+    keys.push_back("missing");
+    keys.push_back("batch1");
+    vector<optional<string>> values;
+    auto collect = [&values](optional<string_view> value) {
+        values.push_back(value ? optional<string>(*value) : nullopt);
+    };
+    store.mget(keys, collect);
+    assert(values.size() == keys.size());
+    for (int i = 0; i < 500; ++i) {
+        assert(values[i] == (i == 7 ? "again" : "v" + to_string(i)));
+    }
+    assert(!values[500] && values[501] == "v1");
+
+    // An empty value is a hit, not a miss.
+    assert(store.set("batch-empty", ""));
+    values.clear();
+    store.mget({"batch-empty", "missing"}, collect);
+    assert(values.size() == 2 && values[0] == "" && !values[1]);
+    assert(store.del("batch-empty"));
+
+    assert(store.pexpire("batch2", 1));
+    this_thread::sleep_for(chrono::milliseconds(5));
+    values.clear();
+    store.mget({"batch2"}, collect);
+    assert(values.size() == 1 && !values[0]);
+
+    assert(store.mdel({"batch0", "batch1", "batch1", "missing"}) == 2);
+    assert(store.get("batch0") == "" && store.exists("batch4"));
+    vector<string> indexed;
+    assert(store.prefix("batch1", 2, indexed));
+    assert(indexed == vector<string>({"batch10", "batch100"}));
+
+    // The whole batch is refused when it cannot fit.
+    store.setMaxMemory(store.memoryStats().usedBytes + 1000);
+    vector<pair<string, string>> big;
+    for (int i = 0; i < 100; ++i) {
+        big.emplace_back("big" + to_string(i), string(100, 'x'));
+    }
+    assert(!store.mset(big));
+    assert(!store.exists("big0"));
+    store.setMaxMemory(0);
+
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    assert(handler.handleCommand("MSET a 1 b 2 c 3") == "OK");
+    assert(handler.handleCommand("MGET a nope c") == "1\n(nil)\n3\n");
+    assert(handler.handleCommand("MDEL a b nope") == "2");
+    assert(handler.handleCommand("MGET a b c") == "(nil)\n(nil)\n3\n");
+    assert(handler.handleCommand("MSET a").find("ERROR") == 0);
+    assert(handler.handleCommand("MSET a 1 b").find("ERROR") == 0);
+    assert(handler.handleCommand("MGET").find("ERROR") == 0);
+    assert(handler.handleCommand("MDEL").find("ERROR") == 0);
+}
+
+void testPipeline() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+
+    // Commands split across reads run once their newline arrives, in order,
+    // and their responses accumulate in one buffer.
+    InputBuffer input;
+    input.append("SET a 1\r\nGET a\nMGET a b\n  \nEXISTS a\nGE");
+    string output;
+    assert(handler.handlePipeline(input, output));
+    assert(output == "OK\n1\n1\n(nil)\n1\n");
+    assert(input.view() == "GE");
+    input.append("T b\nDEL a\nQUIT\nSET after 1\n");
+    output.clear();
+    assert(!handler.handlePipeline(input, output));
+    assert(output == "Key not found\nOK\nBYE\n");
+    assert(!store.exists("after"));
+
+    // A large pipeline in arbitrary chunks answers every command.
+    string stream;
+    for (int i = 0; i < 1000; ++i) {
+        stream += "SET p" + to_string(i) + " v\nGET p" + to_string(i) + "\n";
+    }
+    input.clear();
+    output.clear();
+    for (size_t at = 0; at < stream.size(); at += 777) {
+        input.append(string_view(stream).substr(at, 777));
+        assert(handler.handlePipeline(input, output));
+    }
+    assert(input.empty());
+    assert(count(output.begin(), output.end(), '\n') == 2000);
+    assert(output.substr(0, 10) == "OK\nv\nOK\nv\n");
+}
+
+// A RESP multibulk request, as a Redis client would send it.
+string respRequest(const vector<string>& args) {
+    string request = "*" + to_string(args.size()) + "\r\n";
+    for (const auto& arg : args) {
+        request += "$" + to_string(arg.size()) + "\r\n" + arg + "\r\n";
+    }
+    return request;
+}
+
+void testResp() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+
+    // Arguments are views into the buffer and may hold any bytes; every
+    // proper prefix of a request is incomplete.
+    string value("a b\r\n\0c", 8);
+    string request = respRequest({"SET", "k e y", value});
+    vector<string_view> args;
+    size_t consumed;
+    Protocol protocol;
+    string error;
+    assert(RespParser::parse(request.data(), request.size(), args, consumed, protocol, error) ==
+           RespParser::Status::Complete);
+    assert(protocol == Protocol::Resp && consumed == request.size());
+    assert(args.size() == 3 && args[1] == "k e y" && args[2] == value);
+    assert(args[2].data() > request.data() && args[2].data() < request.data() + request.size());
+    for (size_t size = 0; size < request.size(); ++size) {
+        assert(RespParser::parse(request.data(), size, args, consumed, protocol, error) ==
+               RespParser::Status::Incomplete);
+    }
+
+    // Replies follow each command's protocol, on one connection.
+    InputBuffer input;
+    input.append(request + respRequest({"GET", "k e y"}) + "EXISTS k\n" + respRequest({"get", "nothing"}) +
+                 respRequest({"PING"}) + respRequest({"PING", "hi there"}) + "*0\r\n" +
+                 respRequest({"DEL", "k e y"}) + respRequest({"TTL", "k e y"}) + respRequest({"NOPE"}));
+    string output;
+    assert(handler.handlePipeline(input, output));
+    assert(input.empty());
+    assert(output == "+OK\r\n$8\r\n" + value + "\r\n0\n$-1\r\n+PONG\r\n$8\r\nhi there\r\n:1\r\n:-2\r\n"
+                     "-ERR Unknown command\r\n");
+
+    // Arrays, nested for SCAN; inline replies are unchanged.
+    handler.handleCommand("MSET a 1 b 2");
+    output.clear();
+    input.append(respRequest({"MGET", "a", "x", "b"}) + respRequest({"SCAN", "0", "MATCH", "b", "COUNT", "1000"}) +
+                 respRequest({"CONFIG", "GET", "maxmemory-policy"}) + respRequest({"CONFIG", "GET", "save"}) +
+                 respRequest({"SET", "e", "1", "60"}) + respRequest({"TTL", "a"}) + respRequest({"TTL", "e"}));
+    assert(handler.handlePipeline(input, output));
+    assert(output == "*3\r\n$1\r\n1\r\n$-1\r\n$1\r\n2\r\n*2\r\n$1\r\n0\r\n*1\r\n$1\r\nb\r\n"
+                     "*2\r\n$16\r\nmaxmemory-policy\r\n$10\r\nnoeviction\r\n*0\r\n+OK\r\n:-1\r\n:60\r\n");
+    assert(handler.handleCommand("MGET a x b") == "1\n(nil)\n2\n");
+    assert(handler.handleCommand("SCAN 0 MATCH b COUNT 1000") == "0\nb\n");
+
+    // An empty value stored over RESP reads back empty from MGET, as from
+    // GET, and only a missing key is nil.
+    output.clear();
+    input.append(respRequest({"SET", "empty", ""}) + respRequest({"GET", "empty"}) +
+                 respRequest({"MGET", "empty", "x"}));
+    assert(handler.handlePipeline(input, output));
+    assert(output == "+OK\r\n$0\r\n\r\n*2\r\n$0\r\n\r\n$-1\r\n");
+    assert(handler.handleCommand("PING") == "PONG");
+
+    // Fed a byte at a time, a mixed pipeline gives the same replies.
+    string stream = respRequest({"SET", "s", "x y"}) + "GET s\r\n" + respRequest({"GET", "s"});
+    input.clear();
+    output.clear();
+    for (char c : stream) {
+        input.append(&c, 1);
+        assert(handler.handlePipeline(input, output));
+    }
+    assert(input.empty());
+    assert(output == "+OK\r\nx y\n$3\r\nx y\r\n");
+
+    // A malformed request is answered and closes the connection.
+    input.append(respRequest({"PING"}) + "*1\r\n+PING\r\n" + respRequest({"PING"}));
+    output.clear();
+    assert(!handler.handlePipeline(input, output));
+    assert(output == "+PONG\r\n-ERR Protocol error: expected '$', got '+'\r\n");
+    assert(input.empty());
+    input.append("*1\r\n$-5\r\n");
+    output.clear();
+    assert(!handler.handlePipeline(input, output));
+    assert(output == "-ERR Protocol error: invalid bulk length\r\n");
+    input.append("*x\r\n");
+    assert(!handler.handlePipeline(input, output));
+    input.append(string(RespParser::MAX_INLINE + 1, 'a'));
+    output.clear();
+    assert(!handler.handlePipeline(input, output));
+    assert(output == "ERROR: Protocol error: too big inline request\n");
+}
+
+void testInputBuffer() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+
+    // The line scanner agrees with memchr wherever the byte is, or isn't,
+    // across the vector widths and the scalar tail.
+    mt19937 rng(7);
+    string text(200, 'x');
+    for (size_t size = 0; size <= text.size(); ++size) {
+        for (size_t at = 0; at <= size; ++at) {
+            fill(text.begin(), text.end(), static_cast<char>('a' + rng() % 26));
+            if (at < size) {
+                text[at] = '\n';
+                text[at + (size - at) / 2] = '\n';
+            }
+            const void* found = memchr(text.data(), '\n', size);
+            size_t expected = found ? static_cast<const char*>(found) - text.data() : size;
+            assert(RespParser::find(text.data(), size, '\n') == expected);
+            assert(RespParser::find(text.data(), size, '\r') == size);
+        }
+    }
+
+    // Consuming moves a cursor; what is left stays in order through
+    // compaction and growth.
+    InputBuffer buffer;
+    string expected;
+    for (int i = 0; i < 5000; ++i) {
+        string chunk(1 + rng() % 700, static_cast<char>('a' + i % 26));
+        buffer.append(chunk);
+        expected += chunk;
+        size_t drop = rng() % (expected.size() + 1);
+        buffer.consume(drop);
+        expected.erase(0, drop);
+        assert(buffer.view() == expected);
+    }
+    assert(buffer.capacity() < 8 * 4096);
+    char* room = buffer.prepare(100000);
+    memcpy(room, "abc", 3);
+    buffer.commit(3);
+    assert(buffer.view() == expected + "abc");
+    InputBuffer other;
+    other.takeFrom(buffer);
+    assert(buffer.empty() && other.view() == expected + "abc");
+    other.clear();
+    other.release(0);
+    assert(other.capacity() == 0);
+
+    // A large value is not looked at until all of it is in: the parser
+    // says how much the request needs once its header has arrived.
+    string value(1 << 20, 'v');
+    string request = respRequest({"SET", "big", value});
+    vector<string_view> args;
+    size_t consumed;
+    Protocol protocol;
+    string error;
+    assert(RespParser::parse(request.data(), 40, args, consumed, protocol, error) ==
+           RespParser::Status::Incomplete);
+    assert(consumed == request.size());
+    InputBuffer input;
+    string output;
+    for (size_t at = 0; at < request.size(); at += 16384) {
+        input.append(string_view(request).substr(at, 16384));
+        assert(handler.handlePipeline(input, output));
+        if (input.size() > 40) {
+            assert(input.needed() == request.size() || input.empty());
+        }
+    }
+    assert(input.empty() && output == "+OK\r\n");
+    assert(store.get("big") == value);
+
+    // An inline line is searched only in its new bytes, and its "\r" is
+    // trimmed without copying.
+    output.clear();
+    input.append("GET b");
+    assert(handler.handlePipeline(input, output) && input.progress().scanned == 5 && input.needed() == 6);
+    input.append("ig\r");
+    assert(handler.handlePipeline(input, output) && input.progress().scanned == 8);
+    input.append("\nPING\r\n");
+    assert(handler.handlePipeline(input, output) && input.empty());
+    assert(output == value + "\nPONG\n");
+
+    // A request of many arguments, fed a few bytes at a time behind a
+    // command that completes, is resumed after its last whole argument
+    // rather than parsed again from its start.
+    vector<string> pairs = {"MSET"};
+    vector<string> names;
+    for (int i = 0; i < 2000; ++i) {
+        names.push_back("many" + to_string(i));
+    }
+    for (const auto& name : names) {
+        pairs.push_back(name);
+        pairs.push_back(name);
+    }
+    string stream = respRequest({"PING"}) + respRequest(pairs) + respRequest({"GET", "many1999"});
+    output.clear();
+    size_t parsed = 0;
+    for (size_t at = 0; at < stream.size(); at += 7) {
+        input.append(string_view(stream).substr(at, 7));
+        assert(handler.handlePipeline(input, output));
+        const RespParser::Progress& progress = input.progress();
+        if (progress.count == static_cast<long long>(pairs.size())) {
+            // Whole arguments are kept as spans, never parsed again.
+            assert(progress.parsed >= parsed && progress.parsed <= input.size());
+            assert(progress.spans.size() <= pairs.size());
+            parsed = progress.parsed;
+        }
+    }
+    assert(input.empty() && parsed > stream.size() / 2);
+    assert(output == "+PONG\r\n+OK\r\n$8\r\nmany1999\r\n");
+    assert(input.progress().count == -1 && input.progress().spans.empty());
+}
+
+void testCommandTable() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+
+    // Names match in any case; argument counts are checked before the
+    // handler runs.
+    assert(handler.handleCommand("set Key v") == "OK");
+    assert(handler.handleCommand("gEt Key") == "v");
+    assert(handler.handleCommand("BGREWRITEAOF") == "ERROR: The append-only log is off");
+    assert(handler.handleCommand("TTL") == "ERROR: TTL requires a key");
+    assert(handler.handleCommand("SET Key") == "ERROR: SET requires key and value");
+    assert(handler.handleCommand("GET Key other") == "ERROR: Too many arguments for GET");
+    assert(handler.handleCommand("MSET a 1 b") == "ERROR: MSET requires key value pairs");
+    assert(handler.handleCommand("GETS Key") == "ERROR: Unknown command");
+    assert(handler.handleCommand("A") == "ERROR: Unknown command");
+    assert(handler.handleCommand("ZZZ") == "ERROR: Unknown command");
+    assert(handler.handleCommand("GE") == "ERROR: Unknown command");
+
+    // GET reads in place; an empty value still ends its inline line.
+    InputBuffer input;
+    input.append(respRequest({"SET", "empty", ""}) + respRequest({"GET", "empty"}) + "GET empty\nGET Key\n");
+    string output;
+    assert(handler.handlePipeline(input, output));
+    assert(output == "+OK\r\n$0\r\n\r\n\nv\n");
+}
+
+// Waits up to two seconds for done to hold.
+bool eventually(const function<bool()>& done) {
+    for (int i = 0; i < 200 && !done(); ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return done();
+}
+
+void testExecutionLanes() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    assert(CommandHandler::laneOf({"keys"}) == CommandHandler::Lane::Slow);
+    assert(CommandHandler::laneOf({"LOAD", "f"}) == CommandHandler::Lane::Slow);
+    assert(CommandHandler::laneOf({"GET", "k"}) == CommandHandler::Lane::Fast);
+    assert(CommandHandler::laneOf({"NOPE"}) == CommandHandler::Lane::Fast);
+    // CONFIG by parameter: only building the ordered index is slow.
+    assert(CommandHandler::laneOf({"config", "set", "Ordered-Index", "yes"}) == CommandHandler::Lane::Slow);
+    assert(CommandHandler::laneOf({"CONFIG", "GET", "ordered-index"}) == CommandHandler::Lane::Fast);
+    assert(CommandHandler::laneOf({"CONFIG", "SET", "maxmemory", "0"}) == CommandHandler::Lane::Fast);
+
+    // Without lanes, every command runs where it is read.
+    InputBuffer input;
+    input.append("SET a 1\nKEYS\nGET a\n");
+    string output;
+    CommandHandler::SlowCommand slow;
+    assert(handler.handlePipeline(input, output, slow));
+    assert(slow.request.empty() && input.empty() && output == "OK\na\n1\n");
+
+    // With them, the pipeline stops at KEYS, leaving what follows it.
+    ExecutionLanes lanes(1);
+    handler.setLanes(&lanes);
+    input.append("SET b 2\nKEYS\nGET b\n");
+    output.clear();
+    assert(handler.handlePipeline(input, output, slow));
+    assert(output == "OK\n" && slow.request == "KEYS\n" && input.view() == "GET b\n");
+    promise<string> finished;
+    future<string> reply = finished.get_future();
+    handler.runSlow(move(slow), [&finished](string& text) { finished.set_value(text); });
+    string keys = reply.get();
+    assert((keys == "a\nb\n" || keys == "b\na\n"));
+    slow = CommandHandler::SlowCommand();
+    assert(handler.handlePipeline(input, output, slow) && slow.request.empty() && output == "OK\n2\n");
+    // Counted once done has the reply.
+    assert(eventually([&] { return lanes.slowCompleted() == 1; }));
+    assert(lanes.fastCompleted() == 2 && lanes.fastRunning() == 0);
+
+    // The lane's thread busy and its queue full: a slow command is
+    // refused, and the fast lane runs on.
+    promise<void> release;
+    shared_future<void> released = release.get_future().share();
+    assert(lanes.admitSlow());
+    lanes.submitSlow([released] { released.wait(); });
+    assert(eventually([&] { return lanes.slowRunning() == 1; }));
+    for (size_t i = 0; i < ExecutionLanes::MAX_QUEUED; ++i) {
+        assert(lanes.admitSlow());
+        lanes.submitSlow([] {});
+    }
+    input.append(respRequest({"CLEAR"}) + respRequest({"GET", "b"}));
+    output.clear();
+    assert(handler.handlePipeline(input, output, slow) && slow.request.empty());
+    assert(output == "-ERR Too many slow commands queued, try again later\r\n$1\r\n2\r\n");
+    // STATS sent down a pipeline sees its own batch running.
+    input.append("STATS\n");
+    output.clear();
+    assert(handler.handlePipeline(input, output, slow) && slow.request.empty());
+    assert(output.find("Slow lane: 1024 queued, 1 running (at most 1), 1 completed, 1 refused") != string::npos);
+    assert(output.find("Fast lane: 1 running, ") != string::npos);
+    release.set_value();
+    assert(eventually([&] { return lanes.slowCompleted() == ExecutionLanes::MAX_QUEUED + 2; }));
+    assert(lanes.slowQueued() == 0 && lanes.slowRunning() == 0);
+    assert(store.get("b") == "2");
+}
+
+void testPartitions() {
+    // The channel between two loops: bounded, in order, across threads.
+    SpscQueue<int> small(3);
+    assert(small.capacity() == 4);
+    for (int i = 0; i < 4; ++i) {
+        int item = i;
+        assert(small.push(item));
+    }
+    int extra = 4;
+    assert(!small.push(extra) && extra == 4);
+    for (int i = 0; i < 4; ++i) {
+        int item = -1;
+        assert(small.pop(item) && item == i);
+    }
+    int none = 0;
+    assert(!small.pop(none) && small.empty());
+
+    SpscQueue<int> channel(64);
+    const int count = 200000;
+    thread producer([&] {
+        for (int i = 0; i < count; ++i) {
+            int item = i;
+            while (!channel.push(item)) {
+                this_thread::yield();
+            }
+        }
+    });
+    for (int expected = 0; expected < count;) {
+        int item = -1;
+        if (channel.pop(item)) {
+            assert(item == expected);
+            expected++;
+        }
+    }
+    producer.join();
+
+    // Keys spread over the partitions; a {tag} keeps keys together.
+    vector<size_t> perPartition(8);
+    for (int i = 0; i < 8000; ++i) {
+        perPartition[CommandHandler::partitionOf("key:" + to_string(i), 8)]++;
+    }
+    for (size_t n : perPartition) {
+        assert(n > 800 && n < 1200);
+    }
+    size_t user = CommandHandler::partitionOf("user", 8);
+    assert(CommandHandler::partitionOf("{user}:name", 8) == user);
+    assert(CommandHandler::partitionOf("x{user}y", 8) == user);
+    assert(CommandHandler::partitionOf("{}user", 1) == 0);
+
+    size_t owner;
+    CommandHandler::Args args{"MSET", "{t}a", "1", "{t}b", "2"};
+    assert(CommandHandler::ownerOf(args, 8, owner) && owner == CommandHandler::partitionOf("t", 8));
+    args = {"PING"};
+    assert(!CommandHandler::ownerOf(args, 8, owner));
+    args = {"GET"};
+    assert(!CommandHandler::ownerOf(args, 8, owner));
+
+    // Four partitions, each command run by the handler of its owner.
+    Logger& logger = Logger::getInstance();
+    vector<unique_ptr<KeyValueStore>> stores;
+    vector<unique_ptr<CommandHandler>> handlers;
+    vector<KeyValueStore*> partitions;
+    for (int i = 0; i < 4; ++i) {
+        stores.push_back(make_unique<KeyValueStore>());
+        handlers.push_back(make_unique<CommandHandler>(*stores.back(), logger));
+        partitions.push_back(stores.back().get());
+    }
+    for (auto& handler : handlers) {
+        handler->setPartitions(partitions);
+    }
+    for (int i = 0; i < 100; ++i) {
+        string key = "k" + to_string(i);
+        assert(handlers[CommandHandler::partitionOf(key, 4)]->handleCommand("SET " + key + " v") == "OK");
+    }
+    for (auto& store : stores) {
+        assert(store->getStats().totalKeys > 10);
+    }
+
+    // Whole-keyspace commands reach every partition from any handler.
+    string stats = handlers[1]->handleCommand("STATS");
+    assert(stats.find("Partitions: 4\n") != string::npos);
+    assert(stats.find("Total keys: 100\n") != string::npos);
+    assert(stats.find("Shards: 256\n") != string::npos);
+    string keys = handlers[2]->handleCommand("KEYS");
+    assert(count_if(keys.begin(), keys.end(), [](char c) { return c == '\n'; }) == 100);
+    assert(handlers[0]->handleCommand("CONFIG SET ordered-index yes") == "OK");
+    assert(handlers[3]->handleCommand("PREFIX k1 LIMIT 3") == "k1\nk10\nk11\n");
+    assert(handlers[0]->handleCommand("CONFIG SET maxmemory 4000000") == "OK");
+    assert(stores[3]->maxMemory() == 1000000);
+    assert(handlers[1]->handleCommand("CONFIG GET maxmemory") == "4000000");
+    assert(handlers[0]->handleCommand("MEMORY USAGE k7") != "Key not found");
+
+    // Keys of more than one partition, and commands that need them all in
+    // one store, are refused.
+    assert(handlers[0]->handleCommand("MSET {t}a 1 {t}b 2").find("ERROR") == string::npos);
+    assert(handlers[0]->handleCommand("MGET k1 k2 k3 k4 k5 k6") ==
+           "ERROR: CROSSSLOT Keys in request don't hash to the same partition");
+    assert(handlers[0]->handleCommand("SCAN 0") == "ERROR: SCAN is not available with the keyspace partitioned");
+    assert(handlers[0]->handleCommand("SAVE dump.rdb") == "ERROR: SAVE is not available with the keyspace partitioned");
+
+    assert(handlers[2]->handleCommand("CLEAR") == "OK");
+    for (auto& store : stores) {
+        assert(store->getStats().totalKeys == 0);
+    }
+}
+
+#ifdef KVSTORE_EPOLL
+// A blocking loopback client that gives up on a read after two seconds,
+// with a receive buffer of receiveBuffer bytes if not 0.
+int connectClient(int port, int receiveBuffer = 0) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (receiveBuffer != 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    return fd;
+}
+
+void sendText(int fd, const string& text) {
+    assert(send(fd, text.data(), text.size(), 0) == static_cast<ssize_t>(text.size()));
+}
+
+// Reads until size bytes have arrived, the peer closes or the read times
+// out, and returns what came.
+string receiveText(int fd, size_t size) {
+    string text;
+    char buffer[4096];
+    while (text.size() < size) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            break;
+        }
+        text.append(buffer, static_cast<size_t>(n));
+    }
+    return text;
+}
+
+// Runs clients against a started engine, greeting "hello\n" after 50 ms,
+// and stops it.
+void checkReactor(Reactor& reactor) {
+    assert(reactor.port() > 0);
+
+    // More clients than the old four-thread pool could serve, all
+    // connected at once and answered in turn.
+    vector<int> clients;
+    for (int i = 0; i < 32; ++i) {
+        clients.push_back(connectClient(reactor.port()));
+    }
+    for (size_t i = 0; i < clients.size(); ++i) {
+        sendText(clients[i], respRequest({"SET", "c" + to_string(i), "v" + to_string(i)}));
+    }
+    for (size_t i = 0; i < clients.size(); ++i) {
+        assert(receiveText(clients[i], 5) == "+OK\r\n");
+    }
+    for (size_t i = clients.size(); i-- > 0;) {
+        string value = "v" + to_string(i);
+        sendText(clients[i], respRequest({"GET", "c" + to_string(i)}));
+        string expected = "$" + to_string(value.size()) + "\r\n" + value + "\r\n";
+        assert(receiveText(clients[i], expected.size()) == expected);
+    }
+    assert(reactor.connectionCount() == clients.size());
+
+    // A silent client is greeted after the delay; an inline one right
+    // away, ahead of its first reply. A RESP client never is (above).
+    int silent = connectClient(reactor.port());
+    assert(receiveText(silent, 6) == "hello\n");
+    int typed = connectClient(reactor.port());
+    sendText(typed, "GET c0\n");
+    assert(receiveText(typed, 9) == "hello\nv0\n");
+
+    // A pipeline far larger than one read or one send is answered whole.
+    string pipeline, expected;
+    for (int i = 0; i < 20000; ++i) {
+        pipeline += "GET c1\r\n";
+        expected += "v1\n";
+    }
+    thread writer([&] { sendText(typed, pipeline); });
+    assert(receiveText(typed, expected.size()) == expected);
+    writer.join();
+
+    // QUIT closes once its reply is out.
+    sendText(typed, "QUIT\n");
+    assert(receiveText(typed, 100) == "BYE\n");
+    ::close(typed);
+    ::close(silent);
+    for (int fd : clients) {
+        ::close(fd);
+    }
+    for (int i = 0; i < 100 && reactor.connectionCount() > 0; ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    assert(reactor.connectionCount() == 0);
+
+    // Stopping with clients still connected closes them.
+    int open = connectClient(reactor.port());
+    sendText(open, "*1\r\n$4\r\nPING\r\n");
+    assert(receiveText(open, 7) == "+PONG\r\n");
+    reactor.stop();
+    assert(receiveText(open, 1).empty());
+    ::close(open);
+}
+
+// Polls handler's CLIENT LIST for up to two seconds until it has text in.
+bool clientListed(CommandHandler& handler, const string& text) {
+    for (int i = 0; i < 200; ++i) {
+        if (handler.handleCommand("CLIENT LIST").find(text) != string::npos) {
+            return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// A client that pipelines faster than it reads is paused at the soft
+// output limit and resumed as it catches up, and closed at the hard one,
+// on a started engine whose registry handler uses.
+void checkOutputLimits(Reactor& reactor, CommandHandler& handler) {
+    ClientRegistry& registry = reactor.clients();
+    assert(handler.handleCommand("CONFIG SET client-output-soft-limit 1048576") == "OK");
+    assert(handler.handleCommand("CONFIG GET client-output-soft-limit") == "1048576");
+    assert(handler.handleCommand("CONFIG SET client-output-hard-limit x").find("ERROR") == 0);
+    assert(handler.handleCommand("CLIENT KILL").find("ERROR") == 0);
+    string value(64 * 1024, 'v');
+    assert(handler.handleCommand("SET big " + value) == "OK");
+    string reply = "$" + to_string(value.size()) + "\r\n" + value + "\r\n";
+
+    // 8 MB of replies to a read, most of them more than the sockets hold:
+    // the next read waits until the client has taken them.
+    string batch;
+    for (int i = 0; i < 128; ++i) {
+        batch += respRequest({"GET", "big"});
+    }
+    int client = connectClient(reactor.port(), 64 * 1024);
+    sendText(client, batch);
+    assert(clientListed(handler, "paused=1"));
+    sendText(client, batch);
+    this_thread::sleep_for(chrono::milliseconds(50));
+    assert(clientListed(handler, "paused=1"));
+    string list = handler.handleCommand("CLIENT LIST");
+    assert(list.find("addr=127.0.0.1:") != string::npos && list.find(" omem=0 ") == string::npos);
+    size_t expected = 2 * 128 * reply.size();
+    string received = receiveText(client, expected);
+    assert(received.size() == expected && received.compare(0, reply.size(), reply) == 0);
+    assert(clientListed(handler, "paused=0\n"));
+    assert(registry.count() == 1 && registry.closedOverLimitCount() == 0);
+
+    // With pausing off, the same client is cut off past the hard limit.
+    assert(handler.handleCommand("CONFIG SET client-output-soft-limit 0") == "OK");
+    assert(handler.handleCommand("CONFIG SET client-output-hard-limit 4194304") == "OK");
+    batch.clear();
+    for (int i = 0; i < 256; ++i) {
+        batch += respRequest({"GET", "big"});
+    }
+    sendText(client, batch);
+    this_thread::sleep_for(chrono::milliseconds(100));
+    assert(receiveText(client, 256 * reply.size()).size() < 256 * reply.size());
+    ::close(client);
+    for (int i = 0; i < 100 && reactor.connectionCount() > 0; ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    assert(registry.count() == 0 && registry.closedOverLimitCount() == 1);
+    string stats = handler.handleCommand("STATS");
+    assert(stats.find("Connected clients: 0") != string::npos);
+    assert(stats.find("Clients closed over output limit: 1") != string::npos);
+    registry.setSoftLimit(ClientRegistry::DEFAULT_SOFT_LIMIT);
+    registry.setHardLimit(ClientRegistry::DEFAULT_HARD_LIMIT);
+}
+
+// A slow-lane command holds up the connection that sent it, whose later
+// commands run after it, and no other, on a started engine whose handler
+// uses lanes with one slow thread.
+void checkSlowLane(Reactor& reactor, CommandHandler& handler, ExecutionLanes& lanes) {
+    assert(handler.handleCommand("SET s 1") == "OK");
+    // The lane's thread is kept busy, so CLEAR waits in its queue.
+    promise<void> release;
+    shared_future<void> released = release.get_future().share();
+    assert(lanes.admitSlow());
+    lanes.submitSlow([released] { released.wait(); });
+    uint64_t completed = lanes.slowCompleted();
+
+    int slow = connectClient(reactor.port());
+    int fast = connectClient(reactor.port());
+    sendText(slow, respRequest({"GET", "s"}) + respRequest({"CLEAR"}) + respRequest({"GET", "s"}));
+    assert(receiveText(slow, 7) == "$1\r\n1\r\n");
+    assert(eventually([&] { return lanes.slowQueued() == 1; }));
+    sendText(fast, respRequest({"GET", "s"}) + respRequest({"PING"}));
+    assert(receiveText(fast, 14) == "$1\r\n1\r\n+PONG\r\n");
+    char byte;
+    assert(recv(slow, &byte, 1, MSG_DONTWAIT) < 0);
+    assert(handler.handleCommand("STATS").find("Slow lane: 1 queued, 1 running (at most 1)") != string::npos);
+
+    release.set_value();
+    assert(receiveText(slow, 10) == "+OK\r\n$-1\r\n");
+    assert(eventually([&] { return lanes.slowCompleted() == completed + 2; }));
+    // The connection reads again.
+    sendText(slow, respRequest({"SET", "s", "2"}) + respRequest({"KEYS"}));
+    assert(receiveText(slow, 14) == "+OK\r\n*1\r\n$1\r\ns\r\n");
+
+    // Building the ordered index over the keyspace waits on the slow lane
+    // too, and GETs from other connections are answered meanwhile.
+    promise<void> releaseIndex;
+    shared_future<void> indexReleased = releaseIndex.get_future().share();
+    assert(lanes.admitSlow());
+    lanes.submitSlow([indexReleased] { indexReleased.wait(); });
+    sendText(slow, respRequest({"CONFIG", "SET", "ordered-index", "yes"}) + respRequest({"PREFIX", "s"}));
+    assert(eventually([&] { return lanes.slowQueued() == 1; }));
+    sendText(fast, respRequest({"GET", "s"}));
+    assert(receiveText(fast, 7) == "$1\r\n2\r\n");
+    assert(recv(slow, &byte, 1, MSG_DONTWAIT) < 0);
+    releaseIndex.set_value();
+    assert(receiveText(slow, 14) == "+OK\r\n*1\r\n$1\r\ns\r\n");
+    assert(handler.handleCommand("CONFIG SET ordered-index no") == "OK");
+    ::close(slow);
+    ::close(fast);
+    assert(eventually([&] { return reactor.connectionCount() == 0; }));
+}
+
+void testEpollReactor() {
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    EpollReactor reactor(handler, logger, "hello\n", chrono::milliseconds(50), 2);
+    // After the engine, so it is gone before the loops its replies go to.
+    ExecutionLanes lanes(1);
+    handler.setClients(&reactor.clients());
+    handler.setLanes(&lanes);
+    assert(reactor.start(0));
+    checkOutputLimits(reactor, handler);
+    checkSlowLane(reactor, handler, lanes);
+    checkReactor(reactor);
+}
+
+#ifdef KVSTORE_URING
+// False, skipping the test, where the kernel has no io_uring for it.
+bool testUringReactor() {
+    string reason;
+    if (!IoUring::supported(reason)) {
+        cout << "io_uring unavailable (" << reason << "), skipped" << endl;
+        return false;
+    }
+    KeyValueStore store;
+    Logger& logger = Logger::getInstance();
+    CommandHandler handler(store, logger);
+    UringReactor reactor(handler, logger, "hello\n", chrono::milliseconds(50), 2);
+    ExecutionLanes lanes(1);
+    handler.setClients(&reactor.clients());
+    handler.setLanes(&lanes);
+    assert(reactor.start(0));
+    checkOutputLimits(reactor, handler);
+    checkSlowLane(reactor, handler, lanes);
+
+    // Values past ZEROCOPY_BYTES go out with zero-copy send, across many
+    // of the provided buffers on the way in.
+    string large(1 << 20, 'x');
+    for (size_t i = 0; i < large.size(); i += 997) {
+        large[i] = static_cast<char>('a' + i % 26);
+    }
+    int client = connectClient(reactor.port());
+    sendText(client, respRequest({"SET", "large", large}));
+    assert(receiveText(client, 5) == "+OK\r\n");
+    string reply = "$" + to_string(large.size()) + "\r\n" + large + "\r\n";
+    for (int i = 0; i < 3; ++i) {
+        sendText(client, respRequest({"GET", "large"}));
+        assert(receiveText(client, reply.size()) == reply);
+    }
+    assert(reactor.zeroCopySends() >= 3);
+    ::close(client);
+    for (int i = 0; i < 100 && reactor.connectionCount() > 0; ++i) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    checkReactor(reactor);
+
+    // With the engine chosen, snapshots and the append log are written
+    // through the calling thread's ring.
+    IoUring::useForFiles(true);
+    assert(IoUring::fileRing() != nullptr);
+    const string snapshot = "test_uring_snapshot.bin";
+    const string log = "test_uring_appendonly.aof";
+    remove(log.c_str());
+    {
+        KeyValueStore saved;
+        for (int i = 0; i < 50000; ++i) {
+            assert(saved.set("u" + to_string(i), string(40, static_cast<char>('a' + i % 26))));
+        }
+        assert(saved.save(snapshot));
+        KeyValueStore loaded;
+        assert(loaded.load(snapshot));
+        assert(loaded.getStats().totalKeys == 50000 && loaded.get("u12345") == string(40, 'a' + 12345 % 26));
+
+        KeyValueStore logged;
+        assert(logged.openAppendLog(log, FsyncPolicy::Always));
+        assert(logged.set("a", "1") && logged.set("b", large) && logged.del("a"));
+    }
+    {
+        KeyValueStore replayed;
+        assert(replayed.openAppendLog(log, FsyncPolicy::No));
+        assert(replayed.getStats().totalKeys == 1 && replayed.get("b") == large);
+    }
+    IoUring::useForFiles(false);
+    remove(snapshot.c_str());
+    remove(log.c_str());
+    return true;
+}
+#endif
+
+void testPerCoreReactor() {
+    Logger& logger = Logger::getInstance();
+    vector<unique_ptr<KeyValueStore>> stores;
+    vector<unique_ptr<CommandHandler>> handlers;
+    vector<KeyValueStore*> partitions;
+    vector<CommandHandler*> loops;
+    for (int i = 0; i < 4; ++i) {
+        stores.push_back(make_unique<KeyValueStore>());
+        handlers.push_back(make_unique<CommandHandler>(*stores.back(), logger));
+        partitions.push_back(stores.back().get());
+        loops.push_back(handlers.back().get());
+    }
+    for (auto& handler : handlers) {
+        handler->setPartitions(partitions);
+    }
+    EpollReactor reactor(loops, logger, "hello\n", chrono::milliseconds(50));
+    ExecutionLanes lanes;
+    for (auto& handler : handlers) {
+        handler->setLanes(&lanes);
+    }
+    assert(reactor.start(0));
+
+    // Most keys belong to another loop than the one a client landed on;
+    // replies still come back in command order, forwarded or not.
+    int writer = connectClient(reactor.port());
+    string pipeline, expected;
+    for (int i = 0; i < 500; ++i) {
+        pipeline += respRequest({"SET", "k" + to_string(i), "v" + to_string(i)});
+        expected += "+OK\r\n";
+        if (i % 7 == 0) {
+            pipeline += respRequest({"PING"});
+            expected += "+PONG\r\n";
+        }
+    }
+    sendText(writer, pipeline);
+    assert(receiveText(writer, expected.size()) == expected);
+    for (auto& store : stores) {
+        assert(store->getStats().totalKeys > 50);
+    }
+    assert(reactor.forwardedCount() > 0);
+
+    // Several clients at once, inline, through to QUIT.
+    vector<int> readers;
+    for (int i = 0; i < 8; ++i) {
+        readers.push_back(connectClient(reactor.port()));
+    }
+    for (size_t c = 0; c < readers.size(); ++c) {
+        string requests, replies = "hello\n";
+        for (size_t i = c; i < 500; i += readers.size()) {
+            requests += "GET k" + to_string(i) + "\n";
+            replies += "v" + to_string(i) + "\n";
+        }
+        sendText(readers[c], requests + "DEL missing\nQUIT\n");
+        replies += "Key not found\nBYE\n";
+        assert(receiveText(readers[c], replies.size() + 1) == replies);
+    }
+    sendText(writer, "*1\r\n$5\r\nSTATS\r\n");
+    string stats = receiveText(writer, 30);
+    assert(stats.find("Partitions: 4") != string::npos);
+
+    // A slow-lane command's reply takes its place among forwarded ones,
+    // and the commands after it, forwarded or not, see what it did.
+    int clearer = connectClient(reactor.port());
+    sendText(clearer, respRequest({"GET", "k1"}) + respRequest({"CLEAR"}) + respRequest({"GET", "k1"}) +
+                          respRequest({"SET", "k5", "w"}) + respRequest({"PING"}));
+    expected = "$2\r\nv1\r\n+OK\r\n$-1\r\n+OK\r\n+PONG\r\n";
+    assert(receiveText(clearer, expected.size()) == expected);
+    assert(handlers[0]->handleCommand("KEYS") == "k5\n");
+    ::close(clearer);
+
+    for (int fd : readers) {
+        ::close(fd);
+    }
+    ::close(writer);
+    reactor.stop();
+    assert(reactor.connectionCount() == 0);
+}
+#endif
+
 void testCommandHandler() {
     KeyValueStore store;
     Logger& logger = Logger::getInstance();
@@ -115,6 +1952,89 @@ int main() {
     testConcurrentAccess();
     cout << "Concurrent access test passed" << endl;
     
+    testShardedScaling();
+    cout << "Sharded scaling test passed" << endl;
+    
+    testLockFreeReads();
+    cout << "Lock-free reads test passed" << endl;
+    
+    testFlatHashTable();
+    cout << "Flat hash table test passed" << endl;
+    
+    testTimingWheel();
+    cout << "Timing wheel test passed" << endl;
+    
+    testMillisecondExpiry();
+    cout << "Millisecond expiry test passed" << endl;
+    
+    testEviction();
+    cout << "Eviction test passed" << endl;
+    
+    testMemoryAccounting();
+    cout << "Memory accounting test passed" << endl;
+    
+    testSlabAllocator();
+    cout << "Slab allocator test passed" << endl;
+    
+    testBinarySnapshot();
+    cout << "Binary snapshot test passed" << endl;
+    
+    testBackgroundSave();
+    cout << "Background save test passed" << endl;
+    
+    testThreadPool();
+    cout << "Thread pool test passed" << endl;
+
+    testParallelLoad();
+    cout << "Parallel load test passed" << endl;
+
+    testAppendLog();
+    cout << "Append log test passed" << endl;
+
+    testAppendLogRewrite();
+    cout << "Append log rewrite test passed" << endl;
+    
+    testScan();
+    cout << "Scan test passed" << endl;
+
+    testOrderedIndex();
+    cout << "Ordered index test passed" << endl;
+
+    testBatchCommands();
+    cout << "Batch commands test passed" << endl;
+
+    testPipeline();
+    cout << "Pipeline test passed" << endl;
+
+    testResp();
+    cout << "RESP test passed" << endl;
+
+    testInputBuffer();
+    cout << "Input buffer test passed" << endl;
+
+    testCommandTable();
+    cout << "Command table test passed" << endl;
+
+    testExecutionLanes();
+    cout << "Execution lanes test passed" << endl;
+
+    testPartitions();
+    cout << "Partitions test passed" << endl;
+
+#ifdef KVSTORE_EPOLL
+    testEpollReactor();
+    cout << "Epoll reactor test passed" << endl;
+
+    testPerCoreReactor();
+    cout << "Per-core reactor test passed" << endl;
+
+#ifdef KVSTORE_URING
+    if (testUringReactor()) {
+        cout << "io_uring reactor test passed" << endl;
+    }
+#endif
+#endif
+
     testCommandHandler();
     cout << "Command handler test passed" << endl;
     